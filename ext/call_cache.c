@@ -0,0 +1,598 @@
+#include "call_cache.h"
+
+#include <string.h>
+
+#ifdef REALLY_HAVE_RUBY_NODE_H
+#include <ruby/node.h>
+#endif
+
+#ifdef HAVE_NODE_H
+#include <node.h>
+#endif
+
+#ifdef NEED_MINIMAL_NODE
+#include "minimal_node.h"
+#endif
+
+#ifndef RUBY_VM
+#include <env.h>
+#include <rubysig.h>
+#endif
+
+unsigned long ludicrous_method_serial = 1;
+
+static VALUE rb_cCallCache = Qnil;
+
+/* Totals across all call sites, so stats can be read without having to
+ * find every cache that is still alive.
+ */
+static unsigned long total_hits = 0;
+static unsigned long total_misses = 0;
+static unsigned long total_slow_calls = 0;
+
+static void flush_call_cache(struct Ludicrous_Call_Cache * cache)
+{
+  memset(cache->entries, 0, sizeof(cache->entries));
+  cache->next_entry = 0;
+  cache->direct_klass = 0;
+  cache->attr_klass = 0;
+  cache->attr_vid = 0;
+  cache->serial = ludicrous_method_serial;
+}
+
+static VALUE rb_eSysStackError_ = Qnil;
+
+#ifndef RUBY_VM
+
+static unsigned long call_tick = 0;
+
+/* Frames pushed by the cache need a uniq value that does not collide
+ * with the interpreter's (which counts up from zero), so start counting
+ * from the middle of the range.
+ */
+static unsigned long frame_unique = ~0UL >> 1;
+
+/* Walk the ancestors of klass looking for a method named id, the same
+ * way the interpreter does, and return the NODE_METHOD that was found.
+ */
+static NODE * search_method(VALUE klass, ID id, VALUE * origin)
+{
+  NODE * body;
+
+  for(; klass; klass = RCLASS(klass)->super)
+  {
+    if(st_lookup(RCLASS(klass)->m_tbl, id, (st_data_t *)&body))
+    {
+      *origin = klass;
+      return body;
+    }
+  }
+
+  return 0;
+}
+
+static struct Ludicrous_Call_Cache_Entry * fill_entry(
+    struct Ludicrous_Call_Cache * cache,
+    VALUE klass,
+    int argc)
+{
+  struct Ludicrous_Call_Cache_Entry * entry;
+  VALUE origin;
+  NODE * method = search_method(klass, cache->mid, &origin);
+  NODE * body;
+
+  if(!method || !method->nd_body)
+  {
+    /* undefined; let the interpreter call method_missing */
+    return 0;
+  }
+
+  body = method->nd_body;
+
+  entry = &cache->entries[cache->next_entry];
+  cache->next_entry = (cache->next_entry + 1) % LUDICROUS_CALL_CACHE_SIZE;
+
+  entry->klass = klass;
+  entry->origin = origin;
+  entry->body = body;
+  entry->cfunc = 0;
+  entry->arity = 0;
+  entry->vid = 0;
+
+  switch(nd_type(body))
+  {
+    case NODE_CFUNC:
+      entry->kind = LUDICROUS_CALL_CACHE_CFUNC;
+      entry->cfunc = body->nd_cfnc;
+      entry->arity = body->nd_argc;
+      if(cache->direct_cfunc && entry->cfunc == cache->direct_cfunc)
+      {
+        cache->direct_klass = klass;
+      }
+      break;
+
+    case NODE_IVAR:
+      entry->kind = LUDICROUS_CALL_CACHE_IVAR;
+      entry->vid = body->nd_vid;
+      if(argc == 0 && !cache->attr_klass)
+      {
+        cache->attr_klass = klass;
+        cache->attr_vid = entry->vid;
+      }
+      break;
+
+    case NODE_ATTRSET:
+      entry->kind = LUDICROUS_CALL_CACHE_ATTRSET;
+      entry->vid = body->nd_vid;
+      if(argc == 1 && !cache->attr_klass)
+      {
+        cache->attr_klass = klass;
+        cache->attr_vid = entry->vid;
+      }
+      break;
+
+    default:
+      entry->kind = LUDICROUS_CALL_CACHE_OTHER;
+      break;
+  }
+
+  return entry;
+}
+
+static VALUE call_cfunc(
+    struct Ludicrous_Call_Cache_Entry * entry,
+    VALUE recv,
+    int argc,
+    VALUE * argv)
+{
+  VALUE (*f)(ANYARGS) = entry->cfunc;
+
+  switch(entry->arity)
+  {
+    case -2: return (*f)(recv, rb_ary_new4(argc, argv));
+    case -1: return (*f)(argc, argv, recv);
+    case 0: return (*f)(recv);
+    case 1: return (*f)(recv, argv[0]);
+    case 2: return (*f)(recv, argv[0], argv[1]);
+    case 3: return (*f)(recv, argv[0], argv[1], argv[2]);
+    case 4: return (*f)(recv, argv[0], argv[1], argv[2], argv[3]);
+    case 5: return (*f)(recv, argv[0], argv[1], argv[2], argv[3], argv[4]);
+    case 6: return (*f)(recv, argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+  }
+
+  /* unreachable; can_call_directly() filters other arities */
+  return Qnil;
+}
+
+static int can_call_directly(
+    struct Ludicrous_Call_Cache_Entry * entry,
+    int argc)
+{
+  if(entry->kind != LUDICROUS_CALL_CACHE_CFUNC)
+  {
+    return 0;
+  }
+
+  if(entry->arity < 0)
+  {
+    return entry->arity >= -2;
+  }
+
+  /* Let the interpreter raise ArgumentError on an arity mismatch */
+  return entry->arity == argc && entry->arity <= 6;
+}
+
+/* Call a C function the way rb_call0 would, minus the method lookup.
+ * The frame lives on the C stack; if the function raises, the frame
+ * is discarded when the enclosing tag restores ruby_frame.
+ */
+static VALUE call_with_frame(
+    struct Ludicrous_Call_Cache * cache,
+    struct Ludicrous_Call_Cache_Entry * entry,
+    VALUE recv,
+    int argc,
+    VALUE * argv)
+{
+  struct FRAME frame;
+  VALUE result;
+
+  if((++call_tick & 0xff) == 0)
+  {
+    CHECK_INTS;
+    if(ruby_stack_check())
+    {
+      rb_raise(rb_eSysStackError_, "stack level too deep");
+    }
+  }
+
+  frame.prev = ruby_frame;
+  frame.tmp = 0;
+  frame.node = ruby_current_node;
+  frame.iter = 0; /* ITER_NOT; the cache is never used with a block */
+  frame.argc = argc;
+  frame.flags = 0;
+  frame.uniq = frame_unique++;
+  frame.self = recv;
+  frame.last_func = cache->mid;
+  frame.orig_func = cache->mid;
+  frame.last_class = entry->origin;
+  ruby_frame = &frame;
+
+  result = call_cfunc(entry, recv, argc, argv);
+
+  ruby_current_node = frame.node;
+  ruby_frame = frame.prev;
+
+  return result;
+}
+
+#endif
+
+/* Called by a compiled method before it calls another compiled method
+ * directly.  No frame is pushed for the call, but the stack must still
+ * be checked (as the interpreter does before every call), or deep
+ * recursion would overflow it instead of raising SystemStackError.
+ */
+void ludicrous_direct_call_check()
+{
+  if(ruby_stack_check())
+  {
+    rb_raise(rb_eSysStackError_, "stack level too deep");
+  }
+
+#ifndef RUBY_VM
+  if((++call_tick & 0xff) == 0)
+  {
+    CHECK_INTS;
+  }
+#endif
+}
+
+#ifndef RUBY_VM
+
+/* Find the entry for klass, looking the method up if it isn't in the
+ * cache.  Returns 0 if the method is undefined.
+ */
+static struct Ludicrous_Call_Cache_Entry * lookup_entry(
+    struct Ludicrous_Call_Cache * cache,
+    VALUE klass,
+    int argc)
+{
+  int j;
+
+  if(cache->serial != ludicrous_method_serial)
+  {
+    flush_call_cache(cache);
+  }
+
+  for(j = 0; j < LUDICROUS_CALL_CACHE_SIZE; ++j)
+  {
+    if(cache->entries[j].klass == klass
+       && cache->entries[j].kind != LUDICROUS_CALL_CACHE_EMPTY)
+    {
+      ++cache->hits;
+      ++total_hits;
+      return &cache->entries[j];
+    }
+  }
+
+  ++cache->misses;
+  ++total_misses;
+  return fill_entry(cache, klass, argc);
+}
+
+#endif
+
+/* Return the C function that method cache->mid resolves to for recv
+ * (which, for a compiled method, is the compiled function), or 0 if it
+ * resolves to anything else.
+ */
+void * ludicrous_cached_cfunc(
+    struct Ludicrous_Call_Cache * cache,
+    VALUE recv)
+{
+#ifndef RUBY_VM
+  /* No argument count, so the lookup doesn't mark the cache for
+   * inlined attribute access */
+  struct Ludicrous_Call_Cache_Entry * entry =
+    lookup_entry(cache, CLASS_OF(recv), -1);
+
+  if(entry && entry->kind == LUDICROUS_CALL_CACHE_CFUNC)
+  {
+    return (void *)entry->cfunc;
+  }
+#endif
+
+  return 0;
+}
+
+/* Call method cache->mid on recv, using the cache to skip the method
+ * lookup where possible.  Calls that the cache can't handle (methods
+ * written in ruby, method_missing, or a block being passed) go through
+ * rb_funcall2 as before.
+ */
+VALUE ludicrous_cached_call(
+    struct Ludicrous_Call_Cache * cache,
+    VALUE recv,
+    int argc,
+    VALUE * argv)
+{
+#ifndef RUBY_VM
+  struct Ludicrous_Call_Cache_Entry * entry =
+    lookup_entry(cache, CLASS_OF(recv), argc);
+
+  if(entry)
+  {
+    /* Attribute readers and writers don't need a frame; the
+     * interpreter doesn't push one for them either */
+    if(entry->kind == LUDICROUS_CALL_CACHE_IVAR && argc == 0)
+    {
+      return rb_attr_get(recv, entry->vid);
+    }
+
+    if(entry->kind == LUDICROUS_CALL_CACHE_ATTRSET && argc == 1)
+    {
+      return rb_ivar_set(recv, entry->vid, argv[0]);
+    }
+
+    if(can_call_directly(entry, argc))
+    {
+      return call_with_frame(cache, entry, recv, argc, argv);
+    }
+  }
+#else
+  /* YARV needs a control frame pushed for every call, so the compiler
+   * doesn't emit cached sends there; this is only reached if a cache is
+   * called by hand. */
+#endif
+
+  ++cache->slow_calls;
+  ++total_slow_calls;
+  return rb_funcall2(recv, cache->mid, argc, argv);
+}
+
+static void call_cache_mark(struct Ludicrous_Call_Cache * cache)
+{
+  int j;
+
+  for(j = 0; j < LUDICROUS_CALL_CACHE_SIZE; ++j)
+  {
+    struct Ludicrous_Call_Cache_Entry * entry = &cache->entries[j];
+    if(entry->kind != LUDICROUS_CALL_CACHE_EMPTY)
+    {
+      rb_gc_mark(entry->klass);
+      rb_gc_mark(entry->origin);
+      rb_gc_mark((VALUE)entry->body);
+    }
+  }
+
+  if(cache->direct_klass)
+  {
+    rb_gc_mark(cache->direct_klass);
+  }
+
+  if(cache->attr_klass)
+  {
+    rb_gc_mark(cache->attr_klass);
+  }
+}
+
+static VALUE call_cache_s_alloc(VALUE klass)
+{
+  struct Ludicrous_Call_Cache * cache;
+  VALUE obj = Data_Make_Struct(
+      klass, struct Ludicrous_Call_Cache, call_cache_mark, xfree, cache);
+  flush_call_cache(cache);
+  return obj;
+}
+
+static struct Ludicrous_Call_Cache * get_call_cache(VALUE self)
+{
+  struct Ludicrous_Call_Cache * cache;
+  Data_Get_Struct(self, struct Ludicrous_Call_Cache, cache);
+  return cache;
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::CallCache.new(mid) => CallCache
+ *
+ * Create a new (empty) cache for calls to the method named +mid+.
+ */
+static VALUE call_cache_initialize(VALUE self, VALUE mid)
+{
+  get_call_cache(self)->mid = SYM2ID(mid);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   cache.mid => Symbol
+ *
+ * Return the name of the method called through this cache.
+ */
+static VALUE call_cache_mid(VALUE self)
+{
+  return ID2SYM(get_call_cache(self)->mid);
+}
+
+/*
+ * call-seq:
+ *   cache.address => Integer
+ *
+ * Return the address of the underlying C struct, suitable for
+ * embedding as a constant in a JIT::Function.
+ */
+static VALUE call_cache_address(VALUE self)
+{
+  return ULONG2NUM((unsigned long)get_call_cache(self));
+}
+
+/*
+ * call-seq:
+ *   cache.hits => Integer
+ *
+ * Return the number of calls for which the receiver's class was found
+ * in the cache.
+ */
+static VALUE call_cache_hits(VALUE self)
+{
+  return ULONG2NUM(get_call_cache(self)->hits);
+}
+
+/*
+ * call-seq:
+ *   cache.misses => Integer
+ *
+ * Return the number of calls that required a method lookup.
+ */
+static VALUE call_cache_misses(VALUE self)
+{
+  return ULONG2NUM(get_call_cache(self)->misses);
+}
+
+/*
+ * call-seq:
+ *   cache.slow_calls => Integer
+ *
+ * Return the number of calls that were made with rb_funcall2.
+ */
+static VALUE call_cache_slow_calls(VALUE self)
+{
+  return ULONG2NUM(get_call_cache(self)->slow_calls);
+}
+
+/*
+ * call-seq:
+ *   cache.direct_cfunc = address
+ *
+ * Set the address of the function a direct call site expects the
+ * method to resolve to.
+ */
+static VALUE call_cache_set_direct_cfunc(VALUE self, VALUE address)
+{
+  struct Ludicrous_Call_Cache * cache = get_call_cache(self);
+  cache->direct_cfunc = (VALUE (*)(ANYARGS))NUM2ULONG(address);
+  flush_call_cache(cache);
+  return address;
+}
+
+/*
+ * call-seq:
+ *   cache.direct? => true or false
+ *
+ * Return true if the last lookup through this cache found the function
+ * a direct call site expects.
+ */
+static VALUE call_cache_is_direct(VALUE self)
+{
+  struct Ludicrous_Call_Cache * cache = get_call_cache(self);
+  return cache->direct_klass ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   cache.attr? => true or false
+ *
+ * Return true if the last lookup through this cache found an attribute
+ * reader or writer that generated code can inline.
+ */
+static VALUE call_cache_is_attr(VALUE self)
+{
+  struct Ludicrous_Call_Cache * cache = get_call_cache(self);
+  return cache->attr_klass ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::CallCache.invalidate => Integer
+ *
+ * Invalidate every call cache in the system and return the new method
+ * serial.
+ */
+static VALUE call_cache_s_invalidate(VALUE klass)
+{
+  ++ludicrous_method_serial;
+  return ULONG2NUM(ludicrous_method_serial);
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::CallCache.serial => Integer
+ *
+ * Return the current method serial.
+ */
+static VALUE call_cache_s_serial(VALUE klass)
+{
+  return ULONG2NUM(ludicrous_method_serial);
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::CallCache.serial_address => Integer
+ *
+ * Return the address of the method serial, so generated code can
+ * check whether a cache is still valid.
+ */
+static VALUE call_cache_s_serial_address(VALUE klass)
+{
+  return ULONG2NUM((unsigned long)&ludicrous_method_serial);
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::CallCache.totals => [ hits, misses, slow_calls ]
+ *
+ * Return the hit, miss, and slow call counts summed over all call
+ * sites.
+ */
+static VALUE call_cache_s_totals(VALUE klass)
+{
+  return rb_ary_new3(
+      3,
+      ULONG2NUM(total_hits),
+      ULONG2NUM(total_misses),
+      ULONG2NUM(total_slow_calls));
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::CallCache.reset_totals => nil
+ *
+ * Reset the counts returned by CallCache.totals.
+ */
+static VALUE call_cache_s_reset_totals(VALUE klass)
+{
+  total_hits = 0;
+  total_misses = 0;
+  total_slow_calls = 0;
+  return Qnil;
+}
+
+void Init_ludicrous_call_cache(VALUE rb_mLudicrous)
+{
+  rb_cCallCache = rb_define_class_under(rb_mLudicrous, "CallCache", rb_cObject);
+  rb_define_alloc_func(rb_cCallCache, call_cache_s_alloc);
+  rb_define_method(rb_cCallCache, "initialize", call_cache_initialize, 1);
+  rb_define_method(rb_cCallCache, "mid", call_cache_mid, 0);
+  rb_define_method(rb_cCallCache, "address", call_cache_address, 0);
+  rb_define_method(rb_cCallCache, "hits", call_cache_hits, 0);
+  rb_define_method(rb_cCallCache, "misses", call_cache_misses, 0);
+  rb_define_method(rb_cCallCache, "slow_calls", call_cache_slow_calls, 0);
+  rb_define_method(rb_cCallCache, "direct_cfunc=", call_cache_set_direct_cfunc, 1);
+  rb_define_method(rb_cCallCache, "direct?", call_cache_is_direct, 0);
+  rb_define_method(rb_cCallCache, "attr?", call_cache_is_attr, 0);
+  rb_define_singleton_method(rb_cCallCache, "invalidate", call_cache_s_invalidate, 0);
+  rb_define_singleton_method(rb_cCallCache, "serial", call_cache_s_serial, 0);
+  rb_define_singleton_method(rb_cCallCache, "serial_address", call_cache_s_serial_address, 0);
+  rb_define_singleton_method(rb_cCallCache, "totals", call_cache_s_totals, 0);
+  rb_define_singleton_method(rb_cCallCache, "reset_totals", call_cache_s_reset_totals, 0);
+
+  rb_define_const(rb_cCallCache, "SIZE", INT2NUM(LUDICROUS_CALL_CACHE_SIZE));
+  rb_define_const(rb_cCallCache, "CFUNC", INT2NUM(LUDICROUS_CALL_CACHE_CFUNC));
+  rb_define_const(rb_cCallCache, "IVAR", INT2NUM(LUDICROUS_CALL_CACHE_IVAR));
+  rb_define_const(rb_cCallCache, "ATTRSET", INT2NUM(LUDICROUS_CALL_CACHE_ATTRSET));
+
+  rb_eSysStackError_ = rb_const_get(rb_cObject, rb_intern("SystemStackError"));
+  rb_gc_register_address(&rb_eSysStackError_);
+}
@@ -0,0 +1,81 @@
+#ifndef ludicrous_call_cache_h
+#define ludicrous_call_cache_h
+
+#include <ruby.h>
+
+/* Number of receiver classes remembered by a single call site before
+ * the least recently filled entry is replaced.
+ */
+#define LUDICROUS_CALL_CACHE_SIZE 4
+
+/* The kind of method body held by a cache entry */
+enum Ludicrous_Call_Cache_Kind
+{
+  LUDICROUS_CALL_CACHE_EMPTY,
+  LUDICROUS_CALL_CACHE_CFUNC,
+  LUDICROUS_CALL_CACHE_IVAR,
+  LUDICROUS_CALL_CACHE_ATTRSET,
+  LUDICROUS_CALL_CACHE_OTHER
+};
+
+struct Ludicrous_Call_Cache_Entry
+{
+  VALUE klass;            /* the receiver's class (the cache key) */
+  VALUE origin;           /* the class or iclass the method was found in */
+  void * body;            /* the resolved method body (a NODE *) */
+  VALUE (*cfunc)(ANYARGS);
+  int arity;
+  int kind;
+  ID vid;                 /* ivar name for IVAR and ATTRSET bodies */
+};
+
+/* A per-call-site method cache.  Every entry is checked for the
+ * receiver's class; on a miss the next entry is replaced round-robin, so
+ * a polymorphic site keeps its most recently seen classes.
+ */
+struct Ludicrous_Call_Cache
+{
+  ID mid;
+  unsigned long serial;
+  struct Ludicrous_Call_Cache_Entry entries[LUDICROUS_CALL_CACHE_SIZE];
+  int next_entry;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long slow_calls;
+
+  /* The function a direct call site expects to find, and the class
+   * for which it was last found (generated code checks direct_klass
+   * before calling the compiled function without going through ruby)
+   */
+  VALUE (*direct_cfunc)(ANYARGS);
+  VALUE direct_klass;
+
+  /* The class for which the method was last found to be an attribute
+   * reader or writer that this call site can use, and the name of the
+   * instance variable it reads or writes (generated code checks
+   * attr_klass and then accesses the instance variable directly)
+   */
+  VALUE attr_klass;
+  ID attr_vid;
+};
+
+/* Incremented whenever a method is defined or removed anywhere in the
+ * system; a cache whose serial does not match is stale.
+ */
+extern unsigned long ludicrous_method_serial;
+
+VALUE ludicrous_cached_call(
+    struct Ludicrous_Call_Cache * cache,
+    VALUE recv,
+    int argc,
+    VALUE * argv);
+
+void * ludicrous_cached_cfunc(
+    struct Ludicrous_Call_Cache * cache,
+    VALUE recv);
+
+void ludicrous_direct_call_check();
+
+void Init_ludicrous_call_cache(VALUE rb_mLudicrous);
+
+#endif
@@ -0,0 +1,235 @@
+#include "case_dispatch.h"
+
+#ifndef RARRAY_LEN
+#define RARRAY_LEN(a) (RARRAY(a)->len)
+#define RARRAY_PTR(a) (RARRAY(a)->ptr)
+#endif
+
+#ifndef RHASH_TBL
+#define RHASH_TBL(h) (RHASH(h)->tbl)
+#endif
+
+static VALUE rb_cCaseDispatch = Qnil;
+
+/* Return the number of the clause that matches value, or zero if none
+ * does.  Looking up a Fixnum, a Symbol, or a plain String in a Hash
+ * does not call any methods, so this never calls back into ruby.
+ */
+int ludicrous_case_dispatch(
+    struct Ludicrous_Case_Dispatch * dispatch,
+    VALUE value)
+{
+  st_data_t clause;
+
+  if(FIXNUM_P(value) && dispatch->dense)
+  {
+    long offset = FIX2LONG(value) - dispatch->dense_min;
+    if(offset < 0 || offset >= dispatch->dense_size)
+    {
+      return 0;
+    }
+    return dispatch->dense[offset];
+  }
+
+  if(st_lookup(RHASH_TBL(dispatch->table), (st_data_t)value, &clause))
+  {
+    return FIX2INT((VALUE)clause);
+  }
+
+  return 0;
+}
+
+static void case_dispatch_mark(struct Ludicrous_Case_Dispatch * dispatch)
+{
+  rb_gc_mark(dispatch->table);
+}
+
+static void case_dispatch_free(struct Ludicrous_Case_Dispatch * dispatch)
+{
+  xfree(dispatch->dense);
+  xfree(dispatch);
+}
+
+static VALUE case_dispatch_s_alloc(VALUE klass)
+{
+  struct Ludicrous_Case_Dispatch * dispatch;
+  VALUE obj = Data_Make_Struct(
+      klass, struct Ludicrous_Case_Dispatch, case_dispatch_mark,
+      case_dispatch_free, dispatch);
+  dispatch->table = Qnil;
+  return obj;
+}
+
+static struct Ludicrous_Case_Dispatch * get_case_dispatch(VALUE self)
+{
+  struct Ludicrous_Case_Dispatch * dispatch;
+  Data_Get_Struct(self, struct Ludicrous_Case_Dispatch, dispatch);
+  return dispatch;
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::CaseDispatch.new => CaseDispatch
+ *
+ * Create a new, empty table.
+ */
+static VALUE case_dispatch_initialize(VALUE self)
+{
+  get_case_dispatch(self)->table = rb_hash_new();
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   dispatch.add(key, clause) => CaseDispatch
+ *
+ * Map the literal +key+ (a Fixnum, Symbol, or String) to the clause
+ * numbered +clause+, unless an earlier clause already matches it.
+ */
+static VALUE case_dispatch_add(VALUE self, VALUE key, VALUE clause)
+{
+  struct Ludicrous_Case_Dispatch * dispatch = get_case_dispatch(self);
+
+  if(!FIXNUM_P(key)
+     && !SYMBOL_P(key)
+     && !(TYPE(key) == T_STRING && rb_obj_class(key) == rb_cString))
+  {
+    rb_raise(rb_eTypeError, "case dispatch key must be a Fixnum, Symbol, or String");
+  }
+
+  if(NUM2INT(clause) <= 0)
+  {
+    rb_raise(rb_eArgError, "clause numbers start at 1");
+  }
+
+  if(dispatch->dense)
+  {
+    rb_raise(rb_eRuntimeError, "cannot add to a case dispatch table after making it dense");
+  }
+
+  if(!st_lookup(RHASH_TBL(dispatch->table), (st_data_t)key, 0))
+  {
+    rb_hash_aset(dispatch->table, key, INT2FIX(NUM2INT(clause)));
+  }
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   dispatch.make_dense(min, max) => CaseDispatch
+ *
+ * Keep the clause numbers for the Fixnums from +min+ to +max+ in a
+ * dense array.  Every key must be a Fixnum in that range.
+ */
+static VALUE case_dispatch_make_dense(VALUE self, VALUE min, VALUE max)
+{
+  struct Ludicrous_Case_Dispatch * dispatch = get_case_dispatch(self);
+  long lmin = NUM2LONG(min);
+  long size = NUM2LONG(max) - lmin + 1;
+  VALUE keys = rb_funcall(dispatch->table, rb_intern("keys"), 0);
+  long j;
+
+  if(size <= 0)
+  {
+    rb_raise(rb_eArgError, "empty range for dense case dispatch table");
+  }
+
+  for(j = 0; j < RARRAY_LEN(keys); ++j)
+  {
+    VALUE key = RARRAY_PTR(keys)[j];
+    if(!FIXNUM_P(key) || FIX2LONG(key) < lmin || FIX2LONG(key) - lmin >= size)
+    {
+      rb_raise(rb_eArgError, "key outside the range of the dense case dispatch table");
+    }
+  }
+
+  xfree(dispatch->dense);
+  dispatch->dense = ALLOC_N(int, size);
+  MEMZERO(dispatch->dense, int, size);
+  dispatch->dense_min = lmin;
+  dispatch->dense_size = size;
+
+  for(j = 0; j < RARRAY_LEN(keys); ++j)
+  {
+    VALUE key = RARRAY_PTR(keys)[j];
+    dispatch->dense[FIX2LONG(key) - lmin] =
+      FIX2INT(rb_hash_aref(dispatch->table, key));
+  }
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   dispatch.lookup(value) => Integer
+ *
+ * Return the number of the clause that matches +value+ (a Fixnum,
+ * Symbol, or String), or zero if none does.
+ */
+static VALUE case_dispatch_lookup(VALUE self, VALUE value)
+{
+  return INT2NUM(ludicrous_case_dispatch(get_case_dispatch(self), value));
+}
+
+/*
+ * call-seq:
+ *   dispatch.address => Integer
+ *
+ * Return the address of the underlying C struct, suitable for
+ * embedding as a constant in a JIT::Function.
+ */
+static VALUE case_dispatch_address(VALUE self)
+{
+  return ULONG2NUM((unsigned long)get_case_dispatch(self));
+}
+
+/*
+ * call-seq:
+ *   dispatch.dense_address => Integer
+ *
+ * Return the address of the dense array (an array of int), or zero if
+ * the table is not dense.
+ */
+static VALUE case_dispatch_dense_address(VALUE self)
+{
+  return ULONG2NUM((unsigned long)get_case_dispatch(self)->dense);
+}
+
+/*
+ * call-seq:
+ *   dispatch.dense_min => Integer
+ *
+ * Return the Fixnum at the start of the dense array.
+ */
+static VALUE case_dispatch_dense_min(VALUE self)
+{
+  return LONG2NUM(get_case_dispatch(self)->dense_min);
+}
+
+/*
+ * call-seq:
+ *   dispatch.dense_size => Integer
+ *
+ * Return the number of entries in the dense array (zero if the table
+ * is not dense).
+ */
+static VALUE case_dispatch_dense_size(VALUE self)
+{
+  return LONG2NUM(get_case_dispatch(self)->dense_size);
+}
+
+void Init_ludicrous_case_dispatch(VALUE rb_mLudicrous)
+{
+  rb_cCaseDispatch = rb_define_class_under(rb_mLudicrous, "CaseDispatch", rb_cObject);
+  rb_define_alloc_func(rb_cCaseDispatch, case_dispatch_s_alloc);
+  rb_define_method(rb_cCaseDispatch, "initialize", case_dispatch_initialize, 0);
+  rb_define_method(rb_cCaseDispatch, "add", case_dispatch_add, 2);
+  rb_define_method(rb_cCaseDispatch, "make_dense", case_dispatch_make_dense, 2);
+  rb_define_method(rb_cCaseDispatch, "lookup", case_dispatch_lookup, 1);
+  rb_define_method(rb_cCaseDispatch, "address", case_dispatch_address, 0);
+  rb_define_method(rb_cCaseDispatch, "dense_address", case_dispatch_dense_address, 0);
+  rb_define_method(rb_cCaseDispatch, "dense_min", case_dispatch_dense_min, 0);
+  rb_define_method(rb_cCaseDispatch, "dense_size", case_dispatch_dense_size, 0);
+}
+
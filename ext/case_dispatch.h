@@ -0,0 +1,36 @@
+#ifndef ludicrous_case_dispatch_h
+#define ludicrous_case_dispatch_h
+
+#include <ruby.h>
+
+#ifdef RUBY_VM
+#include <ruby/st.h>
+#else
+#include <st.h>
+#endif
+
+/* A table built at compile time for a case statement whose when
+ * clauses are all literal Fixnums, Symbols, and Strings.  It maps each
+ * literal to the number of the first clause that matches it (counting
+ * from 1).  Fixnum keys that are close enough together are also kept
+ * in a dense array, which generated code can index directly.
+ */
+struct Ludicrous_Case_Dispatch
+{
+  VALUE table;            /* a Hash of literal to clause number */
+  long dense_min;         /* the Fixnum at the start of the dense array */
+  long dense_size;        /* the number of entries in the dense array */
+  int * dense;            /* the clause number for each Fixnum, or 0 */
+};
+
+/* Return the number of the clause that matches value, or zero if none
+ * does.  The value must be a Fixnum, a Symbol, or a String.
+ */
+int ludicrous_case_dispatch(
+    struct Ludicrous_Case_Dispatch * dispatch,
+    VALUE value);
+
+void Init_ludicrous_case_dispatch(VALUE rb_mLudicrous);
+
+#endif
+
@@ -0,0 +1,286 @@
+#include "const_cache.h"
+#include "ivar_cache.h"
+
+unsigned long ludicrous_const_serial = 1;
+
+static VALUE rb_cConstCache = Qnil;
+
+/* YARV bumps its own state version whenever a constant (or method) is
+ * defined, including by plain assignment, which ludicrous has no hook
+ * for; where it is available, use it instead of our serial.  No header
+ * declares it, so extconf.rb checks that it links.
+ */
+#if defined(RUBY_VM) && defined(HAVE_RUBY_VM_GLOBAL_STATE_VERSION)
+extern VALUE ruby_vm_global_state_version;
+#define CONST_SERIAL ruby_vm_global_state_version
+#else
+#define CONST_SERIAL ludicrous_const_serial
+#endif
+
+#ifndef RUBY_VM
+
+/* What the entries of shadow_tbl not in use point to */
+static st_table empty_table;
+
+/* Find the address of the table entry for vid the way rb_const_get
+ * searches for it: klass and its ancestors, then Object if klass is a
+ * module, and record in the cache the tables searched before the one
+ * that holds it.  Returns 0 if the constant is not found or is still
+ * to be autoloaded, or if too many tables were searched.
+ */
+static VALUE * find_const_slot(
+    struct Ludicrous_Const_Cache * cache,
+    VALUE klass)
+{
+  VALUE tmp = klass;
+  VALUE * slot;
+  int mod_retry = 0;
+  int shadows = 0;
+
+retry:
+  for(; tmp; tmp = RCLASS(tmp)->super)
+  {
+    slot = ludicrous_find_slot(RCLASS(tmp)->iv_tbl, cache->vid);
+    if(slot)
+    {
+      for(; shadows < LUDICROUS_CONST_CACHE_SHADOWS; ++shadows)
+      {
+        cache->shadow_tbl[shadows] = &empty_table;
+        cache->shadow_entries[shadows] = 0;
+      }
+      return *slot == Qundef ? 0 : slot;
+    }
+
+    if(shadows == LUDICROUS_CONST_CACHE_SHADOWS)
+    {
+      return 0;
+    }
+
+    /* Give the class a table now, so there is a count to watch */
+    if(!RCLASS(tmp)->iv_tbl)
+    {
+      RCLASS(tmp)->iv_tbl = st_init_numtable();
+    }
+    cache->shadow_tbl[shadows] = RCLASS(tmp)->iv_tbl;
+    cache->shadow_entries[shadows] = RCLASS(tmp)->iv_tbl->num_entries;
+    ++shadows;
+  }
+
+  if(!mod_retry && BUILTIN_TYPE(klass) == T_MODULE)
+  {
+    mod_retry = 1;
+    tmp = rb_cObject;
+    goto retry;
+  }
+
+  return 0;
+}
+
+#endif
+
+/* Fill the cache with the value just looked up in klass.  A value that
+ * came from const_missing is not cached, since the next lookup may
+ * give a different answer.
+ */
+static void fill_const_cache(
+    struct Ludicrous_Const_Cache * cache,
+    VALUE klass,
+    VALUE value,
+    int defined)
+{
+#ifndef RUBY_VM
+  VALUE * slot = find_const_slot(cache, klass);
+
+  if(!slot || *slot != value)
+  {
+    cache->klass = 0;
+    return;
+  }
+#else
+  VALUE * slot = &cache->value;
+
+  if(!defined)
+  {
+    cache->klass = 0;
+    return;
+  }
+#endif
+
+  cache->klass = klass;
+  cache->value = value;
+  cache->slot = slot;
+  cache->serial = CONST_SERIAL;
+}
+
+/* Get the value of the constant cache->vid in klass, using the cache to
+ * skip the lookup where possible.
+ */
+VALUE ludicrous_const_get(struct Ludicrous_Const_Cache * cache, VALUE klass)
+{
+  VALUE value;
+  int defined = 0;
+
+  if(cache->serial == CONST_SERIAL
+     && cache->klass
+     && cache->klass == klass)
+  {
+    ++cache->hits;
+    return *cache->slot;
+  }
+
+  ++cache->misses;
+
+  if(SPECIAL_CONST_P(klass)
+     || (BUILTIN_TYPE(klass) != T_CLASS && BUILTIN_TYPE(klass) != T_MODULE))
+  {
+    /* Let rb_const_get raise the TypeError */
+    return rb_const_get(klass, cache->vid);
+  }
+
+#ifdef RUBY_VM
+  defined = RTEST(rb_const_defined(klass, cache->vid));
+#endif
+  value = rb_const_get(klass, cache->vid);
+  fill_const_cache(cache, klass, value, defined);
+  return value;
+}
+
+/* Store the value computed for a YARV inline cache (the value of a
+ * whole constant path, such as A::B::C), to be returned until the next
+ * time constants change.
+ */
+VALUE ludicrous_const_cache_set(
+    struct Ludicrous_Const_Cache * cache,
+    VALUE value)
+{
+  cache->klass = Qnil;
+  cache->value = value;
+  cache->slot = &cache->value;
+  cache->serial = CONST_SERIAL;
+  return value;
+}
+
+static void const_cache_mark(struct Ludicrous_Const_Cache * cache)
+{
+  if(cache->klass)
+  {
+    rb_gc_mark(cache->klass);
+    rb_gc_mark(cache->value);
+  }
+}
+
+static VALUE const_cache_s_alloc(VALUE klass)
+{
+  struct Ludicrous_Const_Cache * cache;
+  return Data_Make_Struct(
+      klass, struct Ludicrous_Const_Cache, const_cache_mark, xfree, cache);
+}
+
+static struct Ludicrous_Const_Cache * get_const_cache(VALUE self)
+{
+  struct Ludicrous_Const_Cache * cache;
+  Data_Get_Struct(self, struct Ludicrous_Const_Cache, cache);
+  return cache;
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::ConstCache.new(vid) => ConstCache
+ *
+ * Create a new (empty) cache for the constant named +vid+, or, if
+ * +vid+ is nil, for a YARV inline cache.
+ */
+static VALUE const_cache_initialize(VALUE self, VALUE vid)
+{
+  get_const_cache(self)->vid = NIL_P(vid) ? 0 : SYM2ID(vid);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   cache.address => Integer
+ *
+ * Return the address of the underlying C struct, suitable for
+ * embedding as a constant in a JIT::Function.
+ */
+static VALUE const_cache_address(VALUE self)
+{
+  return ULONG2NUM((unsigned long)get_const_cache(self));
+}
+
+/*
+ * call-seq:
+ *   cache.hits => Integer
+ *
+ * Return the number of lookups that went through the cache (not
+ * counting lookups made inline by generated code).
+ */
+static VALUE const_cache_hits(VALUE self)
+{
+  return ULONG2NUM(get_const_cache(self)->hits);
+}
+
+/*
+ * call-seq:
+ *   cache.misses => Integer
+ *
+ * Return the number of lookups that required a search.
+ */
+static VALUE const_cache_misses(VALUE self)
+{
+  return ULONG2NUM(get_const_cache(self)->misses);
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::ConstCache.invalidate => Integer
+ *
+ * Invalidate every constant cache in the system and return the new
+ * serial.
+ */
+static VALUE const_cache_s_invalidate(VALUE klass)
+{
+  ++ludicrous_const_serial;
+  return ULONG2NUM(ludicrous_const_serial);
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::ConstCache.serial => Integer
+ *
+ * Return the serial that caches are currently checked against.
+ */
+static VALUE const_cache_s_serial(VALUE klass)
+{
+  return ULONG2NUM((unsigned long)CONST_SERIAL);
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::ConstCache.serial_address => Integer
+ *
+ * Return the address of the serial, so generated code can check
+ * whether a cache is still valid.
+ */
+static VALUE const_cache_s_serial_address(VALUE klass)
+{
+  return ULONG2NUM((unsigned long)&CONST_SERIAL);
+}
+
+void Init_ludicrous_const_cache(VALUE rb_mLudicrous)
+{
+  rb_cConstCache = rb_define_class_under(rb_mLudicrous, "ConstCache", rb_cObject);
+  rb_define_alloc_func(rb_cConstCache, const_cache_s_alloc);
+  rb_define_method(rb_cConstCache, "initialize", const_cache_initialize, 1);
+  rb_define_method(rb_cConstCache, "address", const_cache_address, 0);
+  rb_define_method(rb_cConstCache, "hits", const_cache_hits, 0);
+  rb_define_method(rb_cConstCache, "misses", const_cache_misses, 0);
+  rb_define_singleton_method(rb_cConstCache, "invalidate", const_cache_s_invalidate, 0);
+  rb_define_singleton_method(rb_cConstCache, "serial", const_cache_s_serial, 0);
+  rb_define_singleton_method(rb_cConstCache, "serial_address", const_cache_s_serial_address, 0);
+
+#ifndef RUBY_VM
+  rb_define_const(rb_cConstCache, "SHADOWS", INT2NUM(LUDICROUS_CONST_CACHE_SHADOWS));
+#endif
+}
+
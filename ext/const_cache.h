@@ -0,0 +1,62 @@
+#ifndef ludicrous_const_cache_h
+#define ludicrous_const_cache_h
+
+#include <ruby.h>
+
+#ifdef RUBY_VM
+#include <ruby/st.h>
+#else
+#include <st.h>
+#endif
+
+/* The most tables a 1.8 lookup may search before the one holding the
+ * constant for the result to be cached.
+ */
+#define LUDICROUS_CONST_CACHE_SHADOWS 4
+
+/* A per-site cache for looking up one constant.  The cache remembers
+ * the class the constant was last looked up in and where to find its
+ * value: on 1.8, the address of the value in the table entry of the
+ * class that holds it (so reassigning the constant is seen without a
+ * lookup); otherwise, the value itself.
+ *
+ * On 1.8, defining a constant has no hook, so the cache also remembers
+ * the tables searched before the one holding the constant and how many
+ * entries each had; a constant defined in one of them (which would
+ * shadow the cached one) changes its count.  Unused entries point to an
+ * empty table.
+ */
+struct Ludicrous_Const_Cache
+{
+  ID vid;
+  unsigned long serial;
+
+  VALUE klass;            /* the class searched (zero if empty) */
+  VALUE value;            /* the value, if there is no table entry */
+  VALUE * slot;           /* where to read the value */
+
+#ifndef RUBY_VM
+  st_table * shadow_tbl[LUDICROUS_CONST_CACHE_SHADOWS];
+  int shadow_entries[LUDICROUS_CONST_CACHE_SHADOWS];
+#endif
+
+  unsigned long hits;
+  unsigned long misses;
+};
+
+/* Incremented whenever a constant is removed or made to autoload, or a
+ * module is mixed in; a cache whose serial does not match the current
+ * serial is stale.  Not used where the VM keeps its own serial.
+ */
+extern unsigned long ludicrous_const_serial;
+
+VALUE ludicrous_const_get(struct Ludicrous_Const_Cache * cache, VALUE klass);
+
+VALUE ludicrous_const_cache_set(
+    struct Ludicrous_Const_Cache * cache,
+    VALUE value);
+
+void Init_ludicrous_const_cache(VALUE rb_mLudicrous);
+
+#endif
+
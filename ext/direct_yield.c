@@ -0,0 +1,319 @@
+#include "direct_yield.h"
+
+#ifndef RUBY_VM
+#include <env.h>
+#endif
+
+#ifdef RUBY_VM
+#include <ruby/st.h>
+#else
+#include <st.h>
+#endif
+
+#ifndef RARRAY_LEN
+#define RARRAY_LEN(a) (RARRAY(a)->len)
+#define RARRAY_PTR(a) (RARRAY(a)->ptr)
+#endif
+
+static VALUE rb_mDirectYield = Qnil;
+
+/* Totals across all yields made by compiled code */
+static unsigned long total_direct_yields = 0;
+static unsigned long total_slow_yields = 0;
+
+/* The compiled methods that only ever use their block through
+ * ludicrous_yield (see DirectYield.add_yielder)
+ */
+static st_table * direct_yielders = 0;
+
+#ifndef RUBY_VM
+
+/* A compiled block body being passed to an iterator method.  The
+ * iterator's frame points back to the frame it was called from, so the
+ * record is keyed on that frame (and its uniq value, since 1.8 threads
+ * share the machine stack and so can reuse a frame's address).  For the
+ * same reason the record itself lives on the heap.
+ */
+struct Direct_Block
+{
+  struct FRAME * frame;
+  unsigned long uniq;
+  Ludicrous_Block_Body body;
+  VALUE scope;
+  struct Direct_Block * prev;
+};
+
+static struct Direct_Block * direct_blocks = 0;
+
+struct Direct_Call
+{
+  VALUE recv;
+  ID mid;
+  VALUE args;
+};
+
+static VALUE call_iterator(VALUE data)
+{
+  struct Direct_Call * call = (struct Direct_Call *)data;
+  return rb_funcall2(
+      call->recv,
+      call->mid,
+      RARRAY_LEN(call->args),
+      RARRAY_PTR(call->args));
+}
+
+/* Remove a block from the list.  Blocks are usually removed in the
+ * order they were added, but not if a thread switch happens in between.
+ */
+static VALUE remove_direct_block(VALUE data)
+{
+  struct Direct_Block * block = (struct Direct_Block *)data;
+  struct Direct_Block * * p;
+
+  for(p = &direct_blocks; *p; p = &(*p)->prev)
+  {
+    if(*p == block)
+    {
+      *p = block->prev;
+      break;
+    }
+  }
+
+  xfree(block);
+  return Qnil;
+}
+
+/* Find the compiled block passed to the method that is yielding, or
+ * return 0 if it was given some other block.
+ */
+static struct Direct_Block * find_direct_block()
+{
+  struct FRAME * caller = ruby_frame->prev;
+  struct Direct_Block * block;
+
+  if(!direct_blocks || !caller || !rb_block_given_p())
+  {
+    return 0;
+  }
+
+  for(block = direct_blocks; block; block = block->prev)
+  {
+    if(block->frame == caller && block->uniq == caller->uniq)
+    {
+      return block;
+    }
+  }
+
+  return 0;
+}
+
+#endif
+
+/* Convert the array passed to rb_yield_splat to the value rb_yield_0
+ * passes to a block function (avalue_to_svalue in eval.c).  A compiled
+ * block body uses this to get the value of a single block variable
+ * when it is called directly with the values yielded.
+ */
+VALUE ludicrous_avalue_to_svalue(VALUE values)
+{
+  VALUE top;
+
+  if(TYPE(values) != T_ARRAY)
+  {
+    return values;
+  }
+
+  switch(RARRAY_LEN(values))
+  {
+    case 0:
+      return Qnil;
+
+    case 1:
+      top = rb_check_array_type(RARRAY_PTR(values)[0]);
+      if(NIL_P(top))
+      {
+        return RARRAY_PTR(values)[0];
+      }
+      if(RARRAY_LEN(top) > 1)
+      {
+        return values;
+      }
+      return top;
+
+    default:
+      return values;
+  }
+}
+
+/* Call method mid on recv with the given arguments (an Array).  Must be
+ * called from the iteration function passed to rb_iterate, whose block
+ * function is body.  While the method runs, a compiled method that
+ * yields to the block can call body directly (see ludicrous_yield).
+ */
+VALUE ludicrous_call_with_direct_block(
+    VALUE recv,
+    ID mid,
+    VALUE args,
+    Ludicrous_Block_Body body,
+    VALUE scope)
+{
+#ifdef RUBY_VM
+  return rb_funcall2(recv, mid, RARRAY_LEN(args), RARRAY_PTR(args));
+#else
+  struct Direct_Block * block = ALLOC(struct Direct_Block);
+  struct Direct_Call call;
+
+  block->frame = ruby_frame;
+  block->uniq = ruby_frame->uniq;
+  block->body = body;
+  block->scope = scope;
+  block->prev = direct_blocks;
+  direct_blocks = block;
+
+  call.recv = recv;
+  call.mid = mid;
+  call.args = args;
+
+  return rb_ensure(
+      call_iterator,
+      (VALUE)&call,
+      remove_direct_block,
+      (VALUE)block);
+#endif
+}
+
+/* Yield value to the current block, calling the block's body function
+ * directly if it is a compiled block passed with
+ * ludicrous_call_with_direct_block, or through rb_yield (rb_yield_splat
+ * if splat is nonzero) otherwise.
+ *
+ * A direct call for a splat yield passes the body the Array of values
+ * as is, rather than the single value rb_yield_0 would make of it, so
+ * a block with more than one variable is assigned exactly what ruby
+ * would assign it (rb_yield_0 can't tell yield *[[1]] from yield [1]
+ * once it has made a single value).
+ *
+ * A direct call skips pushing the block's frame and scope, so it is
+ * only made for blocks whose bodies don't look at either.
+ */
+VALUE ludicrous_yield(VALUE value, int splat)
+{
+#ifndef RUBY_VM
+  struct Direct_Block * block = find_direct_block();
+
+  if(block)
+  {
+    ++total_direct_yields;
+    if(splat && TYPE(value) == T_ARRAY)
+    {
+      return (*block->body)(value, block->scope, Qundef);
+    }
+    return (*block->body)(value, block->scope, Qnil);
+  }
+#endif
+
+  ++total_slow_yields;
+  if(splat)
+  {
+    return rb_yield_splat(value);
+  }
+  else
+  {
+    return rb_yield(value);
+  }
+}
+
+/* Returns nonzero if method cache->mid resolves, for recv, to a
+ * compiled method that only uses its block through ludicrous_yield, so
+ * a block passed to it with ludicrous_call_with_direct_block is always
+ * called directly.
+ */
+int ludicrous_yields_directly(
+    struct Ludicrous_Call_Cache * cache,
+    VALUE recv)
+{
+  void * cfunc;
+
+  if(!direct_yielders)
+  {
+    return 0;
+  }
+
+  cfunc = ludicrous_cached_cfunc(cache, recv);
+  return cfunc && st_lookup(direct_yielders, (st_data_t)cfunc, 0);
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::DirectYield.add_yielder(address) => nil
+ *
+ * Record that the compiled function at +address+ is a method that
+ * only uses its block through yield, compiled to ludicrous_yield (see
+ * ludicrous_yields_directly).
+ */
+static VALUE direct_yield_s_add_yielder(VALUE klass, VALUE address)
+{
+  if(!direct_yielders)
+  {
+    direct_yielders = st_init_numtable();
+  }
+
+  st_insert(direct_yielders, (st_data_t)NUM2ULONG(address), 0);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::DirectYield.yielder?(address) => true or false
+ *
+ * Return true if the compiled function at +address+ was recorded with
+ * DirectYield.add_yielder.
+ */
+static VALUE direct_yield_s_is_yielder(VALUE klass, VALUE address)
+{
+  if(direct_yielders
+     && st_lookup(direct_yielders, (st_data_t)NUM2ULONG(address), 0))
+  {
+    return Qtrue;
+  }
+
+  return Qfalse;
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::DirectYield.totals => [ direct_yields, slow_yields ]
+ *
+ * Return the number of yields from compiled code that called a compiled
+ * block directly, and the number that went through rb_yield.
+ */
+static VALUE direct_yield_s_totals(VALUE klass)
+{
+  return rb_ary_new3(
+      2,
+      ULONG2NUM(total_direct_yields),
+      ULONG2NUM(total_slow_yields));
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::DirectYield.reset_totals => nil
+ *
+ * Reset the counts returned by DirectYield.totals.
+ */
+static VALUE direct_yield_s_reset_totals(VALUE klass)
+{
+  total_direct_yields = 0;
+  total_slow_yields = 0;
+  return Qnil;
+}
+
+void Init_ludicrous_direct_yield(VALUE rb_mLudicrous)
+{
+  rb_mDirectYield = rb_define_module_under(rb_mLudicrous, "DirectYield");
+  rb_define_singleton_method(rb_mDirectYield, "totals", direct_yield_s_totals, 0);
+  rb_define_singleton_method(rb_mDirectYield, "reset_totals", direct_yield_s_reset_totals, 0);
+  rb_define_singleton_method(rb_mDirectYield, "add_yielder", direct_yield_s_add_yielder, 1);
+  rb_define_singleton_method(rb_mDirectYield, "yielder?", direct_yield_s_is_yielder, 1);
+}
+
@@ -0,0 +1,35 @@
+#ifndef ludicrous_direct_yield_h
+#define ludicrous_direct_yield_h
+
+#include <ruby.h>
+
+#include "call_cache.h"
+
+/* The body function of a block compiled by ludicrous, as passed to
+ * rb_iterate: it takes the value being yielded, the block's scope
+ * object, and the self rb_yield passes.  When ludicrous_yield calls
+ * the body directly for a yield with more or less than one value, the
+ * third argument is Qundef instead, and the value is an Array of
+ * exactly the values yielded.
+ */
+typedef VALUE (*Ludicrous_Block_Body)(VALUE value, VALUE scope, VALUE self);
+
+VALUE ludicrous_call_with_direct_block(
+    VALUE recv,
+    ID mid,
+    VALUE args,
+    Ludicrous_Block_Body body,
+    VALUE scope);
+
+VALUE ludicrous_yield(VALUE value, int splat);
+
+VALUE ludicrous_avalue_to_svalue(VALUE values);
+
+int ludicrous_yields_directly(
+    struct Ludicrous_Call_Cache * cache,
+    VALUE recv);
+
+void Init_ludicrous_direct_yield(VALUE rb_mLudicrous);
+
+#endif
+
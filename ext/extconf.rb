@@ -23,7 +23,30 @@ if not have_header('rubyjit.h') then
 end
 
 
+# Check for a global the VM defines but no installed header declares
+# (so have_var, which needs a declaration, can't find it).  Defines
+# HAVE_<VAR> if a program declaring it extern links.
+def have_vm_var(var, type = 'VALUE')
+  checking_for(var) do
+    src = <<-END
+#include "ruby.h"
+extern #{type} #{var};
+int main() { return #{var} != 0; }
+    END
+    if try_link(src) then
+      $defs.push("-DHAVE_#{var.upcase}")
+      true
+    else
+      false
+    end
+  end
+end
+
 have_func("rb_errinfo", "ruby.h")
+have_func("rb_set_errinfo", "ruby.h")
+have_func("rb_add_event_hook", [ "ruby.h", "node.h" ])
+have_vm_var("ruby_vm_global_state_version")
+have_vm_var("ruby_vm_redefined_flag")
 
 if have_struct_member("struct RObject", "iv_tbl", "ruby.h") then
   $defs[-1] = "-DHAVE_ST_ROBJECT_IV_TBL"
@@ -41,6 +64,10 @@ if have_struct_member("struct RFloat", "value", "ruby.h") then
   $defs[-1] = "-DHAVE_ST_RFLOAT_VALUE"
 end
 
+if have_struct_member("struct RFloat", "float_value", "ruby.h") then
+  $defs[-1] = "-DHAVE_ST_RFLOAT_FLOAT_VALUE"
+end
+
 if have_struct_member("struct RString", "len", "ruby.h") then
   $defs[-1] = "-DHAVE_ST_RSTRING_LEN"
 end
@@ -0,0 +1,245 @@
+#include "hotness_counter.h"
+
+#ifdef LUDICROUS_COUNT_BACKEDGES
+
+#ifdef HAVE_NODE_H
+#include <node.h>
+#endif
+
+#ifdef NEED_MINIMAL_NODE
+#include "minimal_node.h"
+#endif
+
+#include <st.h>
+
+/* Defined in ruby-internal */
+NODE * unwrap_node(VALUE v);
+
+/* The first statement of the body of each watched loop, mapped to the
+ * counter for the method the loop is in.  The interpreter runs that
+ * statement once per iteration, so each line event for it is a back
+ * edge.
+ */
+static st_table * loop_heads = 0;
+
+static void count_backedge(
+    rb_event_t event,
+    NODE * node,
+    VALUE self,
+    ID mid,
+    VALUE klass)
+{
+  st_data_t counter;
+
+  if(st_lookup(loop_heads, (st_data_t)node, &counter))
+  {
+    ++((struct Ludicrous_Hotness_Counter *)counter)->backedges;
+  }
+}
+
+static int unwatch_i(st_data_t node, st_data_t counter, st_data_t arg)
+{
+  return counter == arg ? ST_DELETE : ST_CONTINUE;
+}
+
+/* Stop counting the back edges of the counter's loops, and remove the
+ * event hook once no loop is watched (so the interpreter doesn't pay
+ * for it after every stub has compiled its method).
+ */
+static void unwatch_loops(struct Ludicrous_Hotness_Counter * counter)
+{
+  if(!counter->loops)
+  {
+    return;
+  }
+
+  st_foreach(loop_heads, unwatch_i, (st_data_t)counter);
+  if(loop_heads->num_entries == 0)
+  {
+    rb_remove_event_hook(count_backedge);
+  }
+
+  counter->loops = 0;
+}
+
+#endif
+
+static void hotness_counter_mark(struct Ludicrous_Hotness_Counter * counter)
+{
+  if(counter->loops)
+  {
+    rb_gc_mark(counter->loops);
+  }
+}
+
+static void hotness_counter_free(struct Ludicrous_Hotness_Counter * counter)
+{
+#ifdef LUDICROUS_COUNT_BACKEDGES
+  unwatch_loops(counter);
+#endif
+  xfree(counter);
+}
+
+static struct Ludicrous_Hotness_Counter * get_hotness_counter(VALUE self)
+{
+  struct Ludicrous_Hotness_Counter * counter;
+  Data_Get_Struct(self, struct Ludicrous_Hotness_Counter, counter);
+  return counter;
+}
+
+static VALUE hotness_counter_s_alloc(VALUE klass)
+{
+  struct Ludicrous_Hotness_Counter * counter;
+  return Data_Make_Struct(
+      klass,
+      struct Ludicrous_Hotness_Counter,
+      hotness_counter_mark,
+      hotness_counter_free,
+      counter);
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::HotnessCounter.new => HotnessCounter
+ *
+ * Create a new counter, with no calls or back edges counted.
+ */
+static VALUE hotness_counter_initialize(VALUE self)
+{
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   counter.address => Integer
+ *
+ * Return the address of the underlying C struct, suitable for
+ * embedding as a constant in a JIT::Function.
+ */
+static VALUE hotness_counter_address(VALUE self)
+{
+  return ULONG2NUM((unsigned long)get_hotness_counter(self));
+}
+
+/*
+ * call-seq:
+ *   counter.calls => Integer
+ *
+ * Return the number of times the method has been called.
+ */
+static VALUE hotness_counter_calls(VALUE self)
+{
+  return LONG2NUM(get_hotness_counter(self)->calls);
+}
+
+/*
+ * call-seq:
+ *   counter.backedges => Integer
+ *
+ * Return the number of back edges the interpreter has taken in the
+ * watched loops (always zero where back edges can't be counted; see
+ * HotnessCounter::COUNTS_BACKEDGES).
+ */
+static VALUE hotness_counter_backedges(VALUE self)
+{
+  return LONG2NUM(get_hotness_counter(self)->backedges);
+}
+
+/*
+ * call-seq:
+ *   counter.bounces => Integer
+ *
+ * Return the number of calls the stub passed on to the uncompiled
+ * method because the method was not hot yet.
+ */
+static VALUE hotness_counter_bounces(VALUE self)
+{
+  return LONG2NUM(get_hotness_counter(self)->bounces);
+}
+
+#ifdef LUDICROUS_COUNT_BACKEDGES
+
+/*
+ * call-seq:
+ *   counter.watch(node) => nil
+ *
+ * Count a back edge each time the interpreter runs +node+, which
+ * should be the NEWLINE node for the first statement of a loop's body.
+ */
+static VALUE hotness_counter_watch(VALUE self, VALUE node)
+{
+  struct Ludicrous_Hotness_Counter * counter = get_hotness_counter(self);
+
+  if(!loop_heads)
+  {
+    loop_heads = st_init_numtable();
+  }
+
+  if(loop_heads->num_entries == 0)
+  {
+    rb_add_event_hook(count_backedge, RUBY_EVENT_LINE);
+  }
+
+  st_insert(loop_heads, (st_data_t)unwrap_node(node), (st_data_t)counter);
+
+  /* Keep the node alive (so its address can't be reused) while it is
+   * watched */
+  if(!counter->loops)
+  {
+    counter->loops = rb_ary_new();
+  }
+  rb_ary_push(counter->loops, node);
+
+  return Qnil;
+}
+
+#endif
+
+/*
+ * call-seq:
+ *   counter.unwatch => nil
+ *
+ * Stop counting back edges for this counter's loops.
+ */
+static VALUE hotness_counter_unwatch(VALUE self)
+{
+#ifdef LUDICROUS_COUNT_BACKEDGES
+  unwatch_loops(get_hotness_counter(self));
+#endif
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   counter.reset => nil
+ *
+ * Reset the counts to zero.
+ */
+static VALUE hotness_counter_reset(VALUE self)
+{
+  struct Ludicrous_Hotness_Counter * counter = get_hotness_counter(self);
+  counter->calls = 0;
+  counter->backedges = 0;
+  counter->bounces = 0;
+  return Qnil;
+}
+
+void Init_ludicrous_hotness_counter(VALUE rb_mLudicrous)
+{
+  VALUE rb_cHotnessCounter = rb_define_class_under(
+      rb_mLudicrous, "HotnessCounter", rb_cObject);
+  rb_define_alloc_func(rb_cHotnessCounter, hotness_counter_s_alloc);
+  rb_define_method(rb_cHotnessCounter, "initialize", hotness_counter_initialize, 0);
+  rb_define_method(rb_cHotnessCounter, "address", hotness_counter_address, 0);
+  rb_define_method(rb_cHotnessCounter, "calls", hotness_counter_calls, 0);
+  rb_define_method(rb_cHotnessCounter, "backedges", hotness_counter_backedges, 0);
+  rb_define_method(rb_cHotnessCounter, "bounces", hotness_counter_bounces, 0);
+#ifdef LUDICROUS_COUNT_BACKEDGES
+  rb_define_method(rb_cHotnessCounter, "watch", hotness_counter_watch, 1);
+  rb_define_const(rb_cHotnessCounter, "COUNTS_BACKEDGES", Qtrue);
+#else
+  rb_define_const(rb_cHotnessCounter, "COUNTS_BACKEDGES", Qfalse);
+#endif
+  rb_define_method(rb_cHotnessCounter, "unwatch", hotness_counter_unwatch, 0);
+  rb_define_method(rb_cHotnessCounter, "reset", hotness_counter_reset, 0);
+}
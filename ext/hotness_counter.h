@@ -0,0 +1,28 @@
+#ifndef ludicrous_hotness_counter_h
+#define ludicrous_hotness_counter_h
+
+#include <ruby.h>
+
+/* On 1.8 an event hook sees every statement the interpreter runs, so
+ * the back edges of a stubbed method's loops can be counted while the
+ * method is still interpreted.  YARV passes no node to line events.
+ */
+#if defined(HAVE_RB_ADD_EVENT_HOOK) && !defined(RUBY_VM)
+#define LUDICROUS_COUNT_BACKEDGES
+#endif
+
+/* Counts how often a method with a JIT stub has been called, and how
+ * many loop iterations the interpreter has run for it, so the stub can
+ * decide when the method is hot enough to be worth compiling.
+ */
+struct Ludicrous_Hotness_Counter
+{
+  long calls;
+  long backedges;         /* counted by the event hook */
+  long bounces;           /* calls passed on to the uncompiled method */
+  VALUE loops;            /* the watched loop heads (0 if none) */
+};
+
+void Init_ludicrous_hotness_counter(VALUE rb_mLudicrous);
+
+#endif
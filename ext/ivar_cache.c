@@ -0,0 +1,262 @@
+#include "ivar_cache.h"
+
+unsigned long ludicrous_ivar_serial = 1;
+
+static VALUE rb_cIvarCache = Qnil;
+
+#ifndef RUBY_VM
+
+/* st.c keeps struct st_table_entry to itself; this is its layout on
+ * 1.8.  Entries are never moved (st_rehash relinks them), so the
+ * address of the record stays valid until the entry is deleted.
+ */
+struct ivar_table_entry
+{
+  unsigned int hash;
+  st_data_t key;
+  st_data_t record;
+  struct ivar_table_entry * next;
+};
+
+/* Find the address of the value for vid in the given iv table, or
+ * return 0 if the table has no entry for vid.
+ */
+VALUE * ludicrous_find_slot(st_table * tbl, ID vid)
+{
+  struct ivar_table_entry * entry;
+  unsigned int hash;
+
+  if(!tbl)
+  {
+    return 0;
+  }
+
+  hash = (*tbl->type->hash)(vid);
+  entry = ((struct ivar_table_entry **)tbl->bins)[hash % tbl->num_bins];
+
+  for(; entry; entry = entry->next)
+  {
+    if(entry->hash == hash && entry->key == (st_data_t)vid)
+    {
+      return (VALUE *)&entry->record;
+    }
+  }
+
+  return 0;
+}
+
+static void fill_ivar_cache(struct Ludicrous_Ivar_Cache * cache, VALUE obj)
+{
+  VALUE * slot;
+
+  cache->klass = 0;
+  cache->tbl = 0;
+  cache->slot = 0;
+
+  if(SPECIAL_CONST_P(obj) || BUILTIN_TYPE(obj) != T_OBJECT)
+  {
+    return;
+  }
+
+  slot = ludicrous_find_slot(ROBJECT(obj)->iv_tbl, cache->vid);
+  if(!slot)
+  {
+    return;
+  }
+
+  cache->klass = CLASS_OF(obj);
+  cache->tbl = ROBJECT(obj)->iv_tbl;
+  cache->slot = slot;
+  cache->serial = ludicrous_ivar_serial;
+}
+
+/* Return the cached slot for obj's instance variable, or 0 if the
+ * cache does not hold it.
+ */
+static VALUE * cached_slot(struct Ludicrous_Ivar_Cache * cache, VALUE obj)
+{
+  if(cache->serial == ludicrous_ivar_serial
+     && cache->klass
+     && CLASS_OF(obj) == cache->klass
+     && ROBJECT(obj)->iv_tbl == cache->tbl)
+  {
+    ++cache->hits;
+    return cache->slot;
+  }
+
+  ++cache->misses;
+  return 0;
+}
+
+#endif
+
+/* Get the value of cache->vid in obj, using the cache to skip the
+ * iv table lookup where possible.
+ */
+VALUE ludicrous_ivar_get(struct Ludicrous_Ivar_Cache * cache, VALUE obj)
+{
+#ifndef RUBY_VM
+  VALUE * slot = cached_slot(cache, obj);
+  VALUE result;
+
+  if(slot)
+  {
+    return *slot;
+  }
+
+  result = rb_ivar_get(obj, cache->vid);
+  fill_ivar_cache(cache, obj);
+  return result;
+#else
+  return rb_ivar_get(obj, cache->vid);
+#endif
+}
+
+/* Set cache->vid in obj to value, using the cache to skip the iv table
+ * lookup where possible.
+ */
+VALUE ludicrous_ivar_set(
+    struct Ludicrous_Ivar_Cache * cache,
+    VALUE obj,
+    VALUE value)
+{
+#ifndef RUBY_VM
+  VALUE * slot = cached_slot(cache, obj);
+  VALUE result;
+
+  /* rb_ivar_set raises for these, so let it */
+  if(slot && !OBJ_FROZEN(obj) && ruby_safe_level < 4)
+  {
+    *slot = value;
+    return value;
+  }
+
+  result = rb_ivar_set(obj, cache->vid, value);
+  fill_ivar_cache(cache, obj);
+  return result;
+#else
+  return rb_ivar_set(obj, cache->vid, value);
+#endif
+}
+
+/* Return true if cache->vid is defined in obj.
+ */
+VALUE ludicrous_ivar_defined(struct Ludicrous_Ivar_Cache * cache, VALUE obj)
+{
+#ifndef RUBY_VM
+  if(cached_slot(cache, obj))
+  {
+    return Qtrue;
+  }
+#endif
+
+  return rb_ivar_defined(obj, cache->vid);
+}
+
+/* Empty the cache rather than marking what it holds, so it doesn't keep
+ * the last object it saw alive; the object's table may be freed by this
+ * collection.
+ */
+static void ivar_cache_mark(struct Ludicrous_Ivar_Cache * cache)
+{
+  cache->klass = 0;
+  cache->tbl = 0;
+  cache->slot = 0;
+}
+
+static VALUE ivar_cache_s_alloc(VALUE klass)
+{
+  struct Ludicrous_Ivar_Cache * cache;
+  return Data_Make_Struct(
+      klass, struct Ludicrous_Ivar_Cache, ivar_cache_mark, xfree, cache);
+}
+
+static struct Ludicrous_Ivar_Cache * get_ivar_cache(VALUE self)
+{
+  struct Ludicrous_Ivar_Cache * cache;
+  Data_Get_Struct(self, struct Ludicrous_Ivar_Cache, cache);
+  return cache;
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::IvarCache.new(vid) => IvarCache
+ *
+ * Create a new (empty) cache for the instance variable named +vid+.
+ */
+static VALUE ivar_cache_initialize(VALUE self, VALUE vid)
+{
+  get_ivar_cache(self)->vid = SYM2ID(vid);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   cache.address => Integer
+ *
+ * Return the address of the underlying C struct, suitable for
+ * embedding as a constant in a JIT::Function.
+ */
+static VALUE ivar_cache_address(VALUE self)
+{
+  return ULONG2NUM((unsigned long)get_ivar_cache(self));
+}
+
+/*
+ * call-seq:
+ *   cache.hits => Integer
+ *
+ * Return the number of accesses that went through the cache without
+ * a lookup (not counting accesses made inline by generated code).
+ */
+static VALUE ivar_cache_hits(VALUE self)
+{
+  return ULONG2NUM(get_ivar_cache(self)->hits);
+}
+
+/*
+ * call-seq:
+ *   cache.misses => Integer
+ *
+ * Return the number of accesses that required a lookup.
+ */
+static VALUE ivar_cache_misses(VALUE self)
+{
+  return ULONG2NUM(get_ivar_cache(self)->misses);
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::IvarCache.invalidate => Integer
+ *
+ * Invalidate every ivar cache in the system and return the new serial.
+ */
+static VALUE ivar_cache_s_invalidate(VALUE klass)
+{
+  ++ludicrous_ivar_serial;
+  return ULONG2NUM(ludicrous_ivar_serial);
+}
+
+/*
+ * call-seq:
+ *   Ludicrous::IvarCache.serial_address => Integer
+ *
+ * Return the address of the ivar serial, so generated code can check
+ * whether a cache is still valid.
+ */
+static VALUE ivar_cache_s_serial_address(VALUE klass)
+{
+  return ULONG2NUM((unsigned long)&ludicrous_ivar_serial);
+}
+
+void Init_ludicrous_ivar_cache(VALUE rb_mLudicrous)
+{
+  rb_cIvarCache = rb_define_class_under(rb_mLudicrous, "IvarCache", rb_cObject);
+  rb_define_alloc_func(rb_cIvarCache, ivar_cache_s_alloc);
+  rb_define_method(rb_cIvarCache, "initialize", ivar_cache_initialize, 1);
+  rb_define_method(rb_cIvarCache, "address", ivar_cache_address, 0);
+  rb_define_method(rb_cIvarCache, "hits", ivar_cache_hits, 0);
+  rb_define_method(rb_cIvarCache, "misses", ivar_cache_misses, 0);
+  rb_define_singleton_method(rb_cIvarCache, "invalidate", ivar_cache_s_invalidate, 0);
+  rb_define_singleton_method(rb_cIvarCache, "serial_address", ivar_cache_s_serial_address, 0);
+}
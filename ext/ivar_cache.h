@@ -0,0 +1,59 @@
+#ifndef ludicrous_ivar_cache_h
+#define ludicrous_ivar_cache_h
+
+#include <ruby.h>
+
+#ifdef RUBY_VM
+#include <ruby/st.h>
+#else
+#include <st.h>
+#endif
+
+/* A per-site cache for reading and writing one instance variable.  The
+ * cache remembers the class and iv table of the object whose entry was
+ * last looked up, and the address of the value in that entry, so the
+ * next access to the same object skips the hash lookup.
+ *
+ * The object itself is not marked, so the cache is emptied whenever it
+ * is marked; its table can only be freed (and its address reused) by a
+ * collection, so an entry that survives until the next access is still
+ * for a live object.
+ */
+struct Ludicrous_Ivar_Cache
+{
+  ID vid;
+  unsigned long serial;
+
+  VALUE klass;            /* the object's class (zero if empty) */
+  st_table * tbl;         /* the object's iv table */
+  VALUE * slot;           /* the value in tbl's entry for vid */
+
+  unsigned long hits;
+  unsigned long misses;
+};
+
+/* Incremented whenever an instance variable is removed from any object
+ * (which frees its table entry); a cache whose serial does not match is
+ * stale.
+ */
+extern unsigned long ludicrous_ivar_serial;
+
+#ifndef RUBY_VM
+/* Return the address of the value for vid in an iv table (which on 1.8
+ * also holds a class's constants), or 0 if it has no entry for vid.
+ */
+VALUE * ludicrous_find_slot(st_table * tbl, ID vid);
+#endif
+
+VALUE ludicrous_ivar_get(struct Ludicrous_Ivar_Cache * cache, VALUE obj);
+
+VALUE ludicrous_ivar_set(
+    struct Ludicrous_Ivar_Cache * cache,
+    VALUE obj,
+    VALUE value);
+
+VALUE ludicrous_ivar_defined(struct Ludicrous_Ivar_Cache * cache, VALUE obj);
+
+void Init_ludicrous_ivar_cache(VALUE rb_mLudicrous);
+
+#endif
@@ -21,6 +21,13 @@
 
 #include <rubyjit.h>
 
+#include "call_cache.h"
+#include "case_dispatch.h"
+#include "const_cache.h"
+#include "direct_yield.h"
+#include "hotness_counter.h"
+#include "ivar_cache.h"
+
 #ifndef HAVE_RB_ERRINFO
 static VALUE rb_errinfo()
 {
@@ -28,6 +35,13 @@ static VALUE rb_errinfo()
 }
 #endif
 
+#ifndef HAVE_RB_SET_ERRINFO
+static void rb_set_errinfo(VALUE err)
+{
+  ruby_errinfo = err;
+}
+#endif
+
 /* No longer part of the public API on ruby 1.8.7? */
 VALUE rb_proc_new _((VALUE (*)(ANYARGS/* VALUE yieldarg[, VALUE procarg] */), VALUE));
 
@@ -53,6 +67,12 @@ struct rb_vm_tag {
 };  
 
 extern VALUE rb_mRubyVMFrozenCore;
+
+/* Nonzero once any method YARV optimizes with an opt_* instruction has
+ * been redefined */
+#ifdef HAVE_RUBY_VM_REDEFINED_FLAG
+extern VALUE ruby_vm_redefined_flag;
+#endif
 #endif
 
 #ifdef HAVE_TYPE_STRUCT_RTYPEDDATA
@@ -258,92 +278,55 @@ static void * ruby_scope_()
   return ruby_scope;
 }
 
-struct Ludicrous_Splat_Iterate_Proc_Data
-{
-  VALUE (*body)(ANYARGS);
-  VALUE val;
-};
+/* The dynamic variable a block created by ludicrous_splat_iterate_proc
+ * assigns the values yielded to it to */
+static ID id_splat_iterate_var;
 
-static VALUE ludicrous_splat_iterate_proc_(VALUE val)
+/* Create a proc whose block function is body.  The block assigns the
+ * values yielded to it, as an Array, to a dynamic variable the body
+ * gets with ludicrous_splat_iterate_value, so the body sees exactly
+ * what was yielded.  The block otherwise runs in the caller's scope,
+ * so $_ and $~ are shared with it as they are with any other block.
+ */
+static VALUE ludicrous_splat_iterate_proc(
+    VALUE (*body)(ANYARGS),
+    VALUE val)
 {
-  struct Ludicrous_Splat_Iterate_Proc_Data * data =
-    (struct Ludicrous_Splat_Iterate_Proc_Data *)val;
-
-  ID varname = rb_intern("ludicrous_splat_iterate_var");
-
-  /* Create a new scope */
-  NEWOBJ(scope, struct SCOPE);
-  OBJSETUP(scope, 0, T_SCOPE);
-  scope->super = ruby_scope->super;
-  scope->local_tbl = ALLOC_N(ID, 4);
-  scope->local_vars = ALLOC_N(VALUE, 4);
-  scope->flags = SCOPE_MALLOC;
-
-  /* Set the names of the scope's local variables */
-  scope->local_tbl[0] = 3;
-  scope->local_tbl[1] = '_';
-  scope->local_tbl[2] = '~';
-  scope->local_tbl[3] = varname;
-
-  /* And and their values */
-  scope->local_vars[0] = 3;
-  scope->local_vars[1] = Qnil;
-  scope->local_vars[2] = Qnil;
-  scope->local_vars[3] = Qnil;
-  ++scope->local_vars;
-
-  scope->local_vars[0] = ruby_scope->local_vars[0]; /* $_ */
-  scope->local_vars[1] = ruby_scope->local_vars[1]; /* $~ */
-
-  /* Temporarily set ruby_scope to the new scope, so the proc being
-   * created below will pick it up (it will be set back when this
-   * function returns) */
-  ruby_scope = scope;
-
-  /* Create a new proc */
-  VALUE proc = rb_proc_new(
-      data->body,
-      data->val);
+  VALUE proc = rb_proc_new(body, val);
 
   NODE * * var;
   Data_Get_Struct(proc, NODE *, var);
 
-  /* Set the iterator's assignment node to set a local variable that the
-   * iterator's body can retrieve */
+  /* Set the iterator's assignment node to set a dynamic variable that
+   * the iterator's body can retrieve (rb_yield_0 gives each call to
+   * the block its own dynamic variables, so this is reentrant) */
   *var = NEW_MASGN(
       0,
       NEW_NODE(
-          NODE_LASGN,
-          varname,
+          NODE_DASGN_CURR,
+          id_splat_iterate_var,
           0,
-          2));
+          0));
 
-  /* And return the proc */
   return proc;
 }
 
-static VALUE ludicrous_splat_iterate_proc(
-    VALUE (*body)(ANYARGS),
-    VALUE val)
+/* Return the Array of values yielded to the body of a block created by
+ * ludicrous_splat_iterate_proc.
+ */
+static VALUE ludicrous_splat_iterate_value()
 {
-  int state;
-  struct SCOPE * orig_scope = ruby_scope;
-  VALUE proc;
-
-  struct Ludicrous_Splat_Iterate_Proc_Data data = { body, val };
+  struct RVarmap * vars;
 
-  proc = rb_protect(
-      ludicrous_splat_iterate_proc_,
-      (VALUE)&data,
-      &state);
-  ruby_scope = orig_scope;
-
-  if(state != 0)
+  for(vars = ruby_dyna_vars; vars; vars = vars->next)
   {
-    rb_jump_tag(state);
+    if(vars->id == id_splat_iterate_var)
+    {
+      return vars->val;
+    }
   }
 
-  return proc;
+  return rb_ary_new();
 }
 #endif
 
@@ -440,6 +423,75 @@ static VALUE function_set_ruby_source(VALUE self, VALUE node_v)
   return Qnil;
 }
 
+/* The most machine code function_code_size will look through before
+ * giving up.
+ */
+#define MAX_CODE_SIZE (1024 * 1024)
+
+/* Return the number of bytes of machine code generated for a compiled
+ * function, or nil if the function has not been compiled.  libjit does
+ * not record the size, so it is found by searching for the first pc
+ * past the entry point that no longer belongs to the function.  The
+ * function's code is contiguous, so the search doubles the distance
+ * from the entry point until it leaves the function and then bisects,
+ * taking O(log n) lookups instead of one per byte.
+ */
+static VALUE function_code_size(VALUE self)
+{
+  jit_function_t function;
+  jit_context_t context;
+  unsigned char * start;
+  unsigned long inside;
+  unsigned long outside;
+  unsigned long mid;
+
+  Data_Get_Struct(self, struct _jit_function, function);
+
+  if(!jit_function_is_compiled(function))
+  {
+    return Qnil;
+  }
+
+  context = jit_function_get_context(function);
+  start = (unsigned char *)jit_function_to_closure(function);
+
+  if(jit_function_from_pc(context, start, 0) != function)
+  {
+    return ULONG2NUM(0);
+  }
+
+  /* start + inside belongs to the function; start + outside doesn't (or
+   * is past MAX_CODE_SIZE) */
+  inside = 0;
+  outside = 1;
+  while(outside < MAX_CODE_SIZE
+        && jit_function_from_pc(context, start + outside, 0) == function)
+  {
+    inside = outside;
+    outside *= 2;
+  }
+
+  if(outside > MAX_CODE_SIZE)
+  {
+    outside = MAX_CODE_SIZE;
+  }
+
+  while(outside - inside > 1)
+  {
+    mid = inside + (outside - inside) / 2;
+    if(jit_function_from_pc(context, start + mid, 0) == function)
+    {
+      inside = mid;
+    }
+    else
+    {
+      outside = mid;
+    }
+  }
+
+  return ULONG2NUM(outside);
+}
+
 /* Given the name of a registered function, return a pointer to it.
  */
 static VALUE function_pointer_of(VALUE klass, VALUE function_name)
@@ -498,6 +550,7 @@ void Init_ludicrous_ext()
   rb_define_method(rb_cFunction, "ruby_struct_member_offset", function_ruby_struct_member_offset, 2);
   rb_define_method(rb_cFunction, "have_ruby_struct_member", function_have_ruby_struct_member, 2);
   rb_define_method(rb_cFunction, "set_ruby_struct_member", function_set_ruby_struct_member, 4);
+  rb_define_method(rb_cFunction, "code_size", function_code_size, 0);
 
   rb_cValue = rb_define_class_under(rb_mJIT, "Value", rb_cObject);
 
@@ -520,6 +573,10 @@ void Init_ludicrous_ext()
   DEFINE_FUNCTION_POINTER(rb_str_dup);
   DEFINE_FUNCTION_POINTER(rb_str_plus);
   DEFINE_FUNCTION_POINTER(rb_str_concat);
+  DEFINE_FUNCTION_POINTER(rb_str_equal);
+  DEFINE_FUNCTION_POINTER(rb_str_length);
+  DEFINE_FUNCTION_POINTER(rb_float_new);
+  DEFINE_FUNCTION_POINTER(rb_int2big);
   DEFINE_FUNCTION_POINTER(rb_string_value_ptr);
   DEFINE_FUNCTION_POINTER(rb_ary_new);
   DEFINE_FUNCTION_POINTER(rb_ary_new2);
@@ -543,6 +600,7 @@ void Init_ludicrous_ext()
   DEFINE_FUNCTION_POINTER(rb_ivar_set);
   DEFINE_FUNCTION_POINTER(rb_ivar_get);
   DEFINE_FUNCTION_POINTER(rb_ivar_defined);
+  DEFINE_FUNCTION_POINTER(rb_attr_get);
   DEFINE_FUNCTION_POINTER(rb_const_get);
   DEFINE_FUNCTION_POINTER(rb_const_defined);
   DEFINE_FUNCTION_POINTER(rb_const_defined_from);
@@ -580,6 +638,18 @@ void Init_ludicrous_ext()
   DEFINE_FUNCTION_POINTER(rb_gc_mark);
   DEFINE_FUNCTION_POINTER(rb_gc_mark_locations);
   DEFINE_FUNCTION_POINTER(rb_method_boundp);
+  DEFINE_FUNCTION_POINTER(ludicrous_cached_call);
+  DEFINE_FUNCTION_POINTER(ludicrous_direct_call_check);
+  DEFINE_FUNCTION_POINTER(ludicrous_ivar_get);
+  DEFINE_FUNCTION_POINTER(ludicrous_ivar_set);
+  DEFINE_FUNCTION_POINTER(ludicrous_ivar_defined);
+  DEFINE_FUNCTION_POINTER(ludicrous_const_get);
+  DEFINE_FUNCTION_POINTER(ludicrous_const_cache_set);
+  DEFINE_FUNCTION_POINTER(ludicrous_case_dispatch);
+  DEFINE_FUNCTION_POINTER(ludicrous_call_with_direct_block);
+  DEFINE_FUNCTION_POINTER(ludicrous_yield);
+  DEFINE_FUNCTION_POINTER(ludicrous_avalue_to_svalue);
+  DEFINE_FUNCTION_POINTER(ludicrous_yields_directly);
 
 #ifdef RUBY_VM
 
@@ -597,11 +667,14 @@ void Init_ludicrous_ext()
   DEFINE_FUNCTION_POINTER(ruby_scope);
 #undef ruby_scope
 
+  id_splat_iterate_var = rb_intern("ludicrous_splat_iterate_var");
   DEFINE_FUNCTION_POINTER(ludicrous_splat_iterate_proc);
+  DEFINE_FUNCTION_POINTER(ludicrous_splat_iterate_value);
 
 #endif
 
   DEFINE_FUNCTION_POINTER(rb_errinfo);
+  DEFINE_FUNCTION_POINTER(rb_set_errinfo);
 
   DEFINE_FUNCTION_POINTER(block_pass_fcall);
   DEFINE_FUNCTION_POINTER(block_pass_call);
@@ -644,10 +717,8 @@ void Init_ludicrous_ext()
 #define DEFINE_RUBY_STRUCT_MEMBER(name, member, type) \
   add_member_info(#name, #member, offsetof(struct name, member), type);
 
-  // TODO: might not be right for 64-bit
- 
-  DEFINE_RUBY_STRUCT_MEMBER(RBasic, flags, jit_type_uint);
-  DEFINE_RUBY_STRUCT_MEMBER(RBasic, klass, jit_type_uint);
+  DEFINE_RUBY_STRUCT_MEMBER(RBasic, flags, jit_type_nuint);
+  DEFINE_RUBY_STRUCT_MEMBER(RBasic, klass, jit_type_VALUE);
 
 #ifdef HAVE_ST_ROBJECT_IV_TBL
   DEFINE_RUBY_STRUCT_MEMBER(RObject, iv_tbl, jit_type_void_ptr);
@@ -660,15 +731,19 @@ void Init_ludicrous_ext()
   DEFINE_RUBY_STRUCT_MEMBER(RClass, m_tbl, jit_type_void_ptr);
 
 #ifdef HAVE_ST_RCLASS_SUPER
-  DEFINE_RUBY_STRUCT_MEMBER(RClass, super, jit_type_uint);
+  DEFINE_RUBY_STRUCT_MEMBER(RClass, super, jit_type_VALUE);
 #endif
 
 #ifdef HAVE_ST_RFLOAT_VALUE
-  DEFINE_RUBY_STRUCT_MEMBER(RFloat, value, jit_type_uint);
+  DEFINE_RUBY_STRUCT_MEMBER(RFloat, value, jit_type_float64);
+#endif
+
+#ifdef HAVE_ST_RFLOAT_FLOAT_VALUE
+  DEFINE_RUBY_STRUCT_MEMBER(RFloat, float_value, jit_type_float64);
 #endif
 
 #ifdef HAVE_ST_RSTRING_LEN
-  DEFINE_RUBY_STRUCT_MEMBER(RString, len, jit_type_uint);
+  DEFINE_RUBY_STRUCT_MEMBER(RString, len, jit_type_nint);
 #endif
 
 #ifdef HAVE_ST_RSTRING_PTR
@@ -677,7 +752,7 @@ void Init_ludicrous_ext()
   // TODO: capa, shared
 
 #ifdef HAVE_ST_RARRAY_LEN
-  DEFINE_RUBY_STRUCT_MEMBER(RArray, len, jit_type_int);
+  DEFINE_RUBY_STRUCT_MEMBER(RArray, len, jit_type_nint);
 #endif
 
 #ifdef HAVE_ST_RARRAY_PTR
@@ -685,7 +760,7 @@ void Init_ludicrous_ext()
 #endif
 
 #ifdef HAVE_ST_RARRAY_AS_HEAP_LEN
-  DEFINE_RUBY_STRUCT_MEMBER(RArray, as.heap.len, jit_type_int);
+  DEFINE_RUBY_STRUCT_MEMBER(RArray, as.heap.len, jit_type_nint);
 #endif
 
 #ifdef HAVE_ST_RARRAY_AS_HEAP_PTR
@@ -701,7 +776,7 @@ void Init_ludicrous_ext()
   DEFINE_RUBY_STRUCT_MEMBER(RRegexp, ptr, jit_type_void_ptr);
 
 #ifdef HAVE_ST_RREGEXP_LEN
-  DEFINE_RUBY_STRUCT_MEMBER(RRegexp, len, jit_type_uint);
+  DEFINE_RUBY_STRUCT_MEMBER(RRegexp, len, jit_type_nint);
 #endif
 
 #ifdef HAVE_ST_RREGEXP_STR
@@ -712,7 +787,7 @@ void Init_ludicrous_ext()
   DEFINE_RUBY_STRUCT_MEMBER(RHash, tbl, jit_type_void_ptr);
 #endif
   DEFINE_RUBY_STRUCT_MEMBER(RHash, iter_lev, jit_type_int);
-  DEFINE_RUBY_STRUCT_MEMBER(RHash, ifnone, jit_type_uint);
+  DEFINE_RUBY_STRUCT_MEMBER(RHash, ifnone, jit_type_VALUE);
 
   DEFINE_RUBY_STRUCT_MEMBER(RFile, fptr, jit_type_void_ptr);
 
@@ -721,17 +796,17 @@ void Init_ludicrous_ext()
   DEFINE_RUBY_STRUCT_MEMBER(RData, data, jit_type_void_ptr);
 
 #ifdef HAVE_TYPE_STRUCT_FRAME
-  DEFINE_RUBY_STRUCT_MEMBER(FRAME, self, jit_type_uint);
+  DEFINE_RUBY_STRUCT_MEMBER(FRAME, self, jit_type_VALUE);
   DEFINE_RUBY_STRUCT_MEMBER(FRAME, argc, jit_type_int);
-  DEFINE_RUBY_STRUCT_MEMBER(FRAME, last_func, jit_type_uint);
-  DEFINE_RUBY_STRUCT_MEMBER(FRAME, orig_func, jit_type_uint);
-  DEFINE_RUBY_STRUCT_MEMBER(FRAME, last_class, jit_type_uint);
+  DEFINE_RUBY_STRUCT_MEMBER(FRAME, last_func, jit_type_ID);
+  DEFINE_RUBY_STRUCT_MEMBER(FRAME, orig_func, jit_type_ID);
+  DEFINE_RUBY_STRUCT_MEMBER(FRAME, last_class, jit_type_VALUE);
   DEFINE_RUBY_STRUCT_MEMBER(FRAME, prev, jit_type_void_ptr);
   DEFINE_RUBY_STRUCT_MEMBER(FRAME, tmp, jit_type_void_ptr);
   DEFINE_RUBY_STRUCT_MEMBER(FRAME, node, jit_type_void_ptr);
   DEFINE_RUBY_STRUCT_MEMBER(FRAME, iter, jit_type_int);
   DEFINE_RUBY_STRUCT_MEMBER(FRAME, flags, jit_type_int);
-  DEFINE_RUBY_STRUCT_MEMBER(FRAME, uniq, jit_type_uint);
+  DEFINE_RUBY_STRUCT_MEMBER(FRAME, uniq, jit_type_nuint);
 #endif
 
 #ifdef HAVE_TYPE_STRUCT_SCOPE
@@ -740,6 +815,29 @@ void Init_ludicrous_ext()
   DEFINE_RUBY_STRUCT_MEMBER(SCOPE, flags, jit_type_int);
 #endif
 
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Call_Cache, serial, jit_type_nuint);
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Call_Cache, direct_klass, jit_type_VALUE);
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Call_Cache, attr_klass, jit_type_VALUE);
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Call_Cache, attr_vid, jit_type_ID);
+
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Ivar_Cache, serial, jit_type_nuint);
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Ivar_Cache, klass, jit_type_VALUE);
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Ivar_Cache, tbl, jit_type_void_ptr);
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Ivar_Cache, slot, jit_type_void_ptr);
+
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Const_Cache, serial, jit_type_nuint);
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Const_Cache, klass, jit_type_VALUE);
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Const_Cache, slot, jit_type_void_ptr);
+#ifndef RUBY_VM
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Const_Cache, shadow_tbl, jit_type_void_ptr);
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Const_Cache, shadow_entries, jit_type_int);
+  DEFINE_RUBY_STRUCT_MEMBER(st_table, num_entries, jit_type_int);
+#endif
+
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Hotness_Counter, calls, jit_type_nint);
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Hotness_Counter, backedges, jit_type_nint);
+  DEFINE_RUBY_STRUCT_MEMBER(Ludicrous_Hotness_Counter, bounces, jit_type_nint);
+
 #ifdef RUBY_VM
   DEFINE_RUBY_STRUCT_MEMBER(rb_vm_tag, tag, jit_type_VALUE);
   DEFINE_RUBY_STRUCT_MEMBER(rb_vm_tag, retval, jit_type_VALUE);
@@ -788,6 +886,8 @@ void Init_ludicrous_ext()
   }
 #endif
 
+  rb_define_const(rb_mLudicrous, "SIZEOF_VALUE", INT2NUM(sizeof(VALUE)));
+
   rb_define_const(rb_mLudicrous, "Qundef", UINT2NUM(Qundef));
   rb_define_const(rb_mLudicrous, "Qnil", UINT2NUM(Qnil));
   rb_define_const(rb_mLudicrous, "Qtrue", UINT2NUM(Qtrue));
@@ -834,6 +934,13 @@ void Init_ludicrous_ext()
   rb_define_const(rb_mLudicrous, "RUBY_VM_FROZEN_CORE", rb_mRubyVMFrozenCore);
 #endif
 
+#ifdef HAVE_RUBY_VM_REDEFINED_FLAG
+  rb_define_const(rb_mLudicrous, "REDEFINED_FLAG_ADDRESS", ULONG2NUM((unsigned long)&ruby_vm_redefined_flag));
+#endif
+
+  rb_define_const(rb_mLudicrous, "FIXNUM_MAX", LONG2NUM(FIXNUM_MAX));
+  rb_define_const(rb_mLudicrous, "FIXNUM_MIN", LONG2NUM(FIXNUM_MIN));
+
 #ifdef RARRAY_EMBED_FLAG
   rb_define_const(rb_mLudicrous, "RARRAY_EMBED_FLAG", INT2NUM(RARRAY_EMBED_FLAG));
 #endif
@@ -849,5 +956,12 @@ void Init_ludicrous_ext()
 #ifdef NEED_MINIMAL_NODE
   Init_ludicrous_minimal_node();
 #endif
+
+  Init_ludicrous_call_cache(rb_mLudicrous);
+  Init_ludicrous_hotness_counter(rb_mLudicrous);
+  Init_ludicrous_ivar_cache(rb_mLudicrous);
+  Init_ludicrous_const_cache(rb_mLudicrous);
+  Init_ludicrous_case_dispatch(rb_mLudicrous);
+  Init_ludicrous_direct_yield(rb_mLudicrous);
 }
 
@@ -24,12 +24,24 @@ require 'ludicrous_ext'
 
 require 'ludicrous/value_conversions'
 require 'ludicrous/native_functions'
+require 'ludicrous/call_cache'
+require 'ludicrous/redefinition'
+require 'ludicrous/direct_call'
+require 'ludicrous/ivar_cache'
+require 'ludicrous/const_cache'
+require 'ludicrous/direct_yield'
+require 'ludicrous/inline_iterate'
+require 'ludicrous/fixnum_operators'
+require 'ludicrous/unboxed_float'
 require 'ludicrous/method_nodes'
 require 'ludicrous/logger'
 require 'ludicrous/local_variable'
 require 'ludicrous/scope'
 require 'ludicrous/environment'
 require 'ludicrous/compile_options'
+require 'ludicrous/profile'
+require 'ludicrous/perf_map'
+require 'ludicrous/stats'
 require 'ludicrous/debug_output'
 require 'ludicrous/toplevel'
 require 'ludicrous/stubs'
@@ -0,0 +1,253 @@
+# Per-call-site method caches.
+#
+# Each call site in a compiled method gets its own Ludicrous::CallCache
+# (defined in call_cache.c), which remembers the method bodies found
+# for the last few receiver classes seen at that site.  A hit skips
+# the method lookup entirely and, for methods implemented in C
+# (including methods compiled by Ludicrous), calls the function
+# directly.
+#
+# Calls to attribute readers and writers skip the method call entirely:
+# the cache remembers the receiver class for which the method was an
+# attr_reader or attr_writer, and generated code guarded on that class
+# reads or writes the instance variable itself (see
+# JIT::Function#attr_call).
+#
+# Caches are invalidated all at once by bumping a global serial number
+# whenever a method is added, removed, or undefined, or whenever a
+# module is mixed in somewhere.  The same hooks tell
+# Ludicrous::Redefinition about the change.
+
+require 'ludicrous/native_functions'
+require 'ludicrous/redefinition'
+
+module Ludicrous
+
+class CallCache
+  # Returns a Hash with the number of cache hits, cache misses, and
+  # calls that went through rb_funcall, summed over all call sites.
+  def self.stats
+    hits, misses, slow_calls = self.totals
+    return {
+      :hits => hits,
+      :misses => misses,
+      :slow_calls => slow_calls,
+      :serial => self.serial,
+    }
+  end
+
+  # Returns a Hash with the counters for this call site.
+  def stats
+    return {
+      :mid => self.mid,
+      :hits => self.hits,
+      :misses => self.misses,
+      :slow_calls => self.slow_calls,
+    }
+  end
+
+  # Returns true if a call to +mid+ with +argc+ arguments could be a
+  # call to an attribute reader (attr_reader) or writer (attr_writer),
+  # so it is worth emitting an inline attribute access for it.
+  #
+  # +mid+:: a Symbol with the name of the method being called
+  # +argc+:: the number of arguments being passed
+  def self.attr_call?(mid, argc)
+    case argc
+    when 0 then return mid.to_s =~ /\A[a-z_][A-Za-z0-9_]*\z/ ? true : false
+    when 1 then return mid.to_s =~ /\A[a-z_][A-Za-z0-9_]*=\z/ ? true : false
+    else return false
+    end
+  end
+
+  # The hook methods that must invalidate the caches when they are
+  # called.
+  HOOKS = [ :method_added, :method_removed, :method_undefined ]
+  SINGLETON_HOOKS = [
+    :singleton_method_added,
+    :singleton_method_removed,
+    :singleton_method_undefined ]
+
+  # A class that defines its own method_added (or similar) hook without
+  # calling super would keep the caches from being invalidated, so when
+  # such a hook is defined, wrap it in one that invalidates first.
+  #
+  # The wrapper keeps the visibility the hook was defined with.
+  #
+  # +klass+:: the class or module the hook was defined in
+  # +name+:: the name of the hook
+  def self.wrap_hook(klass, name)
+    orig_name = "ludicrous__orig_hook__#{name}"
+    return if klass.private_method_defined?(orig_name) or
+              klass.method_defined?(orig_name)
+    if klass.public_method_defined?(name) then
+      visibility = :public
+    elsif klass.protected_method_defined?(name) then
+      visibility = :protected
+    else
+      visibility = :private
+    end
+    if SINGLETON_HOOKS.include?(name) then
+      changed = "Ludicrous::Redefinition.singleton_method_changed(self, args[0])"
+    else
+      changed = "Ludicrous::Redefinition.method_changed(self, args[0])"
+    end
+    klass.class_eval <<-END
+      alias_method :#{orig_name}, :#{name}
+      def #{name}(*args, &block)
+        Ludicrous::CallCache.invalidate
+        #{changed}
+        #{orig_name}(*args, &block)
+      end
+      private :#{orig_name}
+      #{visibility} :#{name}
+    END
+  end
+end
+
+end # Ludicrous
+
+class Module
+  Ludicrous::CallCache::HOOKS.each do |hook|
+    define_method(hook) do |name|
+      Ludicrous::CallCache.invalidate
+      Ludicrous::Redefinition.method_changed(self, name)
+      if Ludicrous::CallCache::HOOKS.include?(name) then
+        Ludicrous::CallCache.wrap_hook(self, name)
+      end
+    end
+    private hook
+  end
+
+  alias_method :ludicrous__orig_include, :include
+
+  # Invalidate the call caches, since including a module changes the
+  # ancestors of the including class.
+  def include(*modules)
+    result = ludicrous__orig_include(*modules)
+    Ludicrous::CallCache.invalidate
+    Ludicrous::Redefinition.ancestors_changed(self)
+    return result
+  end
+  private :include
+end
+
+module Kernel
+  Ludicrous::CallCache::SINGLETON_HOOKS.each do |hook|
+    define_method(hook) do |name|
+      Ludicrous::CallCache.invalidate
+      Ludicrous::Redefinition.singleton_method_changed(self, name)
+      if Ludicrous::CallCache::HOOKS.include?(name) or
+         Ludicrous::CallCache::SINGLETON_HOOKS.include?(name) then
+        Ludicrous::CallCache.wrap_hook(class << self; self; end, name)
+      end
+    end
+    private hook
+  end
+
+  alias_method :ludicrous__orig_extend, :extend
+
+  # Invalidate the call caches, since extending an object changes the
+  # ancestors of its singleton class.
+  def extend(*modules)
+    result = ludicrous__orig_extend(*modules)
+    Ludicrous::CallCache.invalidate
+    Ludicrous::Redefinition.ancestors_changed(class << self; self; end)
+    return result
+  end
+end
+
+module JIT
+
+class Function
+  define_native_function(
+      :ludicrous_cached_call,
+      JIT::Type::OBJECT,
+      [ :cache, :recv, :argc, :argv ],
+      [ JIT::Type::VOID_PTR, JIT::Type::OBJECT, JIT::Type::INT, JIT::Type::VOID_PTR ])
+
+  # Emit code to call method +mid+ on +recv+ through a new call cache.
+  #
+  # +recv+:: the receiver
+  # +mid+:: a Symbol with the name of the method to call
+  # +args+:: an Array of JIT::Value with the arguments to the method
+  def cached_call(recv, mid, args)
+    Ludicrous::Stats.fast_path(:call_cache)
+    cache = Ludicrous::CallCache.new(mid)
+    return call_through_cache(call_cache_ptr(cache), recv, args)
+  end
+
+  # Returns a constant pointer to the given cache's C struct.
+  #
+  # +cache+:: a Ludicrous::CallCache
+  def call_cache_ptr(cache)
+    # Hold a reference to the cache so it lives as long as the function
+    const(JIT::Type::OBJECT, cache)
+    return const(JIT::Type::VOID_PTR, cache.address)
+  end
+
+  define_native_function(
+      :rb_attr_get,
+      JIT::Type::OBJECT,
+      [ :obj, :id ],
+      [ JIT::Type::OBJECT, JIT::Type::ID ])
+
+  # Emit code to call a method that is likely to be an attribute reader
+  # or writer.  If the receiver's class is the one the call cache last
+  # found an attribute method for, the instance variable is read or
+  # written directly; otherwise the call goes through the cache (which
+  # fills in the class for next time).
+  #
+  # +recv+:: the receiver
+  # +mid+:: a Symbol with the name of the method to call
+  # +args+:: an Array of JIT::Value with the arguments to the method
+  # (none for a reader, the new value for a writer)
+  def attr_call(recv, mid, args)
+    Ludicrous::Stats.fast_path(:attr_access)
+
+    cache = Ludicrous::CallCache.new(mid)
+    cache_ptr = call_cache_ptr(cache)
+    result = value(JIT::Type::OBJECT)
+    done_label = JIT::Label.new
+
+    serial_ptr = const(JIT::Type::VOID_PTR, Ludicrous::CallCache.serial_address)
+    serial = insn_load_relative(serial_ptr, 0, JIT::Type::NUINT)
+
+    self.if(ruby_struct_member(:Ludicrous_Call_Cache, :serial, cache_ptr) == serial) {
+      attr_klass = ruby_struct_member(:Ludicrous_Call_Cache, :attr_klass, cache_ptr)
+      self.if(rb_class_of(recv) == attr_klass) {
+        vid = ruby_struct_member(:Ludicrous_Call_Cache, :attr_vid, cache_ptr)
+        if args.length == 0 then
+          result.store(rb_attr_get(recv, vid))
+        else
+          result.store(rb_ivar_set(recv, vid, args[0]))
+        end
+        insn_branch(done_label)
+      } .end
+    } .end
+
+    result.store(call_through_cache(cache_ptr, recv, args))
+
+    insn_label(done_label)
+    return result
+  end
+
+  # Emit code to call the method for the given cache on +recv+.
+  #
+  # +cache_ptr+:: a pointer to the cache (see #call_cache_ptr)
+  # +recv+:: the receiver
+  # +args+:: an Array of JIT::Value with the arguments to the method
+  def call_through_cache(cache_ptr, recv, args)
+    num_args = const(JIT::Type::INT, args.length)
+    array_type = JIT::Type.create_struct([ JIT::Type::OBJECT ] * args.length)
+    array = value(array_type)
+    array_ptr = insn_address_of(array)
+    args.each_with_index do |arg, idx|
+      insn_store_elem(array_ptr, const(JIT::Type::INT, idx), arg)
+    end
+
+    return ludicrous_cached_call(cache_ptr, recv, num_args, array_ptr)
+  end
+end
+
+end # JIT
@@ -0,0 +1,147 @@
+# Table dispatch for case statements over literals.
+#
+# A case statement normally tests each when value in turn, calling ===
+# on it.  When every when value is a literal Fixnum, Symbol, or String,
+# the clause to run can instead be found with one lookup in a
+# Ludicrous::CaseDispatch (defined in case_dispatch.c) built at compile
+# time: an index into a dense array if the values are Fixnums close
+# enough together, otherwise a hash lookup.  The clause number is then
+# turned into a branch with a binary search, since there is no indirect
+# branch to jump through.
+#
+# Looking up a value of one of those types gives the same answer as
+# the tests would, as long as === and == have not been redefined for
+# them (see Ludicrous::Redefinition).  Any other value (including a
+# subclass of String) falls back on the tests.
+
+require 'ludicrous/native_functions'
+require 'ludicrous/redefinition'
+
+module Ludicrous
+
+class CaseDispatch
+  # The largest dense array to build
+  MAX_DENSE_SIZE = 1024
+
+  # The dense array may have at most this many entries for each key
+  DENSE_ENTRIES_PER_KEY = 4
+
+  # The classes whose literals can be looked up
+  KEY_CLASSES = [ ::Fixnum, ::Symbol, ::String ]
+
+  KEY_CLASSES.each do |klass|
+    Redefinition.track(klass, :===, :==)
+  end
+
+  # Returns true if +obj+ can be a key in the table.
+  def self.key?(obj)
+    return KEY_CLASSES.include?(obj.class)
+  end
+
+  # Build a table for a case statement.
+  #
+  # Returns a new CaseDispatch, or nil if the methods the lookup stands
+  # in for have been redefined.
+  #
+  # +clauses+:: an Array with an Array of the literal keys for each
+  # when clause, in order
+  def self.build(clauses)
+    KEY_CLASSES.each do |klass|
+      return nil if not Redefinition.assume(klass, :===)
+      return nil if not Redefinition.assume(klass, :==)
+    end
+
+    dispatch = self.new
+    clauses.each_with_index do |keys, idx|
+      keys.each do |key|
+        dispatch.add(key, idx + 1)
+      end
+    end
+
+    keys = clauses.flatten
+    if keys.all? { |key| Fixnum === key } then
+      min, max = keys.min, keys.max
+      size = max - min + 1
+      if size <= MAX_DENSE_SIZE and size <= DENSE_ENTRIES_PER_KEY * keys.size then
+        dispatch.make_dense(min, max)
+      end
+    end
+
+    return dispatch
+  end
+end
+
+end # Ludicrous
+
+module JIT
+
+class Function
+  define_native_function(
+      :ludicrous_case_dispatch,
+      JIT::Type::INT,
+      [ :dispatch, :value ],
+      [ JIT::Type::VOID_PTR, JIT::Type::OBJECT ])
+
+  # Emit code to branch to the clause of a case statement that matches
+  # +subject+.
+  #
+  # +dispatch+:: a Ludicrous::CaseDispatch built for the case statement
+  # +subject+:: a JIT::Value with the value being tested
+  # +labels+:: an Array of JIT::Label, with the label for the else
+  # clause (or the end of the case statement) first, followed by the
+  # label for each when clause
+  # +fallback_label+:: a JIT::Label for the code that tests each when
+  # value in turn, branched to if +subject+ cannot be looked up
+  def case_dispatch(dispatch, subject, labels, fallback_label)
+    Ludicrous::Stats.fast_path(:case_dispatch)
+
+    # Hold a reference to the table so it lives as long as the function
+    const(JIT::Type::OBJECT, dispatch)
+
+    clause = value(JIT::Type::INT)
+
+    if dispatch.dense_size > 0 then
+      # A value that is not a Fixnum can't match, but let the tests say
+      # so
+      insn_branch_if_not(subject.is_fixnum, fallback_label)
+      offset = value(JIT::Type::NINT)
+      offset.store(fix2native(subject) - const(JIT::Type::NINT, dispatch.dense_min))
+      clause.store(const(JIT::Type::INT, 0))
+      in_range = (offset >= const(JIT::Type::NINT, 0)) &
+                 (offset < const(JIT::Type::NINT, dispatch.dense_size))
+      self.if(in_range) {
+        dense = const(JIT::Type::VOID_PTR, dispatch.dense_address)
+        clause.store(insn_load_elem(dense, offset, JIT::Type::INT))
+      } .end
+    else
+      is_key = subject.is_fixnum | subject.is_symbol |
+        (rb_class_of(subject) == const(JIT::Type::OBJECT, ::String))
+      insn_branch_if_not(is_key, fallback_label)
+      clause.store(ludicrous_case_dispatch(
+          const(JIT::Type::VOID_PTR, dispatch.address), subject))
+    end
+
+    branch_to_clause(clause, labels, 0, labels.size - 1)
+  end
+
+  private
+
+  # Emit a binary search on +clause+ that branches to labels[clause],
+  # for a clause between +lo+ and +hi+.
+  def branch_to_clause(clause, labels, lo, hi)
+    if lo == hi then
+      insn_branch(labels[lo])
+      return
+    end
+
+    mid = (lo + hi) / 2
+    upper_label = JIT::Label.new
+    insn_branch_if(clause > const(JIT::Type::INT, mid), upper_label)
+    branch_to_clause(clause, labels, lo, mid)
+    insn_label(upper_label)
+    branch_to_clause(clause, labels, mid + 1, hi)
+  end
+end
+
+end # JIT
+
@@ -5,10 +5,36 @@ CompileOptionsMembers = Struct.new(
     :precompile,
     :iterate_style,
     :dont_compile,
-    :exclude_methods)
+    :exclude_methods,
+    :call_cache,
+    :compile_threshold,
+    :ivar_cache,
+    :const_cache,
+    :unboxed_floats,
+    :unboxed_locals,
+    :profile,
+    :perf_map)
 
 # Specifies the parameters used to compile a function or class
 class CompileOptions < CompileOptionsMembers
+  # The value for each option that is not given to #new.  Changing a
+  # default affects every CompileOptions object created afterward.
+  DEFAULTS = {
+    :precompile => false,
+    :optimization_level => 2,
+    :iterate_style => nil,
+    :dont_compile => false,
+    :exclude_methods => [],
+    :call_cache => true,
+    :compile_threshold => 50,
+    :ivar_cache => true,
+    :const_cache => true,
+    :unboxed_floats => true,
+    :unboxed_locals => true,
+    :profile => nil,
+    :perf_map => false,
+  }
+
   # Create a new CompileOptions object.
   #
   # Keyword arguments:
@@ -17,14 +43,46 @@ class CompileOptions < CompileOptionsMembers
   # called (default=false)
   # * optimization_level (integer) - specifies the optimization level to
   # pass to libjit (default=2)
-  # * iterate_style (:fast/:proc/:splat/nil) - indicates the iteration
-  # style to use on 1.8 (default=nil, which is to use the most
-  # conformant method available).  Ludicrous ignores this parameter on
-  # YARV.
+  # * iterate_style (:fast/:direct/:proc/:splat/nil) - indicates the
+  # iteration style to use on 1.8 (default=nil, which is to use :fast
+  # for blocks with at most one parameter, and :direct otherwise).
+  # Ludicrous ignores this parameter on YARV.
   # * dont_compile (true/false) - indicates that this class or method
   # should not be compiled.
   # * exclude_methods (Set or Array of Symbol) - a list of methods that should
   # not be compiled
+  # * call_cache (true/false) - indicates that method calls should go
+  # through a per-call-site method cache instead of rb_funcall
+  # (default=true; ignored on YARV, which always uses rb_funcall)
+  # * compile_threshold (integer) - how hot a method must get before its
+  # JIT stub compiles it; each call counts once, and on 1.8 so does each
+  # back edge the interpreter takes in the method's loops (on YARV only
+  # calls are counted).  Until then the stub calls the
+  # uncompiled method.  A threshold of 1 or less compiles on the first
+  # call (default=50)
+  # * ivar_cache (true/false) - indicates that instance variable
+  # accesses should go through a per-site cache of the variable's slot
+  # instead of looking it up in the object's iv table each time
+  # (default=true)
+  # * const_cache (true/false) - indicates that constant lookups should
+  # go through a per-site cache that is invalidated when constants
+  # change, instead of searching for the constant each time
+  # (default=true)
+  # * unboxed_floats (true/false) - indicates that arithmetic on Floats
+  # should be done on native doubles, only allocating a Float for a
+  # result that is stored or passed to a method (default=true)
+  # * unboxed_locals (true/false) - indicates that local variables a
+  # while or until loop only assigns numbers to should be kept unboxed
+  # for the duration of the loop, on 1.8 (default=true)
+  # * profile (String) - the name of a profile file (see
+  # Ludicrous::Profile); methods the file says were compiled last time
+  # are compiled right away, methods that failed are not compiled, and
+  # the file is updated when the program exits (default=nil, which is
+  # to not use a profile)
+  # * perf_map (true/false) - indicates that the address range of each
+  # compiled method (and of the closures compiled for it) should be
+  # written to /tmp/perf-<pid>.map, so native profilers such as perf can
+  # name them (see Ludicrous::PerfMap) (default=false)
   #
   # == Iteration methods
   #
@@ -39,6 +97,15 @@ class CompileOptions < CompileOptionsMembers
   # but instead is yielded as:
   #   [[1, 2]]
   #
+  # === :direct
+  #
+  # Iterates using rb_iterate() if the iterator is a compiled method that
+  # only uses its block through yield, and like :splat otherwise.
+  #
+  # Such a method yields to the block by calling it directly, passing it
+  # exactly the values yielded, so this is as fast as :fast and as exact
+  # as :splat, and no Proc is allocated for the block.
+  #
   # === :proc
   #
   # The next fastest way to iterate, using avalue instead of svalue (so it
@@ -47,18 +114,13 @@ class CompileOptions < CompileOptionsMembers
   #
   # === :splat
   #
-  # The slowest way to iterate, but matches ruby's behavior 100% for
+  # The slowest way to iterate (a Proc is allocated for the block each
+  # time the iterator is called), but matches ruby's behavior 100% for
   # most cases
-  #
-  # (one case that isn't exact - this method can't handle setting $1..$9
-  # inside a block, but the user should not notice, because this is
-  # disabled for now)
   def initialize(h = {})
-    self.precompile = false
-    self.optimization_level = 2
-    self.iterate_style = nil
-    self.dont_compile = false
-    self.exclude_methods = []
+    DEFAULTS.each do |k, v|
+      self[k] = Array === v ? v.dup : v
+    end
 
     h.each do |k, v|
       self[k] = v
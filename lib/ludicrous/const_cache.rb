@@ -0,0 +1,187 @@
+# Per-site constant caches.
+#
+# Each constant reference in a compiled method gets its own
+# Ludicrous::ConstCache (defined in const_cache.c), which remembers the
+# class the constant was last looked up in and where its value lives.
+# Generated code guarded on a global serial and on that class reads the
+# value directly.  On YARV, the same caches back the getinlinecache and
+# setinlinecache instructions, which cache a whole constant path.
+#
+# On YARV the serial is the VM's own state version, which changes
+# whenever any constant is defined.  On 1.8 there is no hook for
+# defining a constant (plain assignment and class and module
+# definitions call rb_const_set directly), so the cache reads the value
+# from the constant's table entry, which sees it reassigned, and watches
+# the number of entries in each table searched before that one, which
+# sees a new constant shadow it.  The serial is bumped by the hooks
+# below, for the changes those checks cannot see.
+
+require 'ludicrous/native_functions'
+
+module Ludicrous
+
+class ConstCache
+  # Returns a Hash with the counters for this cache.
+  def stats
+    return {
+      :hits => self.hits,
+      :misses => self.misses,
+    }
+  end
+end
+
+end # Ludicrous
+
+class Module
+  alias_method :ludicrous__orig_remove_const, :remove_const
+  alias_method :ludicrous__orig_autoload, :autoload
+  alias_method :ludicrous__const_cache_include, :include
+
+  # Invalidate the constant caches before and after removing the
+  # constant, since removing it frees the table entry they may point to.
+  def remove_const(name)
+    Ludicrous::ConstCache.invalidate
+    result = ludicrous__orig_remove_const(name)
+    Ludicrous::ConstCache.invalidate
+    return result
+  end
+  private :remove_const
+
+  # Invalidate the constant caches, since the constant is replaced by
+  # one that must be loaded first.
+  def autoload(name, path)
+    result = ludicrous__orig_autoload(name, path)
+    Ludicrous::ConstCache.invalidate
+    return result
+  end
+
+  # Invalidate the constant caches, since including a module adds its
+  # constants to the including class.
+  def include(*modules)
+    result = ludicrous__const_cache_include(*modules)
+    Ludicrous::ConstCache.invalidate
+    return result
+  end
+  private :include
+end
+
+module Kernel
+  alias_method :ludicrous__orig_autoload, :autoload
+
+  # Invalidate the constant caches, as for Module#autoload.
+  def autoload(name, path)
+    result = ludicrous__orig_autoload(name, path)
+    Ludicrous::ConstCache.invalidate
+    return result
+  end
+  private :autoload
+end
+
+module JIT
+
+class Function
+  define_native_function(
+      :ludicrous_const_get,
+      JIT::Type::OBJECT,
+      [ :cache, :klass ],
+      [ JIT::Type::VOID_PTR, JIT::Type::OBJECT ])
+
+  define_native_function(
+      :ludicrous_const_cache_set,
+      JIT::Type::OBJECT,
+      [ :cache, :value ],
+      [ JIT::Type::VOID_PTR, JIT::Type::OBJECT ])
+
+  # Returns a constant pointer to the given cache's C struct.
+  #
+  # +cache+:: a Ludicrous::ConstCache
+  def const_cache_ptr(cache)
+    # Hold a reference to the cache so it lives as long as the function
+    const(JIT::Type::OBJECT, cache)
+    return const(JIT::Type::VOID_PTR, cache.address)
+  end
+
+  # Emit code to check whether a constant cache holds a current value
+  # looked up in +klass+.
+  #
+  # Returns a JIT::Value that is nonzero if it does.
+  #
+  # +cache_ptr+:: a pointer returned by const_cache_ptr
+  # +klass+:: a JIT::Value with the class being searched (nil for a
+  # YARV inline cache)
+  def const_cache_valid(cache_ptr, klass)
+    valid = value(JIT::Type::INT)
+    valid.store(const(JIT::Type::INT, 0))
+
+    serial_ptr = const(JIT::Type::VOID_PTR, Ludicrous::ConstCache.serial_address)
+    serial = insn_load_relative(serial_ptr, 0, JIT::Type::NUINT)
+
+    self.if(ruby_struct_member(:Ludicrous_Const_Cache, :serial, cache_ptr) == serial) {
+      self.if(ruby_struct_member(:Ludicrous_Const_Cache, :klass, cache_ptr) == klass) {
+        valid.store(const_cache_unshadowed(cache_ptr))
+      } .end
+    } .end
+
+    return valid
+  end
+
+  # Emit code to check that no constant has been defined in the tables
+  # searched before the one holding a cached constant (see
+  # const_cache.h).  Always true where the serial covers that.
+  #
+  # Returns a JIT::Value that is nonzero if none has.
+  #
+  # +cache_ptr+:: a pointer returned by const_cache_ptr
+  def const_cache_unshadowed(cache_ptr)
+    if not have_ruby_struct_member(:Ludicrous_Const_Cache, :shadow_tbl) then
+      return const(JIT::Type::INT, 1)
+    end
+
+    tbl_offset = ruby_struct_member_offset(:Ludicrous_Const_Cache, :shadow_tbl)
+    entries_offset = ruby_struct_member_offset(:Ludicrous_Const_Cache, :shadow_entries)
+    unshadowed = nil
+    Ludicrous::ConstCache::SHADOWS.times do |i|
+      tbl = insn_load_relative(
+          cache_ptr, tbl_offset + i * JIT::Type::VOID_PTR.size,
+          JIT::Type::VOID_PTR)
+      entries = insn_load_relative(
+          cache_ptr, entries_offset + i * JIT::Type::INT.size,
+          JIT::Type::INT)
+      same = ruby_struct_member(:st_table, :num_entries, tbl) == entries
+      unshadowed = unshadowed ? unshadowed & same : same
+    end
+    return unshadowed
+  end
+
+  # Emit code to read the value held by a constant cache (which must
+  # be valid).
+  #
+  # +cache_ptr+:: a pointer returned by const_cache_ptr
+  def const_cache_value(cache_ptr)
+    slot = ruby_struct_member(:Ludicrous_Const_Cache, :slot, cache_ptr)
+    return insn_load_relative(slot, 0, JIT::Type::OBJECT)
+  end
+
+  # Emit code to get the value of a constant through a new constant
+  # cache.
+  #
+  # +klass+:: the class to search (a JIT::Value or a Module)
+  # +vid+:: a Symbol with the name of the constant
+  def cached_const_get(klass, vid)
+    Ludicrous::Stats.fast_path(:const_cache)
+    cache_ptr = const_cache_ptr(Ludicrous::ConstCache.new(vid))
+    klass = const(JIT::Type::OBJECT, klass) if not JIT::Value === klass
+
+    result = value(JIT::Type::OBJECT)
+    self.if(const_cache_valid(cache_ptr, klass)) {
+      result.store(const_cache_value(cache_ptr))
+    } .else {
+      result.store(ludicrous_const_get(cache_ptr, klass))
+    } .end
+
+    return result
+  end
+end
+
+end # JIT
+
@@ -0,0 +1,214 @@
+# Direct calls from one compiled method to another.
+#
+# A method compiled with a fixed number of arguments has a known native
+# signature (self followed by each argument), so when a call site can
+# prove at runtime that the method it is calling is that compiled
+# function, it can call it with insn_call and pass the arguments in
+# registers, without building an argv array and without going through
+# ruby's method dispatch.
+#
+# The proof is a guard on the call site's CallCache: the cache records
+# the receiver class for which the method last resolved to the
+# function the call site expects, and the guard compares that class
+# (and the cache's serial) before making the direct call.  If the guard
+# fails, the call goes through the cache as usual.
+#
+# Because no ruby frame is pushed for a direct call, only methods that
+# never look at their frame are eligible (see Node#ludicrous_needs_frame).
+
+require 'ludicrous/call_cache'
+
+module Ludicrous
+
+module DirectCall
+  # A compiled method that can be the target of a direct call.
+  Target = Struct.new(:klass, :name, :function, :arity)
+
+  # Compiled, installed methods, indexed by [ klass, name ]
+  @targets = {}
+
+  # Call caches created for calls to a method that is still being
+  # compiled (i.e. recursive calls), indexed by function; their
+  # expected address is filled in once the function is compiled, and
+  # they are dropped if compilation fails.
+  @pending_caches = {}
+
+  class << self
+    attr_reader :targets
+  end
+
+  # Records that the method +name+ in +klass+ is being compiled while
+  # the given block executes, so that recursive calls from the method to
+  # itself can be compiled as direct calls.
+  #
+  # +klass+:: the class or module the method is a member of
+  # +name+:: a Symbol with the name of the method
+  def self.compiling(klass, name)
+    stack = (Thread.current[:ludicrous_compiling] ||= [])
+    stack.push(Target.new(klass, name.to_s.intern, nil, nil))
+    begin
+      return yield
+    ensure
+      target = stack.pop
+      @pending_caches.delete(target.function) if target.function
+    end
+  end
+
+  # Returns the Target for the method currently being compiled, or nil
+  # if no method is being compiled (e.g. if the method was compiled
+  # directly with Method#ludicrous_compile).
+  def self.current
+    stack = Thread.current[:ludicrous_compiling]
+    return stack && stack[-1]
+  end
+
+  # Called by the method compiler when it starts building the function
+  # for a method.
+  #
+  # +function+:: the JIT::Function being built
+  # +arity+:: the number of arguments the function takes (not counting
+  # self), or nil if the function cannot be called directly
+  def self.begin_function(function, arity)
+    target = self.current
+    if target and not target.function then
+      target.function = function
+      target.arity = arity
+    end
+  end
+
+  # Called by the method compiler once a function has been compiled.
+  #
+  # +function+:: the compiled JIT::Function
+  def self.end_function(function)
+    caches = @pending_caches.delete(function)
+    return if not caches
+    address = function.to_closure
+    caches.each do |cache|
+      cache.direct_cfunc = address
+    end
+  end
+
+  # Called when a compiled method has been installed in its class.
+  #
+  # +klass+:: the class or module the method is a member of
+  # +name+:: a Symbol with the name of the method
+  # +function+:: the JIT::Function that was installed
+  def self.installed(klass, name, function)
+    name = name.to_s.intern
+    if function.direct_call_arity then
+      @targets[[klass, name]] = Target.new(
+          klass, name, function, function.direct_call_arity)
+    else
+      @targets.delete([klass, name])
+    end
+  end
+
+  # Called when a compiled method has been replaced, either by its
+  # original body (see Ludicrous::Redefinition) or by any other change to
+  # the method (redefinition, removal, or undefinition).
+  #
+  # +klass+:: the class or module the method is a member of
+  # +name+:: a Symbol with the name of the method
+  def self.uninstalled(klass, name)
+    @targets.delete([klass, name.to_s.intern])
+  end
+
+  # Find a function that a call to +mid+ with +argc+ arguments might
+  # call directly.
+  #
+  # Returns a Target, or nil if there is no likely target.
+  #
+  # +env+:: the Environment for the call site
+  # +mid+:: a Symbol with the name of the method being called
+  # +argc+:: the number of arguments being passed
+  # +is_fcall+:: true if the receiver is self
+  def self.target_for(env, mid, argc, is_fcall)
+    target = nil
+
+    current = self.current
+    if is_fcall and current and current.name == mid and current.function then
+      # A recursive call
+      target = current
+    elsif is_fcall then
+      target = @targets[[env.cbase, mid]]
+    else
+      # We don't know the receiver's class, so pick the only compiled
+      # method with this name, if there is exactly one
+      candidates = @targets.values.select { |t| t.name == mid }
+      target = candidates[0] if candidates.size == 1
+    end
+
+    if target and target.arity == argc then
+      return target
+    else
+      return nil
+    end
+  end
+
+  # Returns true if the given function has not yet been compiled, in
+  # which case the cache must wait for it.
+  #
+  # +target+:: the Target being called
+  # +cache+:: the CallCache for the call site
+  def self.expect(target, cache)
+    current = self.current
+    if current and target.function == current.function then
+      (@pending_caches[target.function] ||= []) << cache
+    else
+      cache.direct_cfunc = target.function.to_closure
+    end
+  end
+end
+
+end # Ludicrous
+
+module JIT
+
+class Function
+  define_native_function(
+      :ludicrous_direct_call_check,
+      JIT::Type::VOID,
+      [ ],
+      [ ])
+
+  # The number of arguments (not counting self) this function takes if
+  # it can be called directly from another compiled function, or nil if
+  # it cannot.
+  attr_accessor :direct_call_arity
+
+  # Emit code to call method +mid+ on +recv+, calling +target+ directly
+  # if the guard passes and through a call cache otherwise.
+  #
+  # +target+:: a Ludicrous::DirectCall::Target
+  # +recv+:: the receiver
+  # +mid+:: a Symbol with the name of the method to call
+  # +args+:: an Array of JIT::Value with the arguments to the method
+  def direct_call(target, recv, mid, args)
+    Ludicrous::Stats.fast_path(:direct_call)
+    cache = Ludicrous::CallCache.new(mid)
+    Ludicrous::DirectCall.expect(target, cache)
+
+    result = value(JIT::Type::OBJECT)
+    done_label = JIT::Label.new
+
+    cache_ptr = call_cache_ptr(cache)
+    serial_ptr = const(JIT::Type::VOID_PTR, Ludicrous::CallCache.serial_address)
+    serial = insn_load_relative(serial_ptr, 0, JIT::Type::NUINT)
+
+    self.if(ruby_struct_member(:Ludicrous_Call_Cache, :serial, cache_ptr) == serial) {
+      direct_klass = ruby_struct_member(:Ludicrous_Call_Cache, :direct_klass, cache_ptr)
+      self.if(rb_class_of(recv) == direct_klass) {
+        ludicrous_direct_call_check()
+        result.store(insn_call(mid, target.function, 0, recv, *args))
+        insn_branch(done_label)
+      } .end
+    } .end
+
+    result.store(call_through_cache(cache_ptr, recv, args))
+
+    insn_label(done_label)
+    return result
+  end
+end
+
+end # JIT
@@ -0,0 +1,67 @@
+# Direct yields from compiled methods into compiled blocks.
+#
+# A block compiled in the :fast or :direct style is a body function
+# passed to rb_iterate.  When the iterator is called with
+# ludicrous_call_with_direct_block (defined in direct_yield.c), a
+# compiled method that yields to that block calls the body function
+# itself, instead of going through rb_yield, which pushes a frame and a
+# scope for the block and packs its arguments.  Yields to any other
+# block still go through rb_yield.
+#
+# A direct call for a yield of more or less than one value passes the
+# body the values exactly as yielded, which rb_yield can't do for a
+# block function, so a block with several variables gets exactly what
+# ruby would assign it.  Compiled methods that only use their block
+# through yield are recorded with DirectYield.add_yielder; a block in
+# the :direct style is passed to rb_iterate only if the iterator is
+# one of them, and is given to other iterators as a Proc.
+
+require 'ludicrous/native_functions'
+
+module Ludicrous
+
+module DirectYield
+  # Returns a Hash with the number of yields from compiled code that
+  # called a compiled block directly and the number that went through
+  # rb_yield.
+  def self.stats
+    direct_yields, slow_yields = self.totals
+    return {
+      :direct_yields => direct_yields,
+      :slow_yields => slow_yields,
+    }
+  end
+end
+
+end # Ludicrous
+
+module JIT
+
+class Function
+  define_native_function(
+      :ludicrous_call_with_direct_block,
+      JIT::Type::OBJECT,
+      [ :recv, :mid, :args, :body, :scope ],
+      [ JIT::Type::OBJECT, JIT::Type::ID, JIT::Type::OBJECT,
+        JIT::Type::FUNCTION_PTR, JIT::Type::OBJECT ])
+
+  define_native_function(
+      :ludicrous_yield,
+      JIT::Type::OBJECT,
+      [ :value, :splat ],
+      [ JIT::Type::OBJECT, JIT::Type::INT ])
+
+  define_native_function(
+      :ludicrous_avalue_to_svalue,
+      JIT::Type::OBJECT,
+      [ :values ],
+      [ JIT::Type::OBJECT ])
+
+  define_native_function(
+      :ludicrous_yields_directly,
+      JIT::Type::INT,
+      [ :cache, :recv ],
+      [ JIT::Type::VOID_PTR, JIT::Type::OBJECT ])
+end
+
+end # JIT
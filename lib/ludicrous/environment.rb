@@ -12,6 +12,15 @@ class Environment
   attr_accessor :file
   attr_accessor :line
 
+  # True if calls compiled in this environment are made while a block
+  # is waiting to be passed (e.g. inside the iter function given to
+  # rb_iterate), in which case they must go through rb_funcall.
+  attr_accessor :passing_block
+
+  # The Ludicrous::UnboxedLocals for the loop being compiled, if its
+  # locals are being kept unboxed.
+  attr_accessor :unboxed_locals
+
   # Create a new Environment
   #
   # +function+:: the JIT::Function currently being compiled
@@ -28,10 +37,13 @@ class Environment
     @scope_stack = []
     @loop_end_labels = []
     @return_procs = []
+    @retry_procs = []
     @loops = []
     @file = nil
     @line = nil
     @iter = false
+    @passing_block = false
+    @unboxed_locals = nil
   end
 
   # Create a new Environment from an outer environment (used when
@@ -96,6 +108,30 @@ class Environment
     end
   end
 
+  # Emit code for the block with retry handled by +retry_proc+ (used
+  # for the rescue clauses of a begin block, which are compiled into the
+  # same function as the begin block).
+  def catch_retry(retry_proc, &block)
+    @retry_procs.push(retry_proc)
+    begin
+      yield
+    ensure
+      @retry_procs.pop
+    end
+  end
+
+  # Emit code to retry the innermost begin block, or to jump to the
+  # iterator that called the function currently being compiled if
+  # there is none.
+  def retry
+    if @retry_procs.size > 0 then
+      @retry_procs.last.call(@function, self)
+    else
+      @function.rb_jump_tag(
+          @function.const(JIT::Type::INT, Ludicrous::TAG_RETRY))
+    end
+  end
+
   # Pushes the given loop onto the loop stack so that +env.break+ and
   # +env.redo+ will operate on this loop.  Does not actually do any
   # looping; this must be taken care of by the loop object in the outer
@@ -137,7 +173,20 @@ class Environment
   def get_constant(vid)
     # TODO: search whole const ref list, not just a single class
     # TODO: set source before calling function
-    return @function.rb_const_get(@cbase, vid)
+    return get_constant_from(@cbase, vid)
+  end
+
+  # Get the value of the constant +vid+ in +klass+ (or one of its
+  # ancestors).
+  #
+  # +klass+:: the class to search (a JIT::Value or a Module)
+  # +vid+:: a Symbol with the name of the constant
+  def get_constant_from(klass, vid)
+    if @options.const_cache then
+      return @function.cached_const_get(klass, vid)
+    else
+      return @function.rb_const_get(klass, vid)
+    end
   end
 
   # Search the environment's cref to determine if a constant is defined.
@@ -4,6 +4,13 @@
 # method_nodes.rb.
 
 require 'ludicrous/iter_loop'
+require 'ludicrous/unboxed_locals'
+require 'ludicrous/redefinition'
+require 'ludicrous/case_dispatch'
+
+Ludicrous::Redefinition.track(String, :+, :<<)
+Ludicrous::Redefinition.track(Array, :[], :[]=, :<<)
+Ludicrous::Redefinition.track(Hash, :[], :[]=)
 
 class Node
 
@@ -74,43 +81,25 @@ def ludicrous_compile_call(function, env, recv, mid, args)
   else
     # number of args only known at runtime
     a = args.ludicrous_compile(function, env)
+    Ludicrous::Stats.fallback("argument count not known until runtime")
     return ludicrous_compile_call_dyn(function, env, recv, mid, a)
   end
 
   result = function.value(JIT::Type::OBJECT)
 
-  # TODO: This doesn't handle bignums
-  binary_fixnum_operators = {
-    :+ => proc { |lhs, rhs| lhs + (rhs & function.const(JIT::Type::INT, ~1)) },
-    :- => proc { |lhs, rhs| lhs - (rhs & function.const(JIT::Type::INT, ~1)) },
-    :< => proc { |lhs, rhs| lhs < rhs },
-    :== => proc { |lhs, rhs| lhs == rhs },
-  }
-
-  # TODO: This optimization is only valid if Fixnum#+/- has not been
-  # redefined
-  if binary_fixnum_operators.include?(mid) then
-    if args.length == 1 then
-      function.if(recv.is_fixnum) {
-        function.if(args[0].is_fixnum) {
-          result.store(binary_fixnum_operators[mid].call(recv, args[0]))
-          function.insn_branch(end_label)
-        } .end
-      } .end
-    end
-  end
-
-  unary_fixnum_operators = {
-    :succ => proc { |lhs| lhs + function.const(JIT::Type::INT, 2) },
-  }
-
-  if unary_fixnum_operators.include?(mid) then
-    if args.length == 0 then
-      function.if(recv.is_fixnum) {
-        result.store(unary_fixnum_operators[mid].call(recv))
-        function.insn_branch(end_label)
-      } .end
+  if Ludicrous.fixnum_operator?(mid, args.length) and
+     Ludicrous::Redefinition.assume(Fixnum, mid) then
+    Ludicrous::Stats.fast_path(:fixnum_operator)
+    fixnum_fallback_label = JIT::Label.new
+    unknown = ([ recv ] + args).reject { |value| value.known_fixnum }
+    if not unknown.empty? then
+      is_fixnum = unknown.map { |value| value.is_fixnum }.inject { |f, v| f & v }
+      function.insn_branch_if_not(is_fixnum, fixnum_fallback_label)
     end
+    result.store(function.fixnum_operator(
+        mid, recv, args, fixnum_fallback_label))
+    function.insn_branch(end_label)
+    function.insn_label(fixnum_fallback_label)
   end
 
   binary_string_operators = {
@@ -118,80 +107,191 @@ def ludicrous_compile_call(function, env, recv, mid, args)
   }
 
   if binary_string_operators.include?(mid) then
-    if args.length == 1 then
-      function.if(recv.is_type(Ludicrous::T_STRING)) {
+    if args.length == 1 and Ludicrous::Redefinition.assume(String, mid) then
+      Ludicrous::Stats.fast_path(:string_operator)
+      function.if(recv.is_exact_class(::String)) {
         result.store(binary_string_operators[mid].call(recv, args[0]))
         function.insn_branch(end_label)
       } .end
     end
   end
 
+  # The receiver's class is only known at runtime, so each class's fast
+  # path is emitted only if its method has not been redefined, and is
+  # taken only for an instance of exactly that class
   if mid == :[] and args.size == 1 then
-    function.if(recv.is_type(Ludicrous::T_ARRAY)) {
-      function.if(args[0].is_fixnum) {
-        idx = args[0].fix2int
-        len = function.ruby_struct_member(:RArray, :len, recv)
-        function.if(idx < len) {
-          is_ge_zero = idx >= function.const(JIT::Type::INT, 0) # TODO: is this right?
-          function.if(is_ge_zero) {
-            ptr = function.ruby_struct_member(:RArray, :ptr, recv)
-            result.store(function.insn_load_elem(ptr, idx, JIT::Type::OBJECT))
-            function.insn_branch(end_label)
+    array = Ludicrous::Redefinition.assume(Array, mid)
+    hash = Ludicrous::Redefinition.assume(Hash, mid)
+    Ludicrous::Stats.fast_path(:array_hash_aref) if array or hash
+    if array then
+      function.if(recv.is_exact_class(::Array)) {
+        function.if(args[0].is_fixnum) {
+          idx = args[0].fix2int
+          len = function.ruby_struct_member(:RArray, :len, recv)
+          function.if(idx < len) {
+            is_ge_zero = idx >= function.const(JIT::Type::INT, 0) # TODO: is this right?
+            function.if(is_ge_zero) {
+              ptr = function.ruby_struct_member(:RArray, :ptr, recv)
+              result.store(function.insn_load_elem(ptr, idx, JIT::Type::OBJECT))
+              function.insn_branch(end_label)
+            } .end
           } .end
         } .end
       } .end
-    } .elsif(recv.is_type(Ludicrous::T_HASH)) {
-      result.store(function.rb_hash_aref(recv, args[0]))
-      function.insn_branch(end_label)
-    } .end
+    end
+    if hash then
+      function.if(recv.is_exact_class(::Hash)) {
+        result.store(function.rb_hash_aref(recv, args[0]))
+        function.insn_branch(end_label)
+      } .end
+    end
   end
 
   if mid == :[]= and args.size == 2 then
-    function.if(recv.is_type(Ludicrous::T_ARRAY)) {
-      function.if(args[0].is_fixnum) {
-        idx = args[0].fix2int
-        len = function.ruby_struct_member(:RArray, :len, recv)
-        function.if(idx < len) {
-          is_ge_zero = idx >= function.const(JIT::Type::INT, 0) # TODO: is this right?
-          function.if(is_ge_zero) {
-            ptr = function.ruby_struct_member(:RArray, :ptr, recv)
-            function.insn_store_elem(ptr, idx, args[1])
-            result.store(args[1])
-            function.insn_branch(end_label)
+    array = Ludicrous::Redefinition.assume(Array, mid)
+    hash = Ludicrous::Redefinition.assume(Hash, mid)
+    Ludicrous::Stats.fast_path(:array_hash_aset) if array or hash
+    if array then
+      function.if(recv.is_exact_class(::Array)) {
+        function.if(args[0].is_fixnum) {
+          idx = args[0].fix2int
+          len = function.ruby_struct_member(:RArray, :len, recv)
+          function.if(idx < len) {
+            is_ge_zero = idx >= function.const(JIT::Type::INT, 0) # TODO: is this right?
+            function.if(is_ge_zero) {
+              ptr = function.ruby_struct_member(:RArray, :ptr, recv)
+              function.insn_store_elem(ptr, idx, args[1])
+              result.store(args[1])
+              function.insn_branch(end_label)
+            } .end
           } .end
         } .end
       } .end
-    } .elsif(recv.is_type(Ludicrous::T_HASH)) {
-      result.store(function.rb_hash_aset(recv, args[0], args[1]))
-      function.insn_branch(end_label)
-    } .end
+    end
+    if hash then
+      function.if(recv.is_exact_class(::Hash)) {
+        result.store(function.rb_hash_aset(recv, args[0], args[1]))
+        function.insn_branch(end_label)
+      } .end
+    end
   end
 
   if mid == :<< and args.size == 1 then
-    function.if(recv.is_type(Ludicrous::T_ARRAY)) {
-      result.store(function.rb_ary_push(recv, args[0]))
-      function.insn_branch(end_label)
-    } .elsif(recv.is_type(Ludicrous::T_STRING)) {
-      result.store(function.rb_str_concat(recv, args[0]))
-      function.insn_branch(end_label)
-    } .end
+    array = Ludicrous::Redefinition.assume(Array, mid)
+    string = Ludicrous::Redefinition.assume(String, mid)
+    Ludicrous::Stats.fast_path(:array_string_append) if array or string
+    if array then
+      function.if(recv.is_exact_class(::Array)) {
+        result.store(function.rb_ary_push(recv, args[0]))
+        function.insn_branch(end_label)
+      } .end
+    end
+    if string then
+      function.if(recv.is_exact_class(::String)) {
+        result.store(function.rb_str_concat(recv, args[0]))
+        function.insn_branch(end_label)
+      } .end
+    end
   end
 
   set_source(function)
-  result.store(function.rb_funcall(recv, mid, *args))
+  if env.options.call_cache and not env.passing_block then
+    result.store(ludicrous_compile_cached_call(function, env, recv, mid, args, false))
+  else
+    ludicrous_record_call_fallback(env)
+    result.store(function.rb_funcall(recv, mid, *args))
+  end
 
   function.insn_label(end_label)
   return result
 end
 
+# Record in the stats why a call site is calling rb_funcall instead of
+# going through a call cache.
+def ludicrous_record_call_fallback(env)
+  if env.passing_block then
+    Ludicrous::Stats.fallback("call inside rb_iterate must pass the block")
+  else
+    Ludicrous::Stats.fallback("call cache disabled")
+  end
+end
+
+# Emit code to call a method through a call cache, calling the target
+# function directly if it is known to be compiled.
+def ludicrous_compile_cached_call(function, env, recv, mid, args, is_fcall)
+  target = Ludicrous::DirectCall.target_for(env, mid, args.length, is_fcall)
+  if target then
+    return function.direct_call(target, recv, mid, args)
+  elsif Ludicrous::CallCache.attr_call?(mid, args.length) then
+    return function.attr_call(recv, mid, args)
+  else
+    return function.cached_call(recv, mid, args)
+  end
+end
+
 class CALL
   def ludicrous_compile(function, env)
+    if env.options.unboxed_floats and ludicrous_float_operator? and
+       not ludicrous_fixnum_operands?(env) then
+      return function.box_float(ludicrous_compile_float_operator(function, env))
+    end
+
     recv = self.recv.ludicrous_compile(function, env)
     mid = self.mid
     args = self.args
     return ludicrous_compile_call(function, env, recv, mid, args)
   end
 
+  # Returns true if this is a call to an operator with a Float fast path
+  # (see unboxed_float.rb).
+  def ludicrous_float_operator?
+    return (ARRAY === self.args and
+            Ludicrous.float_operator?(self.mid, self.args.to_a.size) and
+            Ludicrous::Redefinition.assume(Float, self.mid) and
+            Ludicrous::Redefinition.assume(Fixnum, self.mid))
+  end
+
+  # Returns true if this is a call to an arithmetic operator with a
+  # Float fast path, whose result can be left unboxed.
+  def ludicrous_float_arithmetic?
+    return (ludicrous_float_operator? and
+            Ludicrous::FLOAT_ARITHMETIC_OPERATORS.include?(self.mid))
+  end
+
+  # Returns true if the receiver and argument are both known to be
+  # Fixnums, in which case the Float fast path would only get in the
+  # way.
+  def ludicrous_fixnum_operands?(env)
+    return [ self.recv, self.args.to_a[0] ].all? do |node|
+      (LIT === node and Fixnum === node.lit) or
+      (LVAR === node and env.unboxed_locals and
+       env.unboxed_locals.fixnum?(node.vid))
+    end
+  end
+
+  # Emit code for a call to an operator with a Float fast path.
+  #
+  # Returns a Ludicrous::UnboxedFloat (or, for a comparison, a
+  # JIT::Value).  Operands that are themselves arithmetic on Floats are
+  # compiled the same way, so their results are not boxed.
+  def ludicrous_compile_float_operator(function, env)
+    operands = [ self.recv, self.args.to_a[0] ].map do |node|
+      if node.ludicrous_float_arithmetic? then
+        node.ludicrous_compile_float_operator(function, env)
+      elsif LVAR === node and env.unboxed_locals and
+            env.unboxed_locals.float?(node.vid) then
+        env.unboxed_locals.floats[node.vid]
+      else
+        node.ludicrous_compile(function, env)
+      end
+    end
+
+    Ludicrous::Stats.fast_path(:float_operator)
+    return function.float_operator(self.mid, *operands) do |lhs, rhs|
+      ludicrous_compile_call(function, env, lhs, self.mid, [ rhs ])
+    end
+  end
+
   def ludicrous_defined(function, env)
     result = function.value(JIT::Type::OBJECT)
     recv = self.recv.ludicrous_compile(function, env) # TODO: catch exceptions
@@ -215,6 +315,13 @@ def ludicrous_compile_fcall(function, env, mid, args)
     raise "Can't handle fcall for #{mid}"
   end
 
+  if env.options.call_cache and not env.passing_block then
+    set_source(function)
+    return ludicrous_compile_cached_call(
+        function, env, env.scope.self, mid, args, true)
+  end
+
+  ludicrous_record_call_fallback(env)
   num_args = function.const(JIT::Type::INT, args.length)
   array_type = JIT::Type.create_struct([ JIT::Type::OBJECT ] * args.length)
   array = function.value(array_type)
@@ -344,6 +451,11 @@ end
 
 class LASGN
   def ludicrous_compile(function, env)
+    locals = env.unboxed_locals
+    if locals and locals.include?(self.vid) then
+      return locals.compile_assignment(self.vid, self.value)
+    end
+
     value = self.value.ludicrous_compile(function, env)
     return env.scope.local_set(self.vid, value)
   end
@@ -351,6 +463,11 @@ end
 
 class LVAR
   def ludicrous_compile(function, env)
+    locals = env.unboxed_locals
+    if locals and locals.float?(self.vid) then
+      return locals.floats[self.vid].box
+    end
+
     return env.scope.local_get(self.vid)
   end
 
@@ -373,7 +490,7 @@ class DASGN_CURR
     if self.value then
       value = self.value.ludicrous_compile(function, env)
     else
-      value = function.const(JIT::Type::UINT, Ludicrous::Qundef)
+      value = function.const(JIT::Type::OBJECT, Ludicrous::Qundef)
     end
     return env.scope.dyn_set(self.vid, value)
   end
@@ -391,22 +508,35 @@ end
 
 class IASGN
   def ludicrous_compile(function, env)
-    vid = function.const(JIT::Type::ID, self.vid)
     value = self.value.ludicrous_compile(function, env)
-    return function.rb_ivar_set(env.scope.self, vid, value)
+    if env.options.ivar_cache then
+      return function.cached_ivar_set(env.scope.self, self.vid, value)
+    else
+      vid = function.const(JIT::Type::ID, self.vid)
+      return function.rb_ivar_set(env.scope.self, vid, value)
+    end
   end
 end
 
 class IVAR
   def ludicrous_compile(function, env)
-    vid = function.const(JIT::Type::ID, self.vid)
-    return function.rb_ivar_get(env.scope.self, vid)
+    if env.options.ivar_cache then
+      return function.cached_ivar_get(env.scope.self, self.vid)
+    else
+      vid = function.const(JIT::Type::ID, self.vid)
+      return function.rb_ivar_get(env.scope.self, vid)
+    end
   end
 
   def ludicrous_defined(function, env)
-    vid = function.const(JIT::Type::ID, self.vid)
     result = function.value(JIT::Type::OBJECT)
-    function.if(function.rb_ivar_defined(env.scope.self, vid)) {
+    if env.options.ivar_cache then
+      defined = function.cached_ivar_defined(env.scope.self, self.vid)
+    else
+      vid = function.const(JIT::Type::ID, self.vid)
+      defined = function.rb_ivar_defined(env.scope.self, vid)
+    end
+    function.if(defined) {
       result.store(function.const(JIT::Type::OBJECT, "instance-variable"))
     }.else {
       result.store(function.const(JIT::Type::OBJECT, false))
@@ -485,10 +615,9 @@ def ludicrous_massign(function, env, multi_lhs, rest_lhs, rhs)
     i = function.const(JIT::Type::INT, multi_lhs.size)
     v = function.value(JIT::Type::OBJECT)
     function.if(i < rhs_len) {
-      # TODO: not 64-bit safe
       v.store(function.rb_ary_new4(
           rhs_len - i,
-          rhs_ptr + (i << function.const(JIT::Type::INT, 2))))
+          function.value_elem_address(rhs_ptr, multi_lhs.size)))
     } .else {
       v.store(function.rb_ary_new())
     } .end
@@ -593,7 +722,7 @@ end
 class COLON3
   def ludicrous_compile(function, env)
     set_source(function)
-    return function.rb_const_get(Object, self.vid)
+    return env.get_constant_from(Object, self.vid)
   end
 
   def ludicrous_defined(function, env)
@@ -612,7 +741,7 @@ class COLON2
   def ludicrous_compile(function, env)
     set_source(function)
     klass = self.head.ludicrous_compile(function, env)
-    return function.rb_const_get(klass, self.mid)
+    return env.get_constant_from(klass, self.mid)
   end
 
   def ludicrous_defined(function, env)
@@ -744,6 +873,10 @@ class SCOPE
     else self.next.ludicrous_compile(function, env)
     end
   end
+
+  def ludicrous_needs_frame
+    return self.next ? self.next.ludicrous_needs_frame : false
+  end
 end
 
 class SCLASS
@@ -815,37 +948,69 @@ class BLOCK_ARG
   end
 end
 
+# Emit code for a while or until loop.  The block should emit the loop,
+# calling the Proc it is given to compile the body.  If the loop's
+# numeric locals can be kept unboxed (see unboxed_locals.rb), the block
+# is called once for each copy of the loop.
+def ludicrous_compile_loop(function, env, &emit_loop)
+  retval = function.value(JIT::Type::OBJECT)
+  compile_body = proc {
+    if self.body then
+      retval.store(self.body.ludicrous_compile(function, env))
+    else
+      retval.store(function.const(JIT::Type::OBJECT, nil))
+    end
+  }
+
+  # A loop inside a loop whose locals are unboxed is compiled as part of
+  # the outer loop
+  if env.unboxed_locals or not env.options.unboxed_locals then
+    emit_loop.call(compile_body)
+    return retval
+  end
+
+  locals = Ludicrous::UnboxedLocals.infer(function, env, self)
+  if not locals then
+    emit_loop.call(compile_body)
+    return retval
+  end
+
+  Ludicrous::Stats.fast_path(:unboxed_locals)
+  env.unboxed_locals = locals
+  begin
+    locals.compile { emit_loop.call(compile_body) }
+  ensure
+    env.unboxed_locals = nil
+  end
+
+  # The value of the body may be a Float that was never boxed, but the
+  # value of a loop is nil anyway
+  return function.const(JIT::Type::OBJECT, nil)
+end
+
 class UNTIL
   def ludicrous_compile(function, env)
-    cond = proc { self.cond.ludicrous_compile(function, env).rtest }
-    retval = function.value(JIT::Type::OBJECT)
-    function.until(&cond).do { |loop|
-      env.loop(loop) {
-        if self.body then
-          retval.store(self.body.ludicrous_compile(function, env))
-        else
-          retval.store(function.const(JIT::Type::OBJECT, nil))
-        end
-      }
-    } .end
-    return retval
+    return ludicrous_compile_loop(function, env) do |compile_body|
+      cond = proc { self.cond.ludicrous_compile(function, env).rtest }
+      function.until(&cond).do { |loop|
+        env.loop(loop) {
+          compile_body.call
+        }
+      } .end
+    end
   end
 end
 
 class WHILE
   def ludicrous_compile(function, env)
-    cond = proc { self.cond.ludicrous_compile(function, env).rtest }
-    retval = function.value(JIT::Type::OBJECT)
-    function.while(cond).do { |loop|
-      env.loop(loop) {
-        if self.body then
-          retval.store(self.body.ludicrous_compile(function, env))
-        else
-          retval.store(function.const(JIT::Type::OBJECT, nil))
-        end
-      }
-    } .end
-    return retval
+    return ludicrous_compile_loop(function, env) do |compile_body|
+      cond = proc { self.cond.ludicrous_compile(function, env).rtest }
+      function.while(cond).do { |loop|
+        env.loop(loop) {
+          compile_body.call
+        }
+      } .end
+    end
   end
 end
 
@@ -857,11 +1022,9 @@ class YIELD
       value = function.const(JIT::Type::OBJECT, [])
     end
     set_source(function)
-    if self.state != 0 or not self.head then
-      return function.rb_yield_splat(value)
-    else
-      return function.rb_yield(value)
-    end
+    splat = (self.state != 0 or not self.head) ? 1 : 0
+    return function.ludicrous_yield(
+        value, function.const(JIT::Type::INT, splat))
   end
 
   def ludicrous_defined(function, env)
@@ -875,13 +1038,22 @@ class YIELD
   end
 end
 
-# The fastest way to iterate, but not 100% correct, because:
-#   yield *[[1, 2]]
-# should be yielded to us as:
-#   [1, 2]
-# but instead is yielded as:
-#   [[1, 2]]
-def ludicrous_iterate_fast(function, env, lhs, body, recv=nil, &block)
+# The fastest way to iterate: the block is a pair of functions passed to
+# rb_iterate, so no Proc is allocated.  Through rb_yield the body gets
+# the value ruby would assign to a single block variable, which is
+# exact for a block with at most one variable; multiple assignment from
+# it differs from ruby for yield *[[x]].  A compiled method that yields
+# to the body directly passes it the values exactly as yielded instead
+# (see ludicrous_assign_block_value and ludicrous_iterate_direct).
+#
+# If +mid+ is given, the iteration function calls +mid+ on +recv+ with
+# +args+ (a JIT::Value holding an Array) through
+# ludicrous_call_with_direct_block, so a compiled method yielding to
+# the block can call the body directly.  The body must not need a frame
+# of its own for this (see ludicrous_needs_frame).  Otherwise the block
+# passed to this method is yielded the iteration function, its
+# environment, and +recv+, and should emit the call to the iterator.
+def ludicrous_iterate_fast(function, env, lhs, body, recv=nil, mid=nil, args=nil, &block)
   # lhs - an assignment node that gets executed each time through
   # the loop
   # body - the body of the loop
@@ -892,34 +1064,16 @@ def ludicrous_iterate_fast(function, env, lhs, body, recv=nil, &block)
   # scope_ptr = env.scope.address()
   scope_obj = env.scope.scope_obj
 
-  iter_signature = JIT::Type.create_signature(
-    JIT::ABI::CDECL,
-    JIT::Type::OBJECT,
-    [ JIT::Type::VOID_PTR ])
-  iter_f = JIT::Function.compile(function.context, iter_signature) do |f|
-    f.optimization_level = env.options.optimization_level
-
-    iter_arg = Ludicrous::ITER_ARG_TYPE.wrap(f.get_param(0))
-    outer_scope_obj = iter_arg.scope
-    inner_recv = iter_arg.recv
-    inner_scope = Ludicrous::AddressableScope.load(
-        f, outer_scope_obj, env.scope.local_names, env.scope.args, env.scope.rest_arg)
-    inner_env = Ludicrous::Environment.new(
-        f, env.options, env.cbase, inner_scope)
-
-    result = yield(f, inner_env, inner_recv)
-    f.insn_return(result)
-  end
-
   body_signature = JIT::Type::create_signature(
     JIT::ABI::CDECL,
     JIT::Type::OBJECT,
-    [ JIT::Type::OBJECT, JIT::Type::VOID_PTR ])
+    [ JIT::Type::OBJECT, JIT::Type::VOID_PTR, JIT::Type::OBJECT ])
   body_f = JIT::Function.compile(function.context, body_signature) do |f|
     f.optimization_level = env.options.optimization_level
 
     value = f.get_param(0)
     outer_scope_obj = f.get_param(1)
+    yielded = f.get_param(2)
     inner_scope = Ludicrous::AddressableScope.load(
         f, outer_scope_obj, env.scope.local_names, env.scope.args, env.scope.rest_arg)
     inner_env = Ludicrous::Environment.new(
@@ -927,7 +1081,7 @@ def ludicrous_iterate_fast(function, env, lhs, body, recv=nil, &block)
 
     result = f.value(:OBJECT, nil)
     inner_env.iter { |loop|
-      ludicrous_assign(f, inner_env, lhs, value)
+      ludicrous_assign_block_value(f, inner_env, lhs, value, yielded)
 
       if body then
         body.set_source(f)
@@ -938,10 +1092,47 @@ def ludicrous_iterate_fast(function, env, lhs, body, recv=nil, &block)
     f.insn_return(result)
     # puts f.dump
   end
+  Ludicrous::PerfMap.closure_compiled(body_f, env, "block")
+
+  iter_signature = JIT::Type.create_signature(
+    JIT::ABI::CDECL,
+    JIT::Type::OBJECT,
+    [ JIT::Type::VOID_PTR ])
+  iter_f = JIT::Function.compile(function.context, iter_signature) do |f|
+    f.optimization_level = env.options.optimization_level
+
+    iter_arg = Ludicrous::ITER_ARG_TYPE.wrap(f.get_param(0))
+    outer_scope_obj = iter_arg.scope
+    inner_recv = iter_arg.recv
+
+    if mid then
+      Ludicrous::Stats.fast_path(:direct_block)
+      result = f.ludicrous_call_with_direct_block(
+          inner_recv,
+          f.const(JIT::Type::ID, mid),
+          iter_arg.args,
+          f.const(JIT::Type::FUNCTION_PTR, body_f.to_closure),
+          outer_scope_obj)
+    else
+      inner_scope = Ludicrous::AddressableScope.load(
+          f, outer_scope_obj, env.scope.local_names, env.scope.args, env.scope.rest_arg)
+      inner_env = Ludicrous::Environment.new(
+          f, env.options, env.cbase, inner_scope)
+
+      # The call made here receives the block from rb_iterate, so it
+      # can't go through a call cache
+      inner_env.passing_block = true
+
+      result = yield(f, inner_env, inner_recv)
+    end
+    f.insn_return(result)
+  end
+  Ludicrous::PerfMap.closure_compiled(iter_f, env, "iter")
 
   iter_arg = Ludicrous::ITER_ARG_TYPE.create(function)
   iter_arg.recv = recv ? recv : function.const(JIT::Type::OBJECT, nil)
   iter_arg.scope = scope_obj
+  iter_arg.args = args ? args : function.const(JIT::Type::OBJECT, nil)
 
   # TODO: will this leak memory if the function is redefined later?
   iter_c = function.const(JIT::Type::FUNCTION_PTR, iter_f.to_closure)
@@ -950,6 +1141,71 @@ def ludicrous_iterate_fast(function, env, lhs, body, recv=nil, &block)
   return function.rb_iterate(iter_c, iter_arg.ptr, body_c, scope_obj)
 end
 
+# Emit code to assign the value passed to a block body function (see
+# ludicrous_iterate_fast) to the block variable +lhs+.
+#
+# +value+:: the value passed to the body
+# +yielded+:: the self passed to the body by rb_yield, or Qundef if
+# +value+ is an Array of exactly the values yielded (see
+# ludicrous_yield)
+def ludicrous_assign_block_value(function, env, lhs, value, yielded)
+  return if lhs == false
+  exact = (yielded == function.const(JIT::Type::NUINT, Ludicrous::Qundef))
+  function.if(exact) {
+    ludicrous_assign_yielded_values(function, env, lhs, value)
+  } .else {
+    ludicrous_assign(function, env, lhs, value)
+  } .end
+end
+
+# Emit code to assign an Array of values yielded to a block to the
+# block variable +lhs+, the way ruby does for a yield of more or less
+# than one value.
+def ludicrous_assign_yielded_values(function, env, lhs, values)
+  case lhs
+  when MASGN
+    ludicrous_massign(function, env, lhs.head, lhs.args, values)
+  when false # no block variable
+  else
+    ludicrous_assign(
+        function, env, lhs, function.ludicrous_avalue_to_svalue(values))
+  end
+end
+
+# Iterate with a block that has more than one variable (|a, b|,
+# |a, *b|, |*args|), passing it exactly the values yielded.  If the
+# iterator is a compiled method that only uses its block through yield
+# (see Node#ludicrous_yields_directly?), the block is passed as in
+# ludicrous_iterate_fast and is always called directly with the values
+# yielded, so no Proc is allocated.  Any other iterator is passed a
+# splat Proc (see ludicrous_iter_splat_proc).  The body must not need
+# a frame of its own (see ludicrous_needs_frame).
+#
+# +recv+:: the receiver
+# +mid+:: a Symbol with the name of the iterator
+# +args+:: an Array of JIT::Value with the arguments to the iterator
+# +is_fcall+:: true if the iterator is called without a receiver
+def ludicrous_iterate_direct(function, env, lhs, body, recv, mid, args, is_fcall)
+  result = function.value(JIT::Type::OBJECT)
+  cache = Ludicrous::CallCache.new(mid)
+  yields_directly = function.ludicrous_yields_directly(
+      function.call_cache_ptr(cache), recv)
+
+  function.if(yields_directly) {
+    args_ary = args.size > 0 \
+      ? function.rb_ary_new3(args.size, *args) \
+      : function.const(JIT::Type::OBJECT, [])
+    result.store(ludicrous_iterate_fast(
+        function, env, lhs, body, recv, mid, args_ary))
+  } .else {
+    block = ludicrous_iter_splat_proc(function, env, lhs, body)
+    result.store(ludicrous_iterate_with_proc(
+        function, env, recv, mid, args, is_fcall, block))
+  } .end
+
+  return result
+end
+
 # The next fastest way to iterate, using avalue instead of svalue (so it
 # may be faster for yield splat)
 def ludicrous_iter_proc(function, env, lhs, body)
@@ -988,6 +1244,7 @@ def ludicrous_iter_proc(function, env, lhs, body)
     f.insn_return(r)
     # puts f
   end
+  Ludicrous::PerfMap.closure_compiled(body_f, env, "block")
 
   # TODO: will this leak memory if the function is redefined later?
   body_c = function.const(JIT::Type::FUNCTION_PTR, body_f.to_closure)
@@ -995,13 +1252,243 @@ def ludicrous_iter_proc(function, env, lhs, body)
   return function.rb_proc_new(body_c, scope_obj)
 end
 
-def has_match_data
+# Returns the iteration style to use for a block with the block
+# variable +var+ when the compile options don't give one.
+#
+# A block with no variable or a single one uses :fast, since rb_iterate
+# passes it exactly the value ruby would assign.  Any other block (|a,
+# b|, |a, *b|, |*args|) uses :direct: the value passed by rb_iterate
+# can't tell yield *[[x]] from yield [x], or yield [1, 2] from yield 1,
+# 2, so such a block is only passed that way to compiled iterators that
+# yield to it directly with the exact values (see
+# ludicrous_iterate_direct).  Such blocks can still use :fast for every
+# iterator through the iterate_style option.
+#
+# +var+:: the block variable node (nil if the block has none)
+def ludicrous_default_iterate_style(var)
+  if MASGN === var then
+    return :direct
+  end
+  return :fast
+end
+
+# Methods that look at the caller's frame (and so can't be called from
+# a method that is called directly; see Ludicrous::DirectCall), and the
+# methods that can call any of them on the caller's behalf
+FRAME_METHODS = [
+  :block_given?, :iterator?, :binding, :caller, :__method__, :proc,
+  :lambda, :local_variables, :eval, :set_trace_func,
+  :send, :__send__, :public_send, :method, :instance_eval,
+  :instance_exec, :class_eval, :module_eval, :class_exec, :module_exec ]
+
+# Returns true if this node needs a ruby frame for the method it is in,
+# false if it is safe to call the method without pushing one.
+def ludicrous_needs_frame
+  self.members.each do |name|
+    member = self[name]
+    if Node === member then
+      return true if member.ludicrous_needs_frame
+    end
+  end
+  return false
+end
+
+[ SUPER, ZSUPER, YIELD, ITER, FOR, BLOCK_PASS, DEFN, DEFS, CLASS,
+  MODULE, SCLASS ].each do |klass|
+  klass.class_eval do
+    def ludicrous_needs_frame
+      return true
+    end
+  end
+end
+
+[ FCALL, VCALL ].each do |klass|
+  klass.class_eval do
+    def ludicrous_needs_frame
+      return true if FRAME_METHODS.include?(self.mid)
+      return super
+    end
+  end
+end
+
+class CALL
+  # Proc.new without a block takes the block passed to the method that
+  # calls it, which it finds in that method's frame; dynamic dispatch
+  # (self.send(:block_given?)) can reach the frame too
+  def ludicrous_needs_frame
+    if self.mid == :new and (CONST === self.recv or COLON3 === self.recv) then
+      return true if self.recv.vid == :Proc
+    end
+    return true if FRAME_METHODS.include?(self.mid)
+    return super
+  end
+end
+
+# Nodes that may use the method's block other than by yielding to it
+# from the method's own frame: passing it on (super, &block), taking it
+# as a Proc, yielding from the frame of a nested block, or belonging to
+# another method or class body.
+LUDICROUS_BLOCK_USES = [
+  SUPER, ZSUPER, BLOCK_ARG, BLOCK_PASS, ITER, FOR, DEFN, DEFS, CLASS,
+  MODULE, SCLASS ]
+
+# The methods in FRAME_METHODS that look at the block without using it.
+LUDICROUS_BLOCK_TESTS = [ :block_given?, :iterator? ]
+
+# Returns :yield if this node (or any node inside it) yields to the
+# method's block, nil if none of them uses the block, or false if one
+# may use it in some other way (see #ludicrous_yields_directly?).
+def ludicrous_block_use
+  case self
+  when *LUDICROUS_BLOCK_USES
+    return false
+  when FCALL, VCALL, CALL
+    if FRAME_METHODS.include?(self.mid) then
+      return false if not LUDICROUS_BLOCK_TESTS.include?(self.mid)
+    end
+    if CALL === self and self.mid == :new and
+       (CONST === self.recv or COLON3 === self.recv) then
+      return false if self.recv.vid == :Proc
+    end
+  end
+
+  use = YIELD === self ? :yield : nil
   self.members.each do |name|
     member = self[name]
     if Node === member then
-      return true if member.has_match_data
+      member_use = member.ludicrous_block_use
+      return false if member_use == false
+      use ||= member_use
+    end
+  end
+  return use
+end
+
+# Returns true if the method this node is the body of yields to its
+# block and only ever uses the block that way, so that every yield to
+# a block passed with ludicrous_call_with_direct_block calls it
+# directly (see Ludicrous::DirectYield).
+def ludicrous_yields_directly?
+  return ludicrous_block_use == :yield
+end
+
+# Returns true if this node (or any node inside it) may read the local
+# variable +vid+.
+def ludicrous_reads_variable?(vid)
+  case self
+  when LVAR, DVAR
+    return true if self.vid == vid
+  when FCALL, VCALL
+    # eval, binding, and friends can read any variable
+    return true if FRAME_METHODS.include?(self.mid)
+  end
+
+  self.members.each do |name|
+    member = self[name]
+    if Node === member then
+      return true if member.ludicrous_reads_variable?(vid)
+    end
+  end
+  return false
+end
+
+# Nodes that stop the locals of a loop containing them from being kept
+# unboxed, because they compile code into other functions, compile
+# their contents more than once, or read the method's locals behind the
+# compiler's back.
+LUDICROUS_UNBOXED_LOCALS_BARRIERS = [
+  ITER, FOR, RESCUE, ENSURE, BLOCK_PASS, DEFN, DEFS, CLASS, MODULE,
+  SCLASS, DASGN, DASGN_CURR, DVAR, ZSUPER ]
+
+# Find the assignments to local variables in this node, for inferring
+# the types of a loop's locals (see Ludicrous::UnboxedLocals).
+#
+# Appends [ vid, value, statement ] to +assignments+ for each LASGN,
+# where +statement+ is true if the assignment's value is not used by
+# an enclosing expression.  The value is nil for the targets of a
+# multiple assignment.  Returns false if the loop's locals cannot be
+# kept unboxed.
+#
+# +assignments+:: the Array to append to
+# +statement+:: true if this node is a statement
+def ludicrous_loop_assignments(assignments, statement = false)
+  case self
+  when *LUDICROUS_UNBOXED_LOCALS_BARRIERS
+    return false
+  when FCALL, VCALL
+    return false if FRAME_METHODS.include?(self.mid)
+  when LASGN
+    assignments << [ self.vid, self.value, statement ]
+  end
+
+  self.members.each do |name|
+    member = self[name]
+    if Node === member then
+      # Statements in a block, in either branch of an if, or in the body
+      # of a loop are statements too
+      member_statement = case self
+        when BLOCK, NEWLINE then statement
+        when IF then statement && name.to_s != 'cond'
+        when WHILE, UNTIL then name.to_s == 'body'
+        else false
+      end
+      if not member.ludicrous_loop_assignments(assignments, member_statement) then
+        return false
+      end
+    end
+  end
+
+  return true
+end
+
+# Operators whose results have the same numeric type as their operands
+# (see #ludicrous_numeric_type).
+LUDICROUS_ARITHMETIC_OPERATORS = [ :+, :-, :*, :/, :% ]
+
+# Operators that only produce a Fixnum from Fixnums.
+LUDICROUS_FIXNUM_ONLY_OPERATORS = [ :<<, :>>, :&, :|, :^ ]
+
+# Returns the type of number this expression produces (:fixnum or
+# :float), :unknown if it may not produce a number, or nil if that
+# depends on locals whose types are not known yet.
+#
+# +types+:: a Hash mapping the name of each local assigned in the loop
+# to its type so far
+def ludicrous_numeric_type(types)
+  case self
+  when NEWLINE
+    return self.next.ludicrous_numeric_type(types)
+  when LIT
+    return :fixnum if Fixnum === self.lit
+    return :float if Float === self.lit
+  when LVAR
+    return types[self.vid] if types.include?(self.vid)
+  when CALL
+    args = ARRAY === self.args ? self.args.to_a : []
+    return :unknown if args.size != (self.args ? args.size : 0)
+    lhs = self.recv.ludicrous_numeric_type(types)
+    if args.size == 1 then
+      rhs = args[0].ludicrous_numeric_type(types)
+      if LUDICROUS_ARITHMETIC_OPERATORS.include?(self.mid) then
+        return Ludicrous::UnboxedLocals.arithmetic(lhs, rhs)
+      elsif LUDICROUS_FIXNUM_ONLY_OPERATORS.include?(self.mid) then
+        type = Ludicrous::UnboxedLocals.arithmetic(lhs, rhs)
+        return type == :float ? :unknown : type
+      end
+    elsif args.size == 0 then
+      case self.mid
+      when :-@, :abs then return lhs
+      when :succ then return lhs == :float ? :unknown : lhs
+      end
     end
   end
+
+  return :unknown
+end
+
+# Returns true if this is a call to an arithmetic operator with a Float
+# fast path (see CALL#ludicrous_float_arithmetic?).
+def ludicrous_float_arithmetic?
   return false
 end
 
@@ -1010,10 +1497,6 @@ end
 def ludicrous_iter_splat_proc(function, env, lhs, body)
   scope_obj = env.scope.scope_obj
 
-  if body.has_match_data then
-    raise "Cannot compile splat style iteration (iteration with arguments) with match data in the body"
-  end
-
   body_signature = JIT::Type::create_signature(
     JIT::ABI::CDECL,
     JIT::Type::OBJECT,
@@ -1021,12 +1504,7 @@ def ludicrous_iter_splat_proc(function, env, lhs, body)
   body_f = JIT::Function.compile(function.context, body_signature) do |f|
     f.optimization_level = env.options.optimization_level
 
-    ruby_scope = f.ruby_scope()
-    local_vars_type = JIT::Array.new(JIT::Type::OBJECT, 4)
-    local_vars = local_vars_type.wrap(
-        f.ruby_struct_member(:SCOPE, :local_vars, ruby_scope))
-
-    value = local_vars[2]
+    value = f.ludicrous_splat_iterate_value()
 
     outer_scope_obj = f.get_param(1)
     inner_scope = Ludicrous::AddressableScope.load(
@@ -1035,7 +1513,7 @@ def ludicrous_iter_splat_proc(function, env, lhs, body)
         f, env.options, env.cbase, inner_scope)
 
     r = inner_env.iter { |loop|
-      ludicrous_assign(f, inner_env, lhs, value.avalue_splat)
+      ludicrous_assign_yielded_values(f, inner_env, lhs, value)
 
       if body then
         body.set_source(f)
@@ -1049,6 +1527,7 @@ def ludicrous_iter_splat_proc(function, env, lhs, body)
     f.insn_return(r)
     # puts f
   end
+  Ludicrous::PerfMap.closure_compiled(body_f, env, "block")
 
   # TODO: will this leak memory if the function is redefined later?
   body_c = function.const(JIT::Type::FUNCTION_PTR, body_f.to_closure)
@@ -1060,6 +1539,9 @@ def ludicrous_iterate_with_proc(function, env, recv, mid, args, is_fcall, block)
   case args
   when Node
     args = args.ludicrous_compile(function, env)
+  when Array
+    # already compiled
+    args = function.rb_ary_new3(args.size, *args)
   when nil, false
     args = function.const(JIT::Type::OBJECT, [])
   else
@@ -1131,8 +1613,8 @@ def ludicrous_array_iterate(function, env, array, var, body)
   len = function.ruby_struct_member(:RArray, :len, array)
   ptr = function.ruby_struct_member(:RArray, :ptr, array)
 
-  idx = function.value(JIT::Type::INT)
-  idx.store(function.const(JIT::Type::INT, 0))
+  idx = function.value(JIT::Type::NINT)
+  idx.store(function.const(JIT::Type::NINT, 0))
 
   function.until { idx == len }.do { |loop|
     env.loop(loop) {
@@ -1141,7 +1623,7 @@ def ludicrous_array_iterate(function, env, array, var, body)
       if body then
         result.store(body.ludicrous_compile(function, env))
       end
-      idx.store(idx + function.const(JIT::Type::INT, 1))
+      idx.store(idx + function.const(JIT::Type::NINT, 1))
       result
     }
   } .end
@@ -1152,6 +1634,51 @@ end
 class FOR
   LIBJIT_NEEDS_ADDRESSABLE_SCOPE = true
 
+  # A loop over a range runs in the method's frame; any other for loop
+  # is a call to each with a block.
+  def ludicrous_scope_escapes(frame_bound = false)
+    iter = self.iter
+    if DOT3 === iter or DOT2 === iter or (LIT === iter and Range === iter.lit) then
+      return super
+    end
+    return true
+  end
+
+  # Emit a loop over a range (whose end, as returned by
+  # ludicrous_node_is_range, is exclusive).  If the bounds are Fixnums,
+  # the loop runs on a native integer counter; otherwise it calls ==
+  # and succ on the bounds.
+  def ludicrous_compile_range(function, env, range_begin, range_end)
+    result = function.value(JIT::Type::OBJECT)
+    result.store(function.const(JIT::Type::OBJECT, nil))
+    fallback_label = JIT::Label.new
+    done_label = JIT::Label.new
+
+    function.fixnum_guard([ range_begin, range_end ], fallback_label)
+
+    Ludicrous::Stats.fast_path(:counted_loop)
+    one = function.const(JIT::Type::OBJECT, 1)
+    function.counted_loop(
+        env, range_begin, range_end, one, true, :up) { |index, loop|
+      # The loop variable is visible after the loop, so always assign it
+      ludicrous_assign(function, env, self.var, index.call)
+      loop.redo_from_here
+      if self.body then
+        result.store(self.body.ludicrous_compile(function, env))
+      end
+      result
+    }
+    function.insn_branch(done_label)
+
+    function.insn_label(fallback_label)
+    Ludicrous::Stats.fast_path(:range_loop)
+    result.store(ludicrous_range_iterate(
+        function, env, range_begin, range_end, self.var, self.body))
+
+    function.insn_label(done_label)
+    return result
+  end
+
   def ludicrous_compile(function, env)
     # var - an assignment node that gets executed each time through
     # the loop
@@ -1164,8 +1691,7 @@ class FOR
     if is_range then
       # We can optimize this into a loop (as long as Range#each isn't
       # overridden -- TODO)
-
-      return ludicrous_range_iterate(function, env, range_begin, range_end, self.var, self.body)
+      return ludicrous_compile_range(function, env, range_begin, range_end)
     end
 
     result = function.value(JIT::Type::OBJECT)
@@ -1173,13 +1699,16 @@ class FOR
 
     done_label = JIT::Label.new
 
-    # TODO: Don't do this if Array#each is redefined
-    function.if(recv.is_type(Ludicrous::T_ARRAY)) {
-      result.store(ludicrous_array_iterate(function, env, recv, self.var, self.body))
-      function.insn_branch(done_label)
-    } .end
+    if Ludicrous::Redefinition.assume(Array, :each) then
+      Ludicrous::Stats.fast_path(:array_loop)
+      function.if(recv.is_exact_class(::Array)) {
+        result.store(ludicrous_array_iterate(function, env, recv, self.var, self.body))
+        function.insn_branch(done_label)
+      } .end
+    end
 
-    iterate_style = env.options.iterate_style || :splat
+    iterate_style = env.options.iterate_style ||
+      ludicrous_default_iterate_style(self.var)
 
     case iterate_style
     when :fast
@@ -1188,6 +1717,16 @@ class FOR
         f.rb_funcall(recv, :each)
       end
       result.store(v)
+    when :direct
+      if not self.body or not self.body.ludicrous_needs_frame then
+        v = ludicrous_iterate_direct(
+            function, env, self.var, self.body, recv, :each, [], false)
+      else
+        block = ludicrous_iter_splat_proc(function, env, self.var, self.body)
+        v = ludicrous_iterate_with_proc(
+            function, env, recv, :each, nil, false, block)
+      end
+      result.store(v)
     when :proc
       block = ludicrous_iter_proc(function, env, self.var, self.body)
       args = nil
@@ -1260,64 +1799,279 @@ class ITER
     if env.options.iterate_style then
       iterate_style = env.options.iterate_style
     else
-      if self.var then
-        iterate_style = :splat
-      else
-        # Okay to iterate fast style if the block takes no arguments
-        iterate_style = :fast
-      end
+      iterate_style = ludicrous_default_iterate_style(self.var)
+    end
+
+    if ludicrous_counted_iterator? then
+      return ludicrous_compile_counted(function, env, iterate_style)
+    elsif ludicrous_inline_iterator? then
+      return ludicrous_compile_inline(function, env, iterate_style)
+    end
+
+    return ludicrous_compile_iterate(function, env, iterate_style)
+  end
+
+  # A block that is expanded inline only needs a closure if the guard
+  # fails, and then the scope is moved to the heap on demand (which
+  # only the method's own function can do).
+  def ludicrous_scope_escapes(frame_bound = false)
+    if not ludicrous_counted_iterator? and not ludicrous_inline_iterator? then
+      return true
+    end
+    return true if frame_bound
+    return super
+  end
+
+  # Returns the number of arguments passed to the iterator if this is a
+  # call with a receiver and arguments known at compile time, or nil
+  # otherwise.
+  def ludicrous_iter_argc
+    return nil if not Node::CALL === self.iter
+    args = self.iter.args
+    return nil if args and not ARRAY === args
+    return args ? args.to_a.size : 0
+  end
+
+  # Returns true if this is a call to one of
+  # Ludicrous::COUNTED_ITERATORS, or each on a range, with arguments
+  # known at compile time.
+  def ludicrous_counted_iterator?
+    argc = ludicrous_iter_argc or return false
+    if self.iter.mid == :each and argc == 0 then
+      recv = self.iter.recv
+      return true if DOT2 === recv or DOT3 === recv
+      return true if LIT === recv and Range === recv.lit
     end
+    return Ludicrous.counted_iterator?(self.iter.mid, argc)
+  end
+
+  # Returns true if this is a call to one of Ludicrous::INLINE_ITERATORS
+  # with arguments known at compile time.
+  def ludicrous_inline_iterator?
+    argc = ludicrous_iter_argc or return false
+    return Ludicrous.inline_iterator?(self.iter.mid, argc)
+  end
+
+  # Emit code to assign the block's value.  A block-local variable that
+  # the body never reads is not assigned, so the value need not be
+  # computed.
+  #
+  # +value+:: a Proc that emits code to compute the value and returns
+  # it
+  def ludicrous_assign_block_var(function, env, value)
+    return if not self.var
+    if DASGN_CURR === self.var then
+      return if not self.body
+      return if not self.body.ludicrous_reads_variable?(self.var.vid)
+    end
+    ludicrous_assign(function, env, self.var, value.call)
+  end
 
+  def ludicrous_compile_block_body(function, env)
+    if self.body then
+      self.body.set_source(function)
+      return self.body.ludicrous_compile(function, env)
+    else
+      return function.const(JIT::Type::OBJECT, nil)
+    end
+  end
+
+  # Emit the iterator's loop as a loop over a native integer counter,
+  # guarded on the receiver and arguments being Fixnums.  If the guard
+  # fails, the iterator is called normally.
+  def ludicrous_compile_counted(function, env, iterate_style)
+    result = function.value(JIT::Type::OBJECT)
+    fallback_label = JIT::Label.new
+    done_label = JIT::Label.new
+
+    mid = self.iter.mid
+    recv = self.iter.recv.ludicrous_compile(function, env)
+    args = self.iter.args.to_a.map { |arg| arg.ludicrous_compile(function, env) }
+    first, last, step, exclusive, direction = function.counted_iterator_bounds(
+        recv, mid, args, fallback_label)
+
+    Ludicrous::Stats.fast_path(:counted_loop)
+    completed = function.counted_loop(
+        env, first, last, step, exclusive, direction) { |index, loop|
+      ludicrous_assign_block_var(function, env, index)
+      loop.redo_from_here
+      ludicrous_compile_block_body(function, env)
+    }
+
+    # The iterator returns its receiver, unless the loop ended with a
+    # break
+    result.store(function.const(JIT::Type::OBJECT, nil))
+    function.if(completed) {
+      result.store(recv)
+    } .end
+    function.insn_branch(done_label)
+
+    function.insn_label(fallback_label)
+    result.store(ludicrous_compile_iterate(function, env, iterate_style, recv, args))
+
+    function.insn_label(done_label)
+    return result
+  end
+
+  # Emit the iterator's loop inline, with the block body in this
+  # function, guarded on the type of the receiver.  If the guard fails,
+  # the iterator is called normally.
+  def ludicrous_compile_inline(function, env, iterate_style)
+    result = function.value(JIT::Type::OBJECT)
+    fallback_label = JIT::Label.new
+    done_label = JIT::Label.new
+
+    mid = self.iter.mid
+    recv = self.iter.recv.ludicrous_compile(function, env)
+    args = self.iter.args.to_a.map { |arg| arg.ludicrous_compile(function, env) }
+    array = function.inline_iterator_guard(recv, mid, fallback_label)
+
+    Ludicrous::Stats.fast_path(:inline_iterator)
+    v = function.inline_iterate(env, recv, array, mid, args) { |values, loop|
+      ludicrous_assign_block_var(function, env, proc {
+        if values.size == 1 then
+          values[0]
+        else
+          function.rb_ary_new3(values.size, *values)
+        end
+      })
+      loop.redo_from_here
+      ludicrous_compile_block_body(function, env)
+    }
+    result.store(v)
+    function.insn_branch(done_label)
+
+    function.insn_label(fallback_label)
+    result.store(ludicrous_compile_iterate(function, env, iterate_style, recv, args))
+
+    function.insn_label(done_label)
+    return result
+  end
+
+  # Emit a call to the iterator, passing it a block compiled in the
+  # given style.
+  #
+  # +iterate_style+:: :fast, :direct, :proc, or :splat (see
+  # CompileOptions)
+  # +recv+:: the receiver, if it has already been compiled
+  # +args+:: an Array of the arguments, if they have already been
+  # compiled (must be given if +recv+ is)
+  def ludicrous_compile_iterate(function, env, iterate_style, recv=nil, args=nil)
     # TODO: I think ITER is supposed to get its own scope?
+    Ludicrous::Stats.fast_path(:"iterate_#{iterate_style}")
     case iterate_style
     when :fast
+      if ludicrous_direct_block? then
+        if not recv then
+          recv, args = ludicrous_compile_iter_call(function, env)
+        end
+        if recv then
+          args = args.size > 0 \
+            ? function.rb_ary_new3(args.size, *args) \
+            : function.const(JIT::Type::OBJECT, [])
+          return ludicrous_iterate_fast(
+              function, env, self.var, self.body, recv, self.iter.mid, args)
+        end
+      end
+
+      iter_recv = recv
+      if recv and args.size > 0 then
+        # The iter function can't use this function's values, so pass
+        # the arguments along with the receiver
+        iter_recv = function.rb_ary_new3(1 + args.size, recv, *args)
+      end
+
       result = ludicrous_iterate_fast(
-          function, env, self.var, self.body) do |f, inner_env, recv|
+          function, env, self.var, self.body, iter_recv) do |f, inner_env, inner_recv|
         self.iter.set_source(f)
-        self.iter.ludicrous_compile(f, inner_env)
+        if not recv then
+          self.iter.ludicrous_compile(f, inner_env)
+        elsif args.size > 0 then
+          inner_args = (1..args.size).map { |i|
+            f.rb_ary_entry(inner_recv, f.const(JIT::Type::INT, i))
+          }
+          inner_recv = f.rb_ary_entry(inner_recv, f.const(JIT::Type::INT, 0))
+          f.rb_funcall(inner_recv, self.iter.mid, *inner_args)
+        else
+          f.rb_funcall(inner_recv, self.iter.mid)
+        end
       end
+    when :direct
+      if ludicrous_direct_block? then
+        if not recv then
+          recv, args = ludicrous_compile_iter_call(function, env)
+        end
+        if recv then
+          return ludicrous_iterate_direct(
+              function, env, self.var, self.body, recv, self.iter.mid,
+              args, Node::FCALL === self.iter)
+        end
+      end
+
+      block = ludicrous_iter_splat_proc(function, env, self.var, self.body)
+      result = ludicrous_iterate_with_block(function, env, block, recv, args)
     when :proc
       block = ludicrous_iter_proc(function, env, self.var, self.body)
-      case self.iter
-      when Node::CALL
-        recv = self.iter.recv.ludicrous_compile(function, env)
-        mid = self.iter.mid
-        args = self.iter.args
-        result = ludicrous_iterate_with_proc(
-            function, env, recv, mid, args, false, block)
-      when Node::FCALL
-        recv = env.scope.self
-        mid = self.iter.mid
-        args = self.iter.args
-        result = ludicrous_iterate_with_proc(
-            function, env, recv, mid, args, true, block)
-      else
-        raise "Cannot iterate with #{self.iter}"
-      end
+      result = ludicrous_iterate_with_block(function, env, block, recv, args)
     when :splat
       block = ludicrous_iter_splat_proc(function, env, self.var, self.body)
-      case self.iter
-      when Node::CALL
-        recv = self.iter.recv.ludicrous_compile(function, env)
-        mid = self.iter.mid
-        args = self.iter.args
-        result = ludicrous_iterate_with_proc(
-            function, env, recv, mid, args, false, block)
-      when Node::FCALL
-        recv = env.scope.self
-        mid = self.iter.mid
-        args = self.iter.args
-        result = ludicrous_iterate_with_proc(
-            function, env, recv, mid, args, true, block)
-      else
-        raise "Cannot iterate with #{self.iter}"
-      end
+      result = ludicrous_iterate_with_block(function, env, block, recv, args)
     else
       raise "Invalid iterate style #{iterate_style}"
     end
 
     return result
   end
+
+  # Returns true if the block's body can be called directly by a
+  # compiled method that yields to it (see
+  # ludicrous_call_with_direct_block), i.e. if it doesn't need the
+  # frame rb_yield would push for it.
+  def ludicrous_direct_block?
+    return true if not self.body
+    return !self.body.ludicrous_needs_frame
+  end
+
+  # Emit code to evaluate the receiver and arguments of the iterator
+  # call.
+  #
+  # Returns the receiver and an Array of the arguments, or nil if the
+  # iterator isn't a call with arguments known at compile time.
+  def ludicrous_compile_iter_call(function, env)
+    case self.iter
+    when Node::CALL then recv_node = self.iter.recv
+    when Node::FCALL then recv_node = nil
+    else return nil
+    end
+
+    args = self.iter.args
+    return nil if args and not ARRAY === args
+
+    recv = recv_node ? recv_node.ludicrous_compile(function, env) : env.scope.self
+    args = args ? args.to_a.map { |arg| arg.ludicrous_compile(function, env) } : []
+    return recv, args
+  end
+
+  def ludicrous_iterate_with_block(function, env, block, recv, args)
+    case self.iter
+    when Node::CALL
+      if not recv then
+        recv = self.iter.recv.ludicrous_compile(function, env)
+        args = self.iter.args
+      end
+      mid = self.iter.mid
+      return ludicrous_iterate_with_proc(
+          function, env, recv, mid, args, false, block)
+    when Node::FCALL
+      recv = env.scope.self
+      mid = self.iter.mid
+      args = self.iter.args
+      return ludicrous_iterate_with_proc(
+          function, env, recv, mid, args, true, block)
+    else
+      raise "Cannot iterate with #{self.iter}"
+    end
+  end
 end
 
 class Node::BEGIN
@@ -1326,48 +2080,101 @@ class Node::BEGIN
   end
 end
 
-class ENSURE
-  LIBJIT_NEEDS_ADDRESSABLE_SCOPE = true
-
-  def ludicrous_compile(function, env)
-    scope_obj = env.scope.scope_obj()
+# Emit code to run +body+ under rb_protect.  The body is compiled into a
+# function that gets at the method's scope through its frame (see
+# Ludicrous::Scope#frame_arg); a return inside it stores the value to
+# return, marks the return as its own, and jumps with TAG_RETURN.
+# Everything else about the begin
+# block (the rescue, else, and ensure clauses and retry) is compiled
+# into the caller's function, so the only call made when nothing is
+# raised is the one to rb_protect.
+#
+# Returns a JIT::Value with the result of the body and a JIT::Value of
+# type INT with the state rb_protect returned (zero if the body did not
+# jump).
+#
+# +function+:: the JIT::Function being compiled
+# +env+:: the Ludicrous::Environment
+# +body+:: the Node for the body, or nil
+def ludicrous_compile_protected(function, env, body)
+  frame_arg = env.scope.frame_arg
 
-    body_signature = JIT::Type.create_signature(
-      JIT::ABI::CDECL,
-      JIT::Type::OBJECT,
-      [ JIT::Type::VOID_PTR ])
-    body_f = JIT::Function.compile(function.context, body_signature) do |f|
-      f.optimization_level = env.options.optimization_level
+  body_f = JIT::Function.compile(function.context, [ :VOID_PTR ] => :OBJECT) do |f|
+    f.optimization_level = env.options.optimization_level
 
-      outer_scope_obj = f.get_param(0)
-      inner_scope = Ludicrous::AddressableScope.load(f, outer_scope_obj, env.scope.local_names, env.scope.args, env.scope.rest_arg)
-      inner_env = Ludicrous::Environment.new(
-          f, env.options, env.cbase, inner_scope)
+    inner_scope = env.scope.load_frame(f, f.get_param(0))
+    inner_env = Ludicrous::Environment.from_outer(f, inner_scope, env)
 
-      result = self.head.ludicrous_compile(f, inner_env)
-      f.insn_return(result)
-    end
+    result = f.value(:OBJECT, nil)
+    return_proc = proc { |rf, renv, rvalue|
+      renv.scope.dyn_set(LUDICROUS_RESCUE_RESULT_VAR_NAME, rvalue)
+      renv.scope.dyn_set(LUDICROUS_RESCUE_RETURN_VAR_NAME, rf.const(:OBJECT, true))
+      rf.rb_jump_tag(rf.const(:INT, Ludicrous::TAG_RETURN))
+    }
+    inner_env.catch_return(return_proc) {
+      body_result = body.ludicrous_compile(f, inner_env) if body
+      result.store(body_result) if body_result
+    }
+    f.insn_return(result)
+  end
+  Ludicrous::PerfMap.closure_compiled(body_f, env, "begin")
 
-    ensr_signature = JIT::Type::create_signature(
-      JIT::ABI::CDECL,
-      JIT::Type::OBJECT,
-      [ JIT::Type::OBJECT, JIT::Type::VOID_PTR ])
-    ensr_f = JIT::Function.compile(function.context, ensr_signature) do |f|
-      f.optimization_level = env.options.optimization_level
+  # TODO: will this leak memory if the function is redefined later?
+  body_c = function.const(:FUNCTION_PTR, body_f.to_closure)
+
+  env.scope.dyn_set(LUDICROUS_RESCUE_RETURN_VAR_NAME, function.const(:OBJECT, false))
+  state = function.value(:INT)
+  state.store(function.const(:INT, 0))
+  result = function.value(:OBJECT)
+  result.store(function.rb_protect(body_c, frame_arg, state.address))
+  return result, state
+end
+
+# Emit code to finish a begin block whose body jumped with +state+ (and
+# was not rescued): a return from the body returns from the method, and
+# anything else (including a return from a proc made in another method)
+# continues the jump.
+def ludicrous_compile_protected_jump(function, env, state)
+  is_return = state == function.const(:INT, Ludicrous::TAG_RETURN)
+  is_own_return = env.scope.dyn_get(LUDICROUS_RESCUE_RETURN_VAR_NAME) ==
+    function.const(:OBJECT, true)
+  function.if(is_return & is_own_return) {
+    env.return(env.scope.dyn_get(LUDICROUS_RESCUE_RESULT_VAR_NAME))
+  } .else {
+    # TODO: need to call set_source here?
+    function.rb_jump_tag(state)
+  } .end
+end
 
-      outer_scope_obj = f.get_param(0)
-      inner_scope = Ludicrous::AddressableScope.load(f, outer_scope_obj, env.scope.local_names, env.scope.args, env.scope.rest_arg)
-      inner_env = Ludicrous::Environment.from_outer(f, inner_scope, env)
+class ENSURE
+  LIBJIT_NEEDS_ADDRESSABLE_SCOPE = true
 
-      result = self.ensr.ludicrous_compile(f, inner_env)
-      f.insn_return(result)
-    end
+  # The body is compiled into a function that is only called while the
+  # method's frame is active; the ensure clause is compiled inline.
+  def ludicrous_scope_escapes(frame_bound = false)
+    return true if self.head and self.head.ludicrous_scope_escapes(true)
+    return true if self.ensr and self.ensr.ludicrous_scope_escapes(frame_bound)
+    return false
+  end
 
-    # TODO: will this leak memory if the function is redefined later?
-    body_c = function.const(JIT::Type::FUNCTION_PTR, body_f.to_closure)
-    ensr_c = function.const(JIT::Type::FUNCTION_PTR, ensr_f.to_closure)
+  def ludicrous_compile(function, env)
     set_source(function)
-    result = function.rb_ensure(body_c, scope_obj, ensr_c, scope_obj)
+    result, state = ludicrous_compile_protected(function, env, self.head)
+    zero = function.const(:INT, 0)
+
+    # The ensure clause must not change $! for the jump it interrupts
+    errinfo = function.value(:OBJECT)
+    function.unless(state == zero) {
+      errinfo.store(function.rb_errinfo)
+    } .end
+
+    self.ensr.ludicrous_compile(function, env) if self.ensr
+
+    function.unless(state == zero) {
+      function.rb_set_errinfo(errinfo)
+      ludicrous_compile_protected_jump(function, env, state)
+    } .end
+
     return result
   end
 end
@@ -1375,123 +2182,84 @@ end
 class RESCUE
   LIBJIT_NEEDS_ADDRESSABLE_SCOPE = true
 
-  def ludicrous_compile(function, env)
-    scope_obj = env.scope.scope_obj()
-
-    body_f = self.ludicrous_compile_rescue_body(function, env)
- 
-    rescue_f = self.ludicrous_compile_rescue_resq(function, env)
-
-    # TODO: will this leak memory if the function is redefined later?
-    body_c = function.const(:FUNCTION_PTR, body_f.to_closure)
-    rescue_c = function.const(:FUNCTION_PTR, rescue_f.to_closure)
+  # The body is compiled into a function that is only called while the
+  # method's frame is active; the rescue and else clauses are compiled
+  # inline.
+  def ludicrous_scope_escapes(frame_bound = false)
+    return true if self.head and self.head.ludicrous_scope_escapes(true)
+    return true if self.resq and self.resq.ludicrous_scope_escapes(frame_bound)
+    return true if self.else and self.else.ludicrous_scope_escapes(frame_bound)
+    return false
+  end
 
+  def ludicrous_compile(function, env)
     set_source(function)
-    state = function.value(:INT)
-    result = function.value(:OBJECT)
+    zero = function.const(:INT, 0)
+
+    # $! is restored when the begin block is left other than by an
+    # exception
+    errinfo = function.value(:OBJECT)
+    errinfo.store(function.rb_errinfo)
 
     retry_label = JIT::Label.new
     function.insn_label(retry_label)
 
-    state.store(function.const(:INT, 0))
-    result.store(function.rb_protect(body_c, scope_obj, state.address))
-
-    function.if(state == function.const(:INT, Ludicrous::TAG_RETURN)) {
-      result.store(env.scope.dyn_get(LUDICROUS_RESCUE_RESULT_VAR_NAME))
-      env.return(result)
-    }.elsunless(state == function.const(:INT, 0)) {
-      function.if(state == function.const(:INT, Ludicrous::TAG_RAISE)) {
-        state.store(function.const(:INT, 0))
-        result.store(function.rb_protect(rescue_c, scope_obj, state.address))
-        function.if(state == function.const(:INT, Ludicrous::TAG_RETRY)) {
-          # TODO: set ruby_errinfo?
-          function.insn_branch(retry_label)
-        }.elsif(state == function.const(:INT, Ludicrous::TAG_RAISE)) {
-          # TODO: set ruby_errinfo?
-        }.elsif(state == function.const(:INT, Ludicrous::TAG_RETURN)) {
-          result.store(env.scope.dyn_get(LUDICROUS_RESCUE_RESULT_VAR_NAME))
-          env.return(result)
-        }.end
-
-        function.unless(state == function.const(:INT, 0)) {
-          # TODO: need to call set_source here?
-          function.rb_jump_tag(state)
-        }.end
-      }.elsunless(state == function.const(:INT, 0)) {
-        # TODO: need to call set_source here?
-        function.rb_jump_tag(state)
-      }.end
-    }.end
-
-    if self.else then
-      raise "Can't handle else clause on a RESCUE"
-    end
+    result = function.value(:OBJECT)
+    body_result, state = ludicrous_compile_protected(function, env, self.head)
+    result.store(body_result)
+
+    function.if(state == zero) {
+      if self.else then
+        else_result = self.else.ludicrous_compile(function, env)
+        result.store(else_result) if else_result
+      end
+    } .elsif(state == function.const(:INT, Ludicrous::TAG_RAISE)) {
+      result.store(ludicrous_compile_rescue(function, env, errinfo, retry_label))
+    } .else {
+      function.rb_set_errinfo(errinfo)
+      ludicrous_compile_protected_jump(function, env, state)
+    } .end
 
     return result
   end
 
-  def ludicrous_rescue_return_proc()
-    return proc { |rf, renv, rvalue|
-      value ||= rf.const(:OBJECT, nil)
-      renv.scope.dyn_set(LUDICROUS_RESCUE_RESULT_VAR_NAME, rvalue)
-      rf.rb_jump_tag(Ludicrous::TAG_RETURN)
+  # Emit code to run the first rescue clause that matches the exception
+  # in $!, or to raise it again if none does.
+  #
+  # Returns a JIT::Value with the result of the clause.
+  #
+  # +function+:: the JIT::Function being compiled
+  # +env+:: the Ludicrous::Environment
+  # +errinfo+:: a JIT::Value with $! as it was before the begin block
+  # +retry_label+:: the JIT::Label to branch to for retry
+  def ludicrous_compile_rescue(function, env, errinfo, retry_label)
+    end_label = JIT::Label.new
+    result = function.value(:OBJECT, nil)
+    retry_proc = proc { |rf, renv|
+      rf.rb_set_errinfo(errinfo)
+      rf.insn_branch(retry_label)
     }
-  end
-
-  def ludicrous_compile_rescue_body(function, env)
-    body_f = JIT::Function.compile(function.context, [ :VOID_PTR ] => :OBJECT) do |f|
-      f.optimization_level = env.options.optimization_level
-
-      outer_scope_obj = f.get_param(0)
-      inner_scope = Ludicrous::AddressableScope.load(
-          f, outer_scope_obj, env.scope.local_names, env.scope.args, env.scope.rest_arg)
-      inner_env = Ludicrous::Environment.from_outer(f, inner_scope, env)
-
-      result = f.value(:OBJECT)
-      inner_env.catch_return(self.ludicrous_rescue_return_proc) {
-        result.store self.head.ludicrous_compile(f, inner_env)
-      }
-      f.insn_return(result)
-    end
-
-    return body_f
-  end
-
-  def ludicrous_compile_rescue_resq(function, env)
-    rescue_f = JIT::Function.compile(function.context, [ :VOID_PTR ] => :OBJECT) do |f|
-      f.optimization_level = env.options.optimization_level
 
-      outer_scope_obj = f.get_param(0)
-      inner_scope = Ludicrous::AddressableScope.load(
-          f, outer_scope_obj, env.scope.local_names, env.scope.args, env.scope.rest_arg)
-      inner_env = Ludicrous::Environment.from_outer(f, inner_scope, env)
-
-      result = f.value(:OBJECT)
-      inner_env.catch_return(self.ludicrous_rescue_return_proc) {
-        result.store self.ludicrous_compile_rescue(f, inner_env)
-      }
-      f.insn_return(result)
-    end
-
-    return rescue_f
-  end
-
-  def ludicrous_compile_rescue(function, env)
-    return_label = JIT::Label.new
-    result = function.value(:OBJECT, nil)
     resq = self.resq
     ruby_errinfo = function.ruby_errinfo()
     while resq do
+      next_label = JIT::Label.new
       handle_rescue = handle_rescue(function, env, resq, ruby_errinfo)
-      function.if(handle_rescue) {
+      function.insn_branch_if_not(handle_rescue, next_label)
+      env.catch_retry(retry_proc) {
         if resq.body then
-          result.store(resq.body.ludicrous_compile(function, env))
+          body_result = resq.body.ludicrous_compile(function, env)
+          result.store(body_result) if body_result
         end
-      } .end
-      function.insn_branch(return_label)
+      }
+      function.rb_set_errinfo(errinfo)
+      function.insn_branch(end_label)
+      function.insn_label(next_label)
       resq = resq.head
     end
-    function.insn_label(return_label)
+
+    function.rb_jump_tag(function.const(:INT, Ludicrous::TAG_RAISE))
+    function.insn_label(end_label)
     return result
   end
 
@@ -1502,11 +2270,11 @@ class RESCUE
       types = resq.args.to_a.map { |n| n.ludicrous_compile(function, env) }
     end
 
-    result = function.value(JIT::Type::UINT)
+    result = function.value(JIT::Type::NUINT)
     result.store(function.const(:OBJECT, false))
     resq.set_source(function)
     types.each do |type|
-      result = result | function.rb_funcall(type, :===, ruby_errinfo)
+      result = result | function.rb_funcall(type, :===, ruby_errinfo).rtest
     end
     return result
   end
@@ -1514,7 +2282,7 @@ end
 
 class RETRY
   def ludicrous_compile(function, env)
-    function.rb_jump_tag(function.const(JIT::Type::INT, Ludicrous::TAG_RETRY))
+    env.retry
   end
 end
 
@@ -1549,34 +2317,56 @@ class IF
   end
 end
 
-def ludicrous_compile_when(function, env, n, &match)
+# Emit code for a sequence of when clauses.  The tests for every clause
+# come first, in order, followed by the bodies.
+#
+# +n+:: the first WHEN node
+# +dispatch+:: a Proc that emits code to branch straight to the right
+# clause, or nil; it is called with an Array of labels (for the else
+# clause, then for each when clause) and the label of the tests, to
+# branch to if it cannot tell
+def ludicrous_compile_when(function, env, n, dispatch = nil, &match)
   done_label = JIT::Label.new
+  tests_label = JIT::Label.new
+  else_label = JIT::Label.new
 
   result = function.value(JIT::Type::OBJECT)
   result.store(function.const(JIT::Type::OBJECT, nil))
 
+  clauses = []
   while WHEN === n do
-    next_label = JIT::Label.new
-    match_label = JIT::Label.new
-    to_match_list = n.head.to_a
+    clauses << n
+    n = n.next
+  end
+  match_labels = clauses.map { JIT::Label.new }
+
+  if dispatch then
+    dispatch.call([ else_label ] + match_labels, tests_label)
+  end
+
+  function.insn_label(tests_label)
+  clauses.each_with_index do |clause, idx|
+    to_match_list = clause.head.to_a
     for to_match in to_match_list do
       m = to_match.ludicrous_compile(function, env)
       to_match.set_source(function)
       cond = match.call(m)
-      function.insn_branch_if(cond, match_label)
+      function.insn_branch_if(cond, match_labels[idx])
     end
-    function.insn_branch(next_label)
-    function.insn_label(match_label)
-    if n.body then
-      result.store(n.body.ludicrous_compile(function, env))
+  end
+  function.insn_branch(else_label)
+
+  clauses.each_with_index do |clause, idx|
+    function.insn_label(match_labels[idx])
+    if clause.body then
+      result.store(clause.body.ludicrous_compile(function, env))
     else
       result.store(function.const(JIT::Type::OBJECT, nil))
     end
     function.insn_branch(done_label)
-    function.insn_label(next_label)
-    n = n.next
   end
 
+  function.insn_label(else_label)
   if n then
     # else
     result.store(n.ludicrous_compile(function, env))
@@ -1603,10 +2393,39 @@ class CASE
   def ludicrous_compile(function, env)
     value = self.head.ludicrous_compile(function, env)
 
-    return ludicrous_compile_when(function, env, self.body) do |m|
+    dispatch = nil
+    if table = ludicrous_case_dispatch then
+      dispatch = proc { |labels, tests_label|
+        function.case_dispatch(table, value, labels, tests_label)
+      }
+    end
+
+    return ludicrous_compile_when(function, env, self.body, dispatch) do |m|
       function.rb_funcall(m, :===, value).rtest
     end
   end
+
+  # Returns a Ludicrous::CaseDispatch for this case statement if every
+  # when value is a literal Fixnum, Symbol, or String, or nil otherwise.
+  def ludicrous_case_dispatch
+    clauses = []
+    n = self.body
+    while WHEN === n do
+      return nil if not ARRAY === n.head
+      keys = n.head.to_a.map do |to_match|
+        case to_match
+        when LIT, STR then to_match.lit
+        else return nil
+        end
+      end
+      return nil if not keys.all? { |key| Ludicrous::CaseDispatch.key?(key) }
+      clauses << keys
+      n = n.next
+    end
+
+    return nil if clauses.empty?
+    return Ludicrous::CaseDispatch.build(clauses)
+  end
 end
 
 # case
@@ -1673,7 +2492,7 @@ end
 
 class XSTR
   def ludicrous_compile(function, env)
-    id_backtick = function.const(JIT::Type::UINT, ?`)
+    id_backtick = function.const(JIT::Type::ID, ?`)
     lit = function.const(JIT::Type::OBJECT, self.lit)
     return function.rb_funcall(env.scope.self, id_backtick, lit)
   end
@@ -1689,7 +2508,7 @@ class DXSTR
       s = function.rb_funcall(v, :to_s)
       function.rb_str_concat(str, s)
     end
-    id_backtick = function.const(JIT::Type::UINT, ?`)
+    id_backtick = function.const(JIT::Type::ID, ?`)
     return function.rb_funcall(env.scope.self, id_backtick, str)
   end
 end
@@ -1785,10 +2604,6 @@ class ARGSCAT
 end
 
 class NTH_REF
-  def has_match_data
-    true
-  end
-
   def ludicrous_compile(function, env)
     cnt = function.const(JIT::Type::INT, self.cnt)
     p_match_data = function.rb_svar(cnt)
@@ -1799,10 +2614,6 @@ class NTH_REF
 end
 
 class MATCH
-  def has_match_data
-    true
-  end
-
   def ludicrous_compile(function, env)
     lit = function.const(JIT::Type::OBJECT, self.lit)
     return function.rb_reg_match2(lit)
@@ -1810,10 +2621,6 @@ class MATCH
 end
 
 class MATCH2
-  def has_match_data
-    true
-  end
-
   def ludicrous_compile(function, env)
     recv = self.recv.ludicrous_compile(function, env)
     value = self.value.ludicrous_compile(function, env)
@@ -1822,10 +2629,6 @@ class MATCH2
 end
 
 class MATCH3
-  def has_match_data
-    true
-  end
-
   def ludicrous_compile(function, env)
     recv = self.recv.ludicrous_compile(function, env)
     value = self.value.ludicrous_compile(function, env)
@@ -0,0 +1,223 @@
+# Fast paths for Fixnum arithmetic, shared by the MRI and YARV
+# compilers.
+#
+# Each operator is computed on native (signed) integers.  A result that
+# no longer fits in a Fixnum is promoted with rb_int2big, as Fixnum's
+# own methods do; the few results that may not even fit in a native
+# integer (products and left shifts) are checked for that, and branch
+# to a fallback label instead, so the method is called normally.
+#
+# The caller is responsible for guarding on the operands being Fixnums,
+# and for checking that the operator has not been redefined (see
+# Ludicrous::Redefinition).
+
+require 'ludicrous/ruby_types'
+require 'ludicrous/native_functions'
+require 'ludicrous/redefinition'
+
+module Ludicrous
+
+# Fixnum operators that have fast paths, and the number of arguments
+# each takes.
+FIXNUM_OPERATORS = {
+  :+    => 1,
+  :-    => 1,
+  :*    => 1,
+  :/    => 1,
+  :%    => 1,
+  :<<   => 1,
+  :>>   => 1,
+  :&    => 1,
+  :|    => 1,
+  :^    => 1,
+  :==   => 1,
+  :<    => 1,
+  :<=   => 1,
+  :>    => 1,
+  :>=   => 1,
+  :<=>  => 1,
+  :-@   => 0,
+  :abs  => 0,
+  :succ => 0,
+}
+
+Redefinition.track(Fixnum, *FIXNUM_OPERATORS.keys)
+
+# Returns true if a call to +mid+ with +argc+ arguments has a Fixnum
+# fast path.
+#
+# +mid+:: a Symbol with the name of the method being called
+# +argc+:: the number of arguments passed to the method
+def self.fixnum_operator?(mid, argc)
+  return FIXNUM_OPERATORS[mid] == argc
+end
+
+end # Ludicrous
+
+module JIT
+
+class Function
+  define_native_function(
+      :rb_int2big,
+      JIT::Type::OBJECT,
+      [ :n ],
+      [ JIT::Type::NINT ])
+
+  # The number of bits in a native integer.
+  NINT_BITS = 8 * JIT::Type::NINT.size
+
+  # Emit code to compute the result of a Fixnum operator.
+  #
+  # Returns a JIT::Value holding the result.
+  #
+  # +mid+:: a Symbol with the name of the operator (one of
+  # Ludicrous::FIXNUM_OPERATORS)
+  # +recv+:: a JIT::Value holding the receiver (a Fixnum)
+  # +args+:: an Array of JIT::Value holding the arguments (Fixnums)
+  # +fallback_label+:: a label to branch to if the result must be
+  # computed by calling the method
+  def fixnum_operator(mid, recv, args, fallback_label)
+    a = fix2native(recv)
+    b = fix2native(args[0]) if args[0]
+
+    case mid
+    when :+    then return fixnum_result(a + b)
+    when :-    then return fixnum_result(a - b)
+    when :*    then return fixnum_mult(a, b, fallback_label)
+    when :/    then return fixnum_divmod(a, b, fallback_label, false)
+    when :%    then return fixnum_divmod(a, b, fallback_label, true)
+    when :<<   then return fixnum_lshift(a, b, fallback_label)
+    when :>>   then return fixnum_rshift(a, b, fallback_label)
+    when :&    then return native2fix(a & b)
+    when :|    then return native2fix(a | b)
+    when :^    then return native2fix(a ^ b)
+    when :==   then return (a == b).to_rbool
+    when :<    then return (a < b).to_rbool
+    when :<=   then return (a <= b).to_rbool
+    when :>    then return (a > b).to_rbool
+    when :>=   then return (a >= b).to_rbool
+    when :<=>  then return fixnum_cmp(a, b)
+    when :-@   then return fixnum_result(const(JIT::Type::NINT, 0) - a)
+    when :abs  then return fixnum_abs(a)
+    when :succ then return fixnum_result(a + const(JIT::Type::NINT, 1))
+    else raise "No Fixnum fast path for #{mid}"
+    end
+  end
+
+  # Emit code to convert a native integer to a Fixnum, or to a Bignum if
+  # it is too large to be a Fixnum.
+  #
+  # Returns a new JIT::Value holding the Integer.
+  #
+  # +n+:: a JIT::Value of type NINT
+  def fixnum_result(n)
+    max = const(JIT::Type::NINT, Ludicrous::FIXNUM_MAX)
+    min = const(JIT::Type::NINT, Ludicrous::FIXNUM_MIN)
+    result = value(JIT::Type::OBJECT)
+    self.if((n <= max) & (n >= min)) {
+      result.store(native2fix(n))
+    } .else {
+      result.store(rb_int2big(n))
+    } .end
+    return result
+  end
+
+  # Emit code to multiply two native integers, branching to
+  # +fallback_label+ if the product does not fit in a native integer.
+  def fixnum_mult(a, b, fallback_label)
+    zero = const(JIT::Type::NINT, 0)
+    product = value(JIT::Type::NINT)
+    product.store(a * b)
+    self.if(a.neq(zero)) {
+      insn_branch_if_not(product / a == b, fallback_label)
+    } .end
+    return fixnum_result(product)
+  end
+
+  # Emit code to compute the floored quotient (or, if +modulo+ is true,
+  # the modulus) of two native integers, as Fixnum#/ and Fixnum#% do.
+  # Branches to +fallback_label+ if the divisor is zero, so the method
+  # raises ZeroDivisionError.
+  def fixnum_divmod(a, b, fallback_label, modulo)
+    zero = const(JIT::Type::NINT, 0)
+    insn_branch_if_not(b.neq(zero), fallback_label)
+
+    # C division truncates, so if the remainder has a different sign
+    # from the divisor, the quotient was rounded the wrong way
+    quo = value(JIT::Type::NINT)
+    rem = value(JIT::Type::NINT)
+    quo.store(a / b)
+    rem.store(a % b)
+    self.if(rem.neq(zero) & ((rem ^ b) < zero)) {
+      quo.store(quo - const(JIT::Type::NINT, 1))
+      rem.store(rem + b)
+    } .end
+
+    if modulo then
+      return native2fix(rem)
+    else
+      # The only quotient that is not a Fixnum is FIXNUM_MIN / -1
+      return fixnum_result(quo)
+    end
+  end
+
+  # Emit code to shift a native integer left, branching to
+  # +fallback_label+ if the count is negative or the result does not
+  # fit in a native integer.
+  def fixnum_lshift(a, b, fallback_label)
+    zero = const(JIT::Type::NINT, 0)
+    bits = const(JIT::Type::NINT, NINT_BITS - 1)
+    insn_branch_if_not((b >= zero) & (b < bits), fallback_label)
+
+    shifted = value(JIT::Type::NINT)
+    shifted.store(a << b)
+    insn_branch_if_not((shifted >> b) == a, fallback_label)
+    return fixnum_result(shifted)
+  end
+
+  # Emit code to shift a native integer right, branching to
+  # +fallback_label+ if the count is negative.
+  def fixnum_rshift(a, b, fallback_label)
+    zero = const(JIT::Type::NINT, 0)
+    bits = const(JIT::Type::NINT, NINT_BITS - 1)
+    insn_branch_if(b < zero, fallback_label)
+
+    # Shifting by the width of the integer or more is undefined, but
+    # every bit but the sign has been shifted out by then
+    shifted = value(JIT::Type::NINT)
+    self.if(b < bits) {
+      shifted.store(a >> b)
+    } .else {
+      shifted.store(a >> bits)
+    } .end
+    return native2fix(shifted)
+  end
+
+  # Emit code to compare two native integers, as Fixnum#<=> does.
+  def fixnum_cmp(a, b)
+    result = value(JIT::Type::OBJECT)
+    self.if(a < b) {
+      result.store(const(JIT::Type::OBJECT, -1))
+    } .elsif(a > b) {
+      result.store(const(JIT::Type::OBJECT, 1))
+    } .else {
+      result.store(const(JIT::Type::OBJECT, 0))
+    } .end
+    return result
+  end
+
+  # Emit code to compute the absolute value of a native integer, as
+  # Fixnum#abs does.
+  def fixnum_abs(a)
+    n = value(JIT::Type::NINT)
+    zero = const(JIT::Type::NINT, 0)
+    n.store(a)
+    self.if(n < zero) {
+      n.store(zero - n)
+    } .end
+    return fixnum_result(n)
+  end
+end
+
+end # JIT
+
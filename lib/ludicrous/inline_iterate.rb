@@ -0,0 +1,372 @@
+# Inline expansion of common collection iterators and counted loops.
+#
+# A call such as ary.each { |x| ... } normally goes through rb_iterate,
+# which means compiling the block into functions of its own and keeping
+# the method's locals in a heap-allocated scope the block can reach.
+# When the receiver is a plain Array (or, for each, a plain Hash) and
+# the method is one of INLINE_ITERATORS, the loop can instead be
+# emitted directly into the calling function, with the block body
+# compiled in the caller's frame.
+#
+# Likewise, when the receiver and arguments of one of
+# COUNTED_ITERATORS (or the bounds of a Range) are all Fixnums, the
+# loop runs on a native integer counter, which is only converted to a
+# Fixnum when the block needs it.
+#
+# The code here emits the guard and the loop; the MRI and YARV
+# compilers each supply a block that assigns the block parameters and
+# compiles the block body.  If the guard fails, the caller falls back to
+# calling the iterator normally.
+
+require 'ludicrous/ruby_types'
+require 'ludicrous/value_conversions'
+require 'ludicrous/redefinition'
+
+module Ludicrous
+
+# Iterator methods that can be expanded inline, and the numbers of
+# arguments each can be expanded with.
+INLINE_ITERATORS = {
+  :each            => [ 0 ],
+  :map             => [ 0 ],
+  :collect         => [ 0 ],
+  :select          => [ 0 ],
+  :each_with_index => [ 0 ],
+  :inject          => [ 0, 1 ],
+}
+
+# Returns true if a call to +mid+ with +argc+ arguments and a block can
+# be expanded inline.
+#
+# +mid+:: a Symbol with the name of the method being called
+# +argc+:: the number of arguments passed to the method
+def self.inline_iterator?(mid, argc)
+  argcs = INLINE_ITERATORS[mid]
+  return (argcs and argcs.include?(argc)) ? true : false
+end
+
+# Integer methods that can be expanded into counted loops, and the
+# numbers of arguments each can be expanded with.
+COUNTED_ITERATORS = {
+  :times  => [ 0 ],
+  :upto   => [ 1 ],
+  :downto => [ 1 ],
+  :step   => [ 1, 2 ],
+}
+
+# Returns true if a call to +mid+ with +argc+ arguments and a block can
+# be expanded into a counted loop when the receiver is a Fixnum.
+#
+# +mid+:: a Symbol with the name of the method being called
+# +argc+:: the number of arguments passed to the method
+def self.counted_iterator?(mid, argc)
+  argcs = COUNTED_ITERATORS[mid]
+  return (argcs and argcs.include?(argc)) ? true : false
+end
+
+Redefinition.track(Array, *INLINE_ITERATORS.keys)
+Redefinition.track(Hash, :each)
+Redefinition.track(Fixnum, *COUNTED_ITERATORS.keys)
+Redefinition.track(Range, :each)
+
+end # Ludicrous
+
+module JIT
+
+class Function
+  # Emit a guard for an inline iterator.  Branches to +fallback_label+
+  # if +recv+ is not a plain Array (or, when +mid+ is each, a plain
+  # Hash).
+  #
+  # Returns the array to iterate over (for a Hash, the array of its
+  # pairs).
+  #
+  # +recv+:: the receiver of the iterator method
+  # +mid+:: a Symbol with the name of the iterator method
+  # +fallback_label+:: a JIT::Label for the code that calls the
+  # iterator normally
+  def inline_iterator_guard(recv, mid, fallback_label)
+    array = value(JIT::Type::OBJECT)
+    done_label = JIT::Label.new
+    klass = rb_class_of(recv)
+
+    # The methods Array gets from Enumerable call each
+    if Ludicrous::Redefinition.assume(::Array, mid) and
+       Ludicrous::Redefinition.assume(::Array, :each) then
+      self.if(klass == const(JIT::Type::OBJECT, ::Array)) {
+        array.store(recv)
+        insn_branch(done_label)
+      } .end
+    end
+
+    if mid == :each and Ludicrous::Redefinition.assume(::Hash, :each) then
+      # Hash#each yields the same pairs Hash#to_a returns
+      self.if(klass == const(JIT::Type::OBJECT, ::Hash)) {
+        array.store(rb_funcall(recv, :to_a))
+        insn_branch(done_label)
+      } .end
+    end
+
+    insn_branch(fallback_label)
+    insn_label(done_label)
+
+    return array
+  end
+
+  # Emit an inline loop over +array+ that computes what the iterator
+  # method +mid+ would.
+  #
+  # Yields an array of the values to be passed to the block each time
+  # through the loop (one value, or two for each_with_index and inject)
+  # and the loop object.  The block should assign the values to the
+  # block parameters, compile the block body, and return its result.
+  # The loop is pushed onto the environment's loop stack, so next and
+  # break inside the block body operate on it.
+  #
+  # Returns the result of the iterator method.
+  #
+  # +env+:: the Ludicrous::Environment for this function
+  # +recv+:: the receiver of the iterator method
+  # +array+:: the array returned by inline_iterator_guard
+  # +mid+:: a Symbol with the name of the iterator method
+  # +args+:: an Array of the (already compiled) arguments to the
+  # iterator method
+  def inline_iterate(env, recv, array, mid, args)
+    zero = const(JIT::Type::NINT, 0)
+    one = const(JIT::Type::NINT, 1)
+    nil_value = const(JIT::Type::OBJECT, nil)
+
+    result = value(JIT::Type::OBJECT)
+    result.store(nil_value)
+
+    idx = value(JIT::Type::NINT)
+    idx.store(zero)
+
+    # The value being built up: the new array for map and select, and
+    # the memo for inject
+    acc = value(JIT::Type::OBJECT)
+    case mid
+    when :map, :collect, :select
+      acc.store(rb_ary_new())
+    when :inject
+      if args.size > 0 then
+        acc.store(args[0])
+      else
+        acc.store(nil_value)
+        first = Ludicrous::RArray.wrap(array)
+        self.if(first.len > zero) {
+          acc.store(first[zero])
+          idx.store(one)
+        } .end
+      end
+    end
+
+    block_result = value(JIT::Type::OBJECT)
+    in_body = value(JIT::Type::INT)
+    in_body.store(zero)
+
+    # The array is wrapped anew each time its length or elements are
+    # needed, since the block may resize it
+    self.until { idx >= Ludicrous::RArray.wrap(array).len }.do { |loop|
+      elem = value(JIT::Type::OBJECT)
+      elem.store(Ludicrous::RArray.wrap(array)[idx])
+
+      case mid
+      when :each_with_index
+        index = value(JIT::Type::OBJECT)
+        index.store(idx.int2fix)
+        values = [ elem, index ]
+      when :inject
+        values = [ acc, elem ]
+      else
+        values = [ elem ]
+      end
+
+      # Advance before running the body, so next doesn't skip it
+      idx.store(idx + one)
+
+      in_body.store(one)
+      block_result.store(nil_value)
+      env.loop(loop) {
+        block_result.store(yield(values, loop))
+      }
+      in_body.store(zero)
+
+      case mid
+      when :map, :collect
+        rb_ary_push(acc, block_result)
+      when :select
+        self.if(block_result.rtest) {
+          rb_ary_push(acc, elem)
+        } .end
+      when :inject
+        acc.store(block_result)
+      end
+    } .end
+
+    # If the loop ended with a break, the result is nil
+    self.if(in_body == zero) {
+      case mid
+      when :each, :each_with_index
+        result.store(recv)
+      else
+        result.store(acc)
+      end
+    } .end
+
+    return result
+  end
+
+  # Emit code to branch to +fallback_label+ unless all the given values
+  # are Fixnums.
+  #
+  # +values+:: an Array of JIT::Values holding object references
+  # +fallback_label+:: the JIT::Label to branch to
+  def fixnum_guard(values, fallback_label)
+    values.each do |value|
+      insn_branch_if_not(value.is_fixnum, fallback_label)
+    end
+  end
+
+  # Emit guards for a counted loop.  Branches to +fallback_label+
+  # unless the receiver and arguments (for Range#each, the bounds of the
+  # range) are all Fixnums.
+  #
+  # Returns the first value, the last value, and the step (all
+  # Fixnums), whether the last value is excluded (true, false, or a
+  # JIT::Value), and the direction of the loop (:up, :down, or nil if
+  # it is only known at runtime), suitable for passing to
+  # counted_loop.
+  #
+  # +recv+:: the receiver of the iterator method
+  # +mid+:: a Symbol with the name of the iterator method (one of
+  # Ludicrous::COUNTED_ITERATORS, or each for a Range)
+  # +args+:: an Array of the (already compiled) arguments to the
+  # iterator method
+  # +fallback_label+:: a JIT::Label for the code that calls the
+  # iterator normally
+  def counted_iterator_bounds(recv, mid, args, fallback_label)
+    one = const(JIT::Type::OBJECT, 1)
+
+    builtin = (mid == :each) ? ::Range : ::Fixnum
+    if not Ludicrous::Redefinition.assume(builtin, mid) then
+      # The loop below is never reached
+      insn_branch(fallback_label)
+    end
+
+    case mid
+    when :times
+      first = const(JIT::Type::OBJECT, 0)
+      last, step, exclusive, direction = recv, one, true, :up
+    when :upto
+      first, last, step, exclusive, direction = recv, args[0], one, false, :up
+    when :downto
+      step = const(JIT::Type::OBJECT, -1)
+      first, last, exclusive, direction = recv, args[0], false, :down
+    when :step
+      first, last, exclusive = recv, args[0], false
+      if args.size > 1 then
+        # Let the iterator method raise for a zero step
+        step, direction = args[1], nil
+        insn_branch_if(step == const(JIT::Type::OBJECT, 0), fallback_label)
+      else
+        step, direction = one, :up
+      end
+    when :each
+      insn_branch_if_not(
+          rb_class_of(recv) == const(JIT::Type::OBJECT, ::Range),
+          fallback_label)
+      first = rb_funcall(recv, :begin)
+      last = rb_funcall(recv, :end)
+      exclusive = rb_funcall(recv, :exclude_end?).rtest
+      step, direction = one, :up
+    else
+      raise "Cannot make a counted loop from #{mid}"
+    end
+
+    fixnum_guard([ first, last, step ], fallback_label)
+    return first, last, step, exclusive, direction
+  end
+
+  # Emit a loop over a native integer counter, from +first+ to +last+
+  # by +step+.
+  #
+  # Yields a Proc that emits code to convert the current value of the
+  # counter to a Fixnum (so a block that doesn't need the value doesn't
+  # pay for the conversion) and the loop object.  The loop is pushed
+  # onto the environment's loop stack, so next and break inside the
+  # block operate on it.
+  #
+  # Returns a JIT::Value that is nonzero if the loop ran to the end, or
+  # zero if it ended with a break.
+  #
+  # +env+:: the Ludicrous::Environment for this function
+  # +first+:: the first value of the counter (a Fixnum)
+  # +last+:: the last value of the counter (a Fixnum)
+  # +step+:: the amount to add to the counter each time through the
+  # loop (a nonzero Fixnum)
+  # +exclusive+:: true if +last+ is excluded, false if it is included,
+  # or a JIT::Value that is nonzero if it is excluded
+  # +direction+:: :up if +step+ is positive, :down if it is negative,
+  # or nil if it is not known until runtime
+  def counted_loop(env, first, last, step, exclusive, direction)
+    zero = const(JIT::Type::NINT, 0)
+    one = const(JIT::Type::NINT, 1)
+    int_zero = const(JIT::Type::INT, 0)
+    int_one = const(JIT::Type::INT, 1)
+
+    counter = fix2native(first)
+    limit = fix2native(last)
+    delta = fix2native(step)
+
+    # Make the limit exclusive, so the loop ends when the counter
+    # reaches or passes it
+    case direction
+    when :up, :down
+      adjust = (direction == :up) ? one : const(JIT::Type::NINT, -1)
+      if exclusive == false then
+        limit.store(limit + adjust)
+      elsif exclusive != true then
+        self.unless(exclusive) {
+          limit.store(limit + adjust)
+        } .end
+      end
+    else
+      up = value(JIT::Type::INT)
+      up.store(delta > zero)
+      self.if(up) {
+        limit.store(limit + one)
+      } .else {
+        limit.store(limit - one)
+      } .end
+    end
+
+    at_end = proc {
+      case direction
+      when :up then counter >= limit
+      when :down then counter <= limit
+      else (up & (counter >= limit)) | ((up == int_zero) & (counter <= limit))
+      end
+    }
+
+    current = value(JIT::Type::NINT)
+    in_body = value(JIT::Type::INT)
+    in_body.store(int_zero)
+
+    self.until(at_end).do { |loop|
+      # Advance before running the body, so next doesn't skip it
+      current.store(counter)
+      counter.store(counter + delta)
+
+      in_body.store(int_one)
+      env.loop(loop) {
+        yield(proc { native2fix(current) }, loop)
+      }
+      in_body.store(int_zero)
+    } .end
+
+    return in_body == int_zero
+  end
+end
+
+end # JIT
@@ -4,7 +4,8 @@ module Ludicrous
   # The JIT::Type of the argument to the iterator function
   ITER_ARG_TYPE = JIT::Struct.new(
       [ :recv, JIT::Type::OBJECT ],
-      [ :scope, JIT::Type::OBJECT ])
+      [ :scope, JIT::Type::OBJECT ],
+      [ :args, JIT::Type::OBJECT ])
 
   # An abstraction for the argument to the iterator function.
   class IterArg
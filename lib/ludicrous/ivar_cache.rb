@@ -0,0 +1,119 @@
+# Per-site instance variable caches.
+#
+# Each instance variable access in a compiled method gets its own
+# Ludicrous::IvarCache (defined in ivar_cache.c), which remembers the
+# class and iv table of the object whose entry it last looked up and the
+# address of the value in that entry.  Generated code guarded on the object's class and
+# iv table reads the value directly; writes go through the cache, which
+# writes the value directly when the guard passes.
+#
+# Removing an instance variable frees its table entry, so all caches
+# are invalidated whenever that happens.  Caches don't keep the object
+# alive; each one is emptied by the next garbage collection instead.
+
+require 'ludicrous/native_functions'
+
+class Object
+  alias_method :ludicrous__orig_remove_instance_variable, :remove_instance_variable
+
+  # Invalidate the ivar caches, since removing the variable frees the
+  # table entry they may point to.
+  def remove_instance_variable(name)
+    result = ludicrous__orig_remove_instance_variable(name)
+    Ludicrous::IvarCache.invalidate
+    return result
+  end
+  private :remove_instance_variable
+end
+
+module JIT
+
+class Function
+  define_native_function(
+      :ludicrous_ivar_get,
+      JIT::Type::OBJECT,
+      [ :cache, :obj ],
+      [ JIT::Type::VOID_PTR, JIT::Type::OBJECT ])
+
+  define_native_function(
+      :ludicrous_ivar_set,
+      JIT::Type::OBJECT,
+      [ :cache, :obj, :value ],
+      [ JIT::Type::VOID_PTR, JIT::Type::OBJECT, JIT::Type::OBJECT ])
+
+  define_native_function(
+      :ludicrous_ivar_defined,
+      JIT::Type::OBJECT,
+      [ :cache, :obj ],
+      [ JIT::Type::VOID_PTR, JIT::Type::OBJECT ])
+
+  # Returns a constant pointer to the given cache's C struct.
+  #
+  # +cache+:: a Ludicrous::IvarCache
+  def ivar_cache_ptr(cache)
+    # Hold a reference to the cache so it lives as long as the function
+    const(JIT::Type::OBJECT, cache)
+    return const(JIT::Type::VOID_PTR, cache.address)
+  end
+
+  # Emit code to get the value of an instance variable through a new
+  # ivar cache.
+  #
+  # +obj+:: the object
+  # +vid+:: a Symbol with the name of the instance variable
+  def cached_ivar_get(obj, vid)
+    Ludicrous::Stats.fast_path(:ivar_cache)
+    cache_ptr = ivar_cache_ptr(Ludicrous::IvarCache.new(vid))
+
+    if not have_ruby_struct_member(:RObject, :iv_tbl) then
+      return ludicrous_ivar_get(cache_ptr, obj)
+    end
+
+    result = value(JIT::Type::OBJECT)
+    done_label = JIT::Label.new
+
+    serial_ptr = const(JIT::Type::VOID_PTR, Ludicrous::IvarCache.serial_address)
+    serial = insn_load_relative(serial_ptr, 0, JIT::Type::NUINT)
+
+    self.if(ruby_struct_member(:Ludicrous_Ivar_Cache, :serial, cache_ptr) == serial) {
+      klass = ruby_struct_member(:Ludicrous_Ivar_Cache, :klass, cache_ptr)
+      self.if(rb_class_of(obj) == klass) {
+        tbl = ruby_struct_member(:Ludicrous_Ivar_Cache, :tbl, cache_ptr)
+        self.if(ruby_struct_member(:RObject, :iv_tbl, obj) == tbl) {
+          slot = ruby_struct_member(:Ludicrous_Ivar_Cache, :slot, cache_ptr)
+          result.store(insn_load_relative(slot, 0, JIT::Type::OBJECT))
+          insn_branch(done_label)
+        } .end
+      } .end
+    } .end
+
+    result.store(ludicrous_ivar_get(cache_ptr, obj))
+
+    insn_label(done_label)
+    return result
+  end
+
+  # Emit code to set the value of an instance variable through a new
+  # ivar cache.
+  #
+  # +obj+:: the object
+  # +vid+:: a Symbol with the name of the instance variable
+  # +value+:: the new value
+  def cached_ivar_set(obj, vid, value)
+    Ludicrous::Stats.fast_path(:ivar_cache)
+    cache_ptr = ivar_cache_ptr(Ludicrous::IvarCache.new(vid))
+    return ludicrous_ivar_set(cache_ptr, obj, value)
+  end
+
+  # Emit code to determine whether an instance variable is defined
+  # through a new ivar cache.
+  #
+  # +obj+:: the object
+  # +vid+:: a Symbol with the name of the instance variable
+  def cached_ivar_defined(obj, vid)
+    cache_ptr = ivar_cache_ptr(Ludicrous::IvarCache.new(vid))
+    return ludicrous_ivar_defined(cache_ptr, obj)
+  end
+end
+
+end # JIT
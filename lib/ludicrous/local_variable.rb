@@ -39,6 +39,12 @@ class LocalVariable
     end
   end
 
+  # Returns true if this variable is stored in memory that code outside
+  # the current function may read.
+  def addressable?
+    return @addressable
+  end
+
   # Indicate that this variable needs to be addressable (that is, it
   # needs to be stored somewhere rather than in a pointer).  Variables
   # need to be addressable if they are accessed from inside a block.
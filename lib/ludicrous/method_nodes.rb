@@ -29,14 +29,31 @@ class DVAR
   include DynamicVariableScopeInfo
 end
 
-class RESCUE
-  LUDICROUS_RESCUE_RESULT_VAR_NAME = :"*rescue_result*"
+# The body of a begin block is compiled into a function called with
+# rb_protect; a return inside it stores the value to return here.
+LUDICROUS_RESCUE_RESULT_VAR_NAME = :"*rescue_result*"
+
+# Set to true by a return inside the body of a begin block, to tell it
+# from a return from a proc that belongs to another method.
+LUDICROUS_RESCUE_RETURN_VAR_NAME = :"*rescue_return*"
 
+module ProtectedBodyScopeInfo
   def ludicrous_scope_info
-    return true, [ LUDICROUS_RESCUE_RESULT_VAR_NAME ]
+    needs_addressable_scope, vars = super
+    vars << LUDICROUS_RESCUE_RESULT_VAR_NAME
+    vars << LUDICROUS_RESCUE_RETURN_VAR_NAME
+    return true, vars
   end
 end
 
+class RESCUE
+  include ProtectedBodyScopeInfo
+end
+
+class ENSURE
+  include ProtectedBodyScopeInfo
+end
+
 module DefinitionScopeInfo
   def ludicrous_scope_info
     # TODO
@@ -91,6 +108,51 @@ def ludicrous_scope_info
   return needs_addressable_scope, vars
 end
 
+# Returns true if a block made from the scope of the method containing
+# this node might outlive the method's frame, in which case the
+# method's variables must live on the heap; false if they can live in
+# the frame (see Ludicrous::StackScope).
+#
+# +frame_bound+:: true if this node is compiled into a function that is
+# only called while the method's frame is active (e.g. the body of a
+# begin/rescue)
+def ludicrous_scope_escapes(frame_bound = false)
+  members.each do |name|
+    member = self[name]
+    if Node === member then
+      return true if member.ludicrous_scope_escapes(frame_bound)
+    end
+  end
+
+  return false
+end
+
+# Returns the nodes the interpreter runs once per iteration of each loop
+# (while, until, for, and iterators) in this node: the NEWLINE node for
+# the first statement of the loop's body.  A JIT stub watches these to
+# count the back edges its method takes while it is interpreted (see
+# Ludicrous::HotnessCounter).  A loop with an empty body is not
+# counted.
+#
+# +heads+:: the Array to append the nodes to
+def ludicrous_loop_heads(heads = [])
+  case self
+  when WHILE, UNTIL, FOR, ITER
+    head = self.body
+    head = head.head while BLOCK === head
+    heads << head if NEWLINE === head
+  end
+
+  members.each do |name|
+    member = self[name]
+    if Node === member then
+      member.ludicrous_loop_heads(heads)
+    end
+  end
+
+  return heads
+end
+
 class MethodNodeCompiler
   attr_reader :node
   attr_reader :origin_class
@@ -136,28 +198,62 @@ class MethodNodeCompiler
     return self.node.ludicrous_create_environment(self, function)
   end
 
+  # Returns the number of arguments the compiled function takes if it
+  # can be called directly from other compiled functions, or nil if it
+  # can't (see Ludicrous::DirectCall).
+  def direct_call_arity(arguments_compiler)
+    return nil if not FixedArgumentsCompiler === arguments_compiler
+    return nil if not @node.respond_to?(:ludicrous_needs_frame)
+    return nil if @node.ludicrous_needs_frame
+    return @arg_names.size
+  end
+
+  # Returns the name to give the method in the perf map.
+  def perf_map_name
+    target = Ludicrous::DirectCall.current
+    if target then
+      return "#{target.klass}##{target.name}"
+    else
+      return "#{@origin_class}#(anonymous)"
+    end
+  end
+
   def compile
     arguments_compiler = create_arguments_compiler()
     signature = arguments_compiler.jit_signature
-
-    function = JIT::Function.build(signature) do |f|
-      f.optimization_level = @compile_options.optimization_level
-
-      env = create_environment(f)
-
-      begin
-        arguments_compiler.compile_assign_arguments(env)
-
-        yield(f, env)
-      rescue Exception
-        if env.file and env.line then
-          $!.message << " at #{env.file}:#{env.line}"
+    direct_call_arity = direct_call_arity(arguments_compiler)
+    name = perf_map_name()
+
+    function = nil
+    Ludicrous::PerfMap.compiling(name) do
+      function = JIT::Function.build(signature) do |f|
+        f.optimization_level = @compile_options.optimization_level
+        f.direct_call_arity = direct_call_arity
+        Ludicrous::DirectCall.begin_function(f, direct_call_arity)
+
+        env = create_environment(f)
+
+        begin
+          arguments_compiler.compile_assign_arguments(env)
+
+          yield(f, env)
+        rescue Exception
+          if env.file and env.line then
+            $!.message << " at #{env.file}:#{env.line}"
+          end
+          raise
         end
-        raise
+
+        # puts f.dump
       end
+    end
 
-      # puts f.dump
+    Ludicrous::DirectCall.end_function(function)
+    if @node.respond_to?(:ludicrous_yields_directly?) and
+       @node.ludicrous_yields_directly? then
+      Ludicrous::DirectYield.add_yielder(function.to_closure)
     end
+    Ludicrous::PerfMap.method_compiled(function, @compile_options, name, @node)
 
     # TODO: We return from here instead of inside the build() call in
     # order to work-around a segfault.  This doesn't likely solve the
@@ -230,20 +326,18 @@ class VariableArgumentsCompiler < ArgumentsCompiler
   end
 
   def compile_assign_required_argument(env, arg, idx, argc, argv)
-    # TODO: 64-bit safe?
-    # (even so, I need to comment why I'm multiplying idx by 4)
-    val = env.function.insn_load_relative(argv, idx * 4, JIT::Type::OBJECT)
+    val = env.function.insn_load_elem(
+        argv, env.function.const(JIT::Type::NINT, idx), JIT::Type::OBJECT)
     env.scope.arg_set(arg.name, val)
   end
 
   def compile_assign_rest_argument(env, arg, idx, argc, argv)
     var_idx = env.function.const(:INT, idx)
-    rest = env.function.value(:INT)
+    rest = env.function.value(:OBJECT)
     env.function.if(argc > var_idx) {
-      # TODO: not 64-bit safe?
       rest.store env.function.rb_ary_new4(
           argc - var_idx,
-          argv + var_idx * env.function.const(JIT::Type::UINT, 4))
+          env.function.value_elem_address(argv, idx))
     } .else {
       rest.store env.function.rb_ary_new()
     } .end
@@ -262,11 +356,9 @@ class VariableArgumentsCompiler < ArgumentsCompiler
 
     env.function.if(var_idx < argc) {
       # this arg was passed in
-      # TODO: 64-bit safe?
-      # (even so, I need to comment why I'm multiplying idx by 4)
-      val.store(env.function.insn_load_relative(
+      val.store(env.function.insn_load_elem(
           argv,
-          idx * 4,
+          env.function.const(JIT::Type::NINT, idx),
           JIT::Type::OBJECT))
     } .else {
       # this arg was not passed in
@@ -286,9 +378,13 @@ class SCOPE
     var_names.concat(self.tbl || [])
     var_names.uniq!
 
-    scope_type = needs_addressable_scope \
-      ? Ludicrous::AddressableScope \
-      : Ludicrous::Scope
+    if not needs_addressable_scope then
+      scope_type = Ludicrous::Scope
+    elsif self.next.ludicrous_scope_escapes then
+      scope_type = Ludicrous::AddressableScope
+    else
+      scope_type = Ludicrous::StackScope
+    end
     scope = scope_type.new(function, var_names)
   end
 
@@ -330,13 +426,18 @@ end
 class METHOD
   def ludicrous_create_scope(compiler, function)
     needs_addressable_scope = true # TODO
-    var_names = self.body.local_table
+    var_names = self.body.local_table.dup
     var_names.concat compiler.arg_names
+    var_names.concat self.body.ludicrous_block_local_names
     var_names.uniq!
 
-    scope_type = needs_addressable_scope \
-      ? Ludicrous::AddressableScope \
-      : Ludicrous::Scope
+    if not needs_addressable_scope then
+      scope_type = Ludicrous::Scope
+    elsif self.body.ludicrous_scope_escapes then
+      scope_type = Ludicrous::AddressableScope
+    else
+      scope_type = Ludicrous::StackScope
+    end
     scope = scope_type.new(function, var_names)
   end
 
@@ -395,13 +496,18 @@ if defined?(RubyVM) then
 class RubyVM::InstructionSequence
   def ludicrous_create_scope(compiler, function)
     needs_addressable_scope = true # TODO
-    var_names = self.local_table
+    var_names = self.local_table.dup
     var_names.concat compiler.arg_names
+    var_names.concat self.ludicrous_block_local_names
     var_names.uniq!
 
-    scope_type = needs_addressable_scope \
-      ? Ludicrous::AddressableScope \
-      : Ludicrous::Scope
+    if not needs_addressable_scope then
+      scope_type = Ludicrous::Scope
+    elsif self.ludicrous_scope_escapes then
+      scope_type = Ludicrous::AddressableScope
+    else
+      scope_type = Ludicrous::StackScope
+    end
     scope = scope_type.new(function, var_names)
   end
 
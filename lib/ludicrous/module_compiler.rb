@@ -3,6 +3,7 @@
 
 require 'ludicrous/stubs'
 require 'ludicrous/compile_options'
+require 'ludicrous/profile'
 
 class Mutex
   ##
@@ -26,6 +27,10 @@ class Module
   # +options+:: a CompileOptions object with parameters indicating how
   # the methods in this module should be compiled
   def ludicrous_compile(options = Ludicrous::CompileOptions.new)
+    if options.profile then
+      Ludicrous::Profile.enable(options.profile)
+    end
+
     return if defined?(@LUDICROUS_FEATURES_APPENDED)
 
     module_has_options = self.const_defined?(:LUDICROUS_OPTIONS)
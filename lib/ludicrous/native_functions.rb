@@ -103,7 +103,7 @@ class Function
       :rb_ary_new2,
       JIT::Type::OBJECT,
       [ :size ],
-      [ JIT::Type::INT ])
+      [ JIT::Type::NINT ])
 
   RB_ARY_NEW3_FPTR = Ludicrous.function_pointer_of(:rb_ary_new3)
 
@@ -111,7 +111,7 @@ class Function
     signature = JIT::Type.create_signature(
       JIT::ABI::CDECL,
       JIT::Type::OBJECT,
-      [ JIT::Type::INT ] + [ JIT::Type::OBJECT] * size)
+      [ JIT::Type::NINT ] + [ JIT::Type::OBJECT] * size)
     return insn_call_native(
         :rb_ary_new3, RB_ARY_NEW3_FPTR, signature, 0, size, *objs)
   end
@@ -120,7 +120,7 @@ class Function
       :rb_ary_new4,
       JIT::Type::OBJECT,
       [ :size, :vec ],
-      [ JIT::Type::UINT, JIT::Type::VOID_PTR ])
+      [ JIT::Type::NINT, JIT::Type::VOID_PTR ])
 
   define_native_function(
       :rb_ary_push,
@@ -138,14 +138,14 @@ class Function
       :rb_ary_store,
       JIT::Type::OBJECT,
       [ :array, :idx, :obj ],
-      [ JIT::Type::OBJECT, JIT::Type::INT, JIT::Type::OBJECT ])
+      [ JIT::Type::OBJECT, JIT::Type::NINT, JIT::Type::OBJECT ])
 
   def rb_ary_entry(array, idx)
     fptr = Ludicrous.function_pointer_of(:rb_ary_entry)
     signature = JIT::Type.create_signature(
       JIT::ABI::CDECL,
       JIT::Type::OBJECT,
-      [ JIT::Type::OBJECT, JIT::Type::INT ])
+      [ JIT::Type::OBJECT, JIT::Type::NINT ])
     return insn_call_native(:rb_ary_entry, fptr, signature, 0, array, idx)
   end
 
@@ -212,6 +212,24 @@ class Function
     return insn_call_native(:rb_str_concat, fptr, signature, 0, str1, str2)
   end
 
+  define_native_function(
+      :rb_str_equal,
+      JIT::Type::OBJECT,
+      [ :str1, :str2 ],
+      [ JIT::Type::OBJECT, JIT::Type::OBJECT ])
+
+  define_native_function(
+      :rb_str_length,
+      JIT::Type::OBJECT,
+      [ :str ],
+      [ JIT::Type::OBJECT ])
+
+  define_native_function(
+      :rb_float_new,
+      JIT::Type::OBJECT,
+      [ :d ],
+      [ JIT::Type::FLOAT64 ])
+
   def rb_string_value_ptr(str_ptr)
     fptr = Ludicrous.function_pointer_of(:rb_string_value_ptr)
     signature = JIT::Type.create_signature(
@@ -507,7 +525,7 @@ class Function
     signature = JIT::Type.create_signature(
       JIT::ABI::CDECL,
       JIT::Type::OBJECT,
-      [ JIT::Type::UINT ])
+      [ JIT::Type::NUINT ])
     return insn_call_native(:rb_uint2inum, fptr, signature, 0, uint)
   end
 
@@ -557,7 +575,7 @@ class Function
   end
 
   def data_make_struct(klass, type, mark, free)
-    len = const(JIT::Type::UINT, type.size)
+    len = const(JIT::Type::NUINT, type.size)
     ptr = ruby_xcalloc(1, len)
     obj = data_wrap_struct(klass, mark, free, ptr)
     return [ ptr, obj ]
@@ -568,7 +586,7 @@ class Function
     signature = JIT::Type::create_signature(
         JIT::ABI::CDECL,
         JIT::Type::OBJECT,
-        [ JIT::Type::UINT ])
+        [ JIT::Type::NUINT ])
     return insn_call_native(:ruby_xmalloc, fptr, signature, 0, len)
   end
 
@@ -577,7 +595,7 @@ class Function
     signature = JIT::Type::create_signature(
         JIT::ABI::CDECL,
         JIT::Type::OBJECT,
-        [ JIT::Type::INT, JIT::Type::INT ])
+        [ JIT::Type::NUINT, JIT::Type::NUINT ])
     return insn_call_native(:ruby_xcalloc, fptr, signature, 0, n, len)
   end
 
@@ -595,19 +613,19 @@ class Function
     # TODO: use a jump table?
     self.if(obj.is_fixnum) {
       result.store(const(JIT::Type::INT, Ludicrous::T_FIXNUM))
-    } .elsif(obj & const(JIT::Type::INT, 2)) {
-      self.if(obj == const(JIT::Type::INT, Ludicrous::Qtrue)) { # 2
+    } .elsif(obj & const(JIT::Type::NUINT, 2)) {
+      self.if(obj == const(JIT::Type::NUINT, Ludicrous::Qtrue)) { # 2
         result.store(const(JIT::Type::INT, Ludicrous::T_TRUE))
-      } .elsif(obj == const(JIT::Type::INT, Ludicrous::Qundef)) { # 6
+      } .elsif(obj == const(JIT::Type::NUINT, Ludicrous::Qundef)) { # 6
         result.store(const(JIT::Type::INT, Ludicrous::T_UNDEF))
       } .elsif(obj.is_symbol) {
         result.store(const(JIT::Type::INT, Ludicrous::T_SYMBOL))
       } .end
       # otherwise... ?
     } .else {
-      self.if(obj == const(JIT::Type::INT, Ludicrous::Qfalse)) { # 0
+      self.if(obj == const(JIT::Type::NUINT, Ludicrous::Qfalse)) { # 0
         result.store(const(JIT::Type::INT, Ludicrous::T_FALSE))
-      } .elsif(obj == const(JIT::Type::INT, Ludicrous::Qnil)) { # 4
+      } .elsif(obj == const(JIT::Type::NUINT, Ludicrous::Qnil)) { # 4
         result.store(const(JIT::Type::INT, Ludicrous::T_NIL))
       } .else {
         result.store(obj.builtin_type)
@@ -698,6 +716,12 @@ class Function
 
   alias_method :ruby_errinfo, :rb_errinfo
 
+  define_native_function(
+      :rb_set_errinfo,
+      JIT::Type::VOID,
+      [ :err ],
+      [ JIT::Type::OBJECT ])
+
   def block_pass_fcall(recv, mid, args, proc)
     fptr = Ludicrous::function_pointer_of(:block_pass_fcall)
     signature = JIT::Type::create_signature(
@@ -725,6 +749,15 @@ class Function
     return insn_call_native(:ludicrous_splat_iterate_proc, fptr, signature, 0, body, val)
   end
 
+  def ludicrous_splat_iterate_value
+    fptr = Ludicrous::function_pointer_of(:ludicrous_splat_iterate_value)
+    signature = JIT::Type::create_signature(
+        JIT::ABI::CDECL,
+        JIT::Type::OBJECT,
+        [ ])
+    return insn_call_native(:ludicrous_splat_iterate_value, fptr, signature, 0)
+  end
+
   def rb_node_newnode(type, a0, a1, a2)
     if type.is_a?(Integer) then
       type = const(JIT::Type::INT, type)
@@ -0,0 +1,106 @@
+# A perf map naming the functions Ludicrous compiles.
+#
+# Native profilers such as perf see the code libjit generates as
+# anonymous addresses.  When the perf_map compile option is set (or the
+# ludicrous executable is run with --jit-perf-map), the address range of
+# each compiled function is appended to /tmp/perf-<pid>.map, which perf
+# reads to name the samples that fall in it.  Each line holds the start
+# address and size (in hex) and the name of the function:
+#
+#   b7a2c010 1a4 Foo#bar foo.rb:12
+#
+# The closures compiled for a method's blocks and begin blocks are
+# recorded too, named after the method with the kind of closure in
+# parentheses and the line they were compiled from:
+#
+#   b7a2c1c0 9c Foo#bar (block) foo.rb:14
+
+module Ludicrous
+
+module PerfMap
+  # The file the map is being written to, or nil if it has not been
+  # opened yet
+  @io = nil
+
+  # The process the file was opened for (a child process gets its own
+  # map)
+  @pid = nil
+
+  # Returns the name of the perf map file for this process.
+  def self.filename
+    return "/tmp/perf-#{Process.pid}.map"
+  end
+
+  # Call the block while compiling a method, so the closures compiled
+  # for it are named after it.
+  #
+  # +name+:: a String with the name of the method (e.g. "Foo#bar")
+  def self.compiling(name)
+    stack = (Thread.current[:ludicrous_perf_map_names] ||= [])
+    stack.push(name)
+    begin
+      return yield
+    ensure
+      stack.pop
+    end
+  end
+
+  # Returns the name of the method currently being compiled.
+  def self.current
+    stack = Thread.current[:ludicrous_perf_map_names]
+    return (stack && stack[-1]) || '(toplevel)'
+  end
+
+  # Record a compiled method, if the perf_map option is set.
+  #
+  # +function+:: the compiled JIT::Function
+  # +options+:: the CompileOptions the method was compiled with
+  # +name+:: a String with the name of the method
+  # +node+:: the Node the method was compiled from
+  def self.method_compiled(function, options, name, node)
+    return if not options.perf_map
+    if node.respond_to?(:nd_file) then
+      record(function, "#{name} #{node.nd_file}:#{node.nd_line}")
+    else
+      record(function, name)
+    end
+  end
+
+  # Record a closure compiled for the method currently being compiled,
+  # if the perf_map option is set.
+  #
+  # +function+:: the compiled JIT::Function
+  # +env+:: the Ludicrous::Environment the closure was compiled from
+  # +kind+:: a String describing the closure (e.g. "block")
+  def self.closure_compiled(function, env, kind)
+    return if not env.options.perf_map
+    name = "#{current} (#{kind})"
+    name << " #{env.file}:#{env.line}" if env.file
+    record(function, name)
+  end
+
+  # Append an entry for a compiled function to the map.
+  #
+  # +function+:: the compiled JIT::Function
+  # +name+:: a String with the name to give the function
+  def self.record(function, name)
+    size = function.code_size
+    return if not size
+
+    if @pid != Process.pid then
+      @pid = Process.pid
+      @io = nil
+      begin
+        @io = File.open(filename, 'a')
+        @io.sync = true
+      rescue SystemCallError
+        Ludicrous.logger.error "Unable to open perf map #{filename}: #{$!.class}: #{$!}"
+      end
+    end
+
+    @io.puts("%x %x %s" % [ function.to_closure, size, name ]) if @io
+  end
+end
+
+end # Ludicrous
+
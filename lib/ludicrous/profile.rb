@@ -0,0 +1,185 @@
+# A persistent record of which methods got hot enough to be compiled.
+#
+# Every time a program starts, its JIT stubs have to rediscover the
+# same hot methods.  A profile file remembers, for each class, the
+# methods that were compiled (along with the number of calls the stub
+# counted before compiling them) and the methods that failed to
+# compile (along with the reason).  When a profile is enabled,
+# methods that were compiled last time are compiled as soon as they are
+# defined instead of getting a stub, and methods that failed to compile
+# last time are left alone.
+#
+# The profile is written back to the file when the program exits.  It
+# is a YAML file that looks like:
+#
+#   ---
+#   compiled:
+#     Foo:
+#       bar: 50
+#   failed:
+#     Foo:
+#       baz: "RuntimeError: Unable to compile RESCUE"
+#
+# Anonymous classes and singleton classes have no name that will be the
+# same next time, so they are never recorded.
+
+require 'yaml'
+
+module Ludicrous
+
+class Profile
+  # The name of the file the profile is loaded from and saved to
+  attr_reader :filename
+
+  # A Hash of class name to a Hash of method name to call count
+  attr_reader :compiled
+
+  # A Hash of class name to a Hash of method name to failure reason
+  attr_reader :failed
+
+  # Create a new, empty profile.
+  #
+  # +filename+:: the name of the file the profile should be saved to
+  def initialize(filename)
+    @filename = filename
+    @compiled = {}
+    @failed = {}
+  end
+
+  # Load a profile from a file.  If the file does not exist or cannot be
+  # read, an empty profile is returned.
+  #
+  # +filename+:: the name of the file to load
+  def self.load(filename)
+    profile = self.new(filename)
+    if File.exist?(filename) then
+      begin
+        data = File.open(filename) { |io| YAML.load(io) }
+        if Hash === data then
+          profile.compiled.update(data['compiled'] || {})
+          profile.failed.update(data['failed'] || {})
+        end
+      rescue
+        Ludicrous.logger.error "Unable to load JIT profile #{filename}: #{$!.class}: #{$!}"
+      end
+    end
+    return profile
+  end
+
+  # Returns the name under which methods in the given class are
+  # recorded, or nil if the class cannot be recorded.
+  #
+  # +klass+:: the class or module
+  def self.key_for(klass)
+    name = klass.name
+    return nil if name.nil? or name.empty?
+    return name
+  end
+
+  # Returns true if the given method was compiled in a previous run.
+  #
+  # +klass+:: the class or module the method is a member of
+  # +name+:: the name of the method
+  def hot?(klass, name)
+    key = Profile.key_for(klass) or return false
+    methods = @compiled[key] or return false
+    return methods.include?(name.to_s)
+  end
+
+  # Returns the reason the given method failed to compile in a previous
+  # run, or nil if it did not fail.
+  #
+  # +klass+:: the class or module the method is a member of
+  # +name+:: the name of the method
+  def failure(klass, name)
+    key = Profile.key_for(klass) or return nil
+    methods = @failed[key] or return nil
+    return methods[name.to_s]
+  end
+
+  # Record that a method was compiled.
+  #
+  # +klass+:: the class or module the method is a member of
+  # +name+:: the name of the method
+  def record_compiled(klass, name)
+    key = Profile.key_for(klass) or return
+    (@compiled[key] ||= {})[name.to_s] ||= 0
+    @failed[key].delete(name.to_s) if @failed[key]
+  end
+
+  # Record that a method failed to compile.
+  #
+  # +klass+:: the class or module the method is a member of
+  # +name+:: the name of the method
+  # +exc+:: the exception that was raised by the compiler
+  def record_failure(klass, name, exc)
+    key = Profile.key_for(klass) or return
+    (@failed[key] ||= {})[name.to_s] = "#{exc.class}: #{exc}"
+    @compiled[key].delete(name.to_s) if @compiled[key]
+  end
+
+  # Copy the call counts from the JIT stubs into the profile.  Methods
+  # that were compiled eagerly never had a stub, so they keep the count
+  # from the run that recorded them.
+  def update_call_counts
+    Ludicrous::JITCompiled.hotness_counters.each do |(klass, name), counter|
+      key = Profile.key_for(klass) or next
+      methods = @compiled[key] or next
+      next if not methods.include?(name.to_s)
+      methods[name.to_s] = counter.calls if counter.calls > 0
+    end
+  end
+
+  # Write the profile to its file.
+  def save
+    update_call_counts
+    data = { 'compiled' => @compiled, 'failed' => @failed }
+    File.open(@filename, 'w') { |io| YAML.dump(data, io) }
+  end
+
+  @current = nil
+
+  class << self
+    # The profile that is currently being recorded, or nil if profiling
+    # is not enabled
+    attr_reader :current
+  end
+
+  # Load the profile from the given file, start recording to it, and
+  # save it when the program exits.  Does nothing if the file is
+  # already the current profile.
+  #
+  # +filename+:: the name of the profile file
+  def self.enable(filename)
+    return @current if @current and @current.filename == filename
+    Ludicrous.logger.info "Using JIT profile #{filename}"
+    profile = @current = self.load(filename)
+    at_exit { profile.save }
+    return profile
+  end
+
+  # Returns true if the current profile says the given method should
+  # be compiled eagerly.
+  def self.hot?(klass, name)
+    return @current ? @current.hot?(klass, name) : false
+  end
+
+  # Returns the reason the current profile says the given method failed
+  # to compile, or nil.
+  def self.failure(klass, name)
+    return @current ? @current.failure(klass, name) : nil
+  end
+
+  # Record a compiled method in the current profile, if any.
+  def self.record_compiled(klass, name)
+    @current.record_compiled(klass, name) if @current
+  end
+
+  # Record a method that failed to compile in the current profile, if
+  # any.
+  def self.record_failure(klass, name, exc)
+    @current.record_failure(klass, name, exc) if @current
+  end
+end
+
+end # Ludicrous
@@ -0,0 +1,210 @@
+# Tracking redefinition of the builtin methods fast paths assume.
+#
+# A fast path such as the inline Fixnum#+ or the inline loop for
+# Array#each is only correct as long as the builtin method it stands in
+# for has not been redefined.  Each such method is registered with
+# Redefinition.track when Ludicrous is loaded, which remembers the
+# method as it was then.  The compiler asks Redefinition.assume before
+# emitting a fast path; if the method has not been redefined, the
+# method being compiled is recorded as depending on it.
+#
+# The method hooks (see call_cache.rb) report every method that is
+# added, removed, or undefined.  A builtin counts as redefined once the
+# method its class would call for it is no longer the original, i.e.
+# when the method is changed in the class itself or in one of its
+# ancestors.  An override in a subclass (or a singleton class) does not
+# count: fast paths guard on the exact class of the receiver (see
+# JIT::Value#is_exact_class), or on a type that can't be subclassed
+# (Fixnum), so an instance of a subclass always takes the normal call.
+# When a builtin is redefined, each installed method that
+# depends on it is switched back to its original (interpreted) body.  If
+# its class has a method_added hook from Ludicrous::Speed, that installs
+# a new stub, and the method is compiled again, without the fast path,
+# once it gets hot again.
+#
+# Methods compiled directly with Method#ludicrous_compile are not
+# installed, so they are not tracked.
+
+module Ludicrous
+
+module Redefinition
+  # The original methods, indexed by [ klass, name ]
+  @originals = {}
+
+  # The classes tracking each method name, indexed by name
+  @tracking_classes = {}
+
+  # Builtins whose class calls a method other than the original,
+  # indexed by [ klass, name ]
+  @changed = {}
+
+  # The methods that assumed each builtin, indexed by [ klass, name ];
+  # each is a Hash whose keys are [ klass, name ] of a compiled method
+  @dependents = {}
+
+  # The original method and compiled function for each installed
+  # method, indexed by [ klass, name ]
+  @installed = {}
+
+  # Functions that were uninstalled, which may still be running
+  @retired = []
+
+  # Track redefinition of builtin methods.
+  #
+  # +klass+:: the class the methods are builtin methods of
+  # +names+:: Symbols with the names of the methods
+  def self.track(klass, *names)
+    names.each do |name|
+      key = [ klass, name ]
+      next if @originals.include?(key)
+      @originals[key] = klass.instance_method(name)
+      (@tracking_classes[name] ||= []) << klass
+    end
+  end
+
+  # Returns true if the given builtin method has been redefined.
+  #
+  # +klass+:: the class the method is a builtin method of
+  # +name+:: a Symbol with the name of the method
+  def self.redefined?(klass, name)
+    key = [ klass, name ]
+    if not @originals.include?(key) then
+      raise "Redefinition of #{klass}##{name} is not tracked"
+    end
+    return @changed[key] ? true : false
+  end
+
+  # Check whether a fast path for a builtin method can be emitted.
+  #
+  # Returns true if the method has not been redefined, in which case
+  # the method being compiled is recorded as depending on it.  Otherwise
+  # records a fallback in the stats and returns false.
+  #
+  # +klass+:: the class the method is a builtin method of
+  # +name+:: a Symbol with the name of the method
+  def self.assume(klass, name)
+    if redefined?(klass, name) then
+      Ludicrous::Stats.fallback("#{klass}##{name} redefined")
+      return false
+    end
+
+    target = Ludicrous::DirectCall.current
+    if target then
+      dependents = (@dependents[[klass, name]] ||= {})
+      dependents[[target.klass, target.name]] = true
+    end
+
+    return true
+  end
+
+  # Called when a compiled method has been installed in its class.
+  #
+  # +klass+:: the class or module the method is a member of
+  # +name+:: the name of the method
+  # +method+:: the UnboundMethod the function was compiled from
+  # +function+:: the JIT::Function that was installed
+  def self.installed(klass, name, method, function)
+    @installed[[klass, name.to_s.intern]] = [ method, function ]
+  end
+
+  # Called by the method hooks when a method is added, removed, or
+  # undefined.
+  #
+  # +klass+:: the class or module whose method changed
+  # +name+:: a Symbol with the name of the method
+  def self.method_changed(klass, name)
+    name = name.to_s.intern
+
+    # The installed method is not the compiled one any more, so don't
+    # keep it (or call it directly)
+    @installed.delete([klass, name])
+    Ludicrous::DirectCall.uninstalled(klass, name)
+
+    # Don't use Array#each here, since it may be the method that was
+    # just redefined
+    classes = @tracking_classes[name]
+    return if not classes
+    i = 0
+    while i < classes.size do
+      check(klass, classes[i], name)
+      i += 1
+    end
+  end
+
+  # Called by the singleton method hooks when a singleton method is
+  # added, removed, or undefined.
+  #
+  # +obj+:: the object whose singleton method changed
+  # +name+:: a Symbol with the name of the method
+  def self.singleton_method_changed(obj, name)
+    return if not @tracking_classes[name.to_s.intern]
+    method_changed(class << obj; self; end, name)
+  end
+
+  # Called when the ancestors of a class or module change (i.e. when a
+  # module is included in it).
+  #
+  # +klass+:: the class or module
+  def self.ancestors_changed(klass)
+    @originals.each_key do |tracking_class, name|
+      check(klass, tracking_class, name)
+    end
+  end
+
+  # Check whether a change to +klass+ redefined a builtin, and switch
+  # the methods that depend on it back to their original bodies if it
+  # did.
+  def self.check(klass, tracking_class, name)
+    key = [ tracking_class, name ]
+    original = @originals[key]
+
+    # Only a change in the class or one of its ancestors matters
+    return if not (klass == tracking_class or tracking_class < klass)
+    changed = (current_method(tracking_class, name) != original)
+    @changed[key] = changed
+
+    invalidate(key) if redefined?(tracking_class, name)
+  end
+  private_class_method :check
+
+  # Returns the UnboundMethod +klass+ would call for +name+, or nil if
+  # it has none.
+  def self.current_method(klass, name)
+    return klass.instance_method(name)
+  rescue NameError
+    return nil
+  end
+  private_class_method :current_method
+
+  # Switch the installed methods that depend on a builtin back to their
+  # original bodies.
+  #
+  # +key+:: [ klass, name ] of the builtin
+  def self.invalidate(key)
+    dependents = @dependents.delete(key)
+    return if not dependents
+
+    dependents.each_key do |klass, name|
+      method, function = @installed.delete([klass, name])
+      next if not method
+
+      Ludicrous.logger.info "#{key.join('#')} redefined; uncompiling #{klass}##{name}"
+      Ludicrous::Stats.invalidated(klass, name, "#{key.join('#')} redefined")
+      Ludicrous::DirectCall.uninstalled(klass, name)
+      @retired << function
+
+      if klass.private_method_defined?(name) then
+        noex = Noex::PRIVATE
+      elsif klass.protected_method_defined?(name) then
+        noex = Noex::PROTECTED
+      else
+        noex = Noex::PUBLIC
+      end
+      klass.__send__(:add_method, name, method.body, noex)
+    end
+  end
+  private_class_method :invalidate
+end
+
+end # Ludicrous
+
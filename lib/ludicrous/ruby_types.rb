@@ -71,7 +71,7 @@ module Ludicrous
         return function.ruby_struct_member(:RArray, :len, self)
       else
         # 1.9
-        len = function.value(:INT)
+        len = function.value(:NINT)
         function.if(self.flags & Ludicrous::RARRAY_EMBED_FLAG) {
           len.store(
               (flags >> Ludicrous::RARRAY_EMBED_LEN_SHIFT) &
@@ -112,5 +112,21 @@ module Ludicrous
     end
     private :ptr_
   end
+
+  # An abstraction for an RFloat struct (the C type used to hold a
+  # Float).
+  class RFloat < RBasic
+    # Returns a JIT::Value (of type FLOAT64) with the value of the
+    # Float.
+    def value
+      if function.have_ruby_struct_member(:RFloat, :value) then
+        # 1.8
+        return function.ruby_struct_member(:RFloat, :value, self)
+      else
+        # 1.9
+        return function.ruby_struct_member(:RFloat, :float_value, self)
+      end
+    end
+  end
 end
 
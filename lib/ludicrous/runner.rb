@@ -51,6 +51,7 @@ class Runner
     @ruby_prof = false
     @ruby_prof_printer = "FlatPrinter"
     @ruby_prof_file = nil
+    @jit_stats = nil
   end
 
   # Parse the command-line arguments.
@@ -108,12 +109,30 @@ class Runner
         enable_jit_log(lvl)
       end
 
+      opts.on_tail(
+          "--jit-stats[=fmt]",
+          "print JIT statistics at exit (fmt is text or json)") do |fmt|
+        @jit_stats = fmt || 'text'
+      end
+
       opts.on_tail(
           "--precompile",
           "precompile all methods instead of installing stubs") do |p|
         @options.precompile = p
       end
 
+      opts.on_tail(
+          "--jit-profile=file",
+          "precompile the hot methods recorded in file and update it") do |file|
+        @options.profile = file
+      end
+
+      opts.on_tail(
+          "--jit-perf-map",
+          "write compiled methods to /tmp/perf-<pid>.map for perf") do |p|
+        @options.perf_map = p
+      end
+
       opts.on_tail(
           "-O level",
           "set the optimization level") do |o|
@@ -257,6 +276,11 @@ class Runner
   end
 
   def run_
+    if @jit_stats then
+      format = @jit_stats
+      at_exit { Ludicrous::Stats.report(STDERR, format) }
+    end
+
     jit_compile_all_modules
 
     if @cd then
@@ -59,6 +59,14 @@ class ScopeBase
     return local.get()
   end
 
+  # Return the LocalVariable for a local variable, or nil if there is no
+  # such local variable
+  #
+  # +vid+:: a Symbol with the name of the variable
+  def local_variable(vid)
+    return @locals[vid]
+  end
+
   # Return true if the indicated local variable has been defined at this
   # point, false otherwise
   #
@@ -159,10 +167,6 @@ class AddressableScope < ScopeBase
   # An Array of Symbol containing the names of all the local variables
   attr_reader :local_names
 
-  # A JIT::Value referencing an Object for this scope, to be used with
-  # +rb_iterate+.
-  attr_reader :scope_obj
-
   # Return a JIT::Type for an underlying scope object with the given
   # local variables.
   #
@@ -186,7 +190,9 @@ class AddressableScope < ScopeBase
     return JIT::Function.build([ :VOID_PTR ] => :VOID) do |f|
       scope_ptr = f.get_param(0)
       scope_size = f.insn_load_relative(scope_ptr, 0, JIT::Type::UINT)
-      start_ptr = scope_ptr + f.const(JIT::Type::UINT, 4) # TODO: not 64-bit safe
+      # The object references start after len (and any padding after it)
+      first_offset = scope_type([]).offset_of(:dynavars)
+      start_ptr = scope_ptr + f.const(JIT::Type::NUINT, first_offset)
       end_ptr = scope_ptr + scope_size
       f.if(start_ptr < end_ptr) {
         f.rb_gc_mark_locations(start_ptr, end_ptr)
@@ -231,13 +237,30 @@ class AddressableScope < ScopeBase
   def self.load(function, scope_obj, local_names, args, rest_arg)
     # TODO: This function isn't right
     scope_ptr = function.data_get_struct(scope_obj)
+    return self.load_ptr(function, scope_ptr, local_names, args, rest_arg, scope_obj)
+  end
+
+  # Create a new inner scope from a pointer to the underlying scope
+  # struct of an outer scope.  Unless +scope_obj+ is given, the inner
+  # scope cannot be passed on to +rb_iterate+ (see #scope_obj).
+  #
+  # +function+:: the inner JIT::Function being compiled
+  # +scope_ptr+:: a pointer to the underlying scope struct
+  # +local_names+:: an Array of Symbol containing the names of all the
+  # local variables
+  # +args+:: an Array of Symbol containing the names of all the
+  # arguments to the function
+  # +rest_arg+:: a Symbol with the name of the rest arg (the argument in
+  # the argument list preceded by the splat operator)
+  # +scope_obj+:: an object reference to the underlying scope object
+  def self.load_ptr(function, scope_ptr, local_names, args, rest_arg, scope_obj=nil)
     scope_type = self.scope_type(local_names)
     locals = {}
     local_names.each_with_index do |name, idx|
       offset = scope_type.offset_of(name)
       locals[name] = Ludicrous::LocalVariable.load(function, name, scope_ptr, offset)
     end
-    return self.new(function, local_names, locals, args, rest_arg, scope_ptr, scope_obj)
+    return AddressableScope.new(function, local_names, locals, args, rest_arg, scope_ptr, scope_obj)
   end
 
   # Create a new AddressableScope.
@@ -277,7 +300,7 @@ class AddressableScope < ScopeBase
     scope_type = self.class.scope_type(local_names)
     scope_size = function.const(JIT::Type::UINT, scope_type.size)
 
-    @scope_ptr = scope_ptr || @function.ruby_xcalloc(1, scope_size)
+    @scope_ptr = scope_ptr || allocate_scope(scope_size)
 
     # TODO: scope_size is NOT a normal object!
     @dynavars = Ludicrous::LocalVariable.new(@function, "DYNAVARS")
@@ -288,11 +311,12 @@ class AddressableScope < ScopeBase
     @self.set_addressable(@scope_ptr, scope_type.get_offset(2))
 
     init_locals(scope_type, need_init)
-    @scope_obj = scope_obj || wrap_scope(scope_size)
+    @scope_obj = need_init ? create_scope_obj(scope_size) : scope_obj
 
-    # Creating the dynavars hash MUST happen last, otherwise the GC
-    # might get invoked before the scope is setup
-    @dynavars.set(@function.rb_hash_new())
+    # The dynavars hash is only created if a dynamic variable without a
+    # slot is ever set (see #dynavars_for_set).  An inner scope shares
+    # the hash of the scope it was loaded from.
+    @dynavars.set(@function.const(JIT::Type::OBJECT, nil)) if need_init
   end
 
   def create_locals(function, local_names)
@@ -311,6 +335,14 @@ class AddressableScope < ScopeBase
     end
   end
 
+  def allocate_scope(scope_size)
+    return @function.ruby_xcalloc(1, scope_size)
+  end
+
+  def create_scope_obj(scope_size)
+    return wrap_scope(scope_size)
+  end
+
   def wrap_scope(scope_size)
     scope_obj = @function.data_wrap_struct(
         Ludicrous::Scope,
@@ -322,24 +354,53 @@ class AddressableScope < ScopeBase
     return scope_obj
   end
 
+  # Returns a JIT::Value referencing an Object for this scope, to be
+  # used with +rb_iterate+.
+  def scope_obj
+    if not @scope_obj then
+      raise "Cannot make a block from this scope (it is in the frame of an outer function)"
+    end
+    return @scope_obj
+  end
+
+  # Returns a JIT::Value to pass to a function that is only called
+  # while this function is running (e.g. with +rb_protect+ or
+  # +rb_ensure+).  The function can get at this scope with #load_frame.
+  def frame_arg
+    return @scope_obj ? @scope_obj : @scope_ptr
+  end
+
+  # Create a new inner scope from the value returned by #frame_arg.
+  #
+  # +function+:: the inner JIT::Function being compiled
+  # +frame_arg+:: the value passed to the inner function
+  def load_frame(function, frame_arg)
+    if @scope_obj then
+      return AddressableScope.load(function, frame_arg, @local_names, @args, @rest_arg)
+    else
+      return AddressableScope.load_ptr(function, frame_arg, @local_names, @args, @rest_arg)
+    end
+  end
+
   # Set a dynamic variable.
   #
   # A dynamic variable differs from a local variable in that it exists
   # only in an inner scope.
   #
-  # If Ludicrous can determine the existence of a dynamic variable
-  # statically, it will preallocate a slot for it in the local variable
-  # table and access will be as fast as for local variables, otherwise
-  # it will revert to a hash lookup.
+  # The scope analysis (ludicrous_scope_info on MRI,
+  # ludicrous_block_local_names on YARV) gives every dynamic variable
+  # in the method a slot in the local variable table, so access is as
+  # fast as for local variables.  A variable the analysis could not see
+  # reverts to a hash lookup.
   #
   # +vid+:: a Symbol with the name of the variable to set
   # +value+:: a JIT::Value containing the new value of the variable
   def dyn_set(vid, value)
-    # TODO: a hash is easy to use, but maybe not very fast
     if local_defined(vid) then
       local_set(vid, value)
     else
-      @function.rb_hash_aset(@dynavars.get, vid, value)
+      Ludicrous::Stats.fallback("dynamic variable without a slot")
+      @function.rb_hash_aset(dynavars_for_set, vid, value)
     end
   end
 
@@ -352,7 +413,12 @@ class AddressableScope < ScopeBase
     if local_defined(vid) then
       return local_get(vid)
     else
-      value = @function.rb_hash_aref(@dynavars.get, vid)
+      value = @function.value(JIT::Type::OBJECT)
+      value.store(@function.const(JIT::Type::OBJECT, nil))
+      dynavars = @dynavars.get
+      @function.unless(dynavars == @function.const(JIT::Type::OBJECT, nil)) {
+        value.store(@function.rb_hash_aref(dynavars, vid))
+      } .end
       return value
     end
   end
@@ -369,10 +435,85 @@ class AddressableScope < ScopeBase
     if local_defined(vid) then
       return @function.const(JIT::Type::OBJECT, true)
     else
-      has_key = @function.rb_funcall(@dynavars.get, :has_key?, vid)
+      has_key = @function.value(JIT::Type::OBJECT)
+      has_key.store(@function.const(JIT::Type::OBJECT, false))
+      dynavars = @dynavars.get
+      @function.unless(dynavars == @function.const(JIT::Type::OBJECT, nil)) {
+        has_key.store(@function.rb_funcall(dynavars, :has_key?, vid))
+      } .end
       return has_key # 0 will be false
     end
   end
+
+  # Emit code to get the dynavars hash, creating it if this is the first
+  # dynamic variable without a slot to be set.
+  def dynavars_for_set
+    dynavars = @function.value(JIT::Type::OBJECT)
+    dynavars.store(@dynavars.get)
+    @function.if(dynavars == @function.const(JIT::Type::OBJECT, nil)) {
+      dynavars.store(@function.rb_hash_new())
+      @dynavars.set(dynavars)
+    } .end
+    return dynavars
+  end
+end
+
+# An addressable scope whose variables live in the stack frame of the
+# function being compiled instead of on the heap.  Used when no block
+# made from the scope can outlive the function (see
+# Node#ludicrous_scope_escapes), so no wrapper object is needed.
+#
+# Functions that are only called while the frame is active get a
+# pointer to the frame (see #frame_arg).  If a block has to be made
+# into a closure after all (e.g. when the guard on an inlined iterator
+# fails), the variables are first moved to the heap, where they stay
+# for the rest of the call.
+class StackScope < AddressableScope
+  def allocate_scope(scope_size)
+    @frame = self.class.scope_type(@local_names).create(@function)
+    scope_ptr = @function.value(JIT::Type::VOID_PTR)
+    scope_ptr.store(@frame.ptr)
+    return scope_ptr
+  end
+
+  def create_scope_obj(scope_size)
+    @scope_size.set(scope_size)
+    @self.set(@function.const(JIT::Type::OBJECT, nil))
+    @heap_scope_obj = @function.value(JIT::Type::OBJECT)
+    @heap_scope_obj.store(@function.const(JIT::Type::OBJECT, false))
+    return nil
+  end
+
+  # Emit code to move the variables to the heap, if they have not been
+  # moved already.
+  #
+  # Returns a JIT::Value referencing an Object for the heap scope, to
+  # be used with +rb_iterate+.
+  def scope_obj
+    scope_type = self.class.scope_type(@local_names)
+    scope_size = @function.const(JIT::Type::UINT, scope_type.size)
+
+    @function.unless(@heap_scope_obj) {
+      heap_ptr = @function.ruby_xcalloc(1, scope_size)
+      (3 + @local_names.size).times do |idx|
+        offset = scope_type.get_offset(idx)
+        type = (idx == 0) ? JIT::Type::UINT : JIT::Type::OBJECT
+        value = @function.insn_load_relative(@scope_ptr, offset, type)
+        @function.insn_store_relative(heap_ptr, offset, value)
+      end
+
+      # The variables are still in the frame, so the GC can find them
+      # if it runs before the heap scope is wrapped
+      @scope_ptr.store(heap_ptr)
+      @heap_scope_obj.store(@function.data_wrap_struct(
+          Ludicrous::Scope,
+          MARK_CLOSURE,
+          Ludicrous.function_pointer_of(:ruby_xfree),
+          heap_ptr))
+    } .end
+
+    return @heap_scope_obj
+  end
 end
 
 end # Ludicrous
@@ -38,6 +38,10 @@ module Ludicrous
 # branches)
 # +static?+:: returns true if this is a StaticStack
 #
+# A derived class that keeps values somewhere other than the YARV stack
+# may also override +label+, +mark_unreachable+, +spill+ and +reload+,
+# which by default do nothing.
+#
 # TODO: should perhaps be a mixin?
 class Stack
   # Get the top member of the stack
@@ -66,6 +70,12 @@ class Stack
     return value
   end
 
+  # Pop a value from the top of the stack and return it without boxing
+  # it, if it is a Ludicrous::UnboxedFloat
+  def pop_unboxed
+    return pop
+  end
+
   def debug_inspect
     idx = @function.value(JIT::Type::INT)
     idx.store(@function.const(JIT::Type::INT, 1))
@@ -103,8 +113,46 @@ class Stack
   def static?
     raise NotImplementedError, "derived class must implement"
   end
+
+  # Called before the instruction at the given offset is compiled.
+  def label(offset)
+  end
+
+  # Called after an instruction that never falls through to the next
+  # one.
+  def mark_unreachable
+  end
+
+  # Emit code to make the stack survive a longjmp to a setjmp made after
+  # this point.  Returns an object to pass to reload.
+  def spill
+    return nil
+  end
+
+  # Emit code to restore the stack after a setjmp.
+  def reload(spilled)
+  end
 end
 
+# A stack whose slots are kept in libjit variables (which libjit can
+# keep in registers) instead of in memory.
+#
+# Within a basic block, the stack holds whatever values were pushed, so
+# most pushes and pops generate no code at all.  Where control flow
+# joins (at a branch, and at the instructions branches go to), each
+# value is stored into the variable for its slot, so every path into a
+# join leaves the same variables holding the stack.  The depth at each
+# branch target is recorded so that paths that disagree are caught at
+# compile time.
+#
+# A Ludicrous::UnboxedFloat pushed onto the stack is only boxed when it
+# is read by something other than #pop_unboxed, or flushed at a join.
+#
+# Nothing outside the function being compiled can see these slots, so
+# they need not be written out before calls.  The exception is a
+# setjmp for a catch table entry: a longjmp back to it may lose values
+# kept in registers, so the stack is spilled to memory around it (see
+# #spill).
 class StaticStack < Stack
   # Create a new StaticStack.
   #
@@ -114,9 +162,16 @@ class StaticStack < Stack
     @function = function
     @pc = pc
     @stack = []
-    @stack_pc = []
+    @slots = []
+    @depth_at = {}
+    @branch_targets = {}
+    @reachable = true
   end
 
+  # Set the offsets that may be branched to (a Hash whose keys are the
+  # offsets).  A branch to any other offset is rejected.
+  attr_writer :branch_targets
+
   def sync_sp
     # no-op
   end
@@ -130,7 +185,7 @@ class StaticStack < Stack
       return @function.rb_ary_entry(stack, idx)
     else
       raise "Invalid index #{n}" if n < 1
-      return @stack[-n]
+      return @function.box_float(@stack[-n])
     end
   end
 
@@ -139,7 +194,6 @@ class StaticStack < Stack
   def setn(n, value)
     raise "Invalid index #{n}" if n < 1
     @stack[-n] = value
-    @stack_pc[-n] = @pc.offset
   end
 
   # Pop n members from the top of the stack (or push -n members onto the
@@ -148,12 +202,10 @@ class StaticStack < Stack
     if n < 0 then
       for i in 0...-n do
         @stack.push(nil)
-        @stack_pc.push(@pc.offset)
       end
     else
       for i in 0...n do
         @stack.pop
-        @stack_pc.pop
       end
     end
   end
@@ -163,30 +215,146 @@ class StaticStack < Stack
   # For each element, yields a JIT::Value for that stack element.
   def each
     @stack.reverse.each do |value|
-      yield value
+      yield @function.box_float(value)
     end
   end
 
-  # +validate_branch+:: validate that a branch to dest is allowed.  A
-  # StaticStack cannot handle certain types of branches.
+  # Pop a value from the top of the stack and return it without boxing
+  # it, so a Float operator can use it as a double
+  def pop_unboxed
+    raise "Invalid index 1" if @stack.empty?
+    return @stack.pop
+  end
+
+  # Flush the stack and record its depth for a branch to +dest+.
+  # Raises an exception if +dest+ was already compiled without being
+  # known as a branch target, or if the depth does not match the depth
+  # recorded for it.
   def validate_branch(dest)
-    # Validate that there are no items left on the stack that were
-    # created inside the loop
-    @stack_pc.each do |offset|
-      if offset > dest then
-        raise "Static stack does not allow branch over dynamic stack operations"
+    if not @branch_targets.include?(dest) then
+      if dest < @pc.offset then
+        raise "Static stack does not allow a branch back to #{dest}, which is not a known branch target"
       end
+      @branch_targets[dest] = true
     end
 
-    # TODO: Validate that we don't branch to a spot that immediately
-    # pops (not sure how to check this, but I'm pretty sure ruby doesn't
-    # generate any code that allows it)
+    flush
+    record_depth(dest)
+  end
+
+  # Called before the instruction at +offset+ is compiled.  If it is a
+  # branch target, flush the stack on the way in (or, if the previous
+  # instruction never falls through, take the depth recorded by the
+  # branches to it); either way the stack then holds the slot variables.
+  def label(offset)
+    if @branch_targets.include?(offset) then
+      if @reachable then
+        flush
+        record_depth(offset)
+      elsif @depth_at.include?(offset) then
+        @stack = Array.new(@depth_at[offset])
+      else
+        # Only reached by a branch further on, which will check that
+        # the depth is the same as it is here
+        record_depth(offset)
+      end
+      reset_to_slots
+    elsif not @reachable then
+      reset_to_slots
+    end
+
+    @reachable = true
+  end
+
+  # Indicate that the instruction just compiled never falls through to
+  # the next one.
+  def mark_unreachable
+    @reachable = false
+  end
+
+  # Emit code to store the stack to memory, so it survives a longjmp to
+  # a setjmp made after this point.
+  #
+  # Returns an object to pass to #reload after the setjmp, or nil if
+  # the stack is empty.
+  def spill
+    flush
+    return nil if @stack.empty?
+
+    area = JIT::Array.new(JIT::Type::OBJECT, @stack.size).create(@function)
+    @stack.each_with_index do |value, idx|
+      area[idx] = value
+    end
+    return area
+  end
+
+  # Emit code to load the stack back from memory after a setjmp.
+  #
+  # +area+:: the object returned by #spill
+  def reload(area)
+    return if not area
+
+    @stack.each_index do |idx|
+      slot(idx).store(area[idx])
+    end
   end
 
   # Returns true
   def static?
     return true
   end
+
+  private
+
+  # Returns the variable that holds slot +idx+ of the stack at joins.
+  def slot(idx)
+    @slots[idx] ||= @function.value(JIT::Type::OBJECT)
+    return @slots[idx]
+  end
+
+  # Emit code to store each value on the stack into its slot variable.
+  def flush
+    moves = []
+    @stack.each_with_index do |value, idx|
+      next if value.nil?
+      value = @function.box_float(value)
+      next if value.equal?(slot(idx))
+
+      # A value that is itself a slot variable may be overwritten by
+      # one of the other moves, so copy it first
+      if @slots.any? { |s| s.equal?(value) } then
+        copy = @function.value(JIT::Type::OBJECT)
+        copy.store(value)
+        value = copy
+      end
+
+      moves << [ idx, value ]
+    end
+
+    moves.each do |idx, value|
+      slot(idx).store(value)
+    end
+
+    reset_to_slots
+  end
+
+  # Make the stack hold the slot variables, at its current depth.
+  def reset_to_slots
+    @stack = (0...@stack.size).map { |idx| slot(idx) }
+  end
+
+  # Record that the stack has its current depth at +offset+, or raise
+  # an exception if a different depth was recorded there before.
+  def record_depth(offset)
+    depth = @stack.size
+    if @depth_at.include?(offset) then
+      if @depth_at[offset] != depth then
+        raise "Stack depth #{depth} at a branch to #{offset} does not match depth #{@depth_at[offset]}"
+      end
+    else
+      @depth_at[offset] = depth
+    end
+  end
 end
 
 class YarvStack < Stack
@@ -0,0 +1,258 @@
+# Statistics about what the JIT compiler did and why.
+#
+# For each method Ludicrous tried to compile (or decided not to), the
+# stats record whether it was compiled, how long compilation took, how
+# much machine code it produced, which fast paths were emitted for it,
+# and which call sites fell back to a plain rb_funcall.  Methods that
+# were not compiled record the reason.
+#
+# Use Ludicrous.stats to get the stats as a Hash, or run the ludicrous
+# executable with --jit-stats to print them when the program exits.
+
+module Ludicrous
+
+module Stats
+  # What is known about a single method.
+  #
+  # +status+:: :compiled, :failed, :skipped, or :invalidated
+  # +reason+:: why the method failed, was skipped, or was invalidated
+  # +compile_time+:: seconds spent compiling the method
+  # +code_size+:: bytes of machine code generated for the method
+  # +fast_paths+:: a Hash of fast path name to the number of times it
+  # was emitted
+  # +fallbacks+:: a Hash of fallback reason to the number of call sites
+  # that fell back to rb_funcall for that reason
+  MethodStats = Struct.new(
+      :status,
+      :reason,
+      :compile_time,
+      :code_size,
+      :fast_paths,
+      :fallbacks)
+
+  class MethodStats
+    def initialize
+      super(nil, nil, 0.0, 0, Hash.new(0), Hash.new(0))
+    end
+
+    # Returns the stats for the method as a Hash.
+    def to_hash
+      return {
+        :status => self.status,
+        :reason => self.reason,
+        :compile_time => self.compile_time,
+        :code_size => self.code_size,
+        :fast_paths => hash_without_default(self.fast_paths),
+        :fallbacks => hash_without_default(self.fallbacks),
+      }
+    end
+
+    def hash_without_default(h)
+      result = {}
+      h.each { |k, v| result[k] = v }
+      return result
+    end
+    private :hash_without_default
+  end
+
+  # Clear all the stats (but not the counters kept by the call caches
+  # and JIT stubs).
+  def self.reset
+    @methods = {}
+    @fast_paths = Hash.new(0)
+    @fallbacks = Hash.new(0)
+  end
+
+  reset()
+
+  # Returns the MethodStats for the given method, creating it if
+  # necessary.
+  #
+  # +klass+:: the class or module the method is a member of
+  # +name+:: the name of the method
+  def self.method_stats(klass, name)
+    return (@methods["#{klass}##{name}"] ||= MethodStats.new)
+  end
+
+  # Returns the MethodStats for the method currently being compiled, or
+  # nil if the method is not being compiled through a stub or
+  # jit_compile_method.
+  def self.current
+    target = Ludicrous::DirectCall.current
+    return target && method_stats(target.klass, target.name)
+  end
+
+  # Record that a method was compiled.
+  #
+  # +klass+:: the class or module the method is a member of
+  # +name+:: the name of the method
+  # +function+:: the compiled JIT::Function
+  # +seconds+:: the time it took to compile the method
+  def self.compiled(klass, name, function, seconds)
+    stats = method_stats(klass, name)
+    stats.status = :compiled
+    stats.reason = nil
+    stats.compile_time += seconds
+    stats.code_size = function.code_size.to_i
+  end
+
+  # Record that a method failed to compile.
+  #
+  # +klass+:: the class or module the method is a member of
+  # +name+:: the name of the method
+  # +exc+:: the exception raised by the compiler
+  # +seconds+:: the time spent before compilation failed
+  def self.failed(klass, name, exc, seconds)
+    stats = method_stats(klass, name)
+    stats.status = :failed
+    stats.reason = "#{exc.class}: #{exc}"
+    stats.compile_time += seconds
+  end
+
+  # Record that a method was deliberately not compiled.
+  #
+  # +klass+:: the class or module the method is a member of
+  # +name+:: the name of the method
+  # +reason+:: a String explaining why
+  def self.skipped(klass, name, reason)
+    stats = method_stats(klass, name)
+    stats.status = :skipped
+    stats.reason = reason
+  end
+
+  # Record that a compiled method was switched back to its original
+  # body because an assumption it was compiled under no longer holds
+  # (see Ludicrous::Redefinition).
+  #
+  # +klass+:: the class or module the method is a member of
+  # +name+:: the name of the method
+  # +reason+:: a String explaining why
+  def self.invalidated(klass, name, reason)
+    stats = method_stats(klass, name)
+    stats.status = :invalidated
+    stats.reason = reason
+  end
+
+  # Record that a fast path was emitted in the method being compiled.
+  #
+  # +kind+:: a Symbol naming the fast path
+  def self.fast_path(kind)
+    @fast_paths[kind] += 1
+    stats = self.current
+    stats.fast_paths[kind] += 1 if stats
+  end
+
+  # Record that a call site in the method being compiled fell back to
+  # calling rb_funcall.
+  #
+  # +reason+:: a String explaining why
+  def self.fallback(reason)
+    @fallbacks[reason] += 1
+    stats = self.current
+    stats.fallbacks[reason] += 1 if stats
+  end
+
+  # Returns all the stats as a Hash.
+  def self.to_hash
+    methods = {}
+    count = Hash.new(0)
+    compile_time = 0.0
+    code_size = 0
+    @methods.each do |name, stats|
+      methods[name] = stats.to_hash
+      count[stats.status] += 1
+      compile_time += stats.compile_time
+      code_size += stats.code_size
+    end
+
+    stub_calls = 0
+    stub_bounces = 0
+    Ludicrous::JITCompiled.hotness_counters.each_value do |counter|
+      stub_calls += counter.calls
+      stub_bounces += counter.bounces
+    end
+
+    fast_paths = {}
+    @fast_paths.each { |k, v| fast_paths[k] = v }
+    fallbacks = {}
+    @fallbacks.each { |k, v| fallbacks[k] = v }
+
+    return {
+      :methods => methods,
+      :compiled => count[:compiled],
+      :failed => count[:failed],
+      :skipped => count[:skipped],
+      :invalidated => count[:invalidated],
+      :compile_time => compile_time,
+      :code_size => code_size,
+      :fast_paths => fast_paths,
+      :fallbacks => fallbacks,
+      :stub_calls => stub_calls,
+      :stub_bounces => stub_bounces,
+      :call_cache => Ludicrous::CallCache.stats,
+      :direct_yield => Ludicrous::DirectYield.stats,
+    }
+  end
+
+  # Write the stats to the given stream.
+  #
+  # +io+:: the stream to write to
+  # +format+:: 'json' to write the stats as JSON, or 'text' to write a
+  # human-readable summary
+  def self.report(io, format = 'text')
+    stats = self.to_hash
+
+    case format.to_s
+    when 'json'
+      begin
+        require 'rubygems'
+      rescue LoadError
+      end
+      require 'json'
+      io.puts JSON.generate(stats)
+    when 'text', ''
+      report_text(io, stats)
+    else
+      raise "Unknown stats format #{format}"
+    end
+  end
+
+  def self.report_text(io, stats)
+    cache = stats[:call_cache]
+    io.puts "JIT stats:"
+    io.puts "  compiled: #{stats[:compiled]} methods in %.3fs, #{stats[:code_size]} bytes" % stats[:compile_time]
+    io.puts "  failed: #{stats[:failed]}"
+    io.puts "  skipped: #{stats[:skipped]}"
+    io.puts "  invalidated: #{stats[:invalidated]}"
+    io.puts "  stub calls: #{stats[:stub_calls]} (#{stats[:stub_bounces]} to the uncompiled method)"
+    io.puts "  call cache: #{cache[:hits]} hits, #{cache[:misses]} misses, #{cache[:slow_calls]} slow calls"
+    yields = stats[:direct_yield]
+    io.puts "  yields: #{yields[:direct_yields]} direct, #{yields[:slow_yields]} through rb_yield"
+    stats[:fast_paths].sort_by { |k, v| -v }.each do |kind, n|
+      io.puts "  fast path #{kind}: #{n}"
+    end
+    stats[:fallbacks].sort_by { |k, v| -v }.each do |reason, n|
+      io.puts "  fallback (#{reason}): #{n}"
+    end
+
+    io.puts "Methods:"
+    stats[:methods].sort.each do |name, m|
+      case m[:status]
+      when :compiled
+        paths = m[:fast_paths].map { |kind, n| "#{kind}=#{n}" }.sort
+        io.puts "  #{name}: compiled in %.3fms, #{m[:code_size]} bytes #{paths.join(' ')}" % (m[:compile_time] * 1000)
+      else
+        io.puts "  #{name}: #{m[:status]} (#{m[:reason]})"
+      end
+    end
+  end
+  private_class_method :report_text
+end
+
+# Returns a Hash with statistics about the JIT compiler (see
+# Ludicrous::Stats).
+def self.stats
+  return Stats.to_hash
+end
+
+end # Ludicrous
@@ -7,6 +7,33 @@
 module Ludicrous
 
 module JITCompiled
+  # The HotnessCounter for each method that has a JIT stub, indexed by
+  # [ klass, name ].
+  @hotness_counters = {}
+
+  class << self
+    attr_reader :hotness_counters
+  end
+
+  # Returns the CompileOptions that should be used to compile methods in
+  # the given class or module.
+  #
+  # +klass+:: the class or module
+  def self.compile_options_for(klass)
+    if klass.const_defined?(:LUDICROUS_OPTIONS) then
+      options = klass.const_get(:LUDICROUS_OPTIONS).dup
+    else
+      options = Ludicrous::CompileOptions.new
+    end
+
+    if klass.const_defined?(:LUDICROUS_OPTIMIZATION_LEVEL) and
+       opt = klass.const_get(:LUDICROUS_OPTIMIZATION_LEVEL) then
+      options.optimization_level = opt
+    end
+
+    return options
+  end
+
   # Compile a function for which a stub has been installed.
   #
   # Removes the stub if compilation fails.
@@ -21,6 +48,10 @@ module JITCompiled
   def self.jit_compile_stub(klass, method, name, orig_name)
     tmp_name = "ludicrous__tmp__#{name}".intern
 
+    # The stub is going away either way, so stop counting its loops
+    counter = @hotness_counters[[klass, name.to_s.intern]]
+    counter.unwatch if counter
+
     success = proc { |f|
       # Alias the method so we won't get a warning from the
       # interpreter
@@ -29,6 +60,8 @@ module JITCompiled
       # Replace the method with the compiled version
       # TODO: public/private/protected?
       klass.define_jit_method(name, f)
+      Ludicrous::DirectCall.installed(klass, name, f)
+      Ludicrous::Redefinition.installed(klass, name, method, f)
       return true
     }
 
@@ -64,34 +97,72 @@ module JITCompiled
 
     if klass.ludicrous_dont_compile_method(name) then
       Ludicrous.logger.info("Not compiling #{klass}##{name}")
+      Ludicrous::Stats.skipped(klass, name, "excluded by compile options")
+      return
+    end
+
+    if reason = Ludicrous::Profile.failure(klass, name) then
+      Ludicrous.logger.info("Not compiling #{klass}##{name} (failed last time: #{reason})")
+      Ludicrous::Stats.skipped(klass, name, "failed last time: #{reason}")
+      failure.call(RuntimeError.new(reason))
       return
     end
 
     successful = false
     f = nil
+    start_time = Time.now
 
     begin
       Ludicrous.logger.info "Compiling #{klass}##{name}..."
-      if klass.const_defined?(:LUDICROUS_OPTIMIZATION_LEVEL) and
-         opt = klass.const_get(:LUDICROUS_OPTIMIZATION_LEVEL)
-        f = method.ludicrous_compile(opt)
-      else
-        f = method.ludicrous_compile
+      options = compile_options_for(klass)
+      Ludicrous::DirectCall.compiling(klass, name) do
+        f = method.ludicrous_compile(options)
       end
 
       successful = true
 
     rescue
       Ludicrous.logger.error "#{klass}##{name} failed: #{$!.class}: #{$!} (#{$!.backtrace[0]})"
+      Ludicrous::Stats.failed(klass, name, $!, Time.now - start_time)
+      Ludicrous::Profile.record_failure(klass, name, $!)
       failure.call($!)
     end
 
     if successful then
       Ludicrous.logger.info "#{klass}##{name} compiled"
+      Ludicrous::Stats.compiled(klass, name, f, Time.now - start_time)
+      Ludicrous::Profile.record_compiled(klass, name)
       success.call(f)
     end
   end
 
+  # Compile a method that has no stub right away and install the
+  # compiled version in place of the interpreted one.
+  #
+  # Returns true if the method was compiled, false otherwise.
+  #
+  # +klass+:: the class or module the method is a member of
+  # +name+:: the name of the method
+  # +method+:: a Method or UnboundMethod for the method to be compiled
+  def self.jit_precompile_method(klass, name, method)
+    tmp_name = "ludicrous__tmp__#{name}".intern
+    compiled = false
+
+    success = proc { |f|
+      # Alias the method so we won't get a warning from the
+      # interpreter
+      klass.__send__(:alias_method, tmp_name, name)
+      klass.define_jit_method(name, f)
+      klass.__send__(:remove_method, tmp_name)
+      Ludicrous::DirectCall.installed(klass, name, f)
+      Ludicrous::Redefinition.installed(klass, name, method, f)
+      compiled = true
+    }
+
+    jit_compile_method(klass, name, method, success)
+    return compiled
+  end
+
   # Create a proc that when called will compile a method for which a
   # stub has been installed.
   #
@@ -134,6 +205,21 @@ module JITCompiled
   def self.jit_stub(klass, name, orig_name, method)
     compile_proc = self.compile_proc(klass, method, name, orig_name)
 
+    threshold = compile_options_for(klass).compile_threshold.to_i
+    counter = Ludicrous::HotnessCounter.new
+    @hotness_counters[[klass, name.to_s.intern]] = counter
+
+    # Count the back edges the interpreter takes in the method's loops,
+    # so a method that loops a lot gets compiled after fewer calls (a
+    # loop can't switch to compiled code while it runs, so the method
+    # is compiled on the call after it gets hot)
+    if threshold > 1 and Ludicrous::HotnessCounter::COUNTS_BACKEDGES and
+       method.body.respond_to?(:ludicrous_loop_heads) then
+      method.body.ludicrous_loop_heads.each do |node|
+        counter.watch(node)
+      end
+    end
+
     # TODO: the stub should have the same arity as the original
     # TODO: the stub should have the same access protection as the original
     signature = JIT::Type::RUBY_VARARG_SIGNATURE
@@ -143,22 +229,44 @@ module JITCompiled
         argv = f.get_param(1)
         recv = f.get_param(2)
 
-        # Store the args...
-        args = f.rb_ary_new4(argc, argv)
-
-        # ... and the passed block for later.
-        passed_block = f.value(:OBJECT)
-        f.if(f.rb_block_given_p()) {
-          passed_block.store f.rb_block_proc()
-        }.else {
-          passed_block.store f.const(:OBJECT, nil)
-        }.end
-
         unbound_method = f.value(:OBJECT)
 
         # Check to see if this is a module function
         f.if(f.rb_obj_is_kind_of(recv, klass)) {
-          # If it wasn't, go ahead and compile it
+          if threshold > 1 then
+            # Count this call, and call the uncompiled method until the
+            # method gets hot enough
+            f.const(:OBJECT, counter)
+            counter_ptr = f.const(:VOID_PTR, counter.address)
+            calls = f.ruby_struct_member(
+                :Ludicrous_Hotness_Counter, :calls, counter_ptr) +
+                f.const(JIT::Type::NINT, 1)
+            f.set_ruby_struct_member(
+                :Ludicrous_Hotness_Counter, :calls, counter_ptr, calls)
+            backedges = f.ruby_struct_member(
+                :Ludicrous_Hotness_Counter, :backedges, counter_ptr)
+
+            f.if(calls + backedges < f.const(JIT::Type::NINT, threshold)) {
+              bounces = f.ruby_struct_member(
+                  :Ludicrous_Hotness_Counter, :bounces, counter_ptr) +
+                  f.const(JIT::Type::NINT, 1)
+              f.set_ruby_struct_member(
+                  :Ludicrous_Hotness_Counter, :bounces, counter_ptr, bounces)
+
+              # Pass the arguments straight through; only a call with a
+              # block needs them in an array (and the block as a proc)
+              f.if(f.rb_block_given_p()) {
+                f.insn_return f.block_pass_fcall(
+                    recv,
+                    orig_name,
+                    f.rb_ary_new4(argc, argv),
+                    f.rb_block_proc())
+              }.end
+              f.insn_return f.rb_funcall2(recv, orig_name, argc, argv)
+            }.end
+          end
+
+          # The method is hot, so go ahead and compile it
           f.if(f.rb_funcall(compile_proc, :call)) {
             # If compilation was successful, then we'll call the
             # compiled method
@@ -190,6 +298,15 @@ module JITCompiled
               name)
         }.end
 
+        # Store the args and the passed block
+        args = f.rb_ary_new4(argc, argv)
+        passed_block = f.value(:OBJECT)
+        f.if(f.rb_block_given_p()) {
+          passed_block.store f.rb_block_proc()
+        }.else {
+          passed_block.store f.const(:OBJECT, nil)
+        }.end
+
         # Bind the method we want to call to the receiver
         bound_method = f.rb_funcall(
             unbound_method,
@@ -225,6 +342,7 @@ module JITCompiled
 
     if klass.ludicrous_dont_compile_method(name) then
       Ludicrous.logger.info("Not compiling #{klass}##{name}")
+      Ludicrous::Stats.skipped(klass, name, "excluded by compile options")
       return
     end
 
@@ -248,9 +366,24 @@ module JITCompiled
        Node::IVAR === body or
        Node::ATTRSET === body then
       Ludicrous.logger.info "Not compiling #{body.class} #{klass}##{name}"
+      Ludicrous::Stats.skipped(klass, name, "#{body.class} body")
+      return
+    end
+
+    # Don't pay for a stub (or a compile) if the profile from a previous
+    # run says the method can't be compiled, and skip the stub if it
+    # says the method will get hot anyway
+    if reason = Ludicrous::Profile.failure(klass, name) then
+      Ludicrous.logger.info "Not compiling #{klass}##{name} (failed last time: #{reason})"
+      Ludicrous::Stats.skipped(klass, name, "failed last time: #{reason}")
       return
     end
 
+    if Ludicrous::Profile.hot?(klass, name) then
+      Ludicrous.logger.info "Compiling hot method #{klass}##{name} from profile"
+      return if jit_precompile_method(klass, name, method)
+    end
+
     Ludicrous.logger.info "Installing JIT stub for #{klass}##{name}..."
     tmp_name = "ludicrous__orig_tmp__#{name}".intern
     klass.instance_eval do
@@ -0,0 +1,222 @@
+# Fast paths for Float arithmetic that keep intermediate results
+# unboxed.
+#
+# An arithmetic operator on two Floats (or a Float and a Fixnum) is
+# computed on native doubles.  Rather than allocating a Float for the
+# result right away, the result is returned as a Ludicrous::UnboxedFloat,
+# which another operator can use as a double directly.  So an expression
+# such as a*b + c*d allocates only the Float for the sum, which is boxed
+# when it is stored in a variable or passed to a method (see
+# UnboxedFloat#box).
+#
+# The MRI compiler keeps a result unboxed for the rest of the expression
+# tree it is part of; the YARV compiler keeps it unboxed while it is on
+# the stack within a basic block.
+
+require 'ludicrous/ruby_types'
+require 'ludicrous/native_functions'
+require 'ludicrous/redefinition'
+
+module Ludicrous
+
+# Float operators that have fast paths whose results can stay unboxed.
+FLOAT_ARITHMETIC_OPERATORS = [ :+, :-, :*, :/ ]
+
+# Float operators that have fast paths returning true or false.
+FLOAT_COMPARISON_OPERATORS = [ :<, :<=, :>, :>=, :== ]
+
+Redefinition.track(
+    Float, *(FLOAT_ARITHMETIC_OPERATORS + FLOAT_COMPARISON_OPERATORS))
+
+# Returns true if a call to +mid+ with +argc+ arguments has a Float fast
+# path.
+#
+# +mid+:: a Symbol with the name of the method being called
+# +argc+:: the number of arguments passed to the method
+def self.float_operator?(mid, argc)
+  return argc == 1 &&
+    (FLOAT_ARITHMETIC_OPERATORS.include?(mid) ||
+     FLOAT_COMPARISON_OPERATORS.include?(mid))
+end
+
+# The result of a Float operator, which may not have been boxed yet.
+#
+# At run time, either is_double is nonzero and double holds the result,
+# or is_double is zero and object holds it (the result of calling the
+# operator normally, or the boxed double).
+class UnboxedFloat
+  # A JIT::Value of type INT; nonzero if the result is in double
+  attr_reader :is_double
+
+  # A JIT::Value of type FLOAT64 holding the unboxed result
+  attr_reader :double
+
+  # A JIT::Value holding the result as an object
+  attr_reader :object
+
+  # Create a new UnboxedFloat.
+  #
+  # +function+:: the JIT::Function the result is computed in
+  # +object+:: the JIT::Value to hold the result as an object (default
+  # is a new value)
+  def initialize(function, object = nil)
+    @function = function
+    @is_double = function.value(JIT::Type::INT)
+    @double = function.value(JIT::Type::FLOAT64)
+    @object = object || function.value(JIT::Type::OBJECT)
+  end
+
+  # Emit code to make this hold the same result as another
+  # UnboxedFloat, without boxing it.
+  #
+  # +other+:: the Ludicrous::UnboxedFloat to copy
+  def store(other)
+    @is_double.store(other.is_double)
+    @function.if(other.is_double) {
+      @double.store(other.double)
+    } .else {
+      @object.store(other.object)
+    } .end
+  end
+
+  # Emit code to box the result, if it has not been boxed already.
+  #
+  # Returns a JIT::Value holding the result as an object.  The result is
+  # boxed in place, so it is boxed at most once at run time, whichever
+  # path boxes it first.
+  def box
+    @function.if(@is_double) {
+      @object.store(@function.rb_float_new(@double))
+      @is_double.store(@function.const(JIT::Type::INT, 0))
+    } .end
+    return @object
+  end
+end
+
+end # Ludicrous
+
+module JIT
+
+class Function
+  # The kinds of operand load_double can convert
+  FLOAT_OPERAND_FLOAT = 1
+  FLOAT_OPERAND_FIXNUM = 2
+
+  # Emit code for a Float operator.
+  #
+  # Returns a Ludicrous::UnboxedFloat for an arithmetic operator, or a
+  # JIT::Value holding true or false for a comparison.
+  #
+  # +mid+:: a Symbol with the name of the operator (see
+  # Ludicrous.float_operator?)
+  # +lhs+:: the receiver (a JIT::Value or Ludicrous::UnboxedFloat)
+  # +rhs+:: the argument (a JIT::Value or Ludicrous::UnboxedFloat)
+  # +guard+:: a JIT::Value that must be nonzero for the fast path to be
+  # taken, or nil
+  #
+  # If the operands are not numbers the fast path can handle, yields
+  # the boxed operands; the block should emit code to call the operator
+  # normally and return the result.
+  def float_operator(mid, lhs, rhs, guard = nil)
+    lhs_double = value(JIT::Type::FLOAT64)
+    rhs_double = value(JIT::Type::FLOAT64)
+    lhs_kind = load_double(lhs, lhs_double)
+    rhs_kind = load_double(rhs, rhs_double)
+
+    # Both operands must be numbers, and at least one a Float
+    zero = const(JIT::Type::INT, 0)
+    fixnum = const(JIT::Type::INT, FLOAT_OPERAND_FIXNUM)
+    use_double = lhs_kind.neq(zero) & rhs_kind.neq(zero)
+    use_double = use_double & (lhs_kind.neq(fixnum) | rhs_kind.neq(fixnum))
+    use_double = use_double & guard if guard
+
+    if Ludicrous::FLOAT_COMPARISON_OPERATORS.include?(mid) then
+      result = value(JIT::Type::OBJECT)
+      self.if(use_double) {
+        result.store(
+            double_operator(mid, lhs_double, rhs_double).to_rbool)
+      } .else {
+        result.store(yield(box_float(lhs), box_float(rhs)))
+      } .end
+    else
+      result = Ludicrous::UnboxedFloat.new(self)
+      self.if(use_double) {
+        result.double.store(double_operator(mid, lhs_double, rhs_double))
+        result.is_double.store(const(JIT::Type::INT, 1))
+      } .else {
+        result.object.store(yield(box_float(lhs), box_float(rhs)))
+        result.is_double.store(zero)
+      } .end
+    end
+
+    return result
+  end
+
+  # Emit code to box +value+ if it is a Ludicrous::UnboxedFloat.
+  #
+  # Returns a JIT::Value holding an object.
+  def box_float(value)
+    if Ludicrous::UnboxedFloat === value then
+      return value.box
+    else
+      return value
+    end
+  end
+
+  private
+
+  # Emit code to convert an operand to a double.
+  #
+  # Returns a JIT::Value of type INT that is FLOAT_OPERAND_FLOAT if the
+  # operand is a Float, FLOAT_OPERAND_FIXNUM if it is a Fixnum, or zero
+  # if it is neither (in which case +double+ is not set).
+  #
+  # +operand+:: a JIT::Value or a Ludicrous::UnboxedFloat
+  # +double+:: a JIT::Value of type FLOAT64 to store the double into
+  def load_double(operand, double)
+    kind = value(JIT::Type::INT)
+    kind.store(const(JIT::Type::INT, 0))
+
+    load_object = proc { |obj|
+      self.if(obj.is_fixnum) {
+        double.store(fix2native(obj))
+        kind.store(const(JIT::Type::INT, FLOAT_OPERAND_FIXNUM))
+      } .elsif(obj.is_exact_class(::Float)) {
+        double.store(Ludicrous::RFloat.wrap(obj).value)
+        kind.store(const(JIT::Type::INT, FLOAT_OPERAND_FLOAT))
+      } .end
+    }
+
+    if Ludicrous::UnboxedFloat === operand then
+      self.if(operand.is_double) {
+        double.store(operand.double)
+        kind.store(const(JIT::Type::INT, FLOAT_OPERAND_FLOAT))
+      } .else {
+        load_object.call(operand.object)
+      } .end
+    else
+      load_object.call(operand)
+    end
+
+    return kind
+  end
+
+  # Emit code to apply a Float operator to two doubles.
+  def double_operator(mid, lhs, rhs)
+    case mid
+    when :+  then return lhs + rhs
+    when :-  then return lhs - rhs
+    when :*  then return lhs * rhs
+    when :/  then return lhs / rhs
+    when :<  then return lhs < rhs
+    when :<= then return lhs <= rhs
+    when :>  then return lhs > rhs
+    when :>= then return lhs >= rhs
+    when :== then return lhs == rhs
+    else raise "No Float fast path for #{mid}"
+    end
+  end
+end
+
+end # JIT
+
@@ -0,0 +1,235 @@
+# Keeping the numeric locals of a while or until loop unboxed on 1.8.
+#
+# Before a loop is compiled, the assignments in its body are examined to
+# infer which locals only ever hold numbers (see
+# Node#ludicrous_loop_assignments and Node#ludicrous_numeric_type).
+# Only locals that nothing outside the method can see (that is, locals
+# that are not addressable) are considered.
+#
+# A local inferred to hold Floats is kept as a Ludicrous::UnboxedFloat
+# for the duration of the loop: Float arithmetic assigned to it is not
+# boxed, and it is boxed when it is read by anything but a Float
+# operator, and when the loop exits.  This is safe whatever the local
+# actually holds, so it needs no guard.
+#
+# A local inferred to hold Fixnums is speculated to hold one.  The loop
+# is compiled twice: once with the locals' type checks left out, entered
+# if they all hold Fixnums when the loop starts, and once as usual.  If
+# an assignment in the first copy produces something else (a Bignum,
+# say), the Float locals are boxed and execution continues in the
+# second copy, just after the same assignment.  A Fixnum is already a
+# native integer once its tag is shifted off, so these locals stay in
+# their usual (register) variables; what is saved is the checks.
+
+module Ludicrous
+
+class UnboxedLocals
+  # An Array of Symbol with the names of the locals speculated to hold
+  # Fixnums
+  attr_reader :fixnums
+
+  # A Hash mapping the name of each local inferred to hold Floats to its
+  # Ludicrous::UnboxedFloat
+  attr_reader :floats
+
+  # Infer the types of the locals assigned in a loop.
+  #
+  # Returns a new UnboxedLocals, or nil if no locals can be kept
+  # unboxed.
+  #
+  # +function+:: the JIT::Function being compiled
+  # +env+:: the Ludicrous::Environment
+  # +loop+:: the WHILE or UNTIL Node for the loop
+  def self.infer(function, env, loop)
+    assignments = []
+    return nil if not loop.ludicrous_loop_assignments(assignments)
+
+    types = {}
+    assignments.each do |vid, value, statement|
+      local = env.scope.local_variable(vid)
+      if not statement or not value or not local or local.addressable? then
+        types[vid] = :unknown
+      elsif not types.include?(vid) then
+        types[vid] = nil
+      end
+    end
+
+    # Join the type of each assignment into the type of its local until
+    # nothing changes
+    begin
+      changed = false
+      assignments.each do |vid, value, statement|
+        # A local assigned by a multiple assignment has no value node
+        value_type = value ? value.ludicrous_numeric_type(types) : :unknown
+        type = join(types[vid], value_type)
+        if type != types[vid] then
+          types[vid] = type
+          changed = true
+        end
+      end
+    end while changed
+
+    fixnums = types.keys.select { |vid| types[vid] == :fixnum }
+    floats = types.keys.select { |vid| types[vid] == :float }
+    return nil if fixnums.empty? and floats.empty?
+
+    return self.new(function, env, fixnums, floats)
+  end
+
+  # Returns the type of a value that may have come from either of two
+  # expressions with types +lhs+ and +rhs+ (nil if not yet known,
+  # :fixnum, :float, or :unknown).
+  def self.join(lhs, rhs)
+    return rhs if lhs.nil?
+    return lhs if rhs.nil? or lhs == rhs
+    return :unknown if lhs == :unknown or rhs == :unknown
+    return :float
+  end
+
+  # Returns the type of the result of an arithmetic operator on
+  # operands with types +lhs+ and +rhs+.
+  def self.arithmetic(lhs, rhs)
+    return nil if lhs.nil? or rhs.nil?
+    return :unknown if lhs == :unknown or rhs == :unknown
+    return :float if lhs == :float or rhs == :float
+    return :fixnum
+  end
+
+  # Create a new UnboxedLocals.  Use UnboxedLocals.infer instead.
+  def initialize(function, env, fixnums, floats)
+    @function = function
+    @env = env
+    @fixnums = fixnums
+    @floats = {}
+    floats.each do |vid|
+      object = env.scope.local_variable(vid).get
+      @floats[vid] = Ludicrous::UnboxedFloat.new(function, object)
+    end
+    @resume_labels = []
+    @mode = nil
+  end
+
+  # Returns true if +vid+ is being kept unboxed as a Float.
+  def float?(vid)
+    return @mode == :native && @floats.include?(vid)
+  end
+
+  # Returns true if +vid+ is known to hold a Fixnum.
+  def fixnum?(vid)
+    return @mode == :native && @fixnums.include?(vid)
+  end
+
+  # Returns true if assignments to +vid+ must be compiled with
+  # #compile_assignment.
+  def include?(vid)
+    return @fixnums.include?(vid) || float?(vid)
+  end
+
+  # Emit the loop.  The block should emit the loop as usual (it is
+  # called once for each copy of the loop).
+  def compile
+    if @fixnums.empty? then
+      compile_native { yield }
+      @mode = nil
+      return
+    end
+
+    is_fixnum = nil
+    @fixnums.each do |vid|
+      value = @env.scope.local_get(vid).is_fixnum
+      is_fixnum = is_fixnum ? is_fixnum & value : value
+    end
+
+    @function.if(is_fixnum) {
+      compile_native { yield }
+    } .else {
+      @mode = :boxed
+      @assignment_count = 0
+      yield
+      if @assignment_count != @resume_labels.size then
+        raise "Loop compiled differently the second time"
+      end
+    } .end
+
+    @mode = nil
+  end
+
+  # Emit code to assign to one of the locals.
+  #
+  # Returns a JIT::Value with the value of the assignment.
+  #
+  # +vid+:: a Symbol with the name of the local
+  # +value_node+:: the Node for the value to assign
+  def compile_assignment(vid, value_node)
+    if float?(vid) then
+      return compile_float_assignment(vid, value_node)
+    end
+
+    value = value_node.ludicrous_compile(@function, @env)
+    @env.scope.local_set(vid, value)
+
+    resume_label = (@resume_labels[@assignment_count] ||= JIT::Label.new)
+    @assignment_count += 1
+
+    if @mode == :native then
+      @function.unless(value.is_fixnum) {
+        box_floats
+        @function.insn_branch(resume_label)
+      } .end
+    else
+      @function.insn_label(resume_label)
+    end
+
+    return @env.scope.local_get(vid)
+  end
+
+  private
+
+  # Emit the copy of the loop with the locals unboxed.
+  def compile_native
+    @mode = :native
+    @assignment_count = 0
+
+    @floats.each do |vid, float|
+      float.is_double.store(@function.const(JIT::Type::INT, 0))
+    end
+    @fixnums.each do |vid|
+      @env.scope.local_get(vid).known_fixnum = true
+    end
+
+    begin
+      yield
+    ensure
+      @fixnums.each do |vid|
+        @env.scope.local_get(vid).known_fixnum = false
+      end
+    end
+
+    box_floats
+  end
+
+  # Emit code to assign to a local kept unboxed as a Float.  The value
+  # returned is only the boxed value if something has boxed it; it is
+  # only used for the value of the statement, which the loop ignores.
+  def compile_float_assignment(vid, value_node)
+    float = @floats[vid]
+    if @env.options.unboxed_floats and
+       value_node.ludicrous_float_arithmetic? then
+      float.store(value_node.ludicrous_compile_float_operator(@function, @env))
+    else
+      float.object.store(value_node.ludicrous_compile(@function, @env))
+      float.is_double.store(@function.const(JIT::Type::INT, 0))
+    end
+    return float.object
+  end
+
+  # Emit code to box the locals kept unboxed as Floats.
+  def box_floats
+    @floats.each do |vid, float|
+      float.box
+    end
+  end
+end
+
+end # Ludicrous
+
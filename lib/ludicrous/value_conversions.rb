@@ -26,11 +26,25 @@ class Value
     return defined?(@is_returned) && @is_returned
   end
 
+  # Set the known_fixnum flag on the value.
+  #
+  # A value whose flag is set is known to hold a Fixnum wherever it is
+  # read, so fast paths need not check its type (see
+  # Ludicrous::UnboxedLocals).
+  def known_fixnum=(boolean)
+    @known_fixnum = boolean
+  end
+
+  # Get the value's known_fixnum flag.
+  def known_fixnum
+    return defined?(@known_fixnum) && @known_fixnum
+  end
+
   # Return a constant holding the bit pattern for the Fixnum flag (the
   # least significant bit in an object reference indicates whether a
   # given object reference is a Fixnum).
   def fixnum_flag
-    return self.function.const(JIT::Type::INT, 1)
+    return self.function.const(JIT::Type::NUINT, 1)
   end
 
   # Determine if this value holds a Fixnum.
@@ -41,25 +55,27 @@ class Value
     return self & fixnum_flag
   end
 
-  # Emit code to convert the value from a C integer to a Fixnum.
+  # Emit code to convert the value from a C integer to a Fixnum.  The
+  # integer is widened to a native (pointer-sized) integer first, so
+  # the result is correct whatever the width of the value.
   #
   # Returns a JIT::Value holding a Fixnum.
   def int2fix
-    one = self.function.const(JIT::Type::INT, 1)
-    return (self << one) | fixnum_flag
+    n = self.function.value(JIT::Type::NINT)
+    n.store(self)
+    return self.function.native2fix(n)
   end
 
   # Emit code to convert the value from a Fixnum to a C integer.
   #
-  # Returns a JIT::Value holding a C integer.
+  # Returns a JIT::Value of type NINT holding the (signed) integer.
   def fix2int
-    one = self.function.const(JIT::Type::INT, 1)
-    return self >> one
+    return self.function.fix2native(self)
   end
 
   # Return a constant holding the bit pattern for the symbol flag
   def symbol_flag
-    return self.function.const(JIT::Type::INT, 0x0e)
+    return self.function.const(JIT::Type::NUINT, 0x0e)
   end
 
   # Determine if this value holds a Symbol.
@@ -67,7 +83,7 @@ class Value
   # Return a constant JIT::Value containing a nonzero value if this
   # value holds a Symbol or a constant containing 0 otherwise.
   def is_symbol
-    mask = self.function.const(JIT::Type::INT, 0xff)
+    mask = self.function.const(JIT::Type::NUINT, 0xff)
     return (self & mask) == symbol_flag
   end
 
@@ -75,7 +91,7 @@ class Value
   #
   # Returns a JIT::Value containing a Symbol.
   def id2sym
-    eight = self.function.const(JIT::Type::INT, 8)
+    eight = self.function.const(JIT::Type::NUINT, 8)
     return (self << eight) | symbol_flag
   end
 
@@ -86,7 +102,7 @@ class Value
   # T_OBJECT, etc.).
   def builtin_type
     flags = self.function.ruby_struct_member(:RBasic, :flags, self)
-    return flags & self.function.const(JIT::Type::INT, Ludicrous::T_MASK)
+    return flags & self.function.const(JIT::Type::NUINT, Ludicrous::T_MASK)
   end
 
   # Determine if this value references an object of the given type.
@@ -100,6 +116,18 @@ class Value
     return self.function.rb_type(self) == self.function.const(JIT::Type::INT, type)
   end
 
+  # Determine if this objref refers to an instance of exactly the given
+  # class, and not of a subclass or an object with a singleton class
+  # (either of which may override the class's methods).
+  #
+  # Return a JIT::Value containing a nonzero value if it does, or 0
+  # otherwise.
+  #
+  # +klass+:: the class to test for
+  def is_exact_class(klass)
+    return self.function.rb_class_of(self) == self.function.const(JIT::Type::OBJECT, klass)
+  end
+
   # Determine if this objref refers to an object with a true value.
   #
   # Returns a JIT::Value containing a value of 0 if this value is false
@@ -203,4 +231,46 @@ class Value
   end
 end
 
+class Function
+  # Emit code to convert a Fixnum to a native (signed) integer.
+  #
+  # Returns a new JIT::Value of type NINT.
+  #
+  # +value+:: a JIT::Value holding a Fixnum
+  def fix2native(value)
+    n = self.value(JIT::Type::NINT)
+    n.store(value)
+    n.store(n >> const(JIT::Type::NINT, 1))
+    return n
+  end
+
+  # Emit code to convert a native integer to a Fixnum.
+  #
+  # Returns a new JIT::Value holding a Fixnum.
+  #
+  # +n+:: a JIT::Value of type NINT
+  def native2fix(n)
+    one = const(JIT::Type::NINT, 1)
+    v = value(JIT::Type::OBJECT)
+    v.store((n << one) | one)
+    return v
+  end
+
+  # Emit code to get the address of an element of a C array of object
+  # references (such as argv or the elements of an Array).
+  #
+  # Returns a JIT::Value of type VOID_PTR.
+  #
+  # +ptr+:: a JIT::Value with the address of the first element
+  # +idx+:: the index of the element (an Integer or a JIT::Value)
+  def value_elem_address(ptr, idx)
+    if Integer === idx then
+      offset = const(JIT::Type::NINT, idx * Ludicrous::SIZEOF_VALUE)
+    else
+      offset = idx * const(JIT::Type::NINT, Ludicrous::SIZEOF_VALUE)
+    end
+    return ptr + offset
+  end
+end
+
 end # JIT
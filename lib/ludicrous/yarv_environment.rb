@@ -5,6 +5,10 @@ module Ludicrous
 class YarvBaseEnvironment < Environment
   attr_reader :stack
 
+  # The constant cache pointer and result value for the getinlinecache
+  # instruction whose setinlinecache has not been compiled yet
+  attr_accessor :inline_cache
+
   def initialize(function, options, cbase, scope)
     super(function, options, cbase, scope)
 
@@ -27,6 +31,33 @@ class YarvEnvironment < YarvBaseEnvironment
     @labels = {}
 
     init_catch_table(iseq)
+
+    @stack.branch_targets = find_branch_targets(iseq)
+  end
+
+  # Returns a Hash whose keys are the offsets in +iseq+ that may be
+  # branched to, so the stack knows where control flow joins.
+  def find_branch_targets(iseq)
+    targets = {}
+
+    pc = ProgramCounter.new
+    iseq.each do |instruction|
+      pc.advance(instruction.length)
+      case instruction
+      when RubyVM::Instruction::JUMP,
+           RubyVM::Instruction::BRANCHIF,
+           RubyVM::Instruction::BRANCHUNLESS,
+           RubyVM::Instruction::GETINLINECACHE
+        targets[pc.offset + instruction.operands[0]] = true
+      end
+    end
+
+    iseq.catch_table.each do |catch_entry|
+      targets[catch_entry.start] = true
+      targets[catch_entry.cont] = true
+    end
+
+    return targets
   end
 
   def init_catch_table(iseq)
@@ -57,6 +88,7 @@ class YarvEnvironment < YarvBaseEnvironment
     iseq = @iseq
     while level > 0 and iseq
       iseq = iseq.parent_iseq
+      level -= 1
     end
 
     dyn_table_idx = iseq.local_table.size - idx + 1
@@ -66,6 +98,7 @@ class YarvEnvironment < YarvBaseEnvironment
   def make_label
     # TODO: we don't need to label every offset, only the ones that we
     # might jump to
+    @stack.label(@pc.offset)
     @labels[@pc.offset] ||= JIT::Label.new
     @function.insn_label(@labels[@pc.offset])
   end
@@ -141,9 +174,16 @@ class YarvEnvironment < YarvBaseEnvironment
   end
 
   def exec_tag
+    # Values libjit keeps in registers may be lost by a longjmp back to
+    # the setjmp, so store the stack to memory around it
+    spilled = @stack.spill
+
     # TODO: _setjmp may or may not be right for this platform
     jmp_buf = @function.ruby_current_thread_jmp_buf()
-    return @function._setjmp(jmp_buf)
+    state = @function._setjmp(jmp_buf)
+
+    @stack.reload(spilled)
+    return state
   end
 
   def with_tag(tag)
@@ -204,6 +244,47 @@ class YarvEnvironment < YarvBaseEnvironment
     end
     return catch_entries
   end
+
+  # Emit code to leave the instruction sequence being compiled.
+  #
+  # +value+:: the value to return
+  def leave(value)
+    @function.insn_return(value)
+  end
+end
+
+# An environment for a block's instruction sequence when it is compiled
+# inline into the calling function (see JIT::Function#inline_iterate).
+# Leaving the block stores its value and branches to the end of the
+# block instead of returning from the function.
+class YarvInlineBlockEnvironment < YarvEnvironment
+  # The value of the block, once it has been left
+  attr_reader :result
+
+  # Create a new YarvInlineBlockEnvironment.
+  #
+  # +function+:: the JIT::Function the block is being compiled into
+  # +options+:: a Ludicrous::CompileOptions object
+  # +cbase+:: the cbase to use for constant lookup
+  # +scope+:: the scope of the calling function
+  # +iseq+:: the block's instruction sequence
+  def initialize(function, options, cbase, scope, iseq)
+    super(function, options, cbase, scope, iseq)
+    @result = function.value(JIT::Type::OBJECT)
+    @leave_label = JIT::Label.new
+  end
+
+  # Compile the block and return its value.
+  def compile_block
+    @iseq.ludicrous_compile(@function, self)
+    @function.insn_label(@leave_label)
+    return @result
+  end
+
+  def leave(value)
+    @result.store(value)
+    @function.insn_branch(@leave_label)
+  end
 end
 
 end # Ludicrous
@@ -95,48 +95,213 @@ class RubyVM
     class LEAVE
       def ludicrous_compile(function, env)
         retval = env.stack.pop
-        function.insn_return(retval)
+        env.leave(retval)
+        env.stack.mark_unreachable
       end
     end
 
+    # Emit code that is nonzero if none of the methods YARV optimizes
+    # with its opt_* instructions has been redefined.  Returns nil if
+    # the flag YARV keeps for this is not available, in which case no
+    # fast paths can be emitted.
+    #
+    # YARV keeps one bit per operator, but which bit is which is private
+    # to the VM and differs between versions, so the whole flag is
+    # checked: redefining any of the operators disables every fast path.
+    def ludicrous_basic_ops_unredefined(function)
+      if not defined?(Ludicrous::REDEFINED_FLAG_ADDRESS) then
+        Ludicrous::Stats.fallback("ruby_vm_redefined_flag not available")
+        return nil
+      end
+
+      flag_ptr = function.const(
+          JIT::Type::VOID_PTR,
+          Ludicrous::REDEFINED_FLAG_ADDRESS)
+      flag = function.insn_load_relative(flag_ptr, 0, JIT::Type::NUINT)
+      return flag == function.const(JIT::Type::NUINT, 0)
+    end
+
+    # Emit code to call +operator+ on +recv+ the way a send instruction
+    # would.
+    def ludicrous_compile_opt_send(function, env, recv, operator, args)
+      set_source(function)
+      env.stack.sync_sp()
+      # The call cache can't push a control frame on YARV, so always
+      # call through the interpreter here
+      Ludicrous::Stats.fallback("call cache not available on YARV")
+      return function.rb_funcall(recv, operator, *args)
+    end
+
+    # Emit code that is nonzero if +obj+ is an instance of exactly
+    # +klass+.  Like YARV, the opt_* fast paths guard on the class rather
+    # than the builtin type, so that an instance of a subclass (or an
+    # object with a singleton class) that overrides the operator calls
+    # it.
+    def ludicrous_is_exact_class(function, obj, klass)
+      return function.rb_class_of(obj) == function.const(JIT::Type::OBJECT, klass)
+    end
+
+    # Emit code for an opt_* instruction that calls +operator+ with
+    # +argc+ arguments.
+    #
+    # Yields the receiver, an Array of the arguments, a Proc, and a
+    # fallback label.  The block should emit the fast paths, each
+    # guarded on the types of the operands; a fast path passes its
+    # result to the Proc (which branches past the method call) or
+    # branches to the fallback label if it cannot compute the result.
+    # The block is not called if the fast paths cannot be guarded on
+    # the operator not having been redefined.
+    def ludicrous_compile_opt(function, env, operator, argc)
+      args = (1..argc).collect { env.stack.pop }
+      args.reverse!
+      recv = env.stack.pop
+
+      result = function.value(JIT::Type::OBJECT)
+      end_label = JIT::Label.new
+      fallback_label = JIT::Label.new
+
+      unredefined = ludicrous_basic_ops_unredefined(function)
+      if unredefined then
+        function.insn_branch_if_not(unredefined, fallback_label)
+        done = proc { |value|
+          result.store(value)
+          function.insn_branch(end_label)
+        }
+        yield recv, args, done, fallback_label
+      end
+
+      function.insn_label(fallback_label)
+      result.store(ludicrous_compile_opt_send(function, env, recv, operator, args))
+
+      function.insn_label(end_label)
+      env.stack.push(result)
+    end
+
+    # Emit code for an opt_* instruction with a receiver and one
+    # argument.
+    #
+    # Keyword arguments:
+    # * function - the JIT::Function being compiled
+    # * env - the Ludicrous::YarvEnvironment
+    # * operator - a Symbol with the name of the method
+    # * fixnum - a Proc that computes the result when both operands are
+    #   Fixnums; it is given the operands and a label to branch to if it
+    #   cannot
+    # * float - a Proc that computes the result when both operands are
+    #   Floats; it is given their values (as FLOAT64 JIT::Values)
+    # * classes - a Hash mapping a builtin class (String, etc.) to a Proc
+    #   that computes the result for a receiver of exactly that class,
+    #   given the same arguments as the fixnum Proc
+    # * stat - the name of the fast path recorded in the stats for classes
     def ludicrous_compile_binary_op(args)
       function = args[:function]
       env = args[:env]
-      operator = args[:operator]
-      fixnum_proc = args[:fixnum]
 
-      rhs = env.stack.pop
-      lhs = env.stack.pop
+      if args[:float] and env.options.unboxed_floats and
+         Ludicrous.float_operator?(args[:operator], 1) then
+        return ludicrous_compile_unboxed_float_op(args)
+      end
 
-      result = function.value(JIT::Type::OBJECT)
+      ludicrous_compile_opt(function, env, args[:operator], 1) do |lhs, rhs, done, fallback_label|
+        rhs = rhs[0]
 
-      end_label = JIT::Label.new
+        if args[:fixnum] then
+          Ludicrous::Stats.fast_path(:fixnum_operator)
+          function.if(lhs.is_fixnum & rhs.is_fixnum) {
+            done.call(args[:fixnum].call(lhs, rhs, fallback_label))
+          } .end
+        end
 
-      function.if(lhs.is_fixnum & rhs.is_fixnum) {
-        # TODO: This optimization is only valid if Fixnum#+ has not
-        # been redefined.  Fortunately, YARV gives us
-        # ruby_vm_redefined_flag, which we can check.
-        result.store(fixnum_proc.call(lhs, rhs))
-        function.insn_branch(end_label)
-      } .end
+        if args[:float] then
+          Ludicrous::Stats.fast_path(:float_operator)
+          is_float = lhs.is_type(Ludicrous::T_FLOAT)
+          function.if(is_float & rhs.is_type(Ludicrous::T_FLOAT)) {
+            done.call(args[:float].call(
+                Ludicrous::RFloat.wrap(lhs).value,
+                Ludicrous::RFloat.wrap(rhs).value))
+          } .end
+        end
 
-      set_source(function)
-      env.stack.sync_sp()
-      result.store(function.rb_funcall(lhs, operator, rhs))
+        (args[:classes] || {}).each do |klass, klass_proc|
+          Ludicrous::Stats.fast_path(args[:stat])
+          function.if(ludicrous_is_exact_class(function, lhs, klass)) {
+            done.call(klass_proc.call(lhs, rhs, fallback_label))
+          } .end
+        end
+      end
+    end
 
-      function.insn_label(end_label)
+    # Emit code for an opt_* instruction whose Float fast path leaves its
+    # result unboxed on the stack (see unboxed_float.rb).  Takes the same
+    # keyword arguments as ludicrous_compile_binary_op; the other fast
+    # paths are emitted on the path taken when the operands are not
+    # numbers the Float fast path can handle.
+    def ludicrous_compile_unboxed_float_op(args)
+      function = args[:function]
+      env = args[:env]
+      other_args = args.merge(:float => nil)
+
+      rhs = env.stack.pop_unboxed
+      lhs = env.stack.pop_unboxed
 
+      unredefined = ludicrous_basic_ops_unredefined(function)
+      if not unredefined then
+        env.stack.push(lhs)
+        env.stack.push(rhs)
+        ludicrous_compile_binary_op(other_args)
+        return
+      end
+
+      Ludicrous::Stats.fast_path(:float_operator)
+      result = function.float_operator(args[:operator], lhs, rhs, unredefined) do |l, r|
+        env.stack.push(l)
+        env.stack.push(r)
+        ludicrous_compile_binary_op(other_args)
+        env.stack.pop
+      end
       env.stack.push(result)
     end
 
+    # Emit code for an opt_* instruction with a receiver and no
+    # arguments.  Takes the same keyword arguments as
+    # ludicrous_compile_binary_op, except that the Procs are given only
+    # the receiver and the fallback label.
+    def ludicrous_compile_unary_op(args)
+      function = args[:function]
+      env = args[:env]
+
+      ludicrous_compile_opt(function, env, args[:operator], 0) do |operand, ignored, done, fallback_label|
+        if args[:fixnum] then
+          Ludicrous::Stats.fast_path(:fixnum_operator)
+          function.if(operand.is_fixnum) {
+            done.call(args[:fixnum].call(operand, fallback_label))
+          } .end
+        end
+
+        (args[:classes] || {}).each do |klass, klass_proc|
+          Ludicrous::Stats.fast_path(args[:stat])
+          function.if(ludicrous_is_exact_class(function, operand, klass)) {
+            done.call(klass_proc.call(operand, fallback_label))
+          } .end
+        end
+      end
+    end
+
     class OPT_PLUS
       def ludicrous_compile(function, env)
         ludicrous_compile_binary_op(
             :function => function,
             :env      => env,
             :operator => :+,
-            :fixnum   => proc { |lhs, rhs|
-              lhs + (rhs & function.const(JIT::Type::INT, ~1)) }
+            :fixnum   => proc { |lhs, rhs, fallback_label|
+              function.fixnum_operator(:+, lhs, [ rhs ], fallback_label) },
+            :float    => proc { |lhs, rhs|
+              function.rb_float_new(lhs + rhs) },
+            :classes  => {
+              ::String => proc { |lhs, rhs|
+                function.rb_str_plus(lhs, rhs) },
+            },
+            :stat     => :string_operator
             )
       end
     end
@@ -147,8 +312,69 @@ class RubyVM
             :function => function,
             :env      => env,
             :operator => :-,
+            :fixnum   => proc { |lhs, rhs, fallback_label|
+              function.fixnum_operator(:-, lhs, [ rhs ], fallback_label) },
+            :float    => proc { |lhs, rhs|
+              function.rb_float_new(lhs - rhs) }
+            )
+      end
+    end
+
+    class OPT_MULT
+      def ludicrous_compile(function, env)
+        ludicrous_compile_binary_op(
+            :function => function,
+            :env      => env,
+            :operator => :*,
+            :fixnum   => proc { |lhs, rhs, fallback_label|
+              function.fixnum_operator(:*, lhs, [ rhs ], fallback_label) },
+            :float    => proc { |lhs, rhs|
+              function.rb_float_new(lhs * rhs) }
+            )
+      end
+    end
+
+    class OPT_DIV
+      def ludicrous_compile(function, env)
+        ludicrous_compile_binary_op(
+            :function => function,
+            :env      => env,
+            :operator => :/,
+            :fixnum   => proc { |lhs, rhs, fallback_label|
+              function.fixnum_operator(:/, lhs, [ rhs ], fallback_label) },
+            :float    => proc { |lhs, rhs|
+              function.rb_float_new(lhs / rhs) }
+            )
+      end
+    end
+
+    class OPT_MOD
+      def ludicrous_compile(function, env)
+        ludicrous_compile_binary_op(
+            :function => function,
+            :env      => env,
+            :operator => :%,
+            :fixnum   => proc { |lhs, rhs, fallback_label|
+              function.fixnum_operator(:%, lhs, [ rhs ], fallback_label) }
+            )
+      end
+    end
+
+    class OPT_EQ
+      def ludicrous_compile(function, env)
+        ludicrous_compile_binary_op(
+            :function => function,
+            :env      => env,
+            :operator => :==,
             :fixnum   => proc { |lhs, rhs|
-              lhs - (rhs & function.const(JIT::Type::INT, ~1)) }
+              (lhs == rhs).to_rbool },
+            :float    => proc { |lhs, rhs|
+              (lhs == rhs).to_rbool },
+            :classes  => {
+              ::String => proc { |lhs, rhs|
+                function.rb_str_equal(lhs, rhs) },
+            },
+            :stat     => :string_operator
             )
       end
     end
@@ -160,38 +386,79 @@ class RubyVM
             :env      => env,
             :operator => :!=,
             :fixnum   => proc { |lhs, rhs|
-              lhs.neq(rhs).to_rbool }
+              lhs.neq(rhs).to_rbool },
+            :float    => proc { |lhs, rhs|
+              lhs.neq(rhs).to_rbool },
+            :classes  => {
+              ::String => proc { |lhs, rhs|
+                function.rb_str_equal(lhs, rhs).rnot },
+            },
+            :stat     => :string_operator
             )
       end
     end
 
-    def ludicrous_compile_unary_op(args)
-      function = args[:function]
-      env = args[:env]
-      operator = args[:operator]
-      fixnum_proc = args[:fixnum]
-
-      operand = env.stack.pop
-
-      result = function.value(JIT::Type::OBJECT)
+    # Emit code for a comparison instruction.
+    def ludicrous_compile_comparison(function, env, operator)
+      compare = proc { |lhs, rhs|
+        case operator
+        when :<  then lhs < rhs
+        when :<= then lhs <= rhs
+        when :>  then lhs > rhs
+        when :>= then lhs >= rhs
+        end
+      }
+
+      ludicrous_compile_binary_op(
+          :function => function,
+          :env      => env,
+          :operator => operator,
+          :fixnum   => proc { |lhs, rhs, fallback_label|
+            function.fixnum_operator(operator, lhs, [ rhs ], fallback_label) },
+          :float    => proc { |lhs, rhs|
+            compare.call(lhs, rhs).to_rbool }
+          )
+    end
 
-      end_label = JIT::Label.new
+    class OPT_LT
+      def ludicrous_compile(function, env)
+        ludicrous_compile_comparison(function, env, :<)
+      end
+    end
 
-      function.if(operand.is_fixnum) {
-        # TODO: This optimization is only valid if Fixnum#<operator> has
-        # not been redefined.  Fortunately, YARV gives us
-        # ruby_vm_redefined_flag, which we can check.
-        result.store(fixnum_proc.call(operand))
-        function.insn_branch(end_label)
-      } .end
+    class OPT_LE
+      def ludicrous_compile(function, env)
+        ludicrous_compile_comparison(function, env, :<=)
+      end
+    end
 
-      set_source(function)
-      env.stack.sync_sp()
-      result.store(function.rb_funcall(operand, operator))
+    class OPT_GT
+      def ludicrous_compile(function, env)
+        ludicrous_compile_comparison(function, env, :>)
+      end
+    end
 
-      function.insn_label(end_label)
+    class OPT_GE
+      def ludicrous_compile(function, env)
+        ludicrous_compile_comparison(function, env, :>=)
+      end
+    end
 
-      env.stack.push(result)
+    class OPT_LTLT
+      def ludicrous_compile(function, env)
+        ludicrous_compile_binary_op(
+            :function => function,
+            :env      => env,
+            :operator => :<<,
+            :classes  => {
+              ::String => proc { |lhs, rhs|
+                function.rb_str_concat(lhs, rhs) },
+              ::Array => proc { |lhs, rhs|
+                function.rb_ary_push(lhs, rhs) },
+            },
+            :stat     => :array_string_append
+            )
+      end
     end
 
     class OPT_NOT
@@ -203,11 +470,81 @@ class RubyVM
 
     class OPT_AREF
       def ludicrous_compile(function, env)
-        obj = env.stack.pop
-        recv = env.stack.pop
+        ludicrous_compile_binary_op(
+            :function => function,
+            :env      => env,
+            :operator => :[],
+            :classes  => {
+              ::Array => proc { |recv, idx, fallback_label|
+                function.insn_branch_if_not(idx.is_fixnum, fallback_label)
+                function.rb_ary_entry(recv, function.fix2native(idx)) },
+              ::Hash => proc { |recv, key|
+                function.rb_hash_aref(recv, key) },
+            },
+            :stat     => :array_hash_aref
+            )
+      end
+    end
 
-        result = function.rb_funcall(recv, :[], obj)
-        env.stack.push(result)
+    class OPT_ASET
+      def ludicrous_compile(function, env)
+        ludicrous_compile_opt(function, env, :[]=, 2) do |recv, args, done, fallback_label|
+          key, value = args
+          Ludicrous::Stats.fast_path(:array_hash_aset)
+
+          # rb_ary_store rather than a store into the array's buffer, since
+          # the array may be frozen or share its buffer with another
+          function.if(ludicrous_is_exact_class(function, recv, ::Array)) {
+            function.insn_branch_if_not(key.is_fixnum, fallback_label)
+            function.rb_ary_store(recv, function.fix2native(key), value)
+            done.call(value)
+          } .end
+
+          function.if(ludicrous_is_exact_class(function, recv, ::Hash)) {
+            function.rb_hash_aset(recv, key, value)
+            done.call(value)
+          } .end
+        end
+      end
+    end
+
+    # Emit code for opt_length or opt_size.
+    def ludicrous_compile_length(function, env, operator)
+      ludicrous_compile_unary_op(
+          :function => function,
+          :env      => env,
+          :operator => operator,
+          :classes  => {
+            ::String => proc { |str|
+              function.rb_str_length(str) },
+            ::Array => proc { |ary|
+              Ludicrous::RArray.wrap(ary).len.int2fix },
+          },
+          :stat     => :array_string_length
+          )
+    end
+
+    class OPT_LENGTH
+      def ludicrous_compile(function, env)
+        ludicrous_compile_length(function, env, :length)
+      end
+    end
+
+    class OPT_SIZE
+      def ludicrous_compile(function, env)
+        ludicrous_compile_length(function, env, :size)
+      end
+    end
+
+    class OPT_SUCC
+      def ludicrous_compile(function, env)
+        ludicrous_compile_unary_op(
+            :function => function,
+            :env      => env,
+            :operator => :succ,
+            :fixnum   => proc { |operand, fallback_label|
+              function.fixnum_operator(:succ, operand, [], fallback_label) }
+            )
       end
     end
 
@@ -402,7 +739,7 @@ class RubyVM
         function.if(klass == function.const(JIT::Type::OBJECT, nil)) {
           result.store(env.get_constant(vid))
         }.else {
-          result.store(function.rb_const_get(klass, vid))
+          result.store(env.get_constant_from(klass, vid))
         }.end
 
         env.stack.push(result)
@@ -413,6 +750,7 @@ class RubyVM
       def ludicrous_compile(function, env)
         relative_offset = @operands[0]
         env.branch_relative(relative_offset)
+        env.stack.mark_unreachable
       end
     end
 
@@ -455,6 +793,7 @@ class RubyVM
         result = yield(f, inner_env, iter_arg.recv)
         f.insn_return result
       end
+      Ludicrous::PerfMap.closure_compiled(iter_f, env, "iter")
 
       body_signature = JIT::Type::create_signature(
           JIT::ABI::CDECL,
@@ -476,6 +815,7 @@ class RubyVM
           body.ludicrous_compile(f, inner_env)
         }
       end
+      Ludicrous::PerfMap.closure_compiled(body_f, env, "block")
 
       iter_arg = Ludicrous::IterArg.new(function, env, recv)
 
@@ -518,10 +858,9 @@ class RubyVM
           i = body.argc - 1
           idx = function.const(:INT, i)
           function.if(idx < array.len) {
-            # TODO: not 64-bit safe
             ary = function.rb_ary_new4(
                 array.len - i,
-                array.ptr + (i << 2))
+                function.value_elem_address(array.ptr, i))
             value.store(ary.avalue_splat)
           }.else {
             value.store(function.const(:OBJECT, nil))
@@ -531,6 +870,152 @@ class RubyVM
       }.end
     end
 
+    # Returns true if the block +blockiseq+ can be compiled into the
+    # calling function.
+    def ludicrous_inlineable_block?(blockiseq)
+      # break (and return) leave the block with a throw, which needs the
+      # block to have a frame of its own
+      return false if blockiseq.catch_table.size > 0
+      return false if blockiseq.entries.any? { |i| THROW === i }
+
+      return false if not blockiseq.arg_simple
+      return true
+    end
+
+    # Returns true if a call to +mid+ with +argc+ arguments and the
+    # block +blockiseq+ can have its loop emitted inline (see
+    # JIT::Function#inline_iterate).
+    def ludicrous_inline_iterator?(mid, argc, blockiseq)
+      return false if not Ludicrous.inline_iterator?(mid, argc)
+      return ludicrous_inlineable_block?(blockiseq)
+    end
+
+    # Returns true if a call to +mid+ with +argc+ arguments and the
+    # block +blockiseq+ can be emitted as a counted loop (see
+    # JIT::Function#counted_loop).
+    def ludicrous_counted_iterator?(mid, argc, blockiseq)
+      return false if not Ludicrous.counted_iterator?(mid, argc)
+      return ludicrous_inlineable_block?(blockiseq)
+    end
+
+    # Emit the loop for a call to an Integer iterator as a loop over a
+    # native integer counter, with the block compiled into this
+    # function, guarded on the receiver and arguments being Fixnums.  If
+    # the guard fails, the iterator is called normally.
+    def ludicrous_counted_iterate(function, env, blockiseq, recv, mid, args)
+      result = function.value(JIT::Type::OBJECT)
+      fallback_label = JIT::Label.new
+      done_label = JIT::Label.new
+
+      first, last, step, exclusive, direction =
+        function.counted_iterator_bounds(recv, mid, args, fallback_label)
+
+      Ludicrous::Stats.fast_path(:counted_loop)
+      completed = function.counted_loop(
+          env, first, last, step, exclusive, direction) { |index, loop|
+        block_env = Ludicrous::YarvInlineBlockEnvironment.new(
+            function, env.options, env.cbase, env.scope, blockiseq)
+        if blockiseq.argc > 0 then
+          ludicrous_inline_block_arg_assign(
+              function, block_env, blockiseq, [ index.call ])
+        end
+        block_env.compile_block
+      }
+
+      # The iterator returns its receiver, unless the loop ended with a
+      # break
+      result.store(function.const(JIT::Type::OBJECT, nil))
+      function.if(completed) {
+        result.store(recv)
+      }.end
+      function.insn_branch(done_label)
+
+      function.insn_label(fallback_label)
+      result.store(ludicrous_iterate_call(
+          function, env, blockiseq, recv, mid, args))
+
+      function.insn_label(done_label)
+      return result
+    end
+
+    # Emit the loop for a call to an iterator inline, with the block
+    # compiled into this function, guarded on the type of the receiver.
+    # If the guard fails, the iterator is called normally.
+    def ludicrous_inline_iterate(function, env, blockiseq, recv, mid, args)
+      result = function.value(JIT::Type::OBJECT)
+      fallback_label = JIT::Label.new
+      done_label = JIT::Label.new
+
+      array = function.inline_iterator_guard(recv, mid, fallback_label)
+
+      Ludicrous::Stats.fast_path(:inline_iterator)
+      v = function.inline_iterate(env, recv, array, mid, args) { |values, loop|
+        block_env = Ludicrous::YarvInlineBlockEnvironment.new(
+            function, env.options, env.cbase, env.scope, blockiseq)
+        ludicrous_inline_block_arg_assign(function, block_env, blockiseq, values)
+        block_env.compile_block
+      }
+      result.store(v)
+      function.insn_branch(done_label)
+
+      function.insn_label(fallback_label)
+      result.store(ludicrous_iterate_call(
+          function, env, blockiseq, recv, mid, args))
+
+      function.insn_label(done_label)
+      return result
+    end
+
+    # Emit a call to the iterator +mid+ through rb_iterate, for when the
+    # guard on an inline loop fails.
+    def ludicrous_iterate_call(function, env, blockiseq, recv, mid, args)
+      if args.size == 0 then
+        return ludicrous_iterate(function, env, blockiseq, recv) do |f, e, r|
+          f.rb_funcall(r, mid)
+        end
+      end
+
+      # The iter function can't use this function's values, so pass the
+      # arguments along with the receiver
+      iter_recv = function.rb_ary_new3(1 + args.size, recv, *args)
+      return ludicrous_iterate(function, env, blockiseq, iter_recv) do |f, e, r|
+        inner_args = (1..args.size).map { |i|
+          f.rb_ary_entry(r, f.const(JIT::Type::NINT, i))
+        }
+        inner_recv = f.rb_ary_entry(r, f.const(JIT::Type::NINT, 0))
+        f.rb_funcall(inner_recv, mid, *inner_args)
+      end
+    end
+
+    # Assign the values yielded by an inline iterator to the block's
+    # parameters.
+    def ludicrous_inline_block_arg_assign(function, env, body, values)
+      return if body.argc == 0
+
+      if values.size == 1 then
+        value = values[0]
+        if body.argc == 1 then
+          env.scope.dyn_set(body.local_table[0], value)
+          return
+        end
+
+        rhs = function.value(JIT::Type::OBJECT)
+        function.if(value.is_type(Ludicrous::T_ARRAY)) {
+          rhs.store(value)
+        }.else {
+          rhs.store(function.rb_ary_new3(1, value))
+        }.end
+      else
+        rhs = function.rb_ary_new3(values.size, *values)
+        if body.argc == 1 then
+          env.scope.dyn_set(body.local_table[0], rhs)
+          return
+        end
+      end
+
+      ludicrous_iter_arg_assign(function, env, body, rhs)
+    end
+
     class SEND
       def ludicrous_compile(function, env)
         mid = @operands[0]
@@ -565,12 +1050,18 @@ class RubyVM
         # TODO: pull in optimizations from eval_nodes.rb
         env.stack.sync_sp()
 
-        if blockiseq then
-          result = ludicrous_iterate(function, env, blockiseq, recv) do |f, e, r|
-            # TODO: args is still referencing the outer function
-            f.rb_funcall(r, mid, *args)
-          end
+        if blockiseq and ludicrous_counted_iterator?(mid, argc, blockiseq) then
+          result = ludicrous_counted_iterate(
+              function, env, blockiseq, recv, mid, args)
+        elsif blockiseq and ludicrous_inline_iterator?(mid, argc, blockiseq) then
+          result = ludicrous_inline_iterate(
+              function, env, blockiseq, recv, mid, args)
+        elsif blockiseq then
+          Ludicrous::Stats.fallback("call with a block")
+          result = ludicrous_iterate_call(
+              function, env, blockiseq, recv, mid, args)
         else
+          Ludicrous::Stats.fallback("call cache not available on YARV")
           result = function.rb_funcall(recv, mid, *args)
           # TODO: not sure why this was here, maybe I was trying to
           # prevent a crash
@@ -599,19 +1090,50 @@ class RubyVM
         else
           raise "Cannot handle tag #{state}"
         end
+
+        env.stack.mark_unreachable
       end
     end
 
     class GETINLINECACHE
       def ludicrous_compile(function, env)
-        # ignore, for now
-        env.stack.push(function.const(JIT::Type::OBJECT, nil))
+        if not env.options.const_cache then
+          env.stack.push(function.const(JIT::Type::OBJECT, nil))
+          return
+        end
+
+        relative_offset = @operands[0]
+        Ludicrous::Stats.fast_path(:const_cache)
+        cache_ptr = function.const_cache_ptr(Ludicrous::ConstCache.new(nil))
+        nil_value = function.const(JIT::Type::OBJECT, nil)
+
+        # The value pushed is the cached value on a hit, and nil (the
+        # class for the getconstant that follows) on a miss;
+        # setinlinecache stores the result of the lookup back into it,
+        # so both paths leave the same value on the stack
+        result = function.value(JIT::Type::OBJECT)
+        result.store(nil_value)
+        valid = function.const_cache_valid(cache_ptr, nil_value)
+        function.if(valid) {
+          result.store(function.const_cache_value(cache_ptr))
+        } .end
+
+        env.stack.push(result)
+        env.inline_cache = [ cache_ptr, result ]
+        env.branch_relative_if(valid, relative_offset)
       end
     end
 
     class SETINLINECACHE
       def ludicrous_compile(function, env)
-        # ignore, for now
+        return if not env.inline_cache
+
+        cache_ptr, result = env.inline_cache
+        value = env.stack.pop
+        function.ludicrous_const_cache_set(cache_ptr, value)
+        result.store(value)
+        env.stack.push(result)
+        env.inline_cache = nil
       end
     end
 
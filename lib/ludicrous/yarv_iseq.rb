@@ -124,6 +124,46 @@ class RubyVM
       end
     end
 
+    # Returns true if a block made from the scope of this instruction
+    # sequence might outlive its frame, in which case its variables must
+    # live on the heap; false if they can live in the frame (see
+    # Ludicrous::StackScope).  Blocks that are compiled inline only
+    # need a closure if the guard fails.
+    def ludicrous_scope_escapes
+      self.each do |instruction|
+        next if not RubyVM::Instruction::SEND === instruction
+        mid, argc, blockiseq = instruction.operands[0..2]
+        next if not blockiseq
+        if not instruction.ludicrous_counted_iterator?(mid, argc, blockiseq) and
+           not instruction.ludicrous_inline_iterator?(mid, argc, blockiseq) then
+          return true
+        end
+        return true if blockiseq.ludicrous_scope_escapes
+      end
+      return false
+    end
+
+    # Returns an Array of Symbol with the names of the local variables of
+    # every block (and rescue clause) nested in this instruction
+    # sequence, at any depth, so they can be given slots in the
+    # method's scope instead of going through the dynavars hash.
+    def ludicrous_block_local_names
+      names = []
+      inner = []
+      self.each do |instruction|
+        next if not RubyVM::Instruction::SEND === instruction
+        inner << instruction.operands[2] if instruction.operands[2]
+      end
+      self.catch_table.each do |catch_entry|
+        inner << catch_entry.iseq if catch_entry.iseq
+      end
+      inner.each do |iseq|
+        names.concat(iseq.local_table)
+        names.concat(iseq.ludicrous_block_local_names)
+      end
+      return names
+    end
+
     def ludicrous_compile_body(function, env)
       self.each do |instruction|
         ludicrous_compile_next_instruction(function, env, instruction)
@@ -0,0 +1,305 @@
+# benchmark_suite.rb
+#
+# Runs each workload both interpreted and JIT-compiled and reports,
+# separately:
+#
+# * compile_time - the time it took to compile the workload's method
+# (zero when interpreted)
+# * first_call - the time taken by the first call to the method
+# * steady_state - the median time taken by one run of the workload
+# after the first call
+# * allocations - the number of objects allocated by one call to the
+# method (reported, but not compared to the baseline)
+#
+# Each workload runs in its own ruby process for each mode, so that
+# compiling one workload does not affect another.
+#
+# Usage:
+#
+#   ruby benchmark_suite.rb [--test=a,b] [--skip=a,b] [--factor=n]
+#     [--runs=n] [--json] [--save-baseline=file]
+#     [--baseline=file] [--margin=percent]
+#
+# With --baseline, the suite exits with a nonzero status if any result
+# is slower than the same result in the baseline by more than the
+# margin (10% by default).  Results that took less than MIN_GATED_TIME
+# seconds in the baseline are too noisy to compare and are skipped.
+
+require "benchmark"
+require "getoptlong"
+
+begin
+  require 'rubygems'
+rescue LoadError
+end
+require 'json'
+
+SAMPLE_DIR = File.expand_path(File.dirname(__FILE__))
+LIB_DIR = File.expand_path(File.join(SAMPLE_DIR, '..', 'lib'))
+EXT_DIR = File.expand_path(File.join(SAMPLE_DIR, '..', 'ext'))
+
+MODES = [ 'interpreted', 'jit' ]
+METRICS = [ 'compile_time', 'first_call', 'steady_state' ]
+MIN_GATED_TIME = 0.01
+
+# name => [ description, method, iterations per run, compile options ]
+WORKLOADS = {
+  'ack'             => [ "Ackermann function",     :ack,                   300000 ],
+  'fib'             => [ "Fibonacci numbers",      :fib,                   30 ],
+  'sieve'           => [ "Sieve of Eratosthenes",  :sieve_of_eratosthenes, 10 ],
+  'hash'            => [ "Hash access",            :hash_access_I,         10000 ],
+  'lists'           => [ "Lists",                  :lists,                 30 ],
+  'nested_loop'     => [ "Nested loop",            :nested_loop,           5 ],
+  'string_building' => [ "String building",        :string_building,       100 ],
+  'iterator_block'  => [ "Iterator with a block",  :iterator_block,        100 ],
+  'user_iterator'   => [ "User-defined iterator",  :user_iterator,         100 ],
+  'splat_iterator'  => [ "Splat yield iterator",   :splat_iterator,        100 ],
+  'exception_heavy' => [ "Exception-heavy code",   :exception_heavy,       50 ],
+  'ivar'            => [ "Ivar access",            :ivar_access,           100 ],
+  'ivar_uncached'   => [ "Ivar access (no cache)", :ivar_access,           100,
+                         { :ivar_cache => false } ],
+}
+
+# name => methods the workload calls that are compiled along with it
+HELPERS = {
+  'user_iterator' => [ :each_adjacent_pair ],
+  'splat_iterator' => [ :each_entry_splat ],
+}
+
+def ruby_executable
+  config = defined?(RbConfig) ? RbConfig : Config
+  return File.join(
+      config::CONFIG['bindir'],
+      config::CONFIG['ruby_install_name'] + config::CONFIG['EXEEXT'])
+end
+
+def median(times)
+  sorted = times.sort
+  return sorted[sorted.size / 2]
+end
+
+def live_objects
+  if ObjectSpace.respond_to?(:count_objects) then
+    counts = ObjectSpace.count_objects
+    return counts[:TOTAL] - counts[:FREE]
+  else
+    return ObjectSpace.each_object { }
+  end
+end
+
+# Returns the number of objects allocated by one call to the method.
+def allocations_per_call(method_name)
+  GC.start
+  GC.disable
+  begin
+    before = live_objects
+    send(method_name)
+    return live_objects - before
+  ensure
+    GC.enable
+  end
+end
+
+# Run a single workload in this process and print the results as JSON.
+def run_worker(name, mode, factor, runs)
+  $: << SAMPLE_DIR
+  require "gcls"
+  require "benchmark_workloads"
+
+  description, method_name, iterations, options = WORKLOADS[name]
+  iterations *= factor
+
+  compile_time = 0.0
+  if mode == 'jit' then
+    require "ludicrous"
+    if options then
+      Object.const_set(:LUDICROUS_OPTIONS, Ludicrous::CompileOptions.new(options))
+    end
+    compile_time = Benchmark.realtime {
+      ([ method_name ] + (HELPERS[name] || [])).each do |m|
+        method = Object.instance_method(m)
+        Ludicrous::JITCompiled.jit_precompile_method(Object, m, method)
+      end
+    }
+  end
+
+  first_call = Benchmark.realtime { send(method_name) }
+  allocations = allocations_per_call(method_name)
+
+  times = (1..runs).map do
+    GC.start
+    Benchmark.realtime { iterations.times { send(method_name) } }
+  end
+
+  puts JSON.generate({
+    'compile_time' => compile_time,
+    'first_call' => first_call,
+    'steady_state' => median(times),
+    'allocations' => allocations,
+    'iterations' => iterations,
+  })
+end
+
+# Run a workload in a new ruby process and return its results.
+def run_workload(name, mode, factor, runs)
+  command = [
+    ruby_executable,
+    "-I#{LIB_DIR}",
+    "-I#{EXT_DIR}",
+    __FILE__,
+    "--worker=#{name}",
+    "--mode=#{mode}",
+    "--factor=#{factor}",
+    "--runs=#{runs}" ].join(' ')
+  output = IO.popen(command) { |io| io.read }
+  if not $?.success? then
+    return { 'error' => "worker exited with status #{$?.exitstatus}" }
+  end
+  return JSON.parse(output.split("\n")[-1])
+end
+
+# Compare results to a baseline and return a list of regressions.
+def regressions(results, baseline, margin)
+  found = []
+  results.each do |name, modes|
+    next if not baseline[name]
+    modes.each do |mode, result|
+      old = baseline[name][mode]
+      next if not Hash === old or not Hash === result
+      if result['error'] and not old['error'] then
+        found << "#{name} #{mode}: #{result['error']}"
+        next
+      end
+      METRICS.each do |metric|
+        next if not old[metric] or not result[metric]
+        next if old[metric] < MIN_GATED_TIME
+        if result[metric] > old[metric] * (1.0 + margin / 100.0) then
+          found << "#{name} #{mode} #{metric}: %.4fs (baseline %.4fs)" % [
+            result[metric], old[metric] ]
+        end
+      end
+    end
+  end
+  return found
+end
+
+def print_results(results)
+  width = WORKLOADS.values.map { |w| w[0].length }.max
+  puts "%-#{width}s  %-11s  %10s  %10s  %12s  %11s" % [
+    '', 'mode', 'compile', 'first call', 'steady state', 'allocs/call' ]
+  results.sort.each do |name, modes|
+    MODES.each do |mode|
+      result = modes[mode] or next
+      if result['error'] then
+        puts "%-#{width}s  %-11s  #{result['error']}" % [ WORKLOADS[name][0], mode ]
+      else
+        puts "%-#{width}s  %-11s  %10.4f  %10.4f  %12.4f  %11s" % [
+          WORKLOADS[name][0], mode,
+          result['compile_time'], result['first_call'], result['steady_state'],
+          result['allocations'] ]
+      end
+    end
+  end
+end
+
+opts = GetoptLong.new(*[
+    [ '--test', GetoptLong::REQUIRED_ARGUMENT ],
+    [ '--skip', GetoptLong::REQUIRED_ARGUMENT ],
+    [ '--factor', GetoptLong::REQUIRED_ARGUMENT ],
+    [ '--runs', GetoptLong::REQUIRED_ARGUMENT ],
+    [ '--json', GetoptLong::NO_ARGUMENT ],
+    [ '--save-baseline', GetoptLong::REQUIRED_ARGUMENT ],
+    [ '--baseline', GetoptLong::REQUIRED_ARGUMENT ],
+    [ '--margin', GetoptLong::REQUIRED_ARGUMENT ],
+    [ '--worker', GetoptLong::REQUIRED_ARGUMENT ],
+    [ '--mode', GetoptLong::REQUIRED_ARGUMENT ],
+])
+
+tests = WORKLOADS.keys
+factor = 1
+runs = 5
+json = false
+save_baseline = nil
+baseline = nil
+margin = 10.0
+worker = nil
+mode = nil
+
+opts.each do |opt, arg|
+  case opt
+  when '--test', '--skip'
+    test_names = arg.split(',')
+    test_names.each do |test_name|
+      if not WORKLOADS.include?(test_name) then
+        $stderr.puts "No such test #{test_name}"
+        exit 1
+      end
+    end
+    if opt == '--test' then
+      tests = tests & test_names
+    else
+      tests = tests - test_names
+    end
+  when '--factor'
+    factor = Integer(arg)
+  when '--runs'
+    runs = Integer(arg)
+  when '--json'
+    json = true
+  when '--save-baseline'
+    save_baseline = arg
+  when '--baseline'
+    baseline = arg
+  when '--margin'
+    margin = Float(arg)
+  when '--worker'
+    worker = arg
+  when '--mode'
+    mode = arg
+  end
+end
+
+if worker then
+  run_worker(worker, mode, factor, runs)
+  exit 0
+end
+
+if tests.size == 0 then
+  $stderr.puts "No matching tests found"
+  exit 1
+end
+
+results = {}
+tests.sort.each do |name|
+  results[name] = {}
+  MODES.each do |m|
+    results[name][m] = run_workload(name, m, factor, runs)
+  end
+end
+
+report = {
+  'ruby_version' => RUBY_VERSION,
+  'factor' => factor,
+  'runs' => runs,
+  'results' => results,
+}
+
+if json then
+  puts JSON.generate(report)
+else
+  print_results(results)
+end
+
+if save_baseline then
+  File.open(save_baseline, 'w') { |io| io.puts JSON.generate(report) }
+end
+
+if baseline then
+  old = JSON.parse(File.read(baseline))
+  found = regressions(results, old['results'] || {}, margin)
+  if found.size > 0 then
+    $stderr.puts "Regressions (more than #{margin}% slower than #{baseline}):"
+    found.each { |r| $stderr.puts "  #{r}" }
+    exit 1
+  end
+end
@@ -0,0 +1,96 @@
+# benchmark_workloads.rb
+# Workloads for benchmark_suite.rb that are not in gcls.rb
+
+# String building
+def string_building(n=1000)
+   s = ""
+   for i in 0...n
+      s << "item " << i.to_s << ", "
+   end
+   t = ""
+   n.times do |i|
+      t = t + "x"
+   end
+   return s.length + t.length
+end
+
+# Iterator with a block
+def iterator_block(n=1000)
+   sum = 0
+   a = (1..n).to_a
+   a.each do |x|
+      sum += x
+   end
+   a.each_with_index do |x, i|
+      sum += i
+   end
+   n.times do |i|
+      sum -= i
+   end
+   return sum
+end
+
+# Exception-heavy code
+def exception_heavy(n=200)
+   caught = 0
+   n.times do
+      begin
+         raise ArgumentError, "bad"
+      rescue ArgumentError
+         caught += 1
+      ensure
+         caught += 1
+      end
+   end
+   return caught
+end
+
+# Instance variable access
+def ivar_access(n=10000)
+   @ivar_count = 0
+   @ivar_sum = 0
+   i = 0
+   while i < n
+      @ivar_count = @ivar_count + 1
+      @ivar_sum = @ivar_sum + @ivar_count
+      i += 1
+   end
+   return @ivar_sum
+end
+
+# A user-defined iterator, called with a block that takes several
+# arguments
+def each_adjacent_pair(a)
+   i = 0
+   while i < a.size - 1
+      yield a[i], a[i + 1]
+      i += 1
+   end
+end
+
+def user_iterator(n=100)
+   a = (1..n).to_a
+   sum = 0
+   each_adjacent_pair(a) { |x, y| sum += x * y }
+   each_adjacent_pair(a) { |x, y| sum -= x }
+   return sum
+end
+
+# A user-defined iterator that splats each entry into the values it
+# yields, called with blocks that take several arguments
+SPLAT_ENTRIES = (1..100).map { |i| [ i, i * 2 ] }
+
+def each_entry_splat(entries)
+   i = 0
+   while i < entries.size
+      yield(*entries[i])
+      i += 1
+   end
+end
+
+def splat_iterator
+   sum = 0
+   each_entry_splat(SPLAT_ENTRIES) { |k, v| sum += k * v }
+   each_entry_splat(SPLAT_ENTRIES) { |k, *rest| sum -= rest.size }
+   return sum
+end
@@ -45,6 +45,9 @@ end
 if use_jit then
   require 'ludicrous'
 
+  # Compile each method the first time it is called
+  Ludicrous::CompileOptions::DEFAULTS[:compile_threshold] = 1
+
   require 'logger'
   Ludicrous.logger = Logger.new(STDERR)
 end
@@ -2,6 +2,9 @@ require 'jit'
 require 'ludicrous'
 require 'test/unit/autorunner'
 
+# Compile each method the first time it is called
+Ludicrous::CompileOptions::DEFAULTS[:compile_threshold] = 1
+
 RUBY_SOURCE_DIR='/home/cout/download/ruby/ruby-1.8.6/test/ruby'
 
 exclude_files = [
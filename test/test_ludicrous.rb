@@ -1,8 +1,16 @@
 require 'test/unit'
 require 'ludicrous'
 
+# Compile methods with stubs on their first call, so the tests exercise
+# the compiled code
+Ludicrous::CompileOptions::DEFAULTS[:compile_threshold] = 1
+
 BAR = 42
 
+module ConstCacheTest
+  VALUE = 1
+end
+
 class TestLudicrous < Test::Unit::TestCase
   def compile_and_run(obj, method, *args)
     m = obj.method(method)
@@ -372,9 +380,204 @@ class TestLudicrous < Test::Unit::TestCase
     assert_equal(42, result)
   end
 
+  def test_rescue_else_ensure
+    foo = Class.new do
+      def foo(n)
+        r = []
+        i = 0
+        while i < n do
+          begin
+            raise ArgumentError if i % 3 == 1
+            raise TypeError if i % 3 == 2
+          rescue TypeError
+            r << [ i, :type_error ]
+          rescue ArgumentError => e
+            r << [ i, e.class ]
+          else
+            r << [ i, :else ]
+          ensure
+            r << [ i, :ensure ]
+          end
+          i += 1
+        end
+        return r
+      end
+    end
+    expected = [
+      [ 0, :else ], [ 0, :ensure ],
+      [ 1, ArgumentError ], [ 1, :ensure ],
+      [ 2, :type_error ], [ 2, :ensure ],
+      [ 3, :else ], [ 3, :ensure ] ]
+    result = compile_and_run(foo.new, :foo, 4)
+    assert_equal(expected, result)
+  end
+
+  def test_retry_runs_body_again
+    foo = Class.new do
+      def foo(n)
+        tries = 0
+        log = []
+        begin
+          tries += 1
+          raise "try #{tries}" if tries < n
+          log << :done
+        rescue
+          log << $!.message
+          retry
+        ensure
+          log << :ensure
+        end
+        return [ tries, log ]
+      end
+    end
+    expected = [ 3, [ "try 1", "try 2", :done, :ensure ] ]
+    assert_equal expected, compile_and_run(foo.new, :foo, 3)
+  end
+
+  def test_return_inside_ensure
+    foo = Class.new do
+      def foo
+        begin
+          raise "FOO"
+        ensure
+          return 42
+        end
+      end
+
+      def bar(r)
+        begin
+          return 1
+        ensure
+          r << :ensure
+        end
+        r << :not_reached
+      end
+    end
+    assert_equal 42, compile_and_run(foo.new, :foo)
+    r = []
+    assert_equal 1, compile_and_run(foo.new, :bar, r)
+    assert_equal [ :ensure ], r
+  end
+
+  def call_with_returning_proc(o, method, r)
+    o.__send__(method, proc { return 42 }, r)
+    r << :not_reached
+    return 0
+  end
+
+  def test_proc_return_passes_through_begin_block
+    c = Class.new do
+      def with_ensure(pr, r)
+        begin
+          pr.call
+        ensure
+          r << :ensure
+        end
+        r << :not_reached
+      end
+
+      def with_rescue(pr, r)
+        begin
+          pr.call
+        rescue
+          r << :rescue
+        end
+        r << :not_reached
+      end
+
+      go_plaid
+    end
+
+    o = c.new
+    r = []
+    assert_equal 42, call_with_returning_proc(o, :with_ensure, r)
+    assert_equal [ :ensure ], r
+    r = []
+    assert_equal 42, call_with_returning_proc(o, :with_rescue, r)
+    assert_equal [ ], r
+  end
+
+  def test_rescue_restores_errinfo
+    foo = Class.new do
+      def foo
+        r = []
+        begin
+          raise "outer"
+        rescue
+          begin
+            raise "inner"
+          rescue
+          end
+          r << $!.message
+        end
+        r << $!
+        return r
+      end
+
+      def bar
+        begin
+          begin
+            raise "raised"
+          ensure
+            begin
+              raise "in ensure"
+            rescue
+            end
+          end
+        rescue
+          return $!.message
+        end
+      end
+    end
+    assert_equal [ "outer", nil ], compile_and_run(foo.new, :foo)
+    assert_equal "raised", compile_and_run(foo.new, :bar)
+  end
+
+  def test_unmatched_exception_is_raised_again
+    foo = Class.new do
+      def foo(exc)
+        r = []
+        begin
+          begin
+            raise exc
+          rescue ArgumentError, NameError
+            r << :inner
+          ensure
+            r << :ensure
+          end
+        rescue TypeError
+          r << :outer
+        end
+        return r
+      end
+    end
+    assert_equal [ :inner, :ensure ], compile_and_run(foo.new, :foo, NameError)
+    assert_equal [ :ensure, :outer ], compile_and_run(foo.new, :foo, TypeError)
+    assert_raises(IndexError) { compile_and_run(foo.new, :foo, IndexError) }
+  end
+
+  def test_rescue_matcher_returning_nil
+    foo = Class.new do
+      def foo(matcher)
+        begin
+          raise "FOO"
+        rescue matcher
+          return :rescued
+        end
+      end
+    end
+    nil_matcher = Module.new
+    def nil_matcher.===(exc); return nil; end
+    zero_matcher = Module.new
+    def zero_matcher.===(exc); return 0; end
+    assert_raises(RuntimeError) { compile_and_run(foo.new, :foo, nil_matcher) }
+    assert_equal :rescued, compile_and_run(foo.new, :foo, zero_matcher)
+  end
+
 =begin
-  This doesn't work on YARV (syntax error), and retry is unimplemented
-  on 1.8.
+  This doesn't work on YARV (syntax error).  On 1.8, retry is only
+  compiled inside a rescue clause; the iterators Ludicrous inlines do
+  not restart for a retry in their block.
 
   def test_retry_in_iterator
     foo = Class.new do
@@ -835,6 +1038,1031 @@ class TestLudicrous < Test::Unit::TestCase
 
     compile_and_run(c.new, :foo, StandardError.new)
   end
+
+  def test_call_cache_hits
+    c = Class.new do
+      # Fixnum#abs has a fast path, so call a method that doesn't
+      def foo(x)
+        return x.to_s
+      end
+    end
+
+    o = c.new
+    f = o.method(:foo).ludicrous_compile
+    Ludicrous::CallCache.reset_totals
+    3.times { assert_equal "-42", f.apply(o, -42) }
+    stats = Ludicrous::CallCache.stats
+    if not defined?(RubyVM) then
+      assert_equal 2, stats[:hits]
+      assert_equal 1, stats[:misses]
+      assert_equal 0, stats[:slow_calls]
+    else
+      # Cached sends aren't emitted on YARV
+      assert_equal 0, stats[:misses]
+      assert_equal 0, stats[:slow_calls]
+    end
+  end
+
+  def test_call_cache_invalidated_by_method_added
+    a = Class.new(Array)
+    c = Class.new do
+      def foo(ary)
+        return ary.length
+      end
+    end
+
+    o = c.new
+    ary = a.new
+    f = o.method(:foo).ludicrous_compile
+    assert_equal 0, f.apply(o, ary)
+
+    a.class_eval do
+      def length
+        return 42
+      end
+    end
+    assert_equal 42, f.apply(o, ary)
+  end
+
+  def test_call_cache_hook_keeps_visibility
+    c = Class.new do
+      @added = []
+
+      def self.method_added(name)
+        @added << name
+      end
+
+      class << self
+        attr_reader :added
+      end
+    end
+
+    c.class_eval do
+      def foo
+      end
+    end
+
+    assert_equal [ :foo ], c.added
+
+    # The hook was public, so it still is once wrapped
+    c.method_added(:bar)
+    assert_equal [ :foo, :bar ], c.added
+  end
+
+  def test_direct_recursive_call
+    c = Class.new do
+      def fib(n)
+        if n < 2 then
+          return n
+        else
+          return fib(n - 1) + fib(n - 2)
+        end
+      end
+
+      go_plaid
+    end
+
+    assert_equal 55, c.new.fib(10)
+    if not defined?(RubyVM) then
+      target = Ludicrous::DirectCall.targets[[c, :fib]]
+      assert_not_nil target
+      assert_equal 1, target.arity
+    end
+  end
+
+  def test_stub_waits_for_compile_threshold
+    c = Class.new do
+      const_set(
+          :LUDICROUS_OPTIONS,
+          Ludicrous::CompileOptions.new(:compile_threshold => 3))
+
+      def foo
+        return 42
+      end
+
+      go_plaid
+    end
+
+    o = c.new
+    2.times { assert_equal 42, o.foo }
+    assert_equal 2, Ludicrous::JITCompiled.hotness_counters[[c, :foo]].calls
+    assert_not_equal Node::CFUNC, c.instance_method(:ludicrous__orig_tmp__foo).body.class
+
+    assert_equal 42, o.foo
+    assert_raise(NameError) { c.instance_method(:ludicrous__orig_tmp__foo) }
+  end
+
+  def test_stub_counts_backedges
+    c = Class.new do
+      const_set(
+          :LUDICROUS_OPTIONS,
+          Ludicrous::CompileOptions.new(:compile_threshold => 50))
+
+      def foo(n)
+        i = 0
+        sum = 0
+        while i < n do
+          sum += i
+          i += 1
+        end
+        [ 1, 2 ].each { |x| sum += x }
+        return sum
+      end
+
+      go_plaid
+    end
+
+    o = c.new
+    assert_equal 4953, o.foo(100)
+    counter = Ludicrous::JITCompiled.hotness_counters[[c, :foo]]
+    assert_equal 1, counter.calls
+    return if not Ludicrous::HotnessCounter::COUNTS_BACKEDGES
+
+    # One back edge per iteration of each loop
+    assert_equal 102, counter.backedges
+
+    # The method got hot in a single call, so the next call compiles it
+    assert_equal 4953, o.foo(100)
+    assert_raise(NameError) { c.instance_method(:ludicrous__orig_tmp__foo) }
+  end
+
+  def test_stub_passes_arguments_and_block_to_uncompiled_method
+    c = Class.new do
+      const_set(
+          :LUDICROUS_OPTIONS,
+          Ludicrous::CompileOptions.new(:compile_threshold => 10))
+
+      def foo(a, b = 2, *rest)
+        return [ a, b, rest, block_given? ? yield(a) : nil ]
+      end
+
+      go_plaid
+    end
+
+    o = c.new
+    assert_equal [ 1, 2, [], nil ], o.foo(1)
+    assert_equal [ 1, 3, [ 4, 5 ], nil ], o.foo(1, 3, 4, 5)
+    assert_equal [ 1, 2, [], 2 ], o.foo(1) { |x| x + 1 }
+    assert_equal 3, Ludicrous::JITCompiled.hotness_counters[[c, :foo]].bounces
+  end
+
+  def test_profile_round_trip
+    c = Class.new
+    Object.const_set(:TestLudicrousProfiledClass, c)
+    filename = "ludicrous_profile_test_#{$$}.yml"
+    begin
+      profile = Ludicrous::Profile.new(filename)
+      profile.record_compiled(c, :foo)
+      profile.record_failure(c, :bar, RuntimeError.new("can't compile"))
+      profile.record_compiled(Class.new, :foo)
+      profile.save
+
+      profile = Ludicrous::Profile.load(filename)
+      assert profile.hot?(c, :foo)
+      assert !profile.hot?(c, :bar)
+      assert_equal "RuntimeError: can't compile", profile.failure(c, :bar)
+      assert_nil profile.failure(c, :foo)
+      assert_equal [ 'TestLudicrousProfiledClass' ], profile.compiled.keys
+    ensure
+      File.delete(filename) if File.exist?(filename)
+      Object.__send__(:remove_const, :TestLudicrousProfiledClass)
+    end
+  end
+
+  def test_profile_compiles_hot_methods_without_a_stub
+    c = Class.new
+    Object.const_set(:TestLudicrousProfiledClass, c)
+    profile = Ludicrous::Profile.new("unused.yml")
+    profile.record_compiled(c, :foo)
+    profile.record_failure(c, :bar, RuntimeError.new("can't compile"))
+    old_profile = Ludicrous::Profile.instance_eval { @current }
+    Ludicrous::Profile.instance_eval { @current = profile }
+    begin
+      c.class_eval do
+        def foo; return 42; end
+        def bar; return 43; end
+        go_plaid
+      end
+
+      assert_raise(NameError) { c.instance_method(:ludicrous__orig_tmp__foo) }
+      assert_raise(NameError) { c.instance_method(:ludicrous__orig_tmp__bar) }
+      assert_equal 42, c.new.foo
+      assert_equal 43, c.new.bar
+    ensure
+      Ludicrous::Profile.instance_eval { @current = old_profile }
+      Object.__send__(:remove_const, :TestLudicrousProfiledClass)
+    end
+  end
+
+  def test_stats_record_compiled_method
+    c = Class.new do
+      def foo(x)
+        return x + 1
+      end
+
+      go_plaid
+    end
+
+    assert_equal 42, c.new.foo(41)
+    stats = Ludicrous.stats
+    m = stats[:methods]["#{c}#foo"]
+    assert_equal :compiled, m[:status]
+    assert m[:code_size] > 0
+    assert m[:fast_paths][:fixnum_operator] > 0
+    assert stats[:compiled] > 0
+  end
+
+  def test_inline_attr_access
+    point = Class.new do
+      attr_accessor :x
+    end
+    not_a_point = Class.new do
+      def x; return 42; end
+      def x=(value); @y = value; end
+      attr_reader :y
+    end
+    c = Class.new do
+      def foo(p)
+        p.x = p.x + 1
+        return p.x
+      end
+
+      go_plaid
+    end
+
+    o = c.new
+    p = point.new
+    p.x = 1
+    assert_equal 2, o.foo(p)
+    assert_equal 3, o.foo(p)
+    assert_equal 4, p.x
+
+    # A different class at the same call site falls back to a real call
+    q = not_a_point.new
+    assert_equal 42, o.foo(q)
+    assert_equal 43, q.y
+
+    if not defined?(RubyVM) then
+      assert Ludicrous.stats[:methods]["#{c}#foo"][:fast_paths][:attr_access] > 0
+    end
+  end
+
+  def test_ivar_cache
+    c = Class.new do
+      def initialize
+        @x = 1
+      end
+
+      def foo
+        @x = @x + 1
+        return @x
+      end
+
+      def x_defined
+        return defined?(@x)
+      end
+
+      def forget_x
+        remove_instance_variable(:@x)
+      end
+
+      go_plaid
+    end
+
+    o1 = c.new
+    o2 = c.new
+    assert_equal 2, o1.foo
+    assert_equal 3, o1.foo
+    assert_equal 2, o2.foo
+    assert_equal 4, o1.foo
+    assert_equal "instance-variable", o1.x_defined
+
+    o1.forget_x
+    assert_equal nil, o1.x_defined
+    o1.instance_eval { @x = 10 }
+    assert_equal 11, o1.foo
+
+    # The cache is emptied by a collection and filled again
+    GC.start
+    assert_equal 12, o1.foo
+    assert_equal 3, o2.foo
+  end
+
+  def test_method_with_yield_is_not_called_directly
+    c = Class.new do
+      def foo(x)
+        return yield(x)
+      end
+
+      go_plaid
+    end
+
+    assert_equal 42, c.new.foo(41) { |x| x + 1 }
+    assert_nil Ludicrous::DirectCall.targets[[c, :foo]]
+  end
+
+  def test_proc_new_without_block_is_not_called_directly
+    c = Class.new do
+      def foo(x)
+        return Proc.new
+      end
+
+      go_plaid
+    end
+
+    assert_equal 42, c.new.foo(1) { 42 }.call
+    assert_nil Ludicrous::DirectCall.targets[[c, :foo]]
+  end
+
+  def test_dynamic_dispatch_is_not_called_directly
+    c = Class.new do
+      def foo(x)
+        return send(:block_given?)
+      end
+
+      def bar(x)
+        return instance_eval { block_given? }
+      end
+
+      def baz(x)
+        return method(:block_given?).call
+      end
+
+      go_plaid
+    end
+
+    o = c.new
+    [ :foo, :bar, :baz ].each do |name|
+      o.__send__(name, 1) { }
+      assert_nil Ludicrous::DirectCall.targets[[c, name]], name.to_s
+    end
+  end
+
+  def test_direct_call_target_forgotten_when_method_changes
+    c = Class.new do
+      def foo(x)
+        return x + 1
+      end
+
+      def bar(x)
+        return x + 2
+      end
+
+      go_plaid
+    end
+
+    o = c.new
+    assert_equal 2, o.foo(1)
+    assert_equal 3, o.bar(1)
+    if not defined?(RubyVM) then
+      assert_not_nil Ludicrous::DirectCall.targets[[c, :foo]]
+      assert_not_nil Ludicrous::DirectCall.targets[[c, :bar]]
+    end
+
+    c.class_eval do
+      def foo(x)
+        return x + 10
+      end
+
+      remove_method :bar
+    end
+
+    assert_nil Ludicrous::DirectCall.targets[[c, :bar]]
+    assert_equal 11, o.foo(1)
+    target = Ludicrous::DirectCall.targets[[c, :foo]]
+    assert(target.nil? || target.function.apply(o, 1) == 11)
+  end
+
+  def test_deep_direct_recursion_raises
+    c = Class.new do
+      def down(n)
+        return n if n == 0
+        return down(n - 1)
+      end
+
+      go_plaid
+    end
+
+    o = c.new
+    assert_equal 0, o.down(100)
+    assert_raises(SystemStackError) { o.down(10000000) }
+  end
+
+  def test_inline_iterators
+    foo = Class.new do
+      def foo(a, h)
+        sum = 0
+        a.each { |x| next if x == 2; sum += x }
+        a.each_with_index { |x, i| sum += i }
+        h.each { |k, v| sum += v }
+        b = a.map { |x| x * 2 }
+        c = a.select { |x| x > 1 }
+        d = a.inject { |m, x| m + x }
+        e = a.inject(10) { |m, x| m + x }
+        f = a.each { |x| break if x == 2 }
+        return [ sum, b, c, d, e, f ]
+      end
+    end
+    o = foo.new
+    expected = [ 12, [ 2, 4, 6 ], [ 2, 3 ], 6, 16, nil ]
+    assert_equal expected, compile_and_run(o, :foo, [ 1, 2, 3 ], { :a => 5 })
+
+    # Receivers that fail the guard go through the iterator method
+    assert_equal [ 11, [], [], nil, 10, [] ], compile_and_run(o, :foo, [], { :a => 5, :b => 6 })
+    assert_equal expected, compile_and_run(o, :foo, (1..3), { :a => 5 })
+  end
+
+  def test_counted_loops
+    foo = Class.new do
+      def foo(n, step)
+        a = []
+        n.times { |i| a << i }
+        1.upto(n) { |i| next if i == 2; a << i }
+        n.downto(1) { |i| a << i }
+        0.step(n, step) { |i| a << i }
+        (1...n).each { |i| a << i }
+        for i in 1..n do a << i end
+        x = 0
+        n.times { x += 1 }
+        r = n.times { |i| break if i == 1 }
+        return [ a, x, r ]
+      end
+    end
+    o = foo.new
+    expected = [
+      [ 0, 1, 2, 1, 3, 3, 2, 1, 0, 2, 1, 2, 1, 2, 3 ], 3, nil ]
+    assert_equal expected, compile_and_run(o, :foo, 3, 2)
+
+    # A negative step counts down
+    bar = Class.new do
+      def bar(first, last, step)
+        a = []
+        first.step(last, step) { |i| a << i }
+        return a
+      end
+    end
+    assert_equal [ 5, 3, 1 ], compile_and_run(bar.new, :bar, 5, 0, -2)
+    assert_equal [], compile_and_run(bar.new, :bar, 0, 5, -2)
+
+    # Non-Fixnum bounds go through the iterator method
+    assert_equal [ 1.0, 1.5, 2.0 ], compile_and_run(bar.new, :bar, 1.0, 2.0, 0.5)
+    baz = Class.new do
+      def baz(first, last)
+        a = []
+        first.upto(last) { |i| a << i }
+        return a
+      end
+    end
+    big = 2 ** 70
+    assert_equal [ big, big + 1 ], compile_and_run(baz.new, :baz, big, big + 1)
+  end
+
+  def test_stack_scope
+    foo = Class.new do
+      def foo(list)
+        sum = 0
+        list.each { |x| sum += x }
+        begin
+          sum += Integer(list.first)
+        rescue TypeError
+          sum = -1
+        ensure
+          sum += 100
+        end
+        return sum
+      end
+    end
+    o = foo.new
+    assert_equal 107, compile_and_run(o, :foo, [ 1, 2, 3 ])
+    assert_equal 99, compile_and_run(o, :foo, [])
+
+    # A receiver that isn't an Array makes a closure after all, which
+    # moves the variables to the heap
+    assert_equal 104, compile_and_run(o, :foo, 1..2)
+  end
+
+  def test_block_local_slots
+    foo = Class.new do
+      def foo(list)
+        total = 0
+        list.each { |x| list.each { |y| z = x * y; total += z } }
+        r = nil
+        list.each_with_index { |x, i| w = x + i; r = w }
+        (1..2).each { |i| list.map { |x| v = x; r += v } }
+        return [ total, r ]
+      end
+    end
+    o = foo.new
+    assert_equal [ 36, 17 ], compile_and_run(o, :foo, [ 1, 2, 3 ])
+    assert_equal [ 36, 17 ], compile_and_run(o, :foo, 1..3)
+  end
+
+  def test_user_iterator_block_args
+    foo = Class.new do
+      def pairs
+        yield 1, 2
+        yield [ 3, 4 ]
+        yield 5
+      end
+
+      def foo
+        a = []
+        pairs { |x, y| a << [ x, y ] }
+        pairs { |*x| a << x }
+        pairs { |x, *y| a << y }
+        "ab" =~ /b/
+        pairs { |x, y| a << $~[0] }
+        pairs { |x, y| "cd" =~ /d/ }
+        a << $~[0]
+        return a
+      end
+    end
+    expected = [
+      [ 1, 2 ], [ 3, 4 ], [ 5, nil ],
+      [ 1, 2 ], [ [ 3, 4 ] ], [ 5 ],
+      [ 2 ], [ 4 ], [ ],
+      "b", "b", "b",
+      "d" ]
+    assert_equal expected, compile_and_run(foo.new, :foo)
+  end
+
+  def test_user_iterator_nested_array_splat
+    foo = Class.new do
+      def nested
+        yield(*[[1, 2]])
+        yield(*[[3]])
+      end
+
+      def foo
+        a = []
+        nested { |x| a << x }
+        nested { |x, y| a << [ x, y ] }
+        nested { |x, *y| a << [ x, y ] }
+        return a
+      end
+    end
+    o = foo.new
+    assert_equal o.foo, compile_and_run(o, :foo)
+  end
+
+  def test_direct_yield_exact_values
+    c = Class.new do
+      def nested
+        yield(*[[1, 2]])
+        yield(*[[3]])
+        yield [ 4, 5 ]
+        yield 6, 7
+        yield
+      end
+
+      def foo
+        a = []
+        nested { |x, y| a << [ x, y ] }
+        nested { |x, *y| a << [ x, y ] }
+        nested { |*x| a << x }
+        return a
+      end
+    end
+    expected = c.new.foo
+
+    c.go_plaid
+    assert_equal expected, c.new.foo
+
+    # Now that both methods are compiled, every yield calls its block
+    # directly
+    Ludicrous::DirectYield.reset_totals
+    assert_equal expected, c.new.foo
+    if not defined?(RubyVM) then
+      assert_equal [ 15, 0 ], Ludicrous::DirectYield.totals
+    end
+  end
+
+  def test_direct_yield
+    c = Class.new do
+      def each_pair
+        yield 1, 2
+        yield [ 3, 4 ]
+        yield 5
+        yield
+      end
+
+      def stop_early
+        yield 1
+        yield 2
+        return :not_reached
+      end
+
+      def pairs
+        a = []
+        each_pair { |x, y| a << [ x, y ] }
+        return a
+      end
+
+      def rests
+        a = []
+        each_pair { |x, *y| a << y }
+        return a
+      end
+
+      def early
+        a = []
+        r = stop_early { |x| a << x; break }
+        return [ a, r ]
+      end
+
+      go_plaid
+    end
+
+    # The first calls compile the methods; an iterator is only called
+    # with a direct block once it has been compiled
+    o = c.new
+    o.pairs
+    o.rests
+    o.early
+
+    [ [ :pairs, [ [ 1, 2 ], [ 3, 4 ], [ 5, nil ], [ nil, nil ] ], 4 ],
+      [ :rests, [ [ 2 ], [ 4 ], [ ], [ ] ], 4 ],
+      [ :early, [ [ 1 ], nil ], 1 ],
+    ].each do |name, expected, yields|
+      Ludicrous::DirectYield.reset_totals
+      assert_equal expected, o.send(name)
+      if not defined?(RubyVM) then
+        assert_equal [ yields, 0 ], Ludicrous::DirectYield.totals, name.to_s
+      end
+    end
+
+    # A block from interpreted code is still yielded to through rb_yield
+    Ludicrous::DirectYield.reset_totals
+    a = []
+    o.each_pair { |x, y| a << x }
+    assert_equal [ 1, 3, 5, nil ], a
+    if not defined?(RubyVM) then
+      assert_equal [ 0, 4 ], Ludicrous::DirectYield.totals
+    end
+  end
+
+  def test_const_cache
+    c = Class.new do
+      def foo
+        sum = 0
+        3.times { sum += ConstCacheTest::VALUE + BAR }
+        return [ sum, ::ConstCacheTest::VALUE ]
+      end
+
+      go_plaid
+    end
+
+    o = c.new
+    assert_equal [ 129, 1 ], o.foo
+    assert_equal [ 129, 1 ], o.foo
+
+    verbose = $VERBOSE
+    begin
+      $VERBOSE = nil
+      ConstCacheTest.const_set(:VALUE, 2)
+      assert_equal [ 132, 2 ], o.foo
+
+      # Plain assignment, which has no hook
+      ConstCacheTest.module_eval "VALUE = 3"
+      assert_equal [ 135, 3 ], o.foo
+
+      ConstCacheTest.__send__(:remove_const, :VALUE)
+      ConstCacheTest.const_set(:VALUE, 4)
+      assert_equal [ 138, 4 ], o.foo
+    ensure
+      $VERBOSE = verbose
+    end
+  end
+
+  def test_const_cache_sees_shadowing_constants
+    base = Class.new
+    base.const_set(:VALUE, 1)
+    base.const_set(:Mod, Module.new)
+    sub = Class.new(base)
+
+    c = Class.new do
+      def value(klass)
+        return klass::VALUE
+      end
+
+      def mod(klass)
+        return klass::Mod
+      end
+
+      go_plaid
+    end
+
+    o = c.new
+    mod = base::Mod
+    2.times { assert_equal 1, o.value(sub) }
+    2.times { assert_equal mod, o.mod(sub) }
+
+    verbose = $VERBOSE
+    begin
+      $VERBOSE = nil
+
+      # A constant defined in the subclass shadows the one in the base
+      # class, with no hook to tell the cache
+      sub.class_eval "VALUE = 2"
+      assert_equal 2, o.value(sub)
+
+      # Plain reassignment of the constant the cache holds
+      sub.class_eval "VALUE = 3"
+      assert_equal 3, o.value(sub)
+      assert_equal 1, o.value(base)
+
+      # So does a module definition in interpreted code
+      sub.class_eval "module Mod; end"
+      assert_not_equal mod, o.mod(sub)
+      assert_equal sub::Mod, o.mod(sub)
+      assert_equal mod, o.mod(base)
+    ensure
+      $VERBOSE = verbose
+    end
+  end
+
+  def test_case_dispatch
+    c = Class.new do
+      def num(x)
+        case x
+        when 1 then :one
+        when 2, 3 then :two_or_three
+        when 5 then :five
+        when 3 then :unreachable
+        else :other
+        end
+      end
+
+      def word(x)
+        case x
+        when :get, "GET" then 1
+        when :put then 2
+        when "POST", 7 then 3
+        when 1000000 then 4
+        end
+      end
+
+      go_plaid
+    end
+
+    o = c.new
+    expected = [
+      :one, :two_or_three, :two_or_three, :other, :five, :other, :other,
+      :two_or_three, :other, :other ]
+    assert_equal expected, [ 1, 2, 3, 4, 5, 0, -1, 2.0, nil, "x" ].map { |x| o.num(x) }
+
+    # A String subclass is not looked up, but still matches
+    get = Class.new(String).new("GET")
+    expected = [ 1, 1, 2, 3, 3, 4, nil, nil, nil, 1 ]
+    args = [ :get, "GET", :put, "POST", 7, 1000000, "put", :post, nil, get ]
+    assert_equal expected, args.map { |x| o.word(x) }
+    assert Ludicrous.stats[:methods]["#{c}#word"][:fast_paths][:case_dispatch] > 0
+  end
+
+  def test_basic_operators
+    c = Class.new do
+      def foo(a, b, x, y, s, ary, h)
+        r = []
+        r << a * b << a / b << a % b << -a / b << -a % b
+        r << (a < b) << (a <= b) << (a > b) << (a >= b) << (a == b) << (a != b)
+        r << x * y << x / y << (x < y) << (x == y) << x + y - y
+        r << s + "!" << (s == "abc") << s.length << ary.length << ary.size
+        ary[1] = 5
+        h[:k] = 6
+        r << ary[1] << ary[-1] << h[:k] << h[:missing] << a.succ
+        r << 70000 * 70000
+        r << (s << "d") << (ary << 4)
+        return r
+      end
+
+      def len(ary)
+        return ary.length
+      end
+
+      def push(ary, x)
+        return ary << x
+      end
+
+      go_plaid
+    end
+
+    expected = [
+      21, 2, 1, -3, 2, false, false, true, true, false, true,
+      0.75, 3.0, false, false, 1.5, "abc!", true, 3, 3, 3,
+      5, 3, 6, nil, 8, 4900000000, "abcd", [ 1, 5, 3, 4 ] ]
+    assert_equal expected, c.new.foo(7, 3, 1.5, 0.5, "abc", [ 1, 2, 3 ], { })
+
+    if defined?(RubyVM) then
+      # The fast paths are only emitted if the VM's redefinition flag was
+      # found when the extension was built
+      assert defined?(Ludicrous::REDEFINED_FLAG_ADDRESS)
+      fast_paths = Ludicrous.stats[:methods]["#{c}#foo"][:fast_paths]
+      assert fast_paths[:fixnum_operator] > 0
+      assert fast_paths[:array_hash_aref] > 0
+      assert fast_paths[:array_string_length] > 0
+    end
+
+    # A subclass that overrides an operator calls it, not the builtin
+    o = c.new
+    sub = Class.new(Array) do
+      def length; return 42; end
+      def <<(x); return :pushed; end
+    end
+    assert_equal 42, o.len(sub.new)
+    assert_equal :pushed, o.push(sub.new, 1)
+    assert_equal [ 1 ], o.push([], 1)
+    assert !Ludicrous::Redefinition.redefined?(Array, :length)
+    assert !Ludicrous::Redefinition.redefined?(Array, :<<)
+    assert_equal 3, o.len([ 1, 2, 3 ])
+
+    # A redefined operator is called instead of the fast path
+    assert_equal 3, o.len([ 1, 2, 3 ])
+    Array.class_eval do
+      alias_method :ludicrous__test_length, :length
+      def length; return 42; end
+    end
+    begin
+      assert_equal 42, o.len([ 1, 2, 3 ])
+    ensure
+      Array.class_eval do
+        alias_method :length, :ludicrous__test_length
+        remove_method :ludicrous__test_length
+      end
+    end
+  end
+
+  def test_redefined_builtin_uncompiles_method
+    c = Class.new do
+      def foo(a)
+        sum = 0
+        a.each { |x| sum += x }
+        return sum
+      end
+
+      go_plaid
+    end
+
+    o = c.new
+    assert_equal 6, o.foo([ 1, 2, 3 ])
+    assert_equal :compiled, Ludicrous.stats[:methods]["#{c}#foo"][:status]
+
+    Array.class_eval do
+      alias_method :ludicrous__test_each, :each
+      def each; ludicrous__test_each { |x| yield x * 10 }; end
+    end
+    begin
+      assert_equal :invalidated, Ludicrous.stats[:methods]["#{c}#foo"][:status]
+      assert_equal 60, o.foo([ 1, 2, 3 ])
+      assert_equal 60, o.foo([ 1, 2, 3 ])
+    ensure
+      Array.class_eval do
+        alias_method :each, :ludicrous__test_each
+        remove_method :ludicrous__test_each
+      end
+    end
+  end
+
+  def test_fixnum_operators
+    c = Class.new do
+      def foo(a, b, big)
+        r = []
+        r << a + b << a - b << a * b << a / b << a % b << -a / b << -a % b
+        r << a / -b << a % -b << (a << b) << (a >> 1) << (-a >> 70)
+        r << (a & b) << (a | b) << (a ^ b) << (a <=> b) << (b <=> a)
+        r << (a < b) << (a <= b) << (a > b) << (a >= b) << (a == b)
+        r << -a << (-a).abs << a.succ
+        r << big + big << -big - big << big * big << (big << 4) << (-big).abs
+        return r
+      end
+
+      go_plaid
+    end
+
+    big = 2 ** (0.size * 8 - 2) - 1
+    expected = [
+      10, 4, 21, 2, 1, -3, 2, -3, -2, 56, 3, -1,
+      3, 7, 4, 1, -1, false, false, true, true, false,
+      -7, 7, 8,
+      big * 2, -big * 2, big * big, big * 16, big ]
+    assert_equal expected, c.new.foo(7, 3, big)
+  end
+
+  def test_unboxed_floats
+    c = Class.new do
+      def foo(a, b, c, d, n, s)
+        r = []
+        r << a * b + c * d << (a - b) / (c + n) << a * n - n * d
+        r << (a * b + c < d * n) << (a * a == b * 4) << n * n + n
+        r << s * n + s << a / 0
+        return r
+      end
+
+      go_plaid
+    end
+
+    expected = [ 16.5, -0.125, -8.625, true, false, 12, "xyxyxyxy", 1.0 / 0 ]
+    assert_equal expected, c.new.foo(1.5, 2.25, 3.0, 4.375, 3, "xy")
+  end
+
+  def test_native_width_values
+    foo = Class.new do
+      def foo(a, n, *rest)
+        x, *y = rest
+        return [ a[-1], a[1], n * 3 + 1, n - (n + n), x, y ]
+      end
+    end
+    n = 2 ** 40
+    expected = [ 3, 2, 3 * n + 1, -n, 4, [ 5, 6 ] ]
+    result = compile_and_run(foo.new, :foo, [ 1, 2, 3 ], n, 4, 5, 6)
+    assert_equal(expected, result)
+  end
+
+  def test_perf_map
+    foo = Class.new do
+      def foo(a)
+        sum = 0
+        a.each { |x| sum += x }
+        return sum
+      end
+    end
+    o = foo.new
+    options = Ludicrous::CompileOptions.new(:perf_map => true)
+    f = o.method(:foo).ludicrous_compile(options)
+    assert_equal 6, f.apply(o, [ 1, 2, 3 ])
+
+    entries = File.readlines(Ludicrous::PerfMap.filename)
+    entry = entries.find { |line| line.split[0] == "%x" % f.to_closure }
+    assert_not_nil entry
+    assert_equal f.code_size, entry.split[1].hex
+  end
+
+  def test_unboxed_loop_locals
+    c = Class.new do
+      def foo(n, x, p)
+        i = 0
+        sum = 0.0
+        while i < n do
+          sum = sum + x * i
+          p = p * 1000
+          i += 1
+        end
+        return [ i, sum, p ]
+      end
+
+      go_plaid
+    end
+
+    o = c.new
+    assert_equal [ 8, 14.0, 10 ** 24 ], o.foo(8, 0.5, 1)
+    assert_equal [ 3, 6.0, 2 * 10 ** 9 ], o.foo(3, 2, 2)
+    assert_equal [ 2, 1.0, 3 * 10 ** 26 ], o.foo(2, 1, 3 * 10 ** 20)
+  end
+
+  def test_unboxed_loop_locals_multiple_assignment
+    c = Class.new do
+      def foo(n)
+        i = 0
+        a, b = 0, 1
+        while i < n do
+          a, b = b, a + b
+          i += 1
+        end
+        return [ i, a, b ]
+      end
+
+      go_plaid
+    end
+
+    o = c.new
+    assert_equal [ 10, 55, 89 ], o.foo(10)
+    assert_equal [ 100, 354224848179261915075, 573147844013817084101 ], o.foo(100)
+  end
+
+  def test_stack_values_across_branches
+    c = Class.new do
+      def foo(c, a)
+        r = []
+        i = 0
+        while i < 3 do
+          r << [ a, (c ? i : -i), (i == 1 ? (c ? :x : :y) : :z) ]
+          i += 1
+        end
+        begin
+          r << [ a, (c ? raise("oops") : 1) ]
+        rescue
+          r << [ a, :rescued ]
+        end
+        return r
+      end
+
+      go_plaid
+    end
+
+    expected = [ [ 5, 0, :z ], [ 5, 1, :x ], [ 5, 2, :z ], [ 5, :rescued ] ]
+    assert_equal expected, c.new.foo(true, 5)
+    expected = [ [ 5, 0, :z ], [ 5, -1, :y ], [ 5, -2, :z ], [ 5, 1 ] ]
+    assert_equal expected, c.new.foo(false, 5)
+  end
 end
 
 if __FILE__ == $0 then
@@ -2,6 +2,10 @@ require 'test/unit/autorunner'
 require 'test/unit/testcase'
 require 'ludicrous'
 
+# Compile methods with stubs on their first call, so the tests exercise
+# the compiled code
+Ludicrous::CompileOptions::DEFAULTS[:compile_threshold] = 1
+
 class TestLudicrousSpeed < Test::Unit::TestCase
   def test_existing_method
     c = Class.new { def foo; 42; end }